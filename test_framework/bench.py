@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+"""
+Benchmark the interpreter and JIT across the testsuite
+
+Every datafile with an expected result is run with vm/benchmark, and the
+timings are written as a JSON object keyed by datafile name. Datafiles that
+expect an error are skipped.
+"""
+import os
+import sys
+import json
+import struct
+import tempfile
+import argparse
+from subprocess import Popen, PIPE
+
+ROOT_DIR = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..")
+if os.path.exists(os.path.join(ROOT_DIR, "ubpf")):
+    # Running from source tree
+    sys.path.insert(0, ROOT_DIR)
+
+import ubpf.assembler
+import testdata
+BENCHMARK = os.path.join(ROOT_DIR, "vm", "benchmark")
+
+def bench_datafile(filename, iterations, compiles):
+    """
+    Run the benchmark driver on one datafile and return its parsed output,
+    or None if the datafile has nothing to benchmark
+    """
+    data = testdata.read(filename)
+    if 'asm' not in data and 'raw' not in data:
+        return None
+    if 'result' not in data or 'error' in data or 'error pattern' in data:
+        return None
+
+    if 'raw' in data:
+        code = b''.join(struct.pack("=Q", x) for x in data['raw'])
+    else:
+        code = ubpf.assembler.assemble(data['asm'])
+
+    memfile = None
+
+    cmd = [BENCHMARK, '-n', str(iterations), '-c', str(compiles)]
+    if 'mem' in data:
+        memfile = tempfile.NamedTemporaryFile()
+        memfile.write(data['mem'])
+        memfile.flush()
+        cmd.extend(['-m', memfile.name])
+
+    if 'no jit' in data:
+        cmd.append('--no-jit')
+    cmd.append('-')
+
+    vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+
+    stdout, stderr = vm.communicate(code)
+    stdout = stdout.decode("utf-8")
+    stderr = stderr.decode("utf-8").strip()
+
+    if memfile:
+        memfile.close()
+
+    if vm.returncode != 0:
+        return { 'error': stderr }
+
+    result = json.loads(stdout)
+    expected = int(data['result'], 0)
+    if int(result['result'], 0) != expected:
+        return { 'error': "Expected result 0x%x, got %s" % (expected, result['result']) }
+    return result
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-n', '--iterations', type=int, default=1000000)
+    parser.add_argument('-c', '--compiles', type=int, default=100)
+    parser.add_argument('-o', '--output', type=argparse.FileType('w'), default='-')
+    parser.add_argument('names', nargs='*', help='datafiles to run (default: all)')
+    args = parser.parse_args()
+
+    results = {}
+    failed = False
+    for filename in args.names or testdata.list_files():
+        result = bench_datafile(filename, args.iterations, args.compiles)
+        if result is None:
+            continue
+        if 'error' in result:
+            sys.stderr.write("%s: %s\n" % (filename, result['error']))
+            failed = True
+        results[filename] = result
+
+    json.dump(results, args.output, indent=2, sort_keys=True)
+    args.output.write("\n")
+    return 1 if failed else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,84 @@
+import os
+import tempfile
+import struct
+import re
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import testdata
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+BATCH_SIZE = 4
+
+def check_datafile(filename, jit):
+    """
+    Given assembly source code and an expected result, run the eBPF program
+    over a batch of copies of its memory and verify that every result
+    matches. Runtime errors are reported once per run in the batch.
+    """
+    data = testdata.read(filename)
+    if 'asm' not in data and 'raw' not in data:
+        raise SkipTest("no asm or raw section in datafile")
+    if 'result' not in data and 'error' not in data and 'error pattern' not in data:
+        raise SkipTest("no result or error section in datafile")
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    if jit and 'no jit' in data:
+        raise SkipTest("JIT disabled for this testcase (%s)" % data['no jit'])
+
+    if 'raw' in data:
+        code = b''.join(struct.pack("=Q", x) for x in data['raw'])
+    else:
+        code = ubpf.assembler.assemble(data['asm'])
+
+    memfile = None
+
+    cmd = [VM]
+    if 'mem' in data:
+        memfile = tempfile.NamedTemporaryFile()
+        memfile.write(data['mem'])
+        memfile.flush()
+        cmd.extend(['-m', memfile.name])
+
+    if jit:
+        cmd.append('-j')
+    cmd.extend(['-b', str(BATCH_SIZE), '-'])
+
+    vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+
+    stdout, stderr = vm.communicate(code)
+    stdout = stdout.decode("utf-8")
+    stderr = stderr.decode("utf-8")
+    stderr = stderr.strip()
+
+    if memfile:
+        memfile.close()
+
+    if 'error' in data:
+        expected = [data['error'], '\n'.join([data['error']] * BATCH_SIZE)]
+        if stderr not in expected:
+            raise AssertionError("Expected error %r, got %r" % (data['error'], stderr))
+    elif 'error pattern' in data:
+        if not re.search(data['error pattern'], stderr):
+            raise AssertionError("Expected error matching %r, got %r" % (data['error pattern'], stderr))
+    else:
+        if stderr:
+            raise AssertionError("Unexpected error %r" % stderr)
+
+    if 'result' in data:
+        if vm.returncode != 0:
+            raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+        expected = int(data['result'], 0)
+        result = int(stdout, 0)
+        if expected != result:
+            raise AssertionError("Expected result 0x%x, got 0x%x, stderr=%r" % (expected, result, stderr))
+    else:
+        if vm.returncode == 0:
+            raise AssertionError("Expected VM to exit with an error code")
+
+def test_datafiles():
+    # Nose test generator
+    # Creates a testcase for each datafile, interpreted and JIT compiled
+    for filename in testdata.list_files():
+        yield check_datafile, filename, False
+        yield check_datafile, filename, True
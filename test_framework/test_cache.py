@@ -0,0 +1,98 @@
+import os
+import shutil
+import tempfile
+import struct
+import re
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import testdata
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+def run_vm(cmd, code, data):
+    vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+
+    stdout, stderr = vm.communicate(code)
+    stdout = stdout.decode("utf-8")
+    stderr = stderr.decode("utf-8")
+    stderr = stderr.strip()
+
+    if 'error' in data:
+        if data['error'] != stderr:
+            raise AssertionError("Expected error %r, got %r" % (data['error'], stderr))
+    elif 'error pattern' in data:
+        if not re.search(data['error pattern'], stderr):
+            raise AssertionError("Expected error matching %r, got %r" % (data['error pattern'], stderr))
+    else:
+        if stderr:
+            raise AssertionError("Unexpected error %r" % stderr)
+
+    if 'result' in data:
+        if vm.returncode != 0:
+            raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+        expected = int(data['result'], 0)
+        result = int(stdout, 0)
+        if expected != result:
+            raise AssertionError("Expected result 0x%x, got 0x%x, stderr=%r" % (expected, result, stderr))
+    else:
+        if vm.returncode == 0:
+            raise AssertionError("Expected VM to exit with an error code")
+
+def check_datafile(filename):
+    """
+    Given assembly source code and an expected result, JIT compile the eBPF
+    program with a cache directory, then again from another process, which
+    must find the cached code rather than compile it again, and verify that
+    both results match.
+    """
+    data = testdata.read(filename)
+    if 'asm' not in data and 'raw' not in data:
+        raise SkipTest("no asm or raw section in datafile")
+    if 'result' not in data and 'error' not in data and 'error pattern' not in data:
+        raise SkipTest("no result or error section in datafile")
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    if 'no jit' in data:
+        raise SkipTest("JIT disabled for this testcase (%s)" % data['no jit'])
+
+    if 'raw' in data:
+        code = b''.join(struct.pack("=Q", x) for x in data['raw'])
+    else:
+        code = ubpf.assembler.assemble(data['asm'])
+
+    memfile = None
+    cache_dir = tempfile.mkdtemp()
+
+    cmd = [VM]
+    if 'mem' in data:
+        memfile = tempfile.NamedTemporaryFile()
+        memfile.write(data['mem'])
+        memfile.flush()
+        cmd.extend(['-m', memfile.name])
+
+    cmd.extend(['-j', '-c', cache_dir, '-'])
+
+    try:
+        run_vm(cmd, code, data)
+        entries = os.listdir(cache_dir)
+        if 'error' in data and 'Failed to load code' in data['error']:
+            return
+        if len(entries) != 1:
+            raise AssertionError("Expected one cache entry, got %r" % entries)
+        path = os.path.join(cache_dir, entries[0])
+        before = os.stat(path)
+
+        run_vm(cmd, code, data)
+        after = os.stat(path)
+        if os.listdir(cache_dir) != entries or (before.st_ino, before.st_mtime_ns) != (after.st_ino, after.st_mtime_ns):
+            raise AssertionError("Cached code was compiled again")
+    finally:
+        if memfile:
+            memfile.close()
+        shutil.rmtree(cache_dir)
+
+def test_datafiles():
+    # Nose test generator
+    # Creates a testcase for each datafile
+    for filename in testdata.list_files():
+        yield check_datafile, filename
@@ -166,8 +166,10 @@ def generate_elf(pyelf):
     exec(pyelf, parts)
     return serialize(parts)
 
-def check_datafile(filename):
+def check_datafile(filename, from_file):
     """
+    Load the generated ELF file from stdin, or with from_file from a path,
+    which maps it rather than reading it.
     """
     data = testdata.read(filename)
     if 'pyelf' not in data:
@@ -181,11 +183,21 @@ def check_datafile(filename):
 
     cmd = [VM]
 
-    cmd.append('-')
+    elffile = None
+    if from_file:
+        elffile = tempfile.NamedTemporaryFile()
+        elffile.write(elf)
+        elffile.flush()
+        cmd.append(elffile.name)
+        elf = b''
+    else:
+        cmd.append('-')
 
     vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
 
     stdout, stderr = vm.communicate(elf)
+    if elffile:
+        elffile.close()
     stdout = stdout.decode("utf-8")
     stderr = stderr.decode("utf-8")
     stderr = stderr.strip()
@@ -215,4 +227,5 @@ def test_datafiles():
     # Nose test generator
     # Creates a testcase for each datafile
     for filename in testdata.list_files():
-        yield check_datafile, filename
+        yield check_datafile, filename, False
+        yield check_datafile, filename, True
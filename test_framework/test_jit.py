@@ -87,3 +87,30 @@ def test_datafiles():
     # Creates a testcase for each datafile
     for filename in testdata.list_files():
         yield check_datafile, filename
+
+def test_large_program():
+    """
+    A program whose machine code is much larger than the initial JIT buffer.
+    """
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+
+    # Alternate "lddw r0, imm" and "add r0, 1" with 64-bit immediates
+    n = 15000
+    insts = []
+    for i in xrange(n):
+        imm = 0x0123456789000000 + i
+        insts.append(struct.pack("=BBhI", 0x18, 0, 0, imm & 0xffffffff))
+        insts.append(struct.pack("=BBhI", 0, 0, 0, imm >> 32))
+        insts.append(struct.pack("=BBhi", 0x07, 0, 0, 1))
+    insts.append(struct.pack("=BBhi", 0x95, 0, 0, 0))
+    code = b''.join(insts)
+
+    vm = Popen([VM, '-j', '-'], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate(code)
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+    expected = 0x0123456789000000 + n
+    result = int(stdout.decode("utf-8"), 0)
+    if expected != result:
+        raise AssertionError("Expected result 0x%x, got 0x%x" % (expected, result))
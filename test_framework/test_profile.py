@@ -0,0 +1,68 @@
+import os
+import tempfile
+import struct
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import testdata
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+def check_datafile(filename, flags):
+    """
+    Given assembly source code and an expected profile, run the eBPF program
+    with profiling enabled and verify that the execution counts match.
+    """
+    data = testdata.read(filename)
+    if 'profile' not in data:
+        raise SkipTest("no profile section in datafile")
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    if '-j' in flags and 'no jit' in data:
+        raise SkipTest("JIT disabled for this testcase (%s)" % data['no jit'])
+
+    if 'raw' in data:
+        code = b''.join(struct.pack("=Q", x) for x in data['raw'])
+    else:
+        code = ubpf.assembler.assemble(data['asm'])
+
+    memfile = None
+
+    cmd = [VM, '-P']
+    if 'mem' in data:
+        memfile = tempfile.NamedTemporaryFile()
+        memfile.write(data['mem'])
+        memfile.flush()
+        cmd.extend(['-m', memfile.name])
+
+    cmd.extend(flags)
+    cmd.append('-')
+
+    vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+
+    stdout, stderr = vm.communicate(code)
+    stdout = stdout.decode("utf-8")
+    stderr = stderr.decode("utf-8")
+    stderr = stderr.strip()
+
+    if memfile:
+        memfile.close()
+
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+
+    if 'result' in data:
+        expected = int(data['result'], 0)
+        result = int(stdout, 0)
+        if expected != result:
+            raise AssertionError("Expected result 0x%x, got 0x%x" % (expected, result))
+
+    if data['profile'] != stderr:
+        raise AssertionError("Expected profile %r, got %r" % (data['profile'], stderr))
+
+def test_datafiles():
+    # Nose test generator
+    # Creates a testcase for each datafile with each backend
+    for filename in testdata.list_files():
+        yield check_datafile, filename, []
+        yield check_datafile, filename, ['-t']
+        yield check_datafile, filename, ['-j']
@@ -0,0 +1,107 @@
+import os
+import tempfile
+import struct
+import re
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import testdata
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+NUM_THREADS = 4
+NUM_REPLACES = 20
+
+def check_datafile(filename, flags):
+    """
+    Given assembly source code and an expected result, run the eBPF program
+    from several threads while it is replaced with itself over and over, and
+    verify that every run produces the expected result.
+    """
+    data = testdata.read(filename)
+    if 'asm' not in data and 'raw' not in data:
+        raise SkipTest("no asm or raw section in datafile")
+    if 'result' not in data:
+        raise SkipTest("no result section in datafile")
+    if 'error' in data or 'error pattern' in data:
+        raise SkipTest("error section in datafile")
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    if '-j' in flags and 'no jit' in data:
+        raise SkipTest("JIT disabled for this testcase (%s)" % data['no jit'])
+    if 'no concurrency' in data:
+        raise SkipTest("concurrent runs disabled for this testcase (%s)" % data['no concurrency'])
+    if '-V' in flags and 'verifier error' in data:
+        raise SkipTest("verifier error section in datafile")
+
+    if 'raw' in data:
+        code = b''.join(struct.pack("=Q", x) for x in data['raw'])
+    else:
+        code = ubpf.assembler.assemble(data['asm'])
+
+    memfile = None
+
+    cmd = [VM]
+    if 'mem' in data:
+        memfile = tempfile.NamedTemporaryFile()
+        memfile.write(data['mem'])
+        memfile.flush()
+        cmd.extend(['-m', memfile.name])
+
+    cmd.extend(flags)
+    cmd.extend(['-T', str(NUM_THREADS), '-R', str(NUM_REPLACES), '-'])
+
+    vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+
+    stdout, stderr = vm.communicate(code)
+    stdout = stdout.decode("utf-8")
+    stderr = stderr.decode("utf-8")
+    stderr = stderr.strip()
+
+    if memfile:
+        memfile.close()
+
+    if stderr:
+        raise AssertionError("Unexpected error %r" % stderr)
+
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+    expected = int(data['result'], 0)
+    result = int(stdout, 0)
+    if expected != result:
+        raise AssertionError("Expected result 0x%x, got 0x%x" % (expected, result))
+
+def test_datafiles():
+    # Nose test generator
+    # Creates a testcase for each datafile, replaced as loaded, verified,
+    # optimized and JIT compiled
+    for filename in testdata.list_files():
+        yield check_datafile, filename, []
+        yield check_datafile, filename, ['-V']
+        yield check_datafile, filename, ['-O']
+        yield check_datafile, filename, ['-j']
+        yield check_datafile, filename, ['-O', '-j']
+
+def test_code_regions_bounded():
+    """
+    Replace a JIT compiled program next to one that stays loaded, enough
+    times to fill several code regions if freed code were not reused, and
+    verify that the code still fits in one region.
+    """
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+
+    code = ubpf.assembler.assemble("mov r0, 0\nexit")
+    cmd = [VM, '-j', '-T', '1', '-R', '20000', '-C', '-']
+
+    vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+
+    stdout, stderr = vm.communicate(code)
+    stderr = stderr.decode("utf-8").strip()
+
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+    match = re.match(r'^code regions (\d+) bytes (\d+)$', stderr)
+    if not match:
+        raise AssertionError("Expected code usage, got %r" % stderr)
+    if int(match.group(1)) != 1:
+        raise AssertionError("Expected 1 code region, got %s" % match.group(1))
@@ -8,10 +8,11 @@ import ubpf.assembler
 import testdata
 VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
 
-def check_datafile(filename):
+def check_datafile(filename, threaded):
     """
     Given assembly source code and an expected result, run the eBPF program and
-    verify that the result matches.
+    verify that the result matches. Uses the threaded interpreter if 'threaded'
+    is set.
     """
     data = testdata.read(filename)
     if 'asm' not in data and 'raw' not in data:
@@ -35,6 +36,8 @@ def check_datafile(filename):
         memfile.flush()
         cmd.extend(['-m', memfile.name])
 
+    if threaded:
+        cmd.append('-t')
     cmd.append('-')
 
     vm = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
@@ -72,4 +75,5 @@ def test_datafiles():
     # Nose test generator
     # Creates a testcase for each datafile
     for filename in testdata.list_files():
-        yield check_datafile, filename
+        yield check_datafile, filename, False
+        yield check_datafile, filename, True
@@ -38,13 +38,13 @@ mem_instruction = \
     (keywords(mem_store_reg_ops) + memref + "," + reg) | \
     (keywords(mem_store_imm_ops) + memref + "," + imm) | \
     (keywords(mem_load_ops) + reg + "," + memref) | \
-    (keywords(["lddw"]) + reg + "," + imm)
+    (keywords(["lddw", "ldmap"]) + reg + "," + imm)
 
 jmp_cmp_ops = ['jeq', 'jgt', 'jge', 'jlt', 'jle', 'jset', 'jne', 'jsgt', 'jsge', 'jslt', 'jsle']
 jmp_instruction = \
     (keywords(jmp_cmp_ops) + reg + "," + (reg | imm) + "," + offset) | \
     (keywords(['ja']) + offset) | \
-    (keywords(['call']) + imm) | \
+    (keywords(['call', 'lcall']) + imm) | \
     (keywords(['exit'])[lambda x: (x, )])
 
 instruction = alu_instruction | mem_instruction | jmp_instruction
@@ -88,6 +88,11 @@ def assemble_one(inst):
         a = pack(0x18, inst[1].num, 0, 0, inst[2].value)
         b = pack(0, 0, 0, 0, inst[2].value >> 32)
         return a + b
+    elif op == "ldmap":
+        # lddw of a registered map's index, marked by source register 1
+        a = pack(0x18, inst[1].num, 1, 0, inst[2].value)
+        b = pack(0, 0, 0, 0, 0)
+        return a + b
     elif op in MEM_STORE_IMM_OPS:
         opcode = MEM_STORE_IMM_OPS[op]
         return pack(opcode, inst[1].reg.num, 0, inst[1].offset, inst[2].value)
@@ -109,6 +114,9 @@ def assemble_one(inst):
         return pack(opcode, inst[1].num, 0, 0, imm)
     elif op in JMP_CMP_OPS:
         return assemble_binop(op, 0x05, JMP_CMP_OPS, inst[1], inst[2], inst[3])
+    elif op == "lcall":
+        # call of the function at an offset in the program, marked by source register 1
+        return pack(0x85, 0, 1, 0, inst[1].value)
     elif op in JMP_MISC_OPS:
         opcode = 0x05 | (JMP_MISC_OPS[op] << 4)
         if op == 'ja':
@@ -125,6 +125,9 @@ def disassemble_one(data, offset):
 
         if opcode_name == "exit":
             return opcode_name
+        elif opcode_name == "call" and src_reg == 1: # call of a function of the program
+            imm = imm - (1 << 32) if imm & 0x80000000 else imm
+            return "lcall %+d" % imm
         elif opcode_name == "call":
             return "%s %s" % (opcode_name, I(imm))
         elif opcode_name == "ja":
@@ -139,7 +142,9 @@ def disassemble_one(data, offset):
         mode_name = MODES.get(mode, str(mode))
         # TODO use different syntax for non-MEM instructions
         size_name = SIZES.get(size, str(size))
-        if code == 0x18: # lddw
+        if code == 0x18 and src_reg == 1: # lddw of a map index
+            return "ldmap %s, %s" % (R(dst_reg), I(imm))
+        elif code == 0x18: # lddw
             _, _, _, imm2 = Inst.unpack_from(data, offset+8)
             imm = (imm2 << 32) | imm
             return "%s %s, %s" % (class_name + size_name, R(dst_reg), I(imm))
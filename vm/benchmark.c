@@ -0,0 +1,290 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark driver
+ *
+ * Runs one program repeatedly with the interpreter, the threaded interpreter
+ * and the JIT, both without a profile and laid out from the profile of one
+ * run, and prints the timings as a single JSON object. Instructions
+ * per second are based on the number of instructions executed by a single
+ * profiled run, which assumes every run takes the same path. The memory
+ * is restored from a pristine copy before every run, since programs may
+ * modify it, so the copy is included in each timing.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <elf.h>
+#include "ubpf_int.h"
+#include "test_common.h"
+
+/* The JIT compiler vm/Makefile builds for this machine, so results from different ones can be told apart */
+#if defined(__aarch64__)
+#define JIT_ARCH "arm64"
+#else
+#define JIT_ARCH "x86_64"
+#endif
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h] [-n|--iterations NUM] [-c|--compiles NUM] [--no-jit] [-m|--mem PATH] BINARY\n", name);
+    fprintf(stderr, "\nRuns the eBPF code in BINARY NUM times (default 1000000) with each backend\n");
+    fprintf(stderr, "and prints the timings as JSON to stdout.\n");
+    fprintf(stderr, "If --mem is given then the specified file will be read and a pointer\nto its data passed in r1.\n");
+    fprintf(stderr, "Compile time is averaged over --compiles compilations (default 100).\n");
+    fprintf(stderr, "If --no-jit is given then the JIT is not measured.\n");
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct ubpf_vm *
+load(const void *code, size_t code_len)
+{
+    struct ubpf_vm *vm = ubpf_create();
+    if (!vm) {
+        fprintf(stderr, "Failed to create VM\n");
+        return NULL;
+    }
+
+    register_functions(vm);
+
+    bool elf = code_len >= SELFMAG && !memcmp(code, ELFMAG, SELFMAG);
+
+    char *errmsg;
+    int rv;
+    if (elf) {
+        rv = ubpf_load_elf(vm, code, code_len, &errmsg);
+    } else {
+        rv = ubpf_load(vm, code, code_len, &errmsg);
+    }
+
+    if (rv < 0) {
+        fprintf(stderr, "Failed to load code: %s\n", errmsg);
+        free(errmsg);
+        ubpf_destroy(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+/* Average ns per run of 'fn' or the interpreter, restoring 'mem' from 'orig' each time */
+static double
+time_exec(struct ubpf_vm *vm, ubpf_jit_fn fn, void *mem, const void *orig, size_t mem_len,
+          size_t iterations, uint64_t *ret)
+{
+    uint64_t start = now_ns();
+    size_t i;
+
+    for (i = 0; i < iterations; i++) {
+        if (mem_len) {
+            memcpy(mem, orig, mem_len);
+        }
+        *ret = fn ? fn(mem, mem_len) : ubpf_exec(vm, mem, mem_len);
+    }
+
+    return (double)(now_ns() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    struct option longopts[] = {
+        { .name = "help", .val = 'h', },
+        { .name = "mem", .val = 'm', .has_arg=1 },
+        { .name = "iterations", .val = 'n', .has_arg=1 },
+        { .name = "compiles", .val = 'c', .has_arg=1 },
+        { .name = "no-jit", .val = 'J' },
+        { }
+    };
+
+    const char *mem_filename = NULL;
+    size_t iterations = 1000000;
+    size_t compiles = 100;
+    bool jit = true;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hm:n:c:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_filename = optarg;
+            break;
+        case 'n':
+            iterations = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            compiles = strtoull(optarg, NULL, 0);
+            break;
+        case 'J':
+            jit = false;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc != optind + 1 || iterations == 0 || compiles == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t code_len;
+    void *code = readfile(argv[optind], 1024*1024, &code_len);
+    if (code == NULL) {
+        return 1;
+    }
+
+    size_t mem_len = 0;
+    void *orig = NULL;
+    if (mem_filename != NULL) {
+        orig = readfile(mem_filename, 1024*1024, &mem_len);
+        if (orig == NULL) {
+            return 1;
+        }
+    }
+    void *mem = orig ? malloc(mem_len ? mem_len : 1) : NULL;
+
+    struct ubpf_vm *vm = load(code, code_len);
+    if (!vm) {
+        return 1;
+    }
+
+    uint64_t ret, threaded_ret;
+    double interp_ns = time_exec(vm, NULL, mem, orig, mem_len, iterations, &ret);
+    toggle_threaded_exec(vm, true);
+    double threaded_ns = time_exec(vm, NULL, mem, orig, mem_len, iterations, &threaded_ret);
+    toggle_threaded_exec(vm, false);
+
+    if (threaded_ret != ret) {
+        fprintf(stderr, "Threaded result 0x%"PRIx64" does not match interpreter result 0x%"PRIx64"\n",
+                threaded_ret, ret);
+        return 1;
+    }
+
+    /* Count the instructions executed by one run, on a separate VM so the timed ones are unaffected */
+    uint64_t executed = 0;
+    struct ubpf_vm *profiled = load(code, code_len);
+    if (!profiled) {
+        return 1;
+    }
+    toggle_profiling(profiled, true);
+    if (mem_len) {
+        memcpy(mem, orig, mem_len);
+    }
+    ubpf_exec(profiled, mem, mem_len);
+
+    struct ubpf_profile profile;
+    if (ubpf_get_profile(profiled, &profile) < 0) {
+        fprintf(stderr, "Failed to get profile\n");
+        return 1;
+    }
+    uint32_t pc;
+    for (pc = 0; pc < profile.num_insts; pc++) {
+        executed += profile.insts[pc];
+    }
+    ubpf_free_profile(&profile);
+    toggle_profiling(profiled, false);
+
+    printf("{\"insts\": %u, \"executed_insts\": %"PRIu64", \"result\": \"0x%"PRIx64"\", \"iterations\": %zu, "
+           "\"interp_ns\": %.2f, \"interp_insts_per_sec\": %.0f, "
+           "\"threaded_ns\": %.2f, \"threaded_insts_per_sec\": %.0f",
+           vm->prog->num_insts, executed, ret, iterations,
+           interp_ns, executed * 1e9 / interp_ns, threaded_ns, executed * 1e9 / threaded_ns);
+
+    if (jit) {
+        char *errmsg;
+        uint64_t compile_ns = 0, jit_ret;
+        size_t i;
+
+        /* Each compilation needs a fresh VM since the JIT code is cached */
+        for (i = 0; i < compiles; i++) {
+            struct ubpf_vm *fresh = load(code, code_len);
+            if (!fresh) {
+                return 1;
+            }
+            uint64_t start = now_ns();
+            ubpf_jit_fn fn = ubpf_compile(fresh, &errmsg);
+            compile_ns += now_ns() - start;
+            if (fn == NULL) {
+                fprintf(stderr, "Failed to compile: %s\n", errmsg);
+                free(errmsg);
+                return 1;
+            }
+            ubpf_destroy(fresh);
+        }
+
+        ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+        if (fn == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            return 1;
+        }
+        double jit_ns = time_exec(vm, fn, mem, orig, mem_len, iterations, &jit_ret);
+
+        if (jit_ret != ret) {
+            fprintf(stderr, "JIT result 0x%"PRIx64" does not match interpreter result 0x%"PRIx64"\n",
+                    jit_ret, ret);
+            return 1;
+        }
+
+        printf(", \"jit_arch\": \"%s\", \"jit_ns\": %.2f, \"jit_insts_per_sec\": %.0f, \"compile_ns\": %.0f, \"jit_size\": %zu",
+               JIT_ARCH, jit_ns, executed * 1e9 / jit_ns, (double)compile_ns / compiles, vm->prog->jitted_size);
+
+        /* The profiled VM lays out its code from the counts of its run */
+        fn = ubpf_compile(profiled, &errmsg);
+        if (fn == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            return 1;
+        }
+        double pgo_ns = time_exec(profiled, fn, mem, orig, mem_len, iterations, &jit_ret);
+
+        if (jit_ret != ret) {
+            fprintf(stderr, "Profile-guided JIT result 0x%"PRIx64" does not match interpreter result 0x%"PRIx64"\n",
+                    jit_ret, ret);
+            return 1;
+        }
+
+        printf(", \"pgo_jit_ns\": %.2f, \"pgo_jit_insts_per_sec\": %.0f, \"pgo_jit_size\": %zu",
+               pgo_ns, executed * 1e9 / pgo_ns, profiled->prog->jitted_size);
+    }
+
+    printf("}\n");
+
+    ubpf_destroy(profiled);
+    ubpf_destroy(vm);
+    free(code);
+    free(orig);
+    free(mem);
+
+    return 0;
+}
@@ -43,6 +43,11 @@ struct ebpf_inst {
 #define EBPF_SRC_IMM 0x00
 #define EBPF_SRC_REG 0x08
 
+/* Source register field of an lddw loading a map by index */
+#define EBPF_PSEUDO_MAP_IDX 1
+/* Source register field of a call to the function at PC + 1 + imm in the program itself */
+#define EBPF_PSEUDO_CALL 1
+
 #define EBPF_SIZE_W 0x00
 #define EBPF_SIZE_H 0x08
 #define EBPF_SIZE_B 0x10
@@ -146,4 +151,11 @@ struct ebpf_inst {
 #define EBPF_OP_JSLE_IMM (EBPF_CLS_JMP|EBPF_SRC_IMM|0xd0)
 #define EBPF_OP_JSLE_REG (EBPF_CLS_JMP|EBPF_SRC_REG|0xd0)
 
+/*
+ * Internal to uBPF: ubpf_optimize replaces the first of a chain of jeq on
+ * one register with this. imm indexes prog->switches and offset is that of
+ * the jeq it replaced. Never accepted in loaded code.
+ */
+#define EBPF_OP_JSWITCH  (EBPF_CLS_JMP|EBPF_SRC_IMM|0xe0)
+
 #endif
@@ -22,6 +22,7 @@
 
 struct ubpf_vm;
 typedef uint64_t (*ubpf_jit_fn)(void *mem, size_t mem_len);
+typedef void (*ubpf_jit_batch_fn)(void **mems, size_t *lens, uint64_t *results, size_t n);
 
 struct ubpf_vm *ubpf_create(void);
 void ubpf_destroy(struct ubpf_vm *vm);
@@ -31,16 +32,111 @@ void ubpf_destroy(struct ubpf_vm *vm);
  *
  * Bounds check is enabled by default, but it may be too restrictive
  * Pass true to enable, false to disable
+ * The JIT compiler emits checks according to the state when compiling
+ * Accesses ubpf_load proves within the stack or a map value are never checked
  * Returns previous state
  */
 bool toggle_bounds_check(struct ubpf_vm *vm, bool enable);
 
+/*
+ * Enable / disable the threaded interpreter
+ *
+ * When enabled, ubpf_exec runs from a copy of the program pre-decoded by
+ * ubpf_load, dispatching through computed gotos if the compiler supports
+ * them. This is faster than the default interpreter and, unlike
+ * ubpf_compile, does not need executable memory.
+ *
+ * Threaded execution is disabled by default
+ * Pass true to enable, false to disable
+ * Returns previous state
+ */
+bool toggle_threaded_exec(struct ubpf_vm *vm, bool enable);
+
+/*
+ * Enable / disable profiling
+ *
+ * When enabled, ubpf_exec counts how often each instruction runs and how
+ * often each jump is taken, using the default interpreter even if threaded
+ * execution is enabled. JIT compiled code counts entries to each basic
+ * block and fall-throughs of conditional jumps instead, from which the same
+ * per-instruction counts are derived. The JIT compiler emits counters
+ * according to the state when compiling.
+ *
+ * Code compiled once profiling is disabled again is laid out from the counts
+ * collected so far: the most frequent path through each branch falls
+ * through, and blocks that never ran are moved to the end.
+ *
+ * Counters are not updated atomically, so concurrent runs of the same VM
+ * may lose counts. A run that fails with a runtime error may be counted as
+ * having executed the rest of its basic block when JIT compiled.
+ *
+ * Profiling is disabled by default
+ * Pass true to enable, false to disable
+ * Returns previous state
+ */
+bool toggle_profiling(struct ubpf_vm *vm, bool enable);
+
+/*
+ * Enable / disable the detailed counters of ubpf_get_stats
+ *
+ * While enabled, ubpf_exec and ubpf_exec_batch measure the time they take
+ * and the interpreters count the calls of registered functions. Runs and
+ * runtime errors are counted either way.
+ *
+ * Detailed counters are disabled by default
+ * Pass true to enable, false to disable
+ * Returns previous state
+ */
+bool toggle_stats(struct ubpf_vm *vm, bool enable);
+
+/*
+ * Set the most stack a program may use
+ *
+ * ubpf_load works out how far below r10 the code can access, following
+ * pointers that are r10 plus a value of known range, and each run gets
+ * exactly that much stack. Code that uses the stack in ways that cannot be
+ * followed, such as storing a pointer into it or adding an unbounded value
+ * to one, gets the whole limit. Accesses beyond it fail bounds checks.
+ * Each call of a function of the program gets a frame of its own below its
+ * caller's, and the limit applies to the deepest chain of them: a function
+ * whose use cannot be followed gets what the frames of its callers and
+ * callees leave of it.
+ *
+ * The limit applies to code loaded afterwards. It must be a multiple of 8,
+ * at most 65536 bytes. The default is 512.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ubpf_set_stack_limit(struct ubpf_vm *vm, uint32_t limit);
+
+/* What a run that exhausts its budget returns */
+#define UBPF_BUDGET_EXHAUSTED (UINT64_MAX - 1)
+
+/*
+ * Bound how long each run may take
+ *
+ * A run, which is also each buffer of a batch and each call of a compiled
+ * function, may execute 'budget' jumps to the same or an earlier
+ * instruction and calls of functions of the program. Conditional jumps
+ * count whether taken or not. The next one ends the run with a
+ * UBPF_ERROR_BUDGET runtime error, and it returns UBPF_BUDGET_EXHAUSTED.
+ * Only straight-line code runs in between, so the other instructions need
+ * no checks.
+ *
+ * The budget applies to code loaded afterwards. The default of 0 means no
+ * limit, and the code then has no checks at all.
+ *
+ * Returns 0 on success, -1 if the VM is sealed.
+ */
+int ubpf_set_budget(struct ubpf_vm *vm, uint64_t budget);
+
 /*
  * Register an external function
  *
  * The immediate field of a CALL instruction is an index into an array of
  * functions registered by the user. This API associates a function with
- * an index.
+ * an index below 65536; the array grows to the highest index registered.
+ * Relocations in ELF files are resolved by name through a hash table.
  *
  * 'name' should be a string with a lifetime longer than the VM.
  *
@@ -48,6 +144,163 @@ bool toggle_bounds_check(struct ubpf_vm *vm, bool enable);
  */
 int ubpf_register(struct ubpf_vm *vm, unsigned int idx, const char *name, void *fn);
 
+/* Flags for ubpf_register_helper */
+#define UBPF_HELPER_NO_SIDE_EFFECTS (1 << 0) /* Writes no memory and has no other effect than its result */
+#define UBPF_HELPER_PURE            (1 << 1) /* Also reads no memory, so its result depends only on its arguments */
+
+/*
+ * Register an external function, declaring what it does
+ *
+ * Like ubpf_register, for a function taking 'num_args' arguments, at most
+ * 5, in r1 onwards. Registers past them are not treated as read by the
+ * call, so the JIT compiler does not pass them and the optimizer may drop
+ * the code setting them. ubpf_optimize removes calls of functions without
+ * side effects whose result is unused, and replaces calls of pure functions
+ * whose arguments are all known with their result, calling them once while
+ * optimizing. ubpf_register declares 5 arguments and no flags.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ubpf_register_helper(struct ubpf_vm *vm, unsigned int idx, const char *name, void *fn,
+                         unsigned int num_args, unsigned int flags);
+
+/* Functions built into uBPF, which the JIT compiler emits inline */
+enum ubpf_intrinsic {
+    UBPF_INTRINSIC_BSWAP16,    /* The low 16 bits of r1, byte-swapped */
+    UBPF_INTRINSIC_BSWAP32,    /* The low 32 bits of r1, byte-swapped */
+    UBPF_INTRINSIC_BSWAP64,    /* r1 byte-swapped */
+    UBPF_INTRINSIC_POPCNT,     /* The number of bits set in r1 */
+    UBPF_INTRINSIC_CRC32C_U8,  /* The CRC-32C r1 updated with the low byte of r2 */
+    UBPF_INTRINSIC_CRC32C_U32, /* The CRC-32C r1 updated with the low 4 bytes of r2, least significant first */
+    UBPF_INTRINSIC_CRC32C_U64, /* The CRC-32C r1 updated with the 8 bytes of r2, least significant first */
+    UBPF_INTRINSIC_SQRT_U32,   /* The square root of the low 32 bits of r1, rounded down */
+    UBPF_INTRINSIC_SQRT_F64,   /* The square root of the double r1 holds the bits of */
+};
+
+/*
+ * Register a built-in function
+ *
+ * Like ubpf_register_helper for a pure function, implemented by uBPF. The
+ * CRC-32C updates are those of the SSE4.2 crc32 instruction, without
+ * inverting the CRC before or after. JIT compiled code computes the result
+ * in place of the call, unless the CPU lacks the instruction needed for
+ * popcnt or crc32, in which case it calls the function as usual.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ubpf_register_intrinsic(struct ubpf_vm *vm, unsigned int idx, const char *name, enum ubpf_intrinsic intrinsic);
+
+enum ubpf_map_type {
+    UBPF_MAP_TYPE_ARRAY,
+    UBPF_MAP_TYPE_HASH,
+    UBPF_MAP_TYPE_PERCPU_ARRAY,
+    UBPF_MAP_TYPE_LRU_HASH,
+};
+
+struct ubpf_map;
+
+/*
+ * Create a map
+ *
+ * Array maps hold 'max_entries' values, initially zero, indexed by 4-byte
+ * keys. Per-CPU arrays hold a copy of each value for every CPU configured
+ * in the system, and lookups find the copy of the CPU they run on. Hash
+ * maps hold up to 'max_entries' values with keys of 'key_size' bytes; when
+ * full, LRU hash maps make room for a new key by evicting one of the least
+ * recently used.
+ *
+ * Values are 8-byte aligned. A map may be registered with several VMs and
+ * must outlive them.
+ *
+ * Returns NULL on error.
+ */
+struct ubpf_map *ubpf_map_create(enum ubpf_map_type type, uint32_t key_size, uint32_t value_size, uint32_t max_entries);
+void ubpf_map_destroy(struct ubpf_map *map);
+
+/* Flags for ubpf_map_update */
+#define UBPF_ANY     0 /* Create a new entry or update an existing one */
+#define UBPF_NOEXIST 1 /* Only create a new entry */
+#define UBPF_EXIST   2 /* Only update an existing entry */
+
+/*
+ * Access a map
+ *
+ * These may be called from any number of threads at once, and registered
+ * with ubpf_register for programs to call with a map as the first
+ * argument. Lookups never wait, and updates of different keys do not wait
+ * for each other. Values are accessed in place, so a value being updated
+ * may be read half-written.
+ *
+ * ubpf_map_lookup returns a pointer to the value for 'key', or NULL if
+ * there is none. The pointer stays valid as long as the map, but once the
+ * entry is deleted or evicted it may come to hold the value of another key.
+ * ubpf_map_lookup_cpu returns the copy of the value for 'cpu' in a per-CPU
+ * array, or NULL for other maps.
+ *
+ * ubpf_map_update and ubpf_map_delete return 0 on success, or -1 if 'flags'
+ * do not allow the update, the map is full, the key is out of range for an
+ * array, or there is nothing to delete. Entries of arrays cannot be deleted.
+ */
+void *ubpf_map_lookup(struct ubpf_map *map, const void *key);
+void *ubpf_map_lookup_cpu(struct ubpf_map *map, const void *key, uint32_t cpu);
+int ubpf_map_update(struct ubpf_map *map, const void *key, const void *value, uint64_t flags);
+int ubpf_map_delete(struct ubpf_map *map, const void *key);
+
+/*
+ * Scan packets
+ *
+ * These are to be registered with ubpf_register for programs to call, and
+ * use the widest vector instructions the CPU has. The VM knows how much
+ * memory each reads through its pointer arguments, so unless it can prove
+ * that within bounds, the call is bounds checked first, as loads are.
+ *
+ * ubpf_memchr returns the offset of the first of the 'len' bytes at 'p'
+ * equal to 'c', or 'len' if there is none.
+ *
+ * ubpf_memcmp returns 0 if the 'len' bytes at 'a' and 'b' are equal, else
+ * the difference between the first two that are not.
+ *
+ * ubpf_memmatch returns the first offset in the 'len' bytes at 'p' at which
+ * any pattern matches, with the index of the pattern in the upper 32 bits,
+ * or UINT64_MAX if none does. 'patterns' holds each as a length byte then
+ * its bytes. If several match at the same offset, the first wins. Empty
+ * patterns never match.
+ *
+ * ubpf_csum returns the 16-bit ones' complement sum of the 'len' bytes at
+ * 'p' and 'sum', with the bytes in the order they are in, as the Internet
+ * checksum is computed. Sums of pieces of even length may be chained
+ * through 'sum'. The checksum of an IPv4 header is the complement of its
+ * sum with the checksum field zeroed, and a valid one sums to 0xffff. For
+ * TCP and UDP, start from the sum of the addresses, 8 bytes from the IPv4
+ * source address or 32 from the IPv6 one, plus the protocol and the
+ * length, each as a 16-bit word in network byte order.
+ *
+ * ubpf_toeplitz returns the Toeplitz hash used for RSS of the 'len' bytes
+ * at 'data' with the 'key_len' bytes of 'key'. Bits past the end of the
+ * key count as zero, so a full key is 4 bytes longer than the data.
+ */
+uint64_t ubpf_memchr(const void *p, uint64_t len, uint64_t c);
+int64_t ubpf_memcmp(const void *a, const void *b, uint64_t len);
+uint64_t ubpf_memmatch(const void *p, uint64_t len, const void *patterns, uint64_t patterns_len);
+uint64_t ubpf_csum(const void *p, uint64_t len, uint64_t sum);
+uint64_t ubpf_toeplitz(const void *key, uint64_t key_len, const void *data, uint64_t len);
+
+/*
+ * Register a map
+ *
+ * A program refers to a map with an lddw instruction whose source register
+ * field is 1 and whose immediate is the index of the map, which loads a
+ * pointer to the map. In ELF files, 64-bit relocations against a symbol
+ * named like the map do the same. Loads and stores within the values of
+ * the maps a program refers to pass its bounds checks, and JIT compiled
+ * code does lookups in array maps itself when ubpf_map_lookup is called.
+ *
+ * 'name' should be a string with a lifetime longer than the VM.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ubpf_register_map(struct ubpf_vm *vm, unsigned int idx, const char *name, struct ubpf_map *map);
+
 /*
  * Load code into a VM
  *
@@ -57,6 +310,13 @@ int ubpf_register(struct ubpf_vm *vm, unsigned int idx, const char *name, void *
  * 'code' should point to eBPF bytecodes and 'code_len' should be the size in
  * bytes of that buffer.
  *
+ * A CALL instruction whose source register field is 1 calls the function of
+ * the program starting 'imm' instructions after the next one. It takes its
+ * arguments in r1 to r5 and returns in r0 like a registered function, and
+ * r6 to r9 keep their values across it. Functions may call each other up
+ * to 8 frames deep, but not recursively. Jumps must stay within a function,
+ * and each function but the last must end with an exit or ja.
+ *
  * Returns 0 on success, -1 on error. In case of error a pointer to the error
  * message will be stored in 'errmsg' and should be freed by the caller.
  */
@@ -71,19 +331,273 @@ int ubpf_load(struct ubpf_vm *vm, const void *code, uint32_t code_len, char **er
  * 'elf' should point to a copy of an ELF file in memory and 'elf_len' should
  * be the size in bytes of that buffer.
  *
- * The ELF file must be 64-bit little-endian with a single text section
- * containing the eBPF bytecodes. This is compatible with the output of
- * Clang.
+ * The ELF file must be 64-bit little-endian, and the program is the first
+ * text section containing eBPF bytecodes. Other text sections are only
+ * loaded if the program calls functions they define, after its code in the
+ * order they are first called. This is compatible with the output of
+ * Clang. The buffer is only read: relocations are applied as the code is
+ * copied into the VM, so it may be read-only.
  *
  * Returns 0 on success, -1 on error. In case of error a pointer to the error
  * message will be stored in 'errmsg' and should be freed by the caller.
  */
 int ubpf_load_elf(struct ubpf_vm *vm, const void *elf, size_t elf_len, char **errmsg);
 
+/*
+ * Load code from the ELF file at 'path'
+ *
+ * Like ubpf_load_elf, reading the file through a read-only mapping rather
+ * than a copy.
+ */
+int ubpf_load_elf_file(struct ubpf_vm *vm, const char *path, char **errmsg);
+
+/*
+ * Cache JIT compiled code in a directory
+ *
+ * Compiling code first looks in 'dir' for code compiled by this or any
+ * other process from the same program with the same settings, and saves
+ * what it compiles there otherwise. Entries are keyed by the program as it
+ * is about to be compiled, after ubpf_optimize if that was called, by the
+ * names and indexes of the registered functions and by the names, indexes
+ * and sizes of the registered maps. A name must refer to the same function
+ * in every process sharing the directory, and the directory must be cleared
+ * when the library is upgraded. Code compiled once profiling has been
+ * enabled is not cached.
+ *
+ * The cached code is run as it is, so the directory must only be writable
+ * by users trusted to run code in the process.
+ *
+ * 'dir' is copied. NULL disables caching, which is the default.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ubpf_set_cache_dir(struct ubpf_vm *vm, const char *dir);
+
+/*
+ * Optimize the loaded code
+ *
+ * Rewrites the program with constant folding, copy propagation, jump
+ * threading and removal of dead instructions, then replaces long chains of
+ * jeq on one register with a jump table or a binary search of the keys.
+ * Runtime errors still report the PCs of the code as loaded.
+ *
+ * This must be done after loading the code and before calling ubpf_compile.
+ * If the program is verified, ubpf_verify should be called first.
+ *
+ * Returns 0 on success, -1 on error. In case of error a pointer to the error
+ * message will be stored in 'errmsg' and should be freed by the caller.
+ */
+int ubpf_optimize(struct ubpf_vm *vm, char **errmsg);
+
+#define UBPF_REPLACE_VERIFY   (1 << 0)
+#define UBPF_REPLACE_OPTIMIZE (1 << 1)
+#define UBPF_REPLACE_JIT      (1 << 2)
+
+/*
+ * Replace the loaded code while it may be running
+ *
+ * The new code is validated and, depending on 'flags', verified, optimized
+ * and compiled, all before it is published. With UBPF_REPLACE_JIT,
+ * ubpf_exec and ubpf_exec_batch then run the compiled code. Each call to
+ * ubpf_exec or ubpf_exec_batch runs either the old code or the new code
+ * from start to finish, and the old code, compiled functions included, is
+ * freed once every call that may be using it has returned, so this blocks
+ * for as long as the longest of them.
+ *
+ * This may be called on a sealed VM and concurrently with the functions
+ * that are safe to use from several threads, but not from within a
+ * registered function called by the VM's own code. If no code is loaded
+ * yet, it behaves like ubpf_load. Profiling counts start over.
+ *
+ * Returns 0 on success, -1 on error, leaving the current code in place. In
+ * case of error a pointer to the error message will be stored in 'errmsg'
+ * and should be freed by the caller.
+ */
+int ubpf_replace(struct ubpf_vm *vm, const void *code, uint32_t code_len, int flags, char **errmsg);
+
+/*
+ * Load code into many VMs at once
+ *
+ * Does for each of the 'n' VMs what ubpf_replace does with 'flags', with
+ * codes[i] and code_lens[i] as the code for vms[i], on 'threads' threads
+ * including the caller's, or one per CPU if 0. The VMs are set up by the
+ * caller beforehand, and may share maps and registered functions, but
+ * nothing else may use them until this returns. Compiled code is packed
+ * into the same shared executable memory as that of ubpf_compile.
+ *
+ * Returns the number of programs that failed to load. errmsgs[i] is set to
+ * NULL if the code of vms[i] loaded, or otherwise to the error message,
+ * which should be freed by the caller.
+ */
+int ubpf_load_many(struct ubpf_vm *const *vms, const void *const *codes, const uint32_t *code_lens, size_t n,
+                   int flags, unsigned threads, char **errmsgs);
+
+/*
+ * Get the executable memory JIT compiled code of all VMs is packed into:
+ * the number of regions mapped, and the bytes of them that hold code
+ */
+void ubpf_get_code_usage(size_t *num_regions, size_t *bytes);
+
+/*
+ * Seal the VM against further changes
+ *
+ * Once code is loaded, ubpf_exec, ubpf_exec_batch, ubpf_compile,
+ * ubpf_compile_batch, ubpf_verify, ubpf_replace and the compiled functions
+ * may be called from any number of threads at once. Each kind of code is compiled once,
+ * by whichever thread asks first, and every caller gets the same function.
+ * The other functions change the VM and must not run concurrently with
+ * anything else on it.
+ *
+ * Sealing makes that explicit: afterwards ubpf_register, ubpf_register_map,
+ * ubpf_set_stack_limit, ubpf_set_budget, ubpf_set_cache_dir,
+ * ubpf_set_error_callback, ubpf_load, ubpf_load_elf and ubpf_optimize
+ * fail, and the toggle functions only return the current state. A sealed
+ * VM can then be shared between threads until ubpf_destroy, which must run
+ * once they are all done with it.
+ *
+ * Returns 0 on success, -1 if no code has been loaded.
+ */
+int ubpf_seal(struct ubpf_vm *vm);
+
 uint64_t ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len);
 
+/*
+ * Execute the program once for each of 'n' memory buffers
+ *
+ * 'mems' and 'lens' describe the buffers; the return value of each run is
+ * stored at the same index in 'results'.
+ */
+void ubpf_exec_batch(const struct ubpf_vm *vm, void **mems, size_t *lens, uint64_t *results, size_t n);
+
+/*
+ * Compile the program into a native function
+ *
+ * The function belongs to the code loaded at the time of the call and
+ * must not be called once ubpf_replace has replaced that code; use
+ * ubpf_exec with UBPF_REPLACE_JIT instead when the code may be replaced.
+ *
+ * Returns NULL on error. In case of error a pointer to the error message
+ * will be stored in 'errmsg' and should be freed by the caller.
+ */
 ubpf_jit_fn ubpf_compile(struct ubpf_vm *vm, char **errmsg);
 
+/*
+ * Compile the program into a function that processes a batch of buffers
+ *
+ * The returned function has the same semantics as ubpf_exec_batch. It
+ * saves and restores the host registers once per call rather than once
+ * per buffer. Like the function returned by ubpf_compile, it must not be
+ * called once the code has been replaced.
+ *
+ * Returns NULL on error. In case of error a pointer to the error message
+ * will be stored in 'errmsg' and should be freed by the caller.
+ */
+ubpf_jit_batch_fn ubpf_compile_batch(struct ubpf_vm *vm, char **errmsg);
+
+/*
+ * Check the loaded code for unreachable instructions, reads of registers
+ * that may not be initialized, and loops that cannot be shown to go round
+ * at most 2^20 times each time they are entered.
+ *
+ * Returns 0 if the code passes, otherwise prints why to stderr and returns
+ * nonzero.
+ */
 int ubpf_verify(struct ubpf_vm *vm);
 
+/*
+ * Counters collected while profiling, indexed by PC of the loaded code or,
+ * after ubpf_optimize, of the optimized code.
+ */
+struct ubpf_profile {
+    uint32_t num_insts;
+    /* Times each instruction was executed */
+    uint64_t *insts;
+    /* Times each jump was taken, or 0 for other instructions */
+    uint64_t *taken;
+    /* Times each conditional jump fell through, or 0 for other instructions */
+    uint64_t *not_taken;
+    /* Calls to each external function, indexed like ubpf_register */
+    uint32_t num_funcs;
+    uint64_t *calls;
+};
+
+/*
+ * Get a snapshot of the profiling counters
+ *
+ * The arrays in 'profile' should be released with ubpf_free_profile.
+ *
+ * Returns 0 on success, -1 if no code is loaded, profiling has never been
+ * enabled, or memory could not be allocated.
+ */
+int ubpf_get_profile(const struct ubpf_vm *vm, struct ubpf_profile *profile);
+
+void ubpf_free_profile(struct ubpf_profile *profile);
+
+/* Reset all profiling counters to zero */
+void ubpf_reset_profile(struct ubpf_vm *vm);
+
+/* Errors that end a run, which then returns UINT64_MAX unless noted */
+enum ubpf_error_kind {
+    UBPF_ERROR_DIV_BY_ZERO,   /* Division or modulo by a register holding 0 */
+    UBPF_ERROR_OUT_OF_BOUNDS, /* A load or store outside mem, the stack and map values */
+    UBPF_ERROR_MEM_ARG,       /* Memory a helper reads through an argument is out of bounds */
+    UBPF_ERROR_BUDGET,        /* The budget of ubpf_set_budget ran out, returning UBPF_BUDGET_EXHAUSTED */
+};
+
+#define UBPF_NUM_ERROR_KINDS 4
+
+struct ubpf_runtime_error {
+    enum ubpf_error_kind kind;
+    /* PC of the instruction in the code as loaded */
+    uint16_t pc;
+    /* For out of bounds errors, the memory the instruction or helper would have accessed */
+    void *addr;
+    uint64_t size;
+    /* Whether the access was a store, and the register the helper argument was in */
+    bool store;
+    int reg;
+    /* What the program could access */
+    void *mem;
+    size_t mem_len;
+    void *stack;
+    uint32_t stack_size;
+};
+
+typedef void (*ubpf_error_fn)(void *ctx, const struct ubpf_runtime_error *error);
+
+/*
+ * Report runtime errors to 'fn' instead of printing them to stderr
+ *
+ * 'fn' is called with 'ctx' on the thread the error happened on, during
+ * the run, including runs of compiled code called directly. It may be
+ * called from several threads at once and must not use the VM. Passing
+ * NULL restores printing.
+ *
+ * Returns 0 on success, -1 if the VM is sealed.
+ */
+int ubpf_set_error_callback(struct ubpf_vm *vm, ubpf_error_fn fn, void *ctx);
+
+struct ubpf_stats {
+    /* Runs by ubpf_exec and ubpf_exec_batch, a batch counting each buffer */
+    uint64_t runs;
+    /* Nanoseconds they took while detailed counters were enabled */
+    uint64_t run_ns;
+    /* Calls of registered functions by the interpreters while detailed counters were enabled */
+    uint64_t helper_calls;
+    /* Runtime errors of each kind, by any backend */
+    uint64_t errors[UBPF_NUM_ERROR_KINDS];
+};
+
+/*
+ * Get the sum of the counters kept by each thread that used the VM
+ *
+ * Threads count without synchronizing with each other or with this call,
+ * so the snapshot may be slightly out of date. Calls of functions returned
+ * by ubpf_compile and ubpf_compile_batch only count their errors.
+ */
+void ubpf_get_stats(const struct ubpf_vm *vm, struct ubpf_stats *stats);
+
+/* Reset all counters of ubpf_get_stats to zero */
+void ubpf_reset_stats(struct ubpf_vm *vm);
+
 #endif
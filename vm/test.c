@@ -25,22 +25,51 @@
 #include <getopt.h>
 #include <errno.h>
 #include <elf.h>
-#include <math.h>
+#include <pthread.h>
 #include "ubpf.h"
+#include "test_common.h"
+
+/* The code to replace the program with while the threads run it */
+struct replacement {
+    const void *code;
+    size_t code_len;
+    size_t count;
+    int flags;
+};
 
 void ubpf_set_register_offset(int x);
-static void *readfile(const char *path, size_t maxlen, size_t *len);
-static void register_functions(struct ubpf_vm *vm);
+static int run_batch(struct ubpf_vm *vm, bool jit, void *mem, size_t mem_len, size_t n, uint64_t *ret);
+static int run_threads(struct ubpf_vm *vm, bool jit, void *mem, size_t mem_len, size_t n,
+                       const struct replacement *replace, uint64_t *ret);
+static int run_load_many(const void *code, size_t code_len, int flags, const char *cache_dir, bool threaded,
+                         uint64_t budget, void *mem, size_t mem_len, size_t n, uint64_t *ret);
+static int print_profile(struct ubpf_vm *vm);
+static void print_error(void *ctx, const struct ubpf_runtime_error *error);
+static void print_stats(struct ubpf_vm *vm);
+static void train(struct ubpf_vm *vm, bool profile, void *mem, size_t mem_len);
+static struct ubpf_vm *compile_copy(const void *code, size_t code_len);
 
 static void usage(const char *name)
 {
-    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-V|--verify] [-m|--mem PATH] BINARY\n", name);
+    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-t|--threaded] [-b|--batch NUM] [-T|--threads NUM] [-R|--replace NUM] [-L|--load-many NUM] [-O|--optimize] [-P|--profile] [-S|--stats] [-B|--budget NUM] [-G|--pgo] [-V|--verify] [-C|--code-usage] [-c|--cache DIR] [-m|--mem PATH] BINARY\n", name);
     fprintf(stderr, "\nExecutes the eBPF code in BINARY and prints the result to stdout.\n");
     fprintf(stderr, "If --mem is given then the specified file will be read and a pointer\nto its data passed in r1.\n");
     fprintf(stderr, "If --jit is given then the JIT compiler will be used.\n");
+    fprintf(stderr, "If --threaded is given then the threaded interpreter will be used.\n");
+    fprintf(stderr, "If --batch is given then the program is run over NUM copies of the memory\nusing the batch API, and all results must match.\n");
+    fprintf(stderr, "If --threads is given then the sealed VM runs the program from NUM threads at\nonce, each on its own copy of the memory and compiling it first with --jit,\nand all results must match.\n");
+    fprintf(stderr, "If --replace is also given then the threads keep running the program while\nit is replaced with itself NUM times, with --verify, --optimize and --jit\napplied by ubpf_replace, and all results must still match. With --jit a copy\nof the program is compiled in another VM first and kept until the end.\n");
+    fprintf(stderr, "If --load-many is given then the code is loaded into NUM more VMs at once with\nubpf_load_many, applying --verify, --optimize and --jit, and each of them\nruns it on its own copy of the memory, and all results must match.\n");
     fprintf(stderr, "If --verify is given then the program must pass verification before loading.\n");
+    fprintf(stderr, "If --optimize is given then the program is optimized before running.\n");
+    fprintf(stderr, "If --profile is given then execution counts are printed to stderr after running.\n");
+    fprintf(stderr, "If --stats is given then runtime errors are reported through a callback, and\nthe counters of ubpf_get_stats are printed to stderr after running.\n");
+    fprintf(stderr, "If --budget is given then each run may take at most NUM backward jumps and\nlocal calls.\n");
+    fprintf(stderr, "If --pgo is given then the program is run once with profiling enabled first,\nso the JIT compiler can lay out the code from the counts.\n");
+    fprintf(stderr, "If --code-usage is given then the number of regions and bytes of executable\nmemory holding JIT compiled code are printed to stderr after running.\n");
+    fprintf(stderr, "If --cache is given then JIT compiled code is cached in DIR.\n");
     fprintf(stderr, "\nOther options:\n");
-    fprintf(stderr, "  -r, --register-offset NUM: Change the mapping from eBPF to x86 registers\n");
+    fprintf(stderr, "  -r, --register-offset NUM: Change the mapping from eBPF to machine registers\n");
 }
 
 int main(int argc, char **argv)
@@ -49,17 +78,41 @@ int main(int argc, char **argv)
         { .name = "help", .val = 'h', },
         { .name = "mem", .val = 'm', .has_arg=1 },
         { .name = "jit", .val = 'j' },
+        { .name = "threaded", .val = 't' },
+        { .name = "batch", .val = 'b', .has_arg=1 },
+        { .name = "threads", .val = 'T', .has_arg=1 },
+        { .name = "replace", .val = 'R', .has_arg=1 },
+        { .name = "load-many", .val = 'L', .has_arg=1 },
         { .name = "register-offset", .val = 'r', .has_arg=1 },
         { .name = "verify", .val = 'V' },
+        { .name = "optimize", .val = 'O' },
+        { .name = "profile", .val = 'P' },
+        { .name = "stats", .val = 'S' },
+        { .name = "budget", .val = 'B', .has_arg=1 },
+        { .name = "pgo", .val = 'G' },
+        { .name = "code-usage", .val = 'C' },
+        { .name = "cache", .val = 'c', .has_arg=1 },
         { }
     };
 
     const char *mem_filename = NULL;
     bool jit = false;
+    bool threaded = false;
+    size_t batch = 0;
+    size_t threads = 0;
+    size_t replaces = 0;
+    size_t load_many = 0;
     bool verify = false;
+    bool optimize = false;
+    bool profile = false;
+    bool stats = false;
+    uint64_t budget = 0;
+    bool pgo = false;
+    bool code_usage = false;
+    const char *cache_dir = NULL;
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "hm:jr:V", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hm:jtb:T:R:L:r:VOPSB:GCc:", longopts, NULL)) != -1) {
         switch (opt) {
         case 'm':
             mem_filename = optarg;
@@ -67,12 +120,48 @@ int main(int argc, char **argv)
         case 'j':
             jit = true;
             break;
+        case 't':
+            threaded = true;
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'T':
+            threads = atoi(optarg);
+            break;
+        case 'R':
+            replaces = atoi(optarg);
+            break;
+        case 'L':
+            load_many = atoi(optarg);
+            break;
         case 'r':
             ubpf_set_register_offset(atoi(optarg));
             break;
         case 'V':
             verify = true;
             break;
+        case 'O':
+            optimize = true;
+            break;
+        case 'P':
+            profile = true;
+            break;
+        case 'S':
+            stats = true;
+            break;
+        case 'B':
+            budget = strtoull(optarg, NULL, 0);
+            break;
+        case 'G':
+            pgo = true;
+            break;
+        case 'C':
+            code_usage = true;
+            break;
+        case 'c':
+            cache_dir = optarg;
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -82,7 +171,7 @@ int main(int argc, char **argv)
         }
     }
 
-    if (argc != optind + 1) {
+    if (argc != optind + 1 || (replaces && !threads)) {
         usage(argv[0]);
         return 1;
     }
@@ -110,6 +199,18 @@ int main(int argc, char **argv)
     }
 
     register_functions(vm);
+    if (cache_dir && ubpf_set_cache_dir(vm, cache_dir) < 0) {
+        fprintf(stderr, "Failed to set the cache directory\n");
+        ubpf_destroy(vm);
+        return 1;
+    }
+    toggle_threaded_exec(vm, threaded);
+    toggle_profiling(vm, profile);
+    toggle_stats(vm, stats);
+    if (stats) {
+        ubpf_set_error_callback(vm, print_error, stderr);
+    }
+    ubpf_set_budget(vm, budget);
 
     /* 
      * The ELF magic corresponds to an RSH instruction with an offset,
@@ -119,14 +220,14 @@ int main(int argc, char **argv)
 
     char *errmsg;
     int rv;
-    if (elf) {
+    if (elf && strcmp(code_filename, "-")) {
+	rv = ubpf_load_elf_file(vm, code_filename, &errmsg);
+    } else if (elf) {
 	rv = ubpf_load_elf(vm, code, code_len, &errmsg);
     } else {
 	rv = ubpf_load(vm, code, code_len, &errmsg);
     }
 
-    free(code);
-
     if (rv < 0) {
         fprintf(stderr, "Failed to load code: %s\n", errmsg);
         free(errmsg);
@@ -134,15 +235,62 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if ((replaces || load_many) && elf) {
+        fprintf(stderr, "Replacing ELF code is not supported\n");
+        ubpf_destroy(vm);
+        return 1;
+    }
+
     if (verify && ubpf_verify(vm)) {
         fprintf(stderr, "Failed verification\n");
         ubpf_destroy(vm);
         return 1;
     }
 
+    if (optimize && ubpf_optimize(vm, &errmsg) < 0) {
+        fprintf(stderr, "Failed to optimize: %s\n", errmsg);
+        free(errmsg);
+        ubpf_destroy(vm);
+        return 1;
+    }
+
+    if (pgo) {
+        train(vm, profile, mem, mem_len);
+    }
+
     uint64_t ret;
+    int flags = (verify ? UBPF_REPLACE_VERIFY : 0) | (optimize ? UBPF_REPLACE_OPTIMIZE : 0) |
+        (jit ? UBPF_REPLACE_JIT : 0);
 
-    if (jit) {
+    struct ubpf_vm *neighbour = NULL;
+
+    if (batch) {
+        if (run_batch(vm, jit, mem, mem_len, batch, &ret) < 0) {
+            ubpf_destroy(vm);
+            return 1;
+        }
+    } else if (threads) {
+        struct replacement replace = {
+            .code = code,
+            .code_len = code_len,
+            .count = replaces,
+            .flags = flags,
+        };
+        /* Keeps code in the regions the replaced programs are packed into */
+        if (replaces && jit && !(neighbour = compile_copy(code, code_len))) {
+            ubpf_destroy(vm);
+            return 1;
+        }
+        if (run_threads(vm, jit, mem, mem_len, threads, replaces ? &replace : NULL, &ret) < 0) {
+            ubpf_destroy(vm);
+            return 1;
+        }
+    } else if (load_many) {
+        if (run_load_many(code, code_len, flags, cache_dir, threaded, budget, mem, mem_len, load_many, &ret) < 0) {
+            ubpf_destroy(vm);
+            return 1;
+        }
+    } else if (jit) {
         ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
         if (fn == NULL) {
             fprintf(stderr, "Failed to compile: %s\n", errmsg);
@@ -154,117 +302,368 @@ int main(int argc, char **argv)
         ret = ubpf_exec(vm, mem, mem_len);
     }
 
+    free(code);
+
     printf("0x%"PRIx64"\n", ret);
 
+    if (profile && print_profile(vm) < 0) {
+        ubpf_destroy(vm);
+        return 1;
+    }
+
+    if (stats) {
+        print_stats(vm);
+    }
+
+    if (code_usage) {
+        size_t num_regions, bytes;
+        ubpf_get_code_usage(&num_regions, &bytes);
+        fprintf(stderr, "code regions %zu bytes %zu\n", num_regions, bytes);
+    }
+
+    if (neighbour) {
+        ubpf_destroy(neighbour);
+    }
     ubpf_destroy(vm);
 
     return 0;
 }
 
-static void *readfile(const char *path, size_t maxlen, size_t *len)
+static int run_batch(struct ubpf_vm *vm, bool jit, void *mem, size_t mem_len, size_t n, uint64_t *ret)
 {
-    FILE *file;
-    if (!strcmp(path, "-")) {
-        file = fdopen(STDIN_FILENO, "r");
+    void **mems = calloc(n, sizeof(*mems));
+    size_t *lens = calloc(n, sizeof(*lens));
+    uint64_t *results = calloc(n, sizeof(*results));
+    int rv = 0;
+    size_t i;
+
+    /* Each run gets its own copy since programs may write to memory */
+    for (i = 0; i < n; i++) {
+        if (mem) {
+            mems[i] = malloc(mem_len ? mem_len : 1);
+            memcpy(mems[i], mem, mem_len);
+        }
+        lens[i] = mem_len;
+    }
+
+    if (jit) {
+        char *errmsg;
+        ubpf_jit_batch_fn fn = ubpf_compile_batch(vm, &errmsg);
+        if (fn == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            rv = -1;
+            goto out;
+        }
+        fn(mems, lens, results, n);
     } else {
-        file = fopen(path, "r");
+        ubpf_exec_batch(vm, mems, lens, results, n);
     }
 
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
-        return NULL;
+    for (i = 1; i < n; i++) {
+        if (results[i] != results[0]) {
+            fprintf(stderr, "Batch result %zu is 0x%"PRIx64", expected 0x%"PRIx64"\n",
+                    i, results[i], results[0]);
+            rv = -1;
+            goto out;
+        }
+    }
+    *ret = results[0];
+
+out:
+    for (i = 0; i < n; i++) {
+        free(mems[i]);
     }
+    free(mems);
+    free(lens);
+    free(results);
+    return rv;
+}
 
-    void *data = calloc(maxlen, 1);
-    size_t offset = 0;
-    size_t rv;
-    while ((rv = fread(data+offset, 1, maxlen-offset, file)) > 0) {
-        offset += rv;
+static int run_load_many(const void *code, size_t code_len, int flags, const char *cache_dir, bool threaded,
+                         uint64_t budget, void *mem, size_t mem_len, size_t n, uint64_t *ret)
+{
+    struct ubpf_vm **vms = calloc(n, sizeof(*vms));
+    const void **codes = calloc(n, sizeof(*codes));
+    uint32_t *code_lens = calloc(n, sizeof(*code_lens));
+    char **errmsgs = calloc(n, sizeof(*errmsgs));
+    void *copy = malloc(mem_len ? mem_len : 1);
+    int rv = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        vms[i] = ubpf_create();
+        if (!vms[i]) {
+            fprintf(stderr, "Failed to create VM\n");
+            exit(1);
+        }
+        register_functions(vms[i]);
+        if (cache_dir) {
+            ubpf_set_cache_dir(vms[i], cache_dir);
+        }
+        toggle_threaded_exec(vms[i], threaded);
+        ubpf_set_budget(vms[i], budget);
+        codes[i] = code;
+        code_lens[i] = code_len;
     }
 
-    if (ferror(file)) {
-        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
-        fclose(file);
-        free(data);
-        return NULL;
+    if (ubpf_load_many(vms, codes, code_lens, n, flags, 0, errmsgs)) {
+        for (i = 0; i < n && !errmsgs[i]; i++);
+        fprintf(stderr, "Failed to load code: %s\n", errmsgs[i]);
+        rv = -1;
+        goto out;
     }
 
-    if (!feof(file)) {
-        fprintf(stderr, "Failed to read %s because it is too large (max %u bytes)\n",
-                path, (unsigned)maxlen);
-        fclose(file);
-        free(data);
-        return NULL;
+    /* Each run gets its own copy since programs may write to memory */
+    for (i = 0; i < n; i++) {
+        if (mem) {
+            memcpy(copy, mem, mem_len);
+        }
+        uint64_t result = ubpf_exec(vms[i], mem ? copy : NULL, mem_len);
+        if (i == 0) {
+            *ret = result;
+        } else if (result != *ret) {
+            fprintf(stderr, "VM %zu result is 0x%"PRIx64", expected 0x%"PRIx64"\n", i, result, *ret);
+            rv = -1;
+            break;
+        }
+    }
+
+out:
+    for (i = 0; i < n; i++) {
+        free(errmsgs[i]);
+        ubpf_destroy(vms[i]);
+    }
+    free(vms);
+    free(codes);
+    free(code_lens);
+    free(errmsgs);
+    free(copy);
+    return rv;
+}
+
+struct thread_run {
+    struct ubpf_vm *vm;
+    bool jit;
+    pthread_barrier_t *barrier;
+    void *mem;
+    size_t mem_len;
+    /* With a replacement, the pristine memory to run on until 'stop' is set */
+    const void *orig;
+    const bool *stop;
+    uint64_t ret;
+    int rv;
+};
+
+/* Runs the program until the replacements are done, each time on a fresh copy of the memory */
+static void run_until_stopped(struct thread_run *run)
+{
+    size_t runs = 0;
+
+    do {
+        if (run->mem_len) {
+            memcpy(run->mem, run->orig, run->mem_len);
+        }
+        uint64_t ret = ubpf_exec(run->vm, run->mem, run->mem_len);
+        if (runs++ == 0) {
+            run->ret = ret;
+        } else if (ret != run->ret) {
+            fprintf(stderr, "Run %zu result is 0x%"PRIx64", expected 0x%"PRIx64"\n",
+                    runs, ret, run->ret);
+            run->rv = -1;
+            return;
+        }
+    } while (!__atomic_load_n(run->stop, __ATOMIC_ACQUIRE));
+}
+
+static void *thread_main(void *arg)
+{
+    struct thread_run *run = arg;
+
+    /* Start together, so the threads race to compile */
+    pthread_barrier_wait(run->barrier);
+
+    if (run->stop) {
+        run_until_stopped(run);
+    } else if (run->jit) {
+        char *errmsg;
+        ubpf_jit_fn fn = ubpf_compile(run->vm, &errmsg);
+        if (fn == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            run->rv = -1;
+            return NULL;
+        }
+        run->ret = fn(run->mem, run->mem_len);
+    } else {
+        run->ret = ubpf_exec(run->vm, run->mem, run->mem_len);
+    }
+
+    return NULL;
+}
+
+static int run_threads(struct ubpf_vm *vm, bool jit, void *mem, size_t mem_len, size_t n,
+                       const struct replacement *replace, uint64_t *ret)
+{
+    struct thread_run *runs = calloc(n, sizeof(*runs));
+    pthread_t *tids = calloc(n, sizeof(*tids));
+    pthread_barrier_t barrier;
+    bool stop = false;
+    int rv = 0;
+    size_t i;
+
+    ubpf_seal(vm);
+    /* The main thread replaces the program once the others are running */
+    pthread_barrier_init(&barrier, NULL, replace ? n + 1 : n);
+
+    for (i = 0; i < n; i++) {
+        runs[i].vm = vm;
+        runs[i].jit = jit;
+        runs[i].barrier = &barrier;
+        if (mem) {
+            runs[i].mem = malloc(mem_len ? mem_len : 1);
+            memcpy(runs[i].mem, mem, mem_len);
+        }
+        runs[i].mem_len = mem_len;
+        if (replace) {
+            runs[i].orig = mem;
+            runs[i].stop = &stop;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        /* The others would wait at the barrier forever */
+        if (pthread_create(&tids[i], NULL, thread_main, &runs[i])) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (replace) {
+        pthread_barrier_wait(&barrier);
+        for (i = 0; i < replace->count; i++) {
+            char *errmsg;
+            if (ubpf_replace(vm, replace->code, replace->code_len, replace->flags, &errmsg) < 0) {
+                fprintf(stderr, "Failed to replace code: %s\n", errmsg);
+                free(errmsg);
+                rv = -1;
+                break;
+            }
+        }
+        __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
     }
 
-    fclose(file);
-    if (len) {
-        *len = offset;
+    for (i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+        if (runs[i].rv < 0) {
+            rv = -1;
+        }
     }
-    return data;
+
+    for (i = 0; rv == 0 && i < n; i++) {
+        if (runs[i].ret != runs[0].ret) {
+            fprintf(stderr, "Thread %zu result is 0x%"PRIx64", expected 0x%"PRIx64"\n",
+                    i, runs[i].ret, runs[0].ret);
+            rv = -1;
+        }
+    }
+    *ret = runs[0].ret;
+
+    for (i = 0; i < n; i++) {
+        free(runs[i].mem);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(runs);
+    free(tids);
+    return rv;
 }
 
-#ifndef memfrob
-void *
-memfrob(void *s, size_t n)
+/* Load the code into a new VM and JIT compile it */
+static struct ubpf_vm *compile_copy(const void *code, size_t code_len)
 {
-    for (int i = 0; i < n; i++) {
-        ((char *)s)[i] ^= 42;
+    struct ubpf_vm *vm = ubpf_create();
+    char *errmsg;
+
+    if (!vm) {
+        fprintf(stderr, "Failed to create VM\n");
+        return NULL;
+    }
+    register_functions(vm);
+    if (ubpf_load(vm, code, code_len, &errmsg) < 0) {
+        fprintf(stderr, "Failed to load code: %s\n", errmsg);
+        free(errmsg);
+        ubpf_destroy(vm);
+        return NULL;
     }
-    return s;
+    if (!ubpf_compile(vm, &errmsg)) {
+        fprintf(stderr, "Failed to compile: %s\n", errmsg);
+        free(errmsg);
+        ubpf_destroy(vm);
+        return NULL;
+    }
+    return vm;
 }
-#endif
 
-static uint64_t
-gather_bytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e)
+/* Collect a profile from one run on a copy of mem, then restore the profiling state */
+static void train(struct ubpf_vm *vm, bool profile, void *mem, size_t mem_len)
 {
-    return ((uint64_t)a << 32) |
-        ((uint32_t)b << 24) |
-        ((uint32_t)c << 16) |
-        ((uint16_t)d << 8) |
-        e;
+    void *copy = NULL;
+    if (mem) {
+        copy = malloc(mem_len ? mem_len : 1);
+        memcpy(copy, mem, mem_len);
+    }
+
+    toggle_profiling(vm, true);
+    ubpf_exec(vm, copy, mem_len);
+    toggle_profiling(vm, profile);
+
+    free(copy);
 }
 
-static void
-trash_registers(void)
+static int print_profile(struct ubpf_vm *vm)
 {
-    /* Overwrite all caller-save registers */
-#if defined(__i386__)
-    __asm__(
-        "mov $0xf0, %ax;"
-        "mov $0xf1, %cx;"
-        "mov $0xf2, %dx;"
-        "mov $0xf3, %si;"
-        "mov $0xf4, %di;"
-    );
-#elif defined(__x86_64__)
-    __asm__(
-        "mov $0xf0, %rax;"
-        "mov $0xf1, %rcx;"
-        "mov $0xf2, %rdx;"
-        "mov $0xf3, %rsi;"
-        "mov $0xf4, %rdi;"
-        "mov $0xf5, %r8;"
-        "mov $0xf6, %r9;"
-        "mov $0xf7, %r10;"
-        "mov $0xf8, %r11;"
-    );
-#endif
-// TODO: Add impl. for other architectures
+    struct ubpf_profile profile;
+    uint32_t i;
+
+    if (ubpf_get_profile(vm, &profile) < 0) {
+        fprintf(stderr, "Failed to get profile\n");
+        return -1;
+    }
+
+    for (i = 0; i < profile.num_insts; i++) {
+        if (profile.taken[i] || profile.not_taken[i]) {
+            fprintf(stderr, "PC %u: %"PRIu64" taken %"PRIu64" not taken %"PRIu64"\n",
+                    i, profile.insts[i], profile.taken[i], profile.not_taken[i]);
+        } else if (profile.insts[i]) {
+            fprintf(stderr, "PC %u: %"PRIu64"\n", i, profile.insts[i]);
+        }
+    }
+    for (i = 0; i < profile.num_funcs; i++) {
+        if (profile.calls[i]) {
+            fprintf(stderr, "call %u: %"PRIu64"\n", i, profile.calls[i]);
+        }
+    }
+
+    ubpf_free_profile(&profile);
+    return 0;
 }
 
-static uint32_t
-sqrti(uint32_t x)
+static void print_error(void *ctx, const struct ubpf_runtime_error *error)
 {
-    return sqrt(x);
+    static const char *const kinds[] = { "division by zero", "out of bounds", "memory argument",
+                                          "budget exhausted" };
+
+    fprintf(ctx, "%s at PC %u\n", kinds[error->kind], error->pc);
 }
 
-static void
-register_functions(struct ubpf_vm *vm)
+/* The counters that do not depend on timing */
+static void print_stats(struct ubpf_vm *vm)
 {
-    ubpf_register(vm, 0, "gather_bytes", gather_bytes);
-    ubpf_register(vm, 1, "memfrob", memfrob);
-    ubpf_register(vm, 2, "trash_registers", trash_registers);
-    ubpf_register(vm, 3, "sqrti", sqrti);
-    ubpf_register(vm, 4, "strcmp_ext", strcmp);
+    struct ubpf_stats stats;
+
+    ubpf_get_stats(vm, &stats);
+    fprintf(stderr, "runs %"PRIu64" helper calls %"PRIu64"\n", stats.runs, stats.helper_calls);
+    fprintf(stderr, "errors %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+            stats.errors[UBPF_ERROR_DIV_BY_ZERO], stats.errors[UBPF_ERROR_OUT_OF_BOUNDS],
+            stats.errors[UBPF_ERROR_MEM_ARG], stats.errors[UBPF_ERROR_BUDGET]);
 }
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ * Copyright 2017 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Shared by the test and benchmark drivers */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "test_common.h"
+
+#ifndef memfrob
+void *
+memfrob(void *s, size_t n)
+{
+    for (int i = 0; i < n; i++) {
+        ((char *)s)[i] ^= 42;
+    }
+    return s;
+}
+#endif
+
+static uint64_t
+gather_bytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e)
+{
+    return ((uint64_t)a << 32) |
+        ((uint32_t)b << 24) |
+        ((uint32_t)c << 16) |
+        ((uint16_t)d << 8) |
+        e;
+}
+
+static void
+trash_registers(void)
+{
+    /* Overwrite all caller-save registers */
+#if defined(__i386__)
+    __asm__(
+        "mov $0xf0, %ax;"
+        "mov $0xf1, %cx;"
+        "mov $0xf2, %dx;"
+        "mov $0xf3, %si;"
+        "mov $0xf4, %di;"
+    );
+#elif defined(__x86_64__)
+    __asm__(
+        "mov $0xf0, %rax;"
+        "mov $0xf1, %rcx;"
+        "mov $0xf2, %rdx;"
+        "mov $0xf3, %rsi;"
+        "mov $0xf4, %rdi;"
+        "mov $0xf5, %r8;"
+        "mov $0xf6, %r9;"
+        "mov $0xf7, %r10;"
+        "mov $0xf8, %r11;"
+    );
+#endif
+// TODO: Add impl. for other architectures
+}
+
+/* Shared by every VM in the process, so repeated runs see each other's updates */
+static struct ubpf_map *maps[4];
+
+void
+register_functions(struct ubpf_vm *vm)
+{
+    ubpf_register_helper(vm, 0, "gather_bytes", gather_bytes, 5, UBPF_HELPER_PURE);
+    ubpf_register_helper(vm, 1, "memfrob", memfrob, 2, 0);
+    ubpf_register(vm, 2, "trash_registers", trash_registers);
+    ubpf_register_intrinsic(vm, 3, "sqrti", UBPF_INTRINSIC_SQRT_U32);
+    ubpf_register_helper(vm, 4, "strcmp_ext", strcmp, 2, UBPF_HELPER_NO_SIDE_EFFECTS);
+    ubpf_register_helper(vm, 5, "map_lookup", ubpf_map_lookup, 2, 0);
+    ubpf_register_helper(vm, 6, "map_update", ubpf_map_update, 4, 0);
+    ubpf_register_helper(vm, 7, "map_delete", ubpf_map_delete, 2, 0);
+    ubpf_register_intrinsic(vm, 8, "popcnt", UBPF_INTRINSIC_POPCNT);
+    ubpf_register_intrinsic(vm, 9, "crc32c_u8", UBPF_INTRINSIC_CRC32C_U8);
+    ubpf_register_intrinsic(vm, 10, "crc32c_u32", UBPF_INTRINSIC_CRC32C_U32);
+    ubpf_register_intrinsic(vm, 11, "crc32c_u64", UBPF_INTRINSIC_CRC32C_U64);
+    ubpf_register_intrinsic(vm, 12, "bswap16", UBPF_INTRINSIC_BSWAP16);
+    ubpf_register_intrinsic(vm, 13, "bswap32", UBPF_INTRINSIC_BSWAP32);
+    ubpf_register_intrinsic(vm, 14, "bswap64", UBPF_INTRINSIC_BSWAP64);
+    ubpf_register_intrinsic(vm, 15, "sqrt", UBPF_INTRINSIC_SQRT_F64);
+    ubpf_register(vm, 16, "memchr", ubpf_memchr);
+    ubpf_register(vm, 17, "memcmp", ubpf_memcmp);
+    ubpf_register(vm, 18, "memmatch", ubpf_memmatch);
+    ubpf_register(vm, 19, "csum", ubpf_csum);
+    ubpf_register(vm, 20, "toeplitz", ubpf_toeplitz);
+    /* Well past the 64 slots there once were */
+    ubpf_register_helper(vm, 300, "strlen_ext", strlen, 1, UBPF_HELPER_NO_SIDE_EFFECTS);
+
+    if (!maps[0]) {
+        maps[0] = ubpf_map_create(UBPF_MAP_TYPE_ARRAY, 4, 8, 16);
+        maps[1] = ubpf_map_create(UBPF_MAP_TYPE_HASH, 8, 8, 16);
+        maps[2] = ubpf_map_create(UBPF_MAP_TYPE_PERCPU_ARRAY, 4, 8, 4);
+        maps[3] = ubpf_map_create(UBPF_MAP_TYPE_LRU_HASH, 4, 8, 4);
+    }
+    ubpf_register_map(vm, 0, "array", maps[0]);
+    ubpf_register_map(vm, 1, "hash", maps[1]);
+    ubpf_register_map(vm, 2, "percpu_array", maps[2]);
+    ubpf_register_map(vm, 3, "lru_hash", maps[3]);
+}
+
+void *
+readfile(const char *path, size_t maxlen, size_t *len)
+{
+    FILE *file;
+    if (!strcmp(path, "-")) {
+        file = fdopen(STDIN_FILENO, "r");
+    } else {
+        file = fopen(path, "r");
+    }
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    void *data = calloc(maxlen, 1);
+    size_t offset = 0;
+    size_t rv;
+    while ((rv = fread(data+offset, 1, maxlen-offset, file)) > 0) {
+        offset += rv;
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+
+    if (!feof(file)) {
+        fprintf(stderr, "Failed to read %s because it is too large (max %u bytes)\n",
+                path, (unsigned)maxlen);
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+
+    fclose(file);
+    if (len) {
+        *len = offset;
+    }
+    return data;
+}
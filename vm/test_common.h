@@ -0,0 +1,30 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "ubpf.h"
+
+/* Reads a file, or stdin if 'path' is "-", failing if it is larger than 'maxlen' */
+void *readfile(const char *path, size_t maxlen, size_t *len);
+
+/* Registers the external functions used by the testsuite programs */
+void register_functions(struct ubpf_vm *vm);
+
+#endif
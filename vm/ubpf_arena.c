@@ -0,0 +1,481 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Executable memory for JIT compiled programs
+ *
+ * Code is packed into shared regions, each an executable mapping of a
+ * memfd that is kept open. Installing code maps the pages it goes in
+ * writable from the memfd just for the copy and unmaps them again, so no
+ * page is ever both writable and executable, and no writable view of live
+ * code stays mapped. That costs an mmap and a munmap per program, and the
+ * munmap a TLB shootdown on every CPU running the process. Loading many
+ * programs at once instead keeps the writable view of each region it fills
+ * mapped until it is done, between ubpf_code_begin_install and
+ * ubpf_code_end_install. Regions are 2MB so the executable view can be backed
+ * by a huge page when the system allows it. Each region counts the programs
+ * placed in it and is unmapped when the last one is freed. Before then the
+ * space of freed programs is kept in a list of holes, sorted and merged, for
+ * new programs to reuse, so replacing a program next to long-lived ones
+ * does not keep taking fresh regions.
+ *
+ * If memfd is unavailable, or the executable view cannot be mapped, each
+ * program gets a private mapping that is made executable once written.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "ubpf_int.h"
+
+#define REGION_SIZE (2 * 1024 * 1024)
+#define CODE_ALIGN 64
+
+/* Code within this distance of 'near' can reach it with a rel32 displacement */
+#define NEAR_DISTANCE (INT32_MAX / 2)
+
+/* Space freed in the middle of a region */
+struct code_hole {
+    struct code_hole *next;
+    size_t offset;
+    size_t size;
+};
+
+struct code_region {
+    struct code_region *next;
+    uint8_t *exec;
+    /* The memfd behind a shared region, or -1 for a private mapping */
+    int fd;
+    /* Whether the memfd is of huge pages, which can only be mapped whole */
+    bool huge;
+    /* The writable view of the whole region, kept while installs are batched */
+    uint8_t *rw;
+    size_t size;
+    size_t used;
+    /* Free space below 'used', by offset */
+    struct code_hole *holes;
+    int refs;
+};
+
+static struct code_region *regions;
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Callers between ubpf_code_begin_install and ubpf_code_end_install */
+static int installers;
+
+static bool
+is_near(const void *p, size_t size, const void *near)
+{
+    if (!near) {
+        return true;
+    }
+    intptr_t lo = (intptr_t)p - (intptr_t)near;
+    intptr_t hi = lo + (intptr_t)size;
+    return lo > -NEAR_DISTANCE && hi < NEAR_DISTANCE;
+}
+
+/*
+ * mmap 'size' bytes, preferring an address within rel32 range of 'near' so
+ * JIT code placed there can call it directly.
+ */
+static void *
+map_near(size_t size, int prot, int flags, int fd, const void *near)
+{
+    static const intptr_t hint_offsets[] = { -(1L << 29), 1L << 29, -(3L << 29), 3L << 29 };
+    int i;
+
+    if (near) {
+        intptr_t page = sysconf(_SC_PAGESIZE);
+        for (i = 0; i < sizeof(hint_offsets)/sizeof(hint_offsets[0]); i++) {
+            intptr_t hint = ((intptr_t)near + hint_offsets[i]) & ~(page - 1);
+            if (hint <= 0) {
+                continue;
+            }
+            void *p = mmap((void *)hint, size, prot, flags, fd, 0);
+            if (p == MAP_FAILED) {
+                continue;
+            }
+            if (is_near(p, size, near)) {
+                return p;
+            }
+            munmap(p, size);
+        }
+    }
+
+    return mmap(NULL, size, prot, flags, fd, 0);
+}
+
+/* Create a shared region, an executable view of a memfd */
+static struct code_region *
+create_shared_region(size_t size, const void *near)
+{
+#ifdef MFD_CLOEXEC
+    struct code_region *region = calloc(1, sizeof(*region));
+    if (!region) {
+        return NULL;
+    }
+
+    bool huge = false;
+    int fd = -1;
+#ifdef MFD_HUGETLB
+    if (size % REGION_SIZE == 0) {
+        fd = memfd_create("ubpf-jit", MFD_CLOEXEC | MFD_HUGETLB);
+        huge = fd >= 0;
+    }
+#endif
+
+    while (true) {
+        if (fd < 0) {
+            fd = memfd_create("ubpf-jit", MFD_CLOEXEC);
+        }
+        if (fd < 0 || ftruncate(fd, size) < 0) {
+            break;
+        }
+        region->exec = map_near(size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, near);
+        if (region->exec != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            if (!huge) {
+                madvise(region->exec, size, MADV_HUGEPAGE);
+            }
+#endif
+            region->fd = fd;
+            region->huge = huge;
+            region->size = size;
+            return region;
+        }
+        if (!huge) {
+            break;
+        }
+        /* No huge pages available, retry with normal ones */
+        close(fd);
+        fd = -1;
+        huge = false;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(region);
+#endif
+    return NULL;
+}
+
+/* Create a region holding a single program, made executable in place once written */
+static struct code_region *
+create_private_region(size_t size, const void *near)
+{
+    struct code_region *region = calloc(1, sizeof(*region));
+    if (!region) {
+        return NULL;
+    }
+
+    region->exec = map_near(size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, near);
+    if (region->exec == MAP_FAILED) {
+        free(region);
+        return NULL;
+    }
+    region->fd = -1;
+    region->size = size;
+    return region;
+}
+
+static struct code_region *
+find_region(const void *code)
+{
+    struct code_region *region;
+    for (region = regions; region; region = region->next) {
+        if ((uint8_t *)code >= region->exec && (uint8_t *)code < region->exec + region->size) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take 'size' bytes from a shared region, the first hole they fit in or
+ * else after the rest, within rel32 range of 'near'
+ */
+static void *
+take_space(struct code_region *region, size_t size, const void *near)
+{
+    struct code_hole **link, *hole;
+    uint8_t *code;
+
+    if (region->fd < 0) {
+        return NULL;
+    }
+    for (link = &region->holes; (hole = *link); link = &hole->next) {
+        if (hole->size >= size && is_near(region->exec + hole->offset, size, near)) {
+            code = region->exec + hole->offset;
+            hole->offset += size;
+            hole->size -= size;
+            if (hole->size == 0) {
+                *link = hole->next;
+                free(hole);
+            }
+            return code;
+        }
+    }
+    if (region->size - region->used >= size && is_near(region->exec + region->used, size, near)) {
+        code = region->exec + region->used;
+        region->used += size;
+        return code;
+    }
+    return NULL;
+}
+
+/* Give back the 'size' bytes at 'offset' in a shared region */
+static void
+release_space(struct code_region *region, size_t offset, size_t size)
+{
+    struct code_hole **link = &region->holes, **before = NULL, **hole_link;
+    struct code_hole *hole;
+
+    while (*link && (*link)->offset < offset) {
+        before = link;
+        link = &(*link)->next;
+    }
+
+    if (before && (*before)->offset + (*before)->size == offset) {
+        hole_link = before;
+        hole = *before;
+        hole->size += size;
+    } else {
+        hole = malloc(sizeof(*hole));
+        if (!hole) {
+            /* Lost until the region is unmapped */
+            return;
+        }
+        hole->offset = offset;
+        hole->size = size;
+        hole->next = *link;
+        *link = hole;
+        hole_link = link;
+    }
+
+    struct code_hole *after = hole->next;
+    if (after && hole->offset + hole->size == after->offset) {
+        hole->size += after->size;
+        hole->next = after->next;
+        free(after);
+    }
+
+    /* The last hole is just the end of the region again */
+    if (hole->offset + hole->size == region->used) {
+        region->used = hole->offset;
+        *hole_link = hole->next;
+        free(hole);
+    }
+}
+
+void *
+ubpf_code_alloc(size_t size, const void *near)
+{
+    struct code_region *region;
+    void *code = NULL;
+
+    size = (size + CODE_ALIGN - 1) & ~(size_t)(CODE_ALIGN - 1);
+
+    pthread_mutex_lock(&regions_lock);
+
+    for (region = regions; region; region = region->next) {
+        if ((code = take_space(region, size, near))) {
+            break;
+        }
+    }
+
+    /*
+     * A region out of range is only made once the addresses map_near tries
+     * are taken, and the next would be out of range too, so rather than map
+     * one per program settle for any room left
+     */
+    if (!region && near) {
+        for (region = regions; region; region = region->next) {
+            if ((code = take_space(region, size, NULL))) {
+                break;
+            }
+        }
+    }
+
+    if (!region) {
+        size_t region_size = REGION_SIZE;
+        while (region_size < size) {
+            region_size += REGION_SIZE;
+        }
+        region = create_shared_region(region_size, near);
+        if (!region) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            region = create_private_region((size + page - 1) & ~(page - 1), near);
+        }
+        if (!region) {
+            goto out;
+        }
+        region->next = regions;
+        regions = region;
+        code = region->exec;
+        region->used = size;
+    }
+
+    region->refs++;
+
+out:
+    pthread_mutex_unlock(&regions_lock);
+    return code;
+}
+
+/* Unmap a region, with its writable view if one is kept */
+static void
+destroy_region(struct code_region *region)
+{
+    while (region->holes) {
+        struct code_hole *hole = region->holes;
+        region->holes = hole->next;
+        free(hole);
+    }
+    munmap(region->exec, region->size);
+    if (region->rw) {
+        munmap(region->rw, region->size);
+    }
+    if (region->fd >= 0) {
+        close(region->fd);
+    }
+    free(region);
+}
+
+void
+ubpf_get_code_usage(size_t *num_regions, size_t *bytes)
+{
+    struct code_region *region;
+    struct code_hole *hole;
+
+    *num_regions = 0;
+    *bytes = 0;
+
+    pthread_mutex_lock(&regions_lock);
+    for (region = regions; region; region = region->next) {
+        (*num_regions)++;
+        *bytes += region->used;
+        for (hole = region->holes; hole; hole = hole->next) {
+            *bytes -= hole->size;
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+}
+
+void
+ubpf_code_begin_install(void)
+{
+    pthread_mutex_lock(&regions_lock);
+    installers++;
+    pthread_mutex_unlock(&regions_lock);
+}
+
+void
+ubpf_code_end_install(void)
+{
+    struct code_region *region;
+
+    pthread_mutex_lock(&regions_lock);
+    if (--installers == 0) {
+        for (region = regions; region; region = region->next) {
+            if (region->rw) {
+                munmap(region->rw, region->size);
+                region->rw = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+}
+
+int
+ubpf_code_write(void *code, const void *src, size_t size)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&regions_lock);
+
+    struct code_region *region = find_region(code);
+    if (!region) {
+        rv = -1;
+    } else if (region->fd >= 0 && installers > 0) {
+        /* Map the whole region writable once for all the installs */
+        if (!region->rw) {
+            region->rw = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, 0);
+            if (region->rw == MAP_FAILED) {
+                region->rw = NULL;
+                rv = -1;
+            }
+        }
+        if (region->rw) {
+            memcpy(region->rw + ((uint8_t *)code - region->exec), src, size);
+        }
+    } else if (region->fd >= 0) {
+        /* Map the pages the code goes in writable, only for as long as the copy takes */
+        size_t offset = (uint8_t *)code - region->exec;
+        size_t start = 0, len = region->size;
+        if (!region->huge) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            start = offset & ~(page - 1);
+            len = ((offset + size + page - 1) & ~(page - 1)) - start;
+        }
+        uint8_t *rw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, start);
+        if (rw == MAP_FAILED) {
+            rv = -1;
+        } else {
+            memcpy(rw + (offset - start), src, size);
+            munmap(rw, len);
+        }
+    } else {
+        memcpy(code, src, size);
+        rv = mprotect(region->exec, region->size, PROT_READ | PROT_EXEC);
+    }
+    if (rv == 0) {
+        __builtin___clear_cache(code, (char *)code + size);
+    }
+
+    pthread_mutex_unlock(&regions_lock);
+    return rv;
+}
+
+void
+ubpf_code_free(void *code, size_t size)
+{
+    struct code_region **prev;
+
+    size = (size + CODE_ALIGN - 1) & ~(size_t)(CODE_ALIGN - 1);
+
+    pthread_mutex_lock(&regions_lock);
+
+    for (prev = &regions; *prev; prev = &(*prev)->next) {
+        struct code_region *region = *prev;
+        if ((uint8_t *)code < region->exec || (uint8_t *)code >= region->exec + region->size) {
+            continue;
+        }
+        if (--region->refs == 0) {
+            *prev = region->next;
+            destroy_region(region);
+        } else if (region->fd >= 0) {
+            release_space(region, (uint8_t *)code - region->exec, size);
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&regions_lock);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Loading many programs at once
+ *
+ * ubpf_load_many hands the programs out one at a time to a pool of
+ * threads, so a slow one does not hold up those after it. Each thread
+ * keeps the scratch buffers that loading, verifying and compiling one
+ * program free, and gives them out again for the next, so once it has
+ * seen a program of each size it no longer goes to the allocator, or
+ * faults in fresh pages, for the large per-instruction tables. Compiled
+ * code is installed through one writable mapping of each code region for
+ * the whole load, rather than one per program.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "ubpf_int.h"
+
+#define MAX_LOAD_THREADS 256
+
+/* Size of the block header, which keeps the contents aligned like malloc's */
+#define SCRATCH_HEADER 16
+#define SCRATCH_BLOCKS 32
+
+/* Freed blocks kept by a thread, each headed by its size */
+struct scratch {
+    uint8_t *blocks[SCRATCH_BLOCKS];
+    int num_blocks;
+};
+
+/* Set while the thread is a worker of ubpf_load_many */
+static __thread struct scratch *thread_scratch;
+
+void *
+ubpf_scratch_calloc(size_t n, size_t size)
+{
+    struct scratch *scratch = thread_scratch;
+    uint8_t *block;
+    int i, best = -1;
+
+    if (size && n > (SIZE_MAX - SCRATCH_HEADER) / size) {
+        return NULL;
+    }
+    size_t bytes = n * size;
+
+    /* The smallest block kept that is big enough */
+    for (i = 0; scratch && i < scratch->num_blocks; i++) {
+        size_t block_size = *(size_t *)scratch->blocks[i];
+        if (block_size >= bytes && (best < 0 || block_size < *(size_t *)scratch->blocks[best])) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        block = scratch->blocks[best];
+        scratch->blocks[best] = scratch->blocks[--scratch->num_blocks];
+        memset(block + SCRATCH_HEADER, 0, bytes);
+        return block + SCRATCH_HEADER;
+    }
+
+    block = calloc(1, SCRATCH_HEADER + bytes);
+    if (!block) {
+        return NULL;
+    }
+    *(size_t *)block = bytes;
+    return block + SCRATCH_HEADER;
+}
+
+void
+ubpf_scratch_free(void *p)
+{
+    struct scratch *scratch = thread_scratch;
+
+    if (!p) {
+        return;
+    }
+
+    uint8_t *block = (uint8_t *)p - SCRATCH_HEADER;
+    if (scratch && scratch->num_blocks < SCRATCH_BLOCKS) {
+        scratch->blocks[scratch->num_blocks++] = block;
+    } else {
+        free(block);
+    }
+}
+
+struct bulk_load {
+    struct ubpf_vm *const *vms;
+    const void *const *codes;
+    const uint32_t *code_lens;
+    size_t n;
+    int flags;
+    char **errmsgs;
+    /* Index of the next program to load, and how many failed */
+    size_t next;
+    size_t failed;
+};
+
+static void *
+load_worker(void *arg)
+{
+    struct bulk_load *load = arg;
+    struct scratch scratch = { .num_blocks = 0 };
+    size_t i;
+
+    thread_scratch = &scratch;
+    while ((i = __atomic_fetch_add(&load->next, 1, __ATOMIC_RELAXED)) < load->n) {
+        if (ubpf_replace(load->vms[i], load->codes[i], load->code_lens[i], load->flags, &load->errmsgs[i]) < 0) {
+            __atomic_fetch_add(&load->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    thread_scratch = NULL;
+
+    while (scratch.num_blocks > 0) {
+        free(scratch.blocks[--scratch.num_blocks]);
+    }
+    return NULL;
+}
+
+int
+ubpf_load_many(struct ubpf_vm *const *vms, const void *const *codes, const uint32_t *code_lens, size_t n,
+               int flags, unsigned threads, char **errmsgs)
+{
+    struct bulk_load load = {
+        .vms = vms, .codes = codes, .code_lens = code_lens, .n = n, .flags = flags, .errmsgs = errmsgs,
+    };
+    pthread_t tids[MAX_LOAD_THREADS];
+    unsigned started, i;
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+    if (threads > n) {
+        threads = n;
+    }
+    if (threads > MAX_LOAD_THREADS) {
+        threads = MAX_LOAD_THREADS;
+    }
+
+    ubpf_code_begin_install();
+    /* The calling thread is a worker too, so the loads finish even if no thread starts */
+    for (started = 0; started + 1 < threads; started++) {
+        if (pthread_create(&tids[started], NULL, load_worker, &load)) {
+            break;
+        }
+    }
+    load_worker(&load);
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    ubpf_code_end_install();
+
+    return load.failed;
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * On-disk cache of JIT compiled code
+ *
+ * Each entry is a file named after a hash of its key: everything the
+ * compiled code depends on, written out in a form that does not depend on
+ * where anything is in memory. That is the program as it is about to be
+ * compiled, with maps referred to by index rather than address, the names
+ * and declarations of the registered functions and the names and layout of
+ * the registered maps, and the settings the JIT compiler describes as a
+ * variant. The file
+ * holds the whole key, which must match exactly, then the code and its
+ * relocations from struct ubpf_jit_image.
+ *
+ * Files are written under a temporary name and renamed into place, so
+ * processes sharing a directory never see a partial entry.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ubpf_int.h"
+
+/* Changed whenever the JIT compiler or the format changes what an entry means */
+#define CACHE_MAGIC "uBPFjit6"
+
+struct cache_header {
+    char magic[8];
+    uint32_t key_size;
+    uint32_t code_size;
+    uint32_t num_relocs;
+    uint32_t reloc_size;
+    /* Of everything after the header */
+    uint64_t checksum;
+};
+
+struct key {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    bool oom;
+};
+
+static void
+key_append(struct key *key, const void *data, size_t len)
+{
+    if (key->oom) {
+        return;
+    }
+
+    if (len > key->cap - key->len) {
+        size_t cap = key->cap ? key->cap : 4096;
+        while (len > cap - key->len) {
+            cap *= 2;
+        }
+        uint8_t *p = realloc(key->data, cap);
+        if (!p) {
+            key->oom = true;
+            return;
+        }
+        key->data = p;
+        key->cap = cap;
+    }
+
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+}
+
+static void
+key_append_u32(struct key *key, uint32_t x)
+{
+    key_append(key, &x, sizeof(x));
+}
+
+static void
+key_append_str(struct key *key, const char *s)
+{
+    key_append_u32(key, strlen(s));
+    key_append(key, s, strlen(s));
+}
+
+/* FNV-1a */
+static uint64_t
+hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ull
+
+/* Index of the registered map at 'addr', as in the lddw instructions before ubpf_load resolved them */
+static uint32_t
+map_index(const struct ubpf_vm *vm, uint64_t addr)
+{
+    uint32_t i;
+    for (i = 0; i < MAX_MAPS && (uintptr_t)vm->maps[i] != addr; i++);
+    return i;
+}
+
+static int
+build_key(const struct ubpf_prog *prog, const void *variant, size_t variant_len, struct key *key)
+{
+    const struct ubpf_vm *vm = prog->vm;
+    int i;
+
+    memset(key, 0, sizeof(*key));
+    key_append_u32(key, variant_len);
+    key_append(key, variant, variant_len);
+
+    key_append_u32(key, prog->stack_size);
+    key_append(key, &prog->budget, sizeof(prog->budget));
+    key_append_u32(key, prog->num_funcs);
+    for (i = 0; i < prog->num_funcs; i++) {
+        key_append_u32(key, prog->funcs[i].start);
+        key_append_u32(key, prog->funcs[i].stack_size);
+    }
+    key_append_u32(key, prog->num_insts);
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        if (inst.opcode == EBPF_OP_LDDW && inst.src == EBPF_PSEUDO_MAP_IDX) {
+            struct ebpf_inst hi = prog->insts[++i];
+            inst.imm = map_index(vm, (uint32_t)inst.imm | ((uint64_t)hi.imm << 32));
+            hi.imm = 0;
+            key_append(key, &inst, sizeof(inst));
+            inst = hi;
+        }
+        key_append(key, &inst, sizeof(inst));
+    }
+    key_append(key, prog->safe_accesses, prog->num_insts);
+    key_append_u32(key, prog->orig_pc != NULL);
+    if (prog->orig_pc) {
+        key_append(key, prog->orig_pc, prog->num_insts * sizeof(prog->orig_pc[0]));
+    }
+
+    key_append_u32(key, prog->num_switches);
+    for (i = 0; i < prog->num_switches; i++) {
+        const struct ubpf_switch *sw = &prog->switches[i];
+        key_append(key, &sw->first_imm, sizeof(sw->first_imm));
+        key_append(key, &sw->default_pc, sizeof(sw->default_pc));
+        key_append(key, &sw->dense, sizeof(sw->dense));
+        key_append(key, &sw->min, sizeof(sw->min));
+        key_append_u32(key, sw->num_entries);
+        if (!sw->dense) {
+            key_append(key, sw->keys, sw->num_entries * sizeof(sw->keys[0]));
+        }
+        key_append(key, sw->targets, sw->num_entries * sizeof(sw->targets[0]));
+    }
+
+    for (i = 0; i < vm->num_ext_funcs; i++) {
+        const struct ubpf_ext_func_info *info = &vm->ext_func_info[i];
+        if (vm->ext_funcs[i] || info->name) {
+            key_append_u32(key, i);
+            key_append_str(key, info->name ? info->name : "");
+            key_append_u32(key, info->num_args);
+            key_append_u32(key, info->flags);
+            key_append_u32(key, info->intrinsic);
+            key_append(key, info->mem_args, sizeof(info->mem_args));
+        }
+    }
+    key_append_u32(key, MAX_EXT_FUNCS);
+
+    for (i = 0; i < MAX_MAPS; i++) {
+        const struct ubpf_map *map = vm->maps[i];
+        if (map) {
+            key_append_u32(key, i);
+            key_append_str(key, vm->map_names[i] ? vm->map_names[i] : "");
+            key_append_u32(key, map->type);
+            key_append_u32(key, map->key_size);
+            key_append_u32(key, map->value_size);
+            key_append_u32(key, map->max_entries);
+            key_append_u32(key, map->stride);
+            key_append_u32(key, map->ncpus);
+            key_append(key, &map->storage_size, sizeof(map->storage_size));
+        }
+    }
+    key_append_u32(key, MAX_MAPS);
+
+    if (key->oom) {
+        free(key->data);
+        return -1;
+    }
+    return 0;
+}
+
+/* The file an entry with this key is kept in, to be freed by the caller */
+static char *
+entry_path(const struct ubpf_vm *vm, const struct key *key)
+{
+    char *path;
+    if (asprintf(&path, "%s/%016llx.jit", vm->cache_dir,
+                 (unsigned long long)hash(HASH_INIT, key->data, key->len)) < 0) {
+        return NULL;
+    }
+    return path;
+}
+
+int
+ubpf_cache_load(const struct ubpf_prog *prog, const void *variant, size_t variant_len, struct ubpf_jit_image *image)
+{
+    struct key key;
+    char *path = NULL;
+    void *file = MAP_FAILED;
+    struct stat st;
+    int fd = -1;
+    int rv = -1;
+
+    if (build_key(prog, variant, variant_len, &key) < 0) {
+        return -1;
+    }
+
+    path = entry_path(prog->vm, &key);
+    if (!path) {
+        goto out;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(struct cache_header)) {
+        goto out;
+    }
+
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        goto out;
+    }
+
+    const struct cache_header *header = file;
+    const uint8_t *body = (const uint8_t *)file + sizeof(*header);
+    uint64_t body_size = st.st_size - sizeof(*header);
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+            header->reloc_size != sizeof(struct ubpf_reloc) ||
+            header->key_size != key.len ||
+            body_size != (uint64_t)header->key_size + header->code_size +
+                (uint64_t)header->num_relocs * sizeof(struct ubpf_reloc) ||
+            hash(HASH_INIT, body, body_size) != header->checksum ||
+            memcmp(body, key.data, key.len)) {
+        goto out;
+    }
+
+    image->code = malloc(header->code_size);
+    image->relocs = malloc(header->num_relocs * sizeof(struct ubpf_reloc) + 1);
+    if (!image->code || !image->relocs) {
+        free(image->code);
+        free(image->relocs);
+        goto out;
+    }
+    memcpy(image->code, body + key.len, header->code_size);
+    memcpy(image->relocs, body + key.len + header->code_size, header->num_relocs * sizeof(struct ubpf_reloc));
+    image->size = header->code_size;
+    image->num_relocs = header->num_relocs;
+    rv = 0;
+
+out:
+    if (file != MAP_FAILED) {
+        munmap(file, st.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(path);
+    free(key.data);
+    return rv;
+}
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Makes the temporary names of a process unique */
+static unsigned tmp_seq;
+
+void
+ubpf_cache_store(const struct ubpf_prog *prog, const void *variant, size_t variant_len, const struct ubpf_jit_image *image)
+{
+    struct key key;
+    char *path = NULL;
+    char *tmp_path = NULL;
+    int fd;
+
+    if (build_key(prog, variant, variant_len, &key) < 0) {
+        return;
+    }
+
+    /* Threads of ubpf_load_many may store the same entry at once */
+    path = entry_path(prog->vm, &key);
+    if (!path || asprintf(&tmp_path, "%s.%ld.%u.tmp", path, (long)getpid(),
+                          __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED)) < 0) {
+        tmp_path = NULL;
+        goto out;
+    }
+
+    size_t relocs_size = image->num_relocs * sizeof(struct ubpf_reloc);
+    struct cache_header header = {
+        .key_size = key.len,
+        .code_size = image->size,
+        .num_relocs = image->num_relocs,
+        .reloc_size = sizeof(struct ubpf_reloc),
+    };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.checksum = hash(hash(hash(HASH_INIT, key.data, key.len), image->code, image->size),
+                           image->relocs, relocs_size);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        goto out;
+    }
+    bool ok = write_all(fd, &header, sizeof(header)) == 0 && write_all(fd, key.data, key.len) == 0 &&
+        write_all(fd, image->code, image->size) == 0 && write_all(fd, image->relocs, relocs_size) == 0;
+    if (close(fd) < 0 || !ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+    }
+
+out:
+    free(tmp_path);
+    free(path);
+    free(key.data);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Epoch-based reclamation of replaced programs
+ *
+ * A reader increments the lock counter of its shard for the current epoch,
+ * then loads vm->prog, and increments the matching unlock counter when
+ * done. ubpf_replace swaps vm->prog and then waits in ubpf_synchronize
+ * until the old program can no longer be in use.
+ *
+ * The writer flips the epoch and waits for the half that was current to
+ * drain, twice, so both halves drain after the swap while new readers
+ * proceed on the other half and cannot hold up the wait. A reader that
+ * loaded the old program incremented its lock counter before the swap, so
+ * the writer sees it on whichever half the reader picked. Unlock counters
+ * are summed before lock counters, since an unlock never comes before its
+ * lock; equal sums then mean that every section counted has ended.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "ubpf_int.h"
+
+/* One more than the shard of the calling thread, or 0 before its first read section */
+__thread unsigned ubpf_thread_shard;
+
+static unsigned next_shard;
+
+unsigned
+ubpf_assign_shard(void)
+{
+    unsigned shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % UBPF_READER_SHARDS;
+    ubpf_thread_shard = shard + 1;
+    return shard;
+}
+
+struct ubpf_readers *
+ubpf_alloc_readers(void)
+{
+    void *readers;
+
+    if (posix_memalign(&readers, 64, sizeof(struct ubpf_readers))) {
+        return NULL;
+    }
+    memset(readers, 0, sizeof(struct ubpf_readers));
+    if (pthread_mutex_init(&((struct ubpf_readers *)readers)->lock, NULL)) {
+        free(readers);
+        return NULL;
+    }
+    return readers;
+}
+
+void
+ubpf_free_readers(struct ubpf_readers *readers)
+{
+    pthread_mutex_destroy(&readers->lock);
+    free(readers);
+}
+
+static bool
+drained(const struct ubpf_readers *readers, unsigned idx)
+{
+    uint64_t locks = 0, unlocks = 0;
+    int i;
+
+    for (i = 0; i < UBPF_READER_SHARDS; i++) {
+        unlocks += __atomic_load_n(&readers->shards[i].unlocks[idx], __ATOMIC_SEQ_CST);
+    }
+    for (i = 0; i < UBPF_READER_SHARDS; i++) {
+        locks += __atomic_load_n(&readers->shards[i].locks[idx], __ATOMIC_SEQ_CST);
+    }
+    return locks == unlocks;
+}
+
+void
+ubpf_synchronize(const struct ubpf_vm *vm)
+{
+    struct ubpf_readers *readers = vm->readers;
+    int i;
+
+    /* Concurrent writers flipping the epoch would cut each other's waits short */
+    pthread_mutex_lock(&readers->lock);
+    for (i = 0; i < 2; i++) {
+        unsigned idx = __atomic_fetch_add(&readers->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        int tries;
+        for (tries = 0; !drained(readers, idx); tries++) {
+            /* Sleeping lets a preempted reader run, which yielding may not */
+            if (tries < 16) {
+                sched_yield();
+            } else {
+                struct timespec ts = { .tv_nsec = 10000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    pthread_mutex_unlock(&readers->lock);
+}
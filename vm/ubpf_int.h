@@ -17,26 +17,480 @@
 #ifndef UBPF_INT_H
 #define UBPF_INT_H
 
+#include <pthread.h>
 #include <ubpf.h>
 #include "ebpf.h"
 
 #define MAX_INSTS 65536
-#define STACK_SIZE 128
+#define MAX_EXT_FUNCS 65536
+#define MAX_MAPS 64
+#define DEFAULT_STACK_LIMIT 512
+#define MAX_STACK_LIMIT 65536
+#define MAX_FUNCS 256
+/* Frames a chain of local calls may have, counting the entry function's */
+#define MAX_CALL_FRAMES 8
 
 struct ebpf_inst;
+struct ubpf_threaded_inst;
+struct ubpf_switch;
 typedef uint64_t (*ext_func)(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4);
 
-struct ubpf_vm {
+/* Profiling counters, indexed by PC */
+struct ubpf_counters {
+    /* Executions of each instruction and fall-throughs of each conditional jump by the interpreter */
+    uint64_t *insts;
+    uint64_t *not_taken;
+    /* Entries to PC 0 and to each jump target, and fall-throughs, by JIT compiled code */
+    uint64_t *jit_blocks;
+    uint64_t *jit_not_taken;
+};
+
+/*
+ * A function of the program: the code from PC 0, or from a target of a
+ * local call, up to the next one. Each call gets a stack frame of its own
+ * below the caller's.
+ */
+struct ubpf_func {
+    uint16_t start;
+    uint16_t end;
+    /* Bytes of stack below r10 the function uses, from ubpf_analyze_ranges */
+    uint32_t stack_size;
+};
+
+/*
+ * A loaded program and everything derived from it. ubpf_replace swaps the
+ * whole of it at once, so code running it never sees parts of two programs.
+ */
+struct ubpf_prog {
+    /* The VM it was loaded into, for the registered functions and settings */
+    const struct ubpf_vm *vm;
     struct ebpf_inst *insts;
     uint16_t num_insts;
+    /* Published with a release store once compiled, under vm->lock */
     ubpf_jit_fn jitted;
     size_t jitted_size;
+    ubpf_jit_batch_fn jitted_batch;
+    size_t jitted_batch_size;
+    /* Whether ubpf_exec runs the JIT code, set by ubpf_replace with UBPF_REPLACE_JIT */
+    bool exec_jitted;
+    struct ubpf_threaded_inst *threaded;
+    /* PC of each instruction before ubpf_optimize, or NULL if not optimized */
+    uint16_t *orig_pc;
+    /* Allocated once code is loaded with profiling enabled; JIT code refers to it directly */
+    struct ubpf_counters *counters;
+    /* Sorted by start, the first being the entry function */
+    struct ubpf_func *funcs;
+    int num_funcs;
+    /* Bytes of stack each run gets, enough for the deepest chain of calls, from ubpf_analyze_ranges */
+    uint32_t stack_size;
+    /* Whether the access at each PC is proven in bounds, so needs no check */
+    uint8_t *safe_accesses;
+    /* Maps the code refers to, whose values pass bounds checks */
+    struct ubpf_map *maps[MAX_MAPS];
+    int num_maps;
+    /* Case tables of the jswitch instructions added by ubpf_optimize */
+    struct ubpf_switch *switches;
+    int num_switches;
+    /* From ubpf_set_budget, and which instructions use it up, or NULL without a budget */
+    uint64_t budget;
+    uint8_t *budget_points;
+    /* The switch interpreter specialized for the VM's settings, from ubpf_select_interpreter */
+    uint64_t (*interpret)(const struct ubpf_prog *prog, void *mem, size_t mem_len);
+};
+
+/*
+ * A chain of jeq on one register, lowered to a table. Dense tables have a
+ * target for every value from min on, sparse ones only for the sorted keys.
+ */
+struct ubpf_switch {
+    /* Immediate of the jeq replaced by the jswitch, which profiling still runs */
+    int32_t first_imm;
+    /* Where the chain ends, for values matching no case */
+    uint16_t default_pc;
+    bool dense;
+    uint64_t min;
+    uint32_t num_entries;
+    uint64_t *keys;
+    uint16_t *targets;
+};
+
+/* The PC execution continues at after a jswitch on 'value' */
+static inline uint16_t
+ubpf_switch_target(const struct ubpf_switch *sw, uint64_t value)
+{
+    if (sw->dense) {
+        uint64_t i = value - sw->min;
+        return i < sw->num_entries ? sw->targets[i] : sw->default_pc;
+    }
+
+    uint32_t lo = 0, hi = sw->num_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (sw->keys[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < sw->num_entries && sw->keys[lo] == value ? sw->targets[lo] : sw->default_pc;
+}
+
+#define UBPF_READER_SHARDS 16
+
+/* Read-side critical sections begun and ended in each epoch, on a cache line of its own */
+struct ubpf_reader_shard {
+    uint64_t locks[2];
+    uint64_t unlocks[2];
+    char pad[64 - 4 * sizeof(uint64_t)];
+};
+
+/*
+ * Readers of vm->prog, tracked like sleepable RCU: each section counts on
+ * its thread's shard, in the half selected by the epoch when it began.
+ * Writers flip the epoch so the old half drains, see ubpf_synchronize.
+ */
+struct ubpf_readers {
+    struct ubpf_reader_shard shards[UBPF_READER_SHARDS];
+    unsigned epoch;
+    /* Serializes writers in ubpf_synchronize */
+    pthread_mutex_t lock;
+};
+
+/* Counters of ubpf_get_stats kept by the threads of a reader shard, on a cache line of its own */
+struct ubpf_stats_shard {
+    uint64_t runs;
+    uint64_t run_ns;
+    uint64_t helper_calls;
+    uint64_t errors[UBPF_NUM_ERROR_KINDS];
+    char pad[64 - (3 + UBPF_NUM_ERROR_KINDS) * sizeof(uint64_t)];
+};
+
+/* Most arguments a helper from ubpf_simd.c reads memory through */
+#define UBPF_MAX_MEM_ARGS 2
+
+/* What was registered at an index of vm->ext_funcs */
+struct ubpf_ext_func_info {
+    const char *name;
+    /* The next index with a name in the same bucket of vm->ext_func_buckets, or UINT32_MAX */
+    uint32_t next;
+    uint8_t num_args;
+    /* UBPF_HELPER_* */
+    uint8_t flags;
+    /* One more than the enum ubpf_intrinsic it was registered as, or 0 */
+    uint8_t intrinsic;
+    /* From ubpf_mem_helpers, if one of those was registered */
+    uint8_t mem_args[UBPF_MAX_MEM_ARGS][2];
+};
+
+#define NUM_INTRINSICS (UBPF_INTRINSIC_SQRT_F64 + 1)
+
+/* The portable implementation of an intrinsic */
+struct ubpf_intrinsic_impl {
+    ext_func fn;
+    uint8_t num_args;
+};
+
+extern const struct ubpf_intrinsic_impl ubpf_intrinsics[NUM_INTRINSICS];
+
+#define NUM_MEM_HELPERS 5
+
+/* A helper from ubpf_simd.c and the memory it reads */
+struct ubpf_mem_helper {
+    ext_func fn;
+    uint8_t num_args;
+    /*
+     * Each argument pointing to memory read, then the argument holding how
+     * many bytes, counting from 1. Unused pairs are 0.
+     */
+    uint8_t mem_args[UBPF_MAX_MEM_ARGS][2];
+};
+
+extern const struct ubpf_mem_helper ubpf_mem_helpers[NUM_MEM_HELPERS];
+const struct ubpf_mem_helper *ubpf_find_mem_helper(ext_func fn);
+
+struct ubpf_read_section {
+    unsigned shard;
+    unsigned idx;
+};
+
+struct ubpf_vm {
+    /* The current program, or NULL before any is loaded; freed on replacement once no reader remains */
+    struct ubpf_prog *prog;
+    struct ubpf_readers *readers;
+    /* Serializes compiling and replacing the program */
+    pthread_mutex_t lock;
+    /* Set by ubpf_seal, after which only the program changes */
+    bool sealed;
+    /* Registered functions, NULL where none is, and what was declared about them */
     ext_func *ext_funcs;
-    const char **ext_func_names;
+    struct ubpf_ext_func_info *ext_func_info;
+    uint32_t num_ext_funcs;
+    /* Hash table of the indices with names, each bucket chained through ext_func_info[].next */
+    uint32_t *ext_func_buckets;
+    uint32_t num_buckets;
+    uint32_t num_named;
+    struct ubpf_map **maps;
+    const char **map_names;
     bool bounds_check_enabled;
+    bool threaded_enabled;
+    bool profiling_enabled;
+    bool stats_enabled;
+    /* UBPF_READER_SHARDS counters, each updated by the threads of that shard */
+    struct ubpf_stats_shard *stats;
+    /* Called with error_ctx on runtime errors, or NULL to print them */
+    ubpf_error_fn error_fn;
+    void *error_ctx;
+    /* Most stack a program loaded from now on may get */
+    uint32_t stack_limit;
+    uint64_t budget;
+    /* Directory JIT compiled code is cached in, or NULL */
+    char *cache_dir;
+};
+
+struct ubpf_map {
+    enum ubpf_map_type type;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t max_entries;
+    /* Bytes from one array value, or hash slot, to the next */
+    uint32_t stride;
+    /* Bytes from the start of a hash slot to its value, or 0 for arrays */
+    uint32_t value_offset;
+    /* Copies of each array value, for per-CPU arrays */
+    uint32_t ncpus;
+    /* Array values, one CPU after another, or hash slots */
+    void *storage;
+    size_t storage_size;
+    /* Hash slots, a power of two, and entries in them or being inserted */
+    uint32_t capacity;
+    uint32_t count;
+    /* For LRU hash maps, counts insertions, and where eviction looks next */
+    uint64_t clock;
+    uint32_t cursor;
+};
+
+enum ubpf_patch_kind {
+    UBPF_PATCH_HELPER, /* A call of the registered function with index 'value' */
+    UBPF_PATCH_MAP,    /* An lddw of the map with index 'value' */
+    UBPF_PATCH_LOCAL,  /* A local call of the function at PC 'value' */
+};
+
+/* A change ubpf_load_elf makes to the code as it is loaded, so the ELF file is never written */
+struct ubpf_patch {
+    uint32_t pc;
+    enum ubpf_patch_kind kind;
+    uint32_t value;
+};
+
+/* Code to be loaded as one program, in the order of the segments */
+struct ubpf_segment {
+    const void *code;
+    uint32_t len;
+};
+
+/* What an absolute address in JIT compiled code refers to */
+enum ubpf_reloc_kind {
+    UBPF_RELOC_HELPER,      /* vm->ext_funcs[index] */
+    UBPF_RELOC_MAP,         /* vm->maps[index] */
+    UBPF_RELOC_MAP_STORAGE, /* vm->maps[index]->storage */
+    UBPF_RELOC_INTERNAL,    /* Function or data of the JIT compiler itself */
+};
+
+struct ubpf_reloc {
+    /* Where the 64-bit address is, or for calls the rel32 */
+    uint32_t loc;
+    /* For calls, a stub jumping to the target, used when it is out of rel32 range */
+    uint32_t stub_loc;
+    uint16_t index;
+    uint8_t kind;
+    bool call;
+};
+
+/*
+ * JIT compiled code before it is placed in executable memory. Every
+ * absolute address in it is described by a relocation, so it can be saved
+ * and placed again by another process.
+ */
+struct ubpf_jit_image {
+    uint8_t *code;
+    uint32_t size;
+    struct ubpf_reloc *relocs;
+    uint32_t num_relocs;
 };
 
+/* The PC to report for the instruction at 'pc' */
+static inline uint16_t
+ubpf_orig_pc(const struct ubpf_prog *prog, uint16_t pc)
+{
+    return prog->orig_pc ? prog->orig_pc[pc] : pc;
+}
+
+/* Whether 'inst' calls a function of the program rather than a registered one */
+static inline bool
+ubpf_is_local_call(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_CALL && inst.src == EBPF_PSEUDO_CALL;
+}
+
+/* Index in prog->funcs of the function 'pc' is in */
+static inline int
+ubpf_find_func(const struct ubpf_prog *prog, uint16_t pc)
+{
+    int lo = 0, hi = prog->num_funcs - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (prog->funcs[mid].start <= pc) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+extern __thread unsigned ubpf_thread_shard;
+unsigned ubpf_assign_shard(void);
+
+/* The shard the calling thread counts on, assigned by its first call */
+static inline unsigned
+ubpf_current_shard(void)
+{
+    return ubpf_thread_shard ? ubpf_thread_shard - 1 : ubpf_assign_shard();
+}
+
+/*
+ * Add to a counter of a stats shard. Threads sharing the shard may lose
+ * each other's counts when adding at the same time, which a lock prefix
+ * on every run would prevent at far greater cost.
+ */
+static inline void
+ubpf_count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Begin a read-side critical section and return the current program, which
+ * stays valid until the matching ubpf_read_unlock. Sections may nest.
+ */
+static inline const struct ubpf_prog *
+ubpf_read_lock(const struct ubpf_vm *vm, struct ubpf_read_section *section)
+{
+    struct ubpf_readers *readers = vm->readers;
+    unsigned shard = ubpf_current_shard();
+
+    section->shard = shard;
+    section->idx = __atomic_load_n(&readers->epoch, __ATOMIC_ACQUIRE) & 1;
+    __atomic_fetch_add(&readers->shards[shard].locks[section->idx], 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&vm->prog, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+ubpf_read_unlock(const struct ubpf_vm *vm, struct ubpf_read_section *section)
+{
+    __atomic_fetch_add(&vm->readers->shards[section->shard].unlocks[section->idx], 1, __ATOMIC_RELEASE);
+}
+
+struct ubpf_readers *ubpf_alloc_readers(void);
+void ubpf_free_readers(struct ubpf_readers *readers);
+/* Wait for every read-side critical section begun before the call to end */
+void ubpf_synchronize(const struct ubpf_vm *vm);
+
 char *ubpf_error(const char *fmt, ...);
 unsigned int ubpf_lookup_registered_function(struct ubpf_vm *vm, const char *name);
+unsigned int ubpf_lookup_registered_map(struct ubpf_vm *vm, const char *name);
+bool ubpf_map_contains(const struct ubpf_map *map, const void *addr, uint64_t size);
+/* These check regardless of vm->bounds_check_enabled, so callers skip them when it is off */
+bool ubpf_bounds_check(const struct ubpf_prog *prog, void *addr, int size, bool store, uint16_t cur_pc, void *mem, size_t mem_len, void *stack);
+bool ubpf_check_mem_args(const struct ubpf_prog *prog, const uint64_t *reg, uint16_t cur_pc, void *mem, size_t mem_len, void *stack);
+
+/* Count a runtime error and pass it to the error callback or print it, as every backend does */
+void ubpf_report_error(const struct ubpf_vm *vm, const struct ubpf_runtime_error *error);
+/* Report an error with nothing to it but 'pc' of the code as loaded */
+void ubpf_report_error_at(const struct ubpf_vm *vm, enum ubpf_error_kind kind, uint16_t pc);
+
+uint16_t ubpf_inst_uses(struct ebpf_inst inst);
+uint16_t ubpf_inst_defs(struct ebpf_inst inst);
+void ubpf_analyze_registers(const struct ubpf_prog *prog, uint16_t *live_out, uint16_t *defined_in);
+int ubpf_successors(const struct ubpf_prog *prog, int pc, int succs[2]);
+int ubpf_verify_prog(const struct ubpf_prog *prog);
+int ubpf_load_patched(struct ubpf_vm *vm, const struct ubpf_segment *segments, uint32_t num_segments,
+        const struct ubpf_patch *patches, uint32_t num_patches, char **errmsg);
+/* Splits the program into prog->funcs at the targets of its local calls, checking how they call each other */
+int ubpf_find_funcs(struct ubpf_prog *prog, char **errmsg);
+int ubpf_analyze_ranges(struct ubpf_prog *prog, uint32_t limit, char **errmsg);
+/*
+ * Marks in prog->budget_points the jumps to the same or an earlier PC and
+ * the local calls, which every cycle and every chain of calls goes through
+ */
+int ubpf_find_budget_points(struct ubpf_prog *prog);
+
+/*
+ * Scratch memory for tables that live only while code is loaded, verified,
+ * optimized or compiled. Blocks freed on a thread loading programs for
+ * ubpf_load_many are kept there for the next program, and those from
+ * ubpf_scratch_calloc may only be freed with ubpf_scratch_free.
+ */
+void *ubpf_scratch_calloc(size_t n, size_t size);
+void ubpf_scratch_free(void *p);
+
+/*
+ * Points prog->interpret at the specialization for profiling, the budget
+ * and bounds checking as they are now. Called again whenever one changes.
+ */
+void ubpf_select_interpreter(struct ubpf_prog *prog);
+
+int ubpf_optimize_prog(struct ubpf_prog *prog, char **errmsg);
+void ubpf_free_switches(struct ubpf_prog *prog);
+
+/* Allocates prog->counters if needed */
+int ubpf_alloc_counters(struct ubpf_prog *prog);
+int ubpf_get_prog_profile(const struct ubpf_prog *prog, struct ubpf_profile *profile);
+
+/* A basic block [start, end) of eBPF instructions, as emitted by the JIT compilers */
+struct ubpf_code_block {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* How the JIT compilers find the basic blocks and choose the order to emit them in */
+void ubpf_find_leaders(const struct ubpf_prog *prog, uint8_t *leaders);
+int ubpf_layout_blocks(const struct ubpf_prog *prog, const uint8_t *leaders, bool counting,
+                       struct ubpf_code_block *order, int *num_order);
+
+int ubpf_threaded_decode(struct ubpf_prog *prog);
+uint64_t ubpf_threaded_exec(const struct ubpf_prog *prog, void *mem, size_t mem_len);
+
+/*
+ * Compiles prog unless already done, keeping the result in prog->jitted or
+ * prog->jitted_batch. Once prog is published, vm->lock must be held.
+ */
+int ubpf_compile_prog(struct ubpf_prog *prog, bool batch, char **errmsg);
+
+/*
+ * Executable memory shared between JIT compiled programs. Space is reserved
+ * with ubpf_code_alloc, preferably within rel32 range of 'near', filled once
+ * with ubpf_code_write and released with ubpf_code_free, given the same size.
+ */
+void *ubpf_code_alloc(size_t size, const void *near);
+int ubpf_code_write(void *code, const void *src, size_t size);
+void ubpf_code_free(void *code, size_t size);
+
+/*
+ * While any thread is between these, ubpf_code_write keeps the writable
+ * view of each region it writes to mapped, rather than mapping and
+ * unmapping the pages of each program.
+ */
+void ubpf_code_begin_install(void);
+void ubpf_code_end_install(void);
+
+/*
+ * The JIT compiled code cached in vm->cache_dir for prog, compiled with
+ * settings described by 'variant'. Returns -1 if there is none, otherwise
+ * fills 'image', whose arrays the caller frees.
+ */
+int ubpf_cache_load(const struct ubpf_prog *prog, const void *variant, size_t variant_len, struct ubpf_jit_image *image);
+/* Save an image for ubpf_cache_load to find, ignoring errors since the cache is only an optimization */
+void ubpf_cache_store(const struct ubpf_prog *prog, const void *variant, size_t variant_len, const struct ubpf_jit_image *image);
 
 #endif
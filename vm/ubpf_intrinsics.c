@@ -0,0 +1,115 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Portable implementations of the intrinsics
+ *
+ * The interpreters call these like any registered function, as does JIT
+ * compiled code when the CPU lacks the instructions it would emit inline.
+ * Each must compute exactly what the inline code does.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "ubpf_int.h"
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint64_t
+bswap16(uint64_t x)
+{
+    return __builtin_bswap16(x);
+}
+
+static uint64_t
+bswap32(uint64_t x)
+{
+    return __builtin_bswap32(x);
+}
+
+static uint64_t
+bswap64(uint64_t x)
+{
+    return __builtin_bswap64(x);
+}
+
+static uint64_t
+popcnt(uint64_t x)
+{
+    return __builtin_popcountll(x);
+}
+
+/* Bit by bit, as the crc32 instruction, least significant byte first */
+static uint64_t
+crc32c(uint32_t crc, uint64_t data, int bytes)
+{
+    int i, j;
+    for (i = 0; i < bytes; i++) {
+        crc ^= (uint8_t)(data >> (8 * i));
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+static uint64_t
+crc32c_u8(uint64_t crc, uint64_t data)
+{
+    return crc32c(crc, data, 1);
+}
+
+static uint64_t
+crc32c_u32(uint64_t crc, uint64_t data)
+{
+    return crc32c(crc, data, 4);
+}
+
+static uint64_t
+crc32c_u64(uint64_t crc, uint64_t data)
+{
+    return crc32c(crc, data, 8);
+}
+
+static uint64_t
+sqrt_u32(uint64_t x)
+{
+    return (uint64_t)sqrt((uint32_t)x);
+}
+
+static uint64_t
+sqrt_f64(uint64_t x)
+{
+    double d;
+    memcpy(&d, &x, sizeof(d));
+    d = sqrt(d);
+    memcpy(&x, &d, sizeof(x));
+    return x;
+}
+
+const struct ubpf_intrinsic_impl ubpf_intrinsics[NUM_INTRINSICS] = {
+    [UBPF_INTRINSIC_BSWAP16] = { (ext_func)bswap16, 1 },
+    [UBPF_INTRINSIC_BSWAP32] = { (ext_func)bswap32, 1 },
+    [UBPF_INTRINSIC_BSWAP64] = { (ext_func)bswap64, 1 },
+    [UBPF_INTRINSIC_POPCNT] = { (ext_func)popcnt, 1 },
+    [UBPF_INTRINSIC_CRC32C_U8] = { (ext_func)crc32c_u8, 2 },
+    [UBPF_INTRINSIC_CRC32C_U32] = { (ext_func)crc32c_u32, 2 },
+    [UBPF_INTRINSIC_CRC32C_U64] = { (ext_func)crc32c_u64, 2 },
+    [UBPF_INTRINSIC_SQRT_U32] = { (ext_func)sqrt_u32, 1 },
+    [UBPF_INTRINSIC_SQRT_F64] = { (ext_func)sqrt_f64, 1 },
+};
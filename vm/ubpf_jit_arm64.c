@@ -0,0 +1,1629 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * AArch64 JIT compiler
+ *
+ * The same design as the x86-64 one: the code is translated in the order
+ * ubpf_layout_blocks chooses, jumps are recorded and patched by
+ * resolve_jumps once pc_locs is known, and every absolute address is a
+ * relocation, so images can be cached. The addresses are literals loaded
+ * from next to where they are used, calls included, so placing an image
+ * only fills them in.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/auxv.h>
+#include "ubpf_int.h"
+#include "ubpf_jit_arm64.h"
+
+/* Special values for target_pc in struct jump */
+#define TARGET_PC_EXIT -1
+#define TARGET_PC_DIV_BY_ZERO -2
+#define TARGET_PC_BATCH_LOOP -3
+#define TARGET_PC_BATCH_DONE -4
+#define TARGET_PC_BUDGET -5
+/* The cold path of the i-th inline bounds check */
+#define TARGET_PC_BOUNDS_STUB(i) (-6 - (i))
+
+/*
+ * The prologue saves the frame pointer, the link register and X19 to X28
+ * at the bottom of SAVE_SIZE bytes, and points X29 there. The eBPF stack
+ * is below, r10 starting at X29, and the batch entry point keeps its
+ * arguments above the saved registers, followed by the budget left.
+ */
+#define SAVE_SIZE 144
+#define BATCH_MEMS 96
+#define BATCH_LENS 104
+#define BATCH_RESULTS 112
+#define BATCH_REMAINING 120
+#define BUDGET 128
+
+/*
+ * Registers used for inline bounds checks. BOUNDS_LIMIT(size) is one past
+ * the highest offset from mem at which an access of that operand size
+ * still fits, or 0 if none does, so the one for S8 is mem_len.
+ */
+#define BOUNDS_MEM X24
+#define BOUNDS_LIMIT(size) (X25 + (size))
+#define BOUNDS_MEM_LEN BOUNDS_LIMIT(S8)
+
+/* Scratch registers, which hold no eBPF register */
+#define TMP X9
+#define TMP2 X10
+/* Where divmod puts the PC for the division by zero handler */
+#define DIV_PC X11
+
+/* Indexes of UBPF_RELOC_INTERNAL relocations */
+enum {
+    INTERNAL_PROG,
+    INTERNAL_DIV_BY_ZERO,
+    INTERNAL_BOUNDS_CHECK_FAILED,
+    INTERNAL_MEM_ARG_CHECK_FAILED,
+    INTERNAL_BUDGET_EXHAUSTED,
+    NUM_INTERNAL,
+};
+
+static void divmod(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm);
+static void div_by_zero(const struct ubpf_prog *prog, uint64_t pc);
+static void emit_budget_check(struct jit_state *state, uint16_t pc);
+static void budget_exhausted(const struct ubpf_prog *prog, uint64_t pc);
+static void emit_bounds_check(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, int bpf_base, int16_t offset, enum operand_size size);
+static void emit_bounds_stubs(const struct ubpf_prog *prog, struct jit_state *state);
+static void bounds_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, void *mem, size_t mem_len, void *stack);
+static void emit_mem_arg_checks(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static void mem_arg_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, uint64_t size, void *mem, size_t mem_len, void *stack);
+static bool emit_inline_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static bool emit_intrinsic(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static void emit_switch(const struct ubpf_prog *prog, struct jit_state *state, struct ebpf_inst inst);
+static void emit_local_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static int vm_map_index(const struct ubpf_prog *prog, const struct ubpf_map *map);
+
+/*
+ * r1 to r5 are the argument registers of helpers, r0 is kept out of X0 so
+ * that r1 can be there, and r6 to r10 are callee-saved.
+ */
+#define REGISTER_MAP_SIZE 11
+static int register_map[REGISTER_MAP_SIZE] = {
+    X5,
+    X0,
+    X1,
+    X2,
+    X3,
+    X4,
+    X19,
+    X20,
+    X21,
+    X22,
+    X23,
+};
+
+/* Return the AArch64 register for the given eBPF register */
+static int
+map_register(int r)
+{
+    assert(r < REGISTER_MAP_SIZE);
+    return register_map[r % REGISTER_MAP_SIZE];
+}
+
+/* For testing, this changes the mapping between AArch64 and eBPF registers */
+void
+ubpf_set_register_offset(int x)
+{
+    int i;
+    if (x < REGISTER_MAP_SIZE) {
+        int tmp[REGISTER_MAP_SIZE];
+        memcpy(tmp, register_map, sizeof(register_map));
+        for (i = 0; i < REGISTER_MAP_SIZE; i++) {
+            register_map[i] = tmp[(i+x)%REGISTER_MAP_SIZE];
+        }
+    } else {
+        /* Shuffle array */
+        unsigned int seed = x;
+        for (i = 0; i < REGISTER_MAP_SIZE-1; i++) {
+            int j = i + (rand_r(&seed) % (REGISTER_MAP_SIZE-i));
+            int tmp = register_map[j];
+            register_map[j] = register_map[i];
+            register_map[i] = tmp;
+        }
+    }
+}
+
+/* Whether execution can only continue after the instruction by jumping */
+static bool
+ends_block(struct ebpf_inst inst)
+{
+    return (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_CALL;
+}
+
+/*
+ * Emit a conditional jump to 'target_pc' for the current instruction. If
+ * the code emitted next is the jump target rather than the fall-through,
+ * the condition is inverted, and if it is neither the fall-through needs a
+ * jump of its own.
+ */
+static void
+emit_cond_jump(struct jit_state *state, enum condition cond, int32_t target_pc)
+{
+    if (state->next_pc == state->fallthrough_pc) {
+        emit_jcc(state, cond, target_pc);
+    } else if (state->next_pc == target_pc) {
+        emit_jcc(state, cond ^ 1, state->fallthrough_pc);
+    } else {
+        emit_jcc(state, cond, target_pc);
+        emit_jmp(state, state->fallthrough_pc);
+    }
+}
+
+/* Operations of an eBPF ALU instruction applied to dst and either src or imm */
+static void
+emit_alu(struct jit_state *state, struct ebpf_inst inst, int src, int dst)
+{
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool reg = inst.opcode & EBPF_SRC_REG;
+    int size = is64 ? 64 : 32;
+    int shift = inst.imm & (size - 1);
+
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_OP_ADD_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            emit_addsub(state, 0x0b000000, is64, dst, dst, src, 0);
+        } else {
+            emit_add_imm(state, is64, dst, dst, inst.imm, TMP);
+        }
+        break;
+    case EBPF_OP_SUB_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            emit_addsub(state, 0x4b000000, is64, dst, dst, src, 0);
+        } else {
+            emit_add_imm(state, is64, dst, dst, -(int64_t)inst.imm, TMP);
+        }
+        break;
+    case EBPF_OP_MUL_IMM & EBPF_ALU_OP_MASK:
+        if (!reg) {
+            emit_load_imm(state, TMP, inst.imm);
+            src = TMP;
+        }
+        emit_madd(state, is64, false, dst, dst, src, XZR);
+        break;
+    case EBPF_OP_OR_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            emit_logical(state, 0x2a000000, is64, dst, dst, src);
+        } else {
+            emit_logical_imm(state, 0x32000000, is64, dst, dst, inst.imm, TMP);
+        }
+        break;
+    case EBPF_OP_AND_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            emit_logical(state, 0x0a000000, is64, dst, dst, src);
+        } else {
+            emit_logical_imm(state, 0x12000000, is64, dst, dst, inst.imm, TMP);
+        }
+        break;
+    case EBPF_OP_XOR_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            emit_logical(state, 0x4a000000, is64, dst, dst, src);
+        } else {
+            emit_logical_imm(state, 0x52000000, is64, dst, dst, inst.imm, TMP);
+        }
+        break;
+    case EBPF_OP_LSH_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            /* lslv */
+            emit_dp2(state, 0x1ac02000, is64, dst, dst, src);
+        } else {
+            emit_bfm(state, is64, false, dst, dst, (size - shift) & (size - 1), size - 1 - shift);
+        }
+        break;
+    case EBPF_OP_RSH_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            /* lsrv */
+            emit_dp2(state, 0x1ac02400, is64, dst, dst, src);
+        } else {
+            emit_bfm(state, is64, false, dst, dst, shift, size - 1);
+        }
+        break;
+    case EBPF_OP_ARSH_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            /* asrv */
+            emit_dp2(state, 0x1ac02800, is64, dst, dst, src);
+        } else {
+            emit_bfm(state, is64, true, dst, dst, shift, size - 1);
+        }
+        break;
+    case EBPF_OP_NEG & EBPF_ALU_OP_MASK:
+        emit_addsub(state, 0x4b000000, is64, dst, XZR, dst, 0);
+        break;
+    case EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK:
+        if (reg) {
+            emit_mov(state, is64, src, dst);
+        } else {
+            emit_load_imm(state, dst, is64 ? (int64_t)inst.imm : (int64_t)(uint32_t)inst.imm);
+        }
+        break;
+    }
+}
+
+static int
+translate(struct ubpf_prog *prog, struct jit_state *state, bool batch, char **errmsg)
+{
+    /* SP stays 16-byte aligned, including while local calls save registers below it */
+    int32_t frame_size = (state->stack_size + 15) & ~15;
+    int i;
+
+    /* stp x29, x30, [sp, #-SAVE_SIZE]! */
+    emit4(state, 0xa9800000 | (((-SAVE_SIZE / 8) & 0x7f) << 15) | (X30 << 10) | (SP << 5) | X29);
+    for (i = 0; i < 5; i++) {
+        emit_pair(state, false, X19 + 2 * i, X20 + 2 * i, SP, 16 * (i + 1));
+    }
+    emit_mov_sp(state, SP, X29);
+
+    if (batch) {
+        /* Save the batch arguments and return early if n == 0 */
+        emit_store(state, S64, X0, X29, BATCH_MEMS, TMP);
+        emit_store(state, S64, X1, X29, BATCH_LENS, TMP);
+        emit_store(state, S64, X2, X29, BATCH_RESULTS, TMP);
+        emit_store(state, S64, X3, X29, BATCH_REMAINING, TMP);
+        emit_cbz(state, true, X3, TARGET_PC_BATCH_DONE);
+
+        /* Load mems[i] into x0 and lens[i] into x1, then advance */
+        state->batch_loop_loc = state->offset;
+        emit_load(state, S64, X29, TMP, BATCH_MEMS, TMP);
+        emit_load(state, S64, TMP, X0, 0, TMP);
+        emit_add_imm(state, true, TMP, TMP, 8, TMP);
+        emit_store(state, S64, TMP, X29, BATCH_MEMS, TMP2);
+        emit_load(state, S64, X29, TMP, BATCH_LENS, TMP);
+        emit_load(state, S64, TMP, X1, 0, TMP);
+        emit_add_imm(state, true, TMP, TMP, 8, TMP);
+        emit_store(state, S64, TMP, X29, BATCH_LENS, TMP2);
+    }
+
+    if (state->bounds_check) {
+        /* A NULL mem has no accessible bytes, whatever mem_len says */
+        emit_mov(state, true, X0, BOUNDS_MEM);
+        emit_cmp_imm(state, true, X0, 0, TMP);
+        emit_csel(state, BOUNDS_MEM_LEN, XZR, X1, COND_EQ);
+
+        /* Precompute the limit for each operand size, clamped at 0 */
+        enum operand_size size;
+        for (size = S16; size <= S64; size++) {
+            /* subs limit, mem_len, #(bytes - 1) */
+            emit4(state, 0xf1000000 | (((1 << size) - 1) << 10) | (BOUNDS_MEM_LEN << 5) | BOUNDS_LIMIT(size));
+            emit_csel(state, BOUNDS_LIMIT(size), BOUNDS_LIMIT(size), XZR, COND_HS);
+        }
+    }
+
+    /* The budget starts over for each buffer of a batch */
+    if (prog->budget_points) {
+        emit_load_imm(state, TMP, prog->budget);
+        emit_store(state, S64, TMP, X29, BUDGET, TMP2);
+    }
+
+    /* Move x0 into register 1 */
+    if (map_register(1) != X0) {
+        emit_mov(state, true, X0, map_register(1));
+    }
+
+    /* r10 is the top of the stack, below which it is allocated */
+    emit_mov(state, true, X29, map_register(10));
+    emit_add_imm(state, true, SP, X29, -frame_size, TMP);
+
+    int b;
+    for (b = 0; b < state->num_blocks; b++) {
+        struct ubpf_code_block block = state->blocks[b];
+        int32_t next_block = b + 1 < state->num_blocks ? (int32_t)state->blocks[b+1].start : TARGET_PC_EXIT;
+
+        for (i = block.start; i < (int)block.end; i++) {
+            struct ebpf_inst inst = prog->insts[i];
+            int len = inst.opcode == EBPF_OP_LDDW ? 2 : 1;
+            bool last = i + len == (int)block.end;
+            state->pc_locs[i] = state->offset;
+            state->fallthrough_pc = i + len < prog->num_insts ? i + len : TARGET_PC_EXIT;
+            state->next_pc = last ? next_block : i + len;
+
+            /* Jumps land on the counter, so it sees every entry to the block */
+            if (state->counters && (i == 0 || state->leaders[i])) {
+                emit_counter_inc(state, &state->counters->jit_blocks[i]);
+            }
+
+            if (prog->budget_points && prog->budget_points[i]) {
+                emit_budget_check(state, ubpf_orig_pc(prog, i));
+            }
+
+            int dst = map_register(inst.dst);
+            int src = map_register(inst.src);
+            uint32_t target_pc = i + inst.offset + 1;
+
+            switch (inst.opcode) {
+            case EBPF_OP_ADD_IMM:
+            case EBPF_OP_ADD_REG:
+            case EBPF_OP_SUB_IMM:
+            case EBPF_OP_SUB_REG:
+            case EBPF_OP_MUL_IMM:
+            case EBPF_OP_MUL_REG:
+            case EBPF_OP_OR_IMM:
+            case EBPF_OP_OR_REG:
+            case EBPF_OP_AND_IMM:
+            case EBPF_OP_AND_REG:
+            case EBPF_OP_LSH_IMM:
+            case EBPF_OP_LSH_REG:
+            case EBPF_OP_RSH_IMM:
+            case EBPF_OP_RSH_REG:
+            case EBPF_OP_NEG:
+            case EBPF_OP_XOR_IMM:
+            case EBPF_OP_XOR_REG:
+            case EBPF_OP_MOV_IMM:
+            case EBPF_OP_MOV_REG:
+            case EBPF_OP_ARSH_IMM:
+            case EBPF_OP_ARSH_REG:
+            case EBPF_OP_ADD64_IMM:
+            case EBPF_OP_ADD64_REG:
+            case EBPF_OP_SUB64_IMM:
+            case EBPF_OP_SUB64_REG:
+            case EBPF_OP_MUL64_IMM:
+            case EBPF_OP_MUL64_REG:
+            case EBPF_OP_OR64_IMM:
+            case EBPF_OP_OR64_REG:
+            case EBPF_OP_AND64_IMM:
+            case EBPF_OP_AND64_REG:
+            case EBPF_OP_LSH64_IMM:
+            case EBPF_OP_LSH64_REG:
+            case EBPF_OP_RSH64_IMM:
+            case EBPF_OP_RSH64_REG:
+            case EBPF_OP_NEG64:
+            case EBPF_OP_XOR64_IMM:
+            case EBPF_OP_XOR64_REG:
+            case EBPF_OP_MOV64_IMM:
+            case EBPF_OP_MOV64_REG:
+            case EBPF_OP_ARSH64_IMM:
+            case EBPF_OP_ARSH64_REG:
+                emit_alu(state, inst, src, dst);
+                break;
+
+            case EBPF_OP_DIV_IMM:
+            case EBPF_OP_DIV_REG:
+            case EBPF_OP_MOD_IMM:
+            case EBPF_OP_MOD_REG:
+            case EBPF_OP_DIV64_IMM:
+            case EBPF_OP_DIV64_REG:
+            case EBPF_OP_MOD64_IMM:
+            case EBPF_OP_MOD64_REG:
+                divmod(prog, state, i, inst.opcode, src, dst, inst.imm);
+                break;
+
+            case EBPF_OP_LE:
+                /* Truncate to the size, as the bytes are already in order */
+                if (inst.imm == 16) {
+                    emit_bfm(state, false, false, dst, dst, 0, 15);
+                } else if (inst.imm == 32) {
+                    emit_mov(state, false, dst, dst);
+                }
+                break;
+            case EBPF_OP_BE:
+                if (inst.imm == 16) {
+                    /* rev16, then zero-extend the low half */
+                    emit_dp1(state, 0x5ac00400, dst, dst);
+                    emit_bfm(state, false, false, dst, dst, 0, 15);
+                } else if (inst.imm == 32) {
+                    emit_dp1(state, 0x5ac00800, dst, dst);
+                } else if (inst.imm == 64) {
+                    emit_dp1(state, 0xdac00c00, dst, dst);
+                }
+                break;
+
+            case EBPF_OP_JA:
+                if ((int32_t)target_pc != state->next_pc) {
+                    emit_jmp(state, target_pc);
+                }
+                break;
+            case EBPF_OP_JEQ_IMM:
+                emit_cmp_imm(state, true, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_EQ, target_pc);
+                break;
+            case EBPF_OP_JEQ_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_EQ, target_pc);
+                break;
+            case EBPF_OP_JGT_IMM:
+                emit_cmp_imm(state, true, dst, (uint32_t)inst.imm, TMP);
+                emit_cond_jump(state, COND_HI, target_pc);
+                break;
+            case EBPF_OP_JGT_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_HI, target_pc);
+                break;
+            case EBPF_OP_JGE_IMM:
+                emit_cmp_imm(state, true, dst, (uint32_t)inst.imm, TMP);
+                emit_cond_jump(state, COND_HS, target_pc);
+                break;
+            case EBPF_OP_JGE_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_HS, target_pc);
+                break;
+            case EBPF_OP_JLT_IMM:
+                emit_cmp_imm(state, true, dst, (uint32_t)inst.imm, TMP);
+                emit_cond_jump(state, COND_LO, target_pc);
+                break;
+            case EBPF_OP_JLT_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_LO, target_pc);
+                break;
+            case EBPF_OP_JLE_IMM:
+                emit_cmp_imm(state, true, dst, (uint32_t)inst.imm, TMP);
+                emit_cond_jump(state, COND_LS, target_pc);
+                break;
+            case EBPF_OP_JLE_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_LS, target_pc);
+                break;
+            case EBPF_OP_JSET_IMM:
+                /* tst */
+                emit_logical_imm(state, 0x72000000, true, XZR, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_NE, target_pc);
+                break;
+            case EBPF_OP_JSET_REG:
+                emit_logical(state, 0x6a000000, true, XZR, dst, src);
+                emit_cond_jump(state, COND_NE, target_pc);
+                break;
+            case EBPF_OP_JNE_IMM:
+                emit_cmp_imm(state, true, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_NE, target_pc);
+                break;
+            case EBPF_OP_JNE_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_NE, target_pc);
+                break;
+            case EBPF_OP_JSGT_IMM:
+                emit_cmp_imm(state, true, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_GT, target_pc);
+                break;
+            case EBPF_OP_JSGT_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_GT, target_pc);
+                break;
+            case EBPF_OP_JSGE_IMM:
+                emit_cmp_imm(state, true, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_GE, target_pc);
+                break;
+            case EBPF_OP_JSGE_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_GE, target_pc);
+                break;
+            case EBPF_OP_JSLT_IMM:
+                emit_cmp_imm(state, true, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_LT, target_pc);
+                break;
+            case EBPF_OP_JSLT_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_LT, target_pc);
+                break;
+            case EBPF_OP_JSLE_IMM:
+                emit_cmp_imm(state, true, dst, inst.imm, TMP);
+                emit_cond_jump(state, COND_LE, target_pc);
+                break;
+            case EBPF_OP_JSLE_REG:
+                emit_cmp(state, true, dst, src);
+                emit_cond_jump(state, COND_LE, target_pc);
+                break;
+            case EBPF_OP_JSWITCH:
+                if (state->counters) {
+                    /* Counted like the chain of jeq it replaced */
+                    emit_cmp_imm(state, true, dst, prog->switches[inst.imm].first_imm, TMP);
+                    emit_cond_jump(state, COND_EQ, target_pc);
+                } else {
+                    emit_switch(prog, state, inst);
+                }
+                break;
+            case EBPF_OP_CALL:
+                if (ubpf_is_local_call(inst)) {
+                    emit_local_call(prog, state, i);
+                    break;
+                }
+                if (emit_inline_call(prog, state, i) || emit_intrinsic(prog, state, i)) {
+                    break;
+                }
+                emit_mem_arg_checks(prog, state, i);
+                if (i >= prog->funcs[0].end) {
+                    /* A local function keeps its return address in x30, which blr overwrites */
+                    emit_push_lr(state);
+                }
+                emit_call(state, UBPF_RELOC_HELPER, inst.imm, prog->vm->ext_funcs[inst.imm]);
+                if (i >= prog->funcs[0].end) {
+                    emit_pop_lr(state);
+                }
+                if (map_register(0) != X0) {
+                    emit_mov(state, true, X0, map_register(0));
+                }
+                break;
+            case EBPF_OP_EXIT:
+                if (i >= prog->funcs[0].end) {
+                    /* Return from a local call */
+                    emit_ret(state);
+                } else if (state->next_pc != TARGET_PC_EXIT) {
+                    emit_jmp(state, TARGET_PC_EXIT);
+                }
+                break;
+
+            case EBPF_OP_LDXW:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S32);
+                emit_load(state, S32, src, dst, inst.offset, TMP);
+                break;
+            case EBPF_OP_LDXH:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S16);
+                emit_load(state, S16, src, dst, inst.offset, TMP);
+                break;
+            case EBPF_OP_LDXB:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S8);
+                emit_load(state, S8, src, dst, inst.offset, TMP);
+                break;
+            case EBPF_OP_LDXDW:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S64);
+                emit_load(state, S64, src, dst, inst.offset, TMP);
+                break;
+
+            case EBPF_OP_STW:
+            case EBPF_OP_STH:
+            case EBPF_OP_STB:
+            case EBPF_OP_STDW: {
+                enum operand_size size = inst.opcode == EBPF_OP_STB ? S8 : inst.opcode == EBPF_OP_STH ? S16 :
+                    inst.opcode == EBPF_OP_STW ? S32 : S64;
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, size);
+                emit_load_imm(state, TMP2, inst.imm);
+                emit_store(state, size, TMP2, dst, inst.offset, TMP);
+                break;
+            }
+
+            case EBPF_OP_STXW:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S32);
+                emit_store(state, S32, src, dst, inst.offset, TMP);
+                break;
+            case EBPF_OP_STXH:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S16);
+                emit_store(state, S16, src, dst, inst.offset, TMP);
+                break;
+            case EBPF_OP_STXB:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S8);
+                emit_store(state, S8, src, dst, inst.offset, TMP);
+                break;
+            case EBPF_OP_STXDW:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S64);
+                emit_store(state, S64, src, dst, inst.offset, TMP);
+                break;
+
+            case EBPF_OP_LDDW: {
+                struct ebpf_inst inst2 = prog->insts[++i];
+                uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+                if (inst.src == EBPF_PSEUDO_MAP_IDX) {
+                    const struct ubpf_map *map = (const struct ubpf_map *)(uintptr_t)imm;
+                    emit_load_addr(state, dst, UBPF_RELOC_MAP, vm_map_index(prog, map), map);
+                } else {
+                    emit_load_imm(state, dst, imm);
+                }
+                break;
+            }
+
+            default:
+                *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+                return -1;
+            }
+
+            /* Only reached when a conditional jump falls through */
+            if (state->counters && (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP &&
+                    inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_CALL && inst.opcode != EBPF_OP_EXIT) {
+                emit_counter_inc(state, &state->counters->jit_not_taken[i]);
+            }
+
+            /* A block that ends without a jump may no longer be followed by its successor */
+            if (last && !ends_block(inst) && state->next_pc != state->fallthrough_pc) {
+                emit_jmp(state, state->fallthrough_pc);
+            }
+        }
+    }
+
+    /* Epilogue, which errors may jump to from within local calls */
+    state->exit_loc = state->offset;
+    emit_mov_sp(state, X29, SP);
+
+    /* Move register 0 into x0 */
+    if (map_register(0) != X0) {
+        emit_mov(state, true, map_register(0), X0);
+    }
+
+    if (batch) {
+        /* Store x0 into *results++ and loop until no buffers remain */
+        emit_load(state, S64, X29, TMP, BATCH_RESULTS, TMP);
+        emit_store(state, S64, X0, TMP, 0, TMP2);
+        emit_add_imm(state, true, TMP, TMP, 8, TMP);
+        emit_store(state, S64, TMP, X29, BATCH_RESULTS, TMP2);
+        emit_load(state, S64, X29, TMP, BATCH_REMAINING, TMP);
+        /* subs tmp, tmp, #1 */
+        emit4(state, 0xf1000400 | (TMP << 5) | TMP);
+        emit_store(state, S64, TMP, X29, BATCH_REMAINING, TMP2);
+        emit_jcc(state, COND_NE, TARGET_PC_BATCH_LOOP);
+        state->batch_done_loc = state->offset;
+    }
+
+    for (i = 0; i < 5; i++) {
+        emit_pair(state, true, X19 + 2 * i, X20 + 2 * i, SP, 16 * (i + 1));
+    }
+    /* ldp x29, x30, [sp], #SAVE_SIZE */
+    emit4(state, 0xa8c00000 | ((SAVE_SIZE / 8) << 15) | (X30 << 10) | (SP << 5) | X29);
+    emit_ret(state);
+
+    /* Division by zero handler */
+    state->div_by_zero_loc = state->offset;
+    emit_mov(state, true, DIV_PC, X1); /* divmod stored pc in DIV_PC */
+    emit_load_addr(state, X0, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+    emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_DIV_BY_ZERO, div_by_zero);
+    emit_load_imm(state, map_register(0), -1);
+    emit_jmp(state, TARGET_PC_EXIT);
+
+    if (prog->budget_points) {
+        /* Budget exhausted handler, entered with the PC in TMP2 */
+        state->budget_loc = state->offset;
+        emit_mov(state, true, TMP2, X1);
+        emit_load_addr(state, X0, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+        emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_BUDGET_EXHAUSTED, budget_exhausted);
+        emit_load_imm(state, map_register(0), (int64_t)UBPF_BUDGET_EXHAUSTED);
+        emit_jmp(state, TARGET_PC_EXIT);
+    }
+
+    if (state->bounds_check) {
+        /* Out of bounds handler, entered with the check info in TMP and the address in X16 */
+        state->bounds_fail_loc = state->offset;
+        emit_mov(state, true, TMP, X1);
+        emit_mov(state, true, X16, X2);
+        emit_mov(state, true, BOUNDS_MEM, X3);
+        emit_mov(state, true, BOUNDS_MEM_LEN, X4);
+        emit_add_imm(state, true, X5, X29, -(int64_t)state->stack_size, X5);
+        emit_load_addr(state, X0, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+        emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_BOUNDS_CHECK_FAILED, bounds_check_failed);
+        emit_load_imm(state, map_register(0), -1);
+        emit_jmp(state, TARGET_PC_EXIT);
+
+        emit_bounds_stubs(prog, state);
+    }
+
+    return 0;
+}
+
+/*
+ * Call a function of the program, which runs on the same native stack with
+ * the same register mapping. Its frame is below the caller's, so r10 moves
+ * down by the caller's frame size around the call. The callee may use any
+ * register, so those of r6 to r9 still needed are saved below SP, and so
+ * is the link register if the caller is a local function itself.
+ */
+static void
+emit_local_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    uint32_t frame = prog->funcs[ubpf_find_func(prog, pc)].stack_size;
+    int saved[5];
+    int i, n = 0;
+
+    for (i = 6; i <= 9; i++) {
+        if (state->live_out[pc] & (1 << i)) {
+            saved[n++] = map_register(i);
+        }
+    }
+    if (pc >= prog->funcs[0].end) {
+        saved[n++] = X30;
+    }
+
+    int32_t save_size = (n * 8 + 15) & ~15;
+    if (n) {
+        emit_add_imm(state, true, SP, SP, -save_size, TMP);
+    }
+    for (i = 0; i < n; i++) {
+        emit_store(state, S64, saved[i], SP, 8 * i, TMP);
+    }
+    if (frame) {
+        emit_add_imm(state, true, map_register(10), map_register(10), -(int64_t)frame, TMP);
+    }
+
+    emit_call_pc(state, pc + 1 + prog->insts[pc].imm);
+
+    if (frame) {
+        emit_add_imm(state, true, map_register(10), map_register(10), frame, TMP);
+    }
+    for (i = 0; i < n; i++) {
+        emit_load(state, S64, SP, saved[i], 8 * i, TMP);
+    }
+    if (n) {
+        emit_add_imm(state, true, SP, SP, save_size, TMP);
+    }
+}
+
+/* If inst is a load or store, return its base register, access size and kind */
+static bool
+mem_access(struct ebpf_inst inst, int *base, int *size, bool *store)
+{
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    if (cls != EBPF_CLS_LDX && cls != EBPF_CLS_ST && cls != EBPF_CLS_STX) {
+        return false;
+    }
+
+    switch (inst.opcode & 0x18) {
+    case EBPF_SIZE_B: *size = 1; break;
+    case EBPF_SIZE_H: *size = 2; break;
+    case EBPF_SIZE_W: *size = 4; break;
+    default: *size = 8; break;
+    }
+
+    *store = cls != EBPF_CLS_LDX;
+    *base = *store ? inst.dst : inst.src;
+    return true;
+}
+
+/*
+ * Check that the access at 'pc' through eBPF register bpf_base lies within
+ * mem, the stack or a map value. Accesses ubpf_analyze_ranges proved safe
+ * need none. The address is computed into X16, and only whether it is
+ * within mem is checked inline, with a register holding the limit for the
+ * operand size. Otherwise a cold stub from emit_bounds_stubs checks the rest.
+ */
+static void
+emit_bounds_check(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, int bpf_base, int16_t offset, enum operand_size size)
+{
+    if (!state->bounds_check || prog->safe_accesses[pc]) {
+        return;
+    }
+
+    /* addr - mem < limit, as an unsigned comparison */
+    emit_add_imm(state, true, X16, map_register(bpf_base), offset, X17);
+    emit_addsub(state, 0x4b000000, true, X17, X16, BOUNDS_MEM, 0);
+    emit_cmp(state, true, X17, BOUNDS_LIMIT(size));
+
+    struct bounds_stub *stub = &state->bounds_stubs[state->num_bounds_stubs];
+    emit_jcc(state, COND_HS, TARGET_PC_BOUNDS_STUB(state->num_bounds_stubs));
+    state->num_bounds_stubs++;
+    stub->pc = pc;
+    stub->resume_loc = state->offset;
+}
+
+/*
+ * Turn the offset in X17 from the start of a map's storage into the offset
+ * from the start of the value in the same slot, which is past the end of
+ * the value, as an unsigned number, for an offset into the state word or
+ * key of a hash slot. Clobbers TMP and TMP2.
+ */
+static void
+emit_value_offset(struct jit_state *state, const struct ubpf_map *map)
+{
+    if (!(map->stride & (map->stride - 1))) {
+        emit_logical_imm(state, 0x12000000, true, X17, X17, map->stride - 1, TMP);
+    } else {
+        /* udiv tmp2, x17, tmp; msub x17, tmp2, tmp, x17 */
+        emit_load_imm(state, TMP, map->stride);
+        emit_dp2(state, 0x1ac00800, true, TMP2, X17, TMP);
+        emit_madd(state, true, true, X17, TMP2, TMP, X17);
+    }
+    if (map->value_offset) {
+        emit_add_imm(state, true, X17, X17, -(int64_t)map->value_offset, TMP);
+    }
+}
+
+/*
+ * Emit the cold paths taken when an access is not within mem, which check
+ * the stack and then the values of each map the program refers to, with
+ * the address still in X16. If none has it, they report the access the
+ * same way the interpreter would.
+ */
+static void
+emit_bounds_stubs(const struct ubpf_prog *prog, struct jit_state *state)
+{
+    int i, j;
+    for (i = 0; i < state->num_bounds_stubs; i++) {
+        struct bounds_stub *stub = &state->bounds_stubs[i];
+        struct ebpf_inst inst = prog->insts[stub->pc];
+        int base = 0, size = 0;
+        bool store = false;
+        mem_access(inst, &base, &size, &store);
+
+        stub->loc = state->offset;
+
+        if (size <= (int32_t)state->stack_size) {
+            /* addr - stack <= stack_size - size, as an unsigned comparison */
+            emit_addsub(state, 0x4b000000, true, X17, X16, X29, 0);
+            emit_add_imm(state, true, X17, X17, state->stack_size, TMP);
+            emit_cmp_imm(state, true, X17, state->stack_size - size, TMP);
+            /* b.hi over the b back */
+            emit4(state, 0x54000000 | COND_HI | (2 << 5));
+            emit_branch_back(state, stub->resume_loc);
+        }
+
+        for (j = 0; j < prog->num_maps; j++) {
+            const struct ubpf_map *map = prog->maps[j];
+            if (map->value_size < size) {
+                continue;
+            }
+
+            /* addr - storage <= storage_size - size, as an unsigned comparison */
+            emit_load_addr(state, TMP, UBPF_RELOC_MAP_STORAGE, vm_map_index(prog, map), map->storage);
+            emit_addsub(state, 0x4b000000, true, X17, X16, TMP, 0);
+            emit_cmp_imm(state, true, X17, map->storage_size - size, TMP);
+            uint32_t next_loc = emit_forward_jcc(state, COND_HI);
+
+            /* and then within the value of its slot */
+            emit_value_offset(state, map);
+            emit_cmp_imm(state, true, X17, map->value_size - size, TMP);
+            emit4(state, 0x54000000 | COND_HI | (2 << 5));
+            emit_branch_back(state, stub->resume_loc);
+            patch_branch(state, next_loc, false);
+        }
+
+        emit_load_imm(state, TMP, ubpf_orig_pc(prog, stub->pc) | (size << 16) | (store << 24));
+        emit_branch_back(state, state->bounds_fail_loc);
+    }
+}
+
+/*
+ * Emit checks of the memory a helper from ubpf_simd.c reads through its
+ * pointer arguments, unless ubpf_analyze_ranges proved it in bounds. The
+ * lengths are only known at runtime, so each range is compared with what
+ * is left of mem, the stack and the values of each map the program refers
+ * to past its start. Empty ranges pass.
+ */
+static void
+emit_mem_arg_checks(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    const struct ubpf_ext_func_info *info = &prog->vm->ext_func_info[prog->insts[pc].imm];
+    uint32_t ok_locs[3 + MAX_MAPS];
+    uint32_t next_loc;
+    int i, j, k, n;
+
+    if (!state->bounds_check || prog->safe_accesses[pc]) {
+        return;
+    }
+
+    for (i = 0; i < UBPF_MAX_MEM_ARGS && info->mem_args[i][0]; i++) {
+        int ptr = map_register(info->mem_args[i][0]);
+        int len = map_register(info->mem_args[i][1]);
+        n = 0;
+
+        ok_locs[n++] = emit_forward_cbz(state, len);
+
+        /* ptr - base <= size && len <= size - (ptr - base), as unsigned comparisons */
+        for (j = -2; j < prog->num_maps; j++) {
+            int size = TMP2;
+            if (j == -2) {
+                emit_addsub(state, 0x4b000000, true, X17, ptr, BOUNDS_MEM, 0);
+                size = BOUNDS_MEM_LEN;
+            } else if (j == -1) {
+                emit_add_imm(state, true, TMP, X29, -(int64_t)state->stack_size, TMP);
+                emit_addsub(state, 0x4b000000, true, X17, ptr, TMP, 0);
+                emit_load_imm(state, TMP2, state->stack_size);
+            } else {
+                /* For a map, the base and size are those of the value in the slot ptr is in */
+                const struct ubpf_map *map = prog->maps[j];
+                emit_load_addr(state, TMP, UBPF_RELOC_MAP_STORAGE, vm_map_index(prog, map), map->storage);
+                emit_addsub(state, 0x4b000000, true, X17, ptr, TMP, 0);
+                emit_cmp_imm(state, true, X17, map->storage_size, TMP);
+                next_loc = emit_forward_jcc(state, COND_HS);
+                emit_value_offset(state, map);
+                emit_load_imm(state, TMP2, map->value_size);
+                emit_cmp(state, true, X17, TMP2);
+                uint32_t past_loc = emit_forward_jcc(state, COND_HI);
+                emit_addsub(state, 0x4b000000, true, X16, TMP2, X17, 0);
+                emit_cmp(state, true, len, X16);
+                ok_locs[n++] = emit_forward_jcc(state, COND_LS);
+                patch_branch(state, next_loc, false);
+                patch_branch(state, past_loc, false);
+                continue;
+            }
+            emit_cmp(state, true, X17, size);
+            next_loc = emit_forward_jcc(state, COND_HI);
+            emit_addsub(state, 0x4b000000, true, X16, size, X17, 0);
+            emit_cmp(state, true, len, X16);
+            ok_locs[n++] = emit_forward_jcc(state, COND_LS);
+            patch_branch(state, next_loc, false);
+        }
+
+        emit_mov(state, true, ptr, X16);
+        emit_mov(state, true, len, X17);
+        emit_mov(state, true, X16, X2);
+        emit_mov(state, true, X17, X3);
+        emit_load_imm(state, X1, ubpf_orig_pc(prog, pc) | (info->mem_args[i][0] << 16));
+        emit_mov(state, true, BOUNDS_MEM, X4);
+        emit_mov(state, true, BOUNDS_MEM_LEN, X5);
+        emit_add_imm(state, true, X6, X29, -(int64_t)state->stack_size, X6);
+        emit_load_addr(state, X0, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+        emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_MEM_ARG_CHECK_FAILED, mem_arg_check_failed);
+        emit_load_imm(state, map_register(0), -1);
+        emit_jmp(state, TARGET_PC_EXIT);
+
+        for (k = 0; k < n; k++) {
+            patch_branch(state, ok_locs[k], false);
+        }
+    }
+}
+
+/* The index the map is registered with, by which relocations refer to it */
+static int
+vm_map_index(const struct ubpf_prog *prog, const struct ubpf_map *map)
+{
+    int i;
+    for (i = 0; i < MAX_MAPS && prog->vm->maps[i] != map; i++);
+    return i;
+}
+
+/*
+ * The map that r1 points to at the call at 'pc', if it was loaded in the
+ * same basic block, directly or through moves, or NULL.
+ */
+static const struct ubpf_map *
+known_map_arg(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    int reg = 1;
+    int i = pc;
+
+    while (i > 0 && !state->leaders[i]) {
+        i--;
+        if (i > 0 && prog->insts[i].opcode == 0 && prog->insts[i-1].opcode == EBPF_OP_LDDW) {
+            i--;
+        }
+
+        struct ebpf_inst inst = prog->insts[i];
+        if (ends_block(inst)) {
+            return NULL;
+        }
+        if (!(ubpf_inst_defs(inst) & (1 << reg))) {
+            continue;
+        }
+
+        if (inst.opcode == EBPF_OP_MOV64_REG) {
+            reg = inst.src;
+        } else if (inst.opcode == EBPF_OP_LDDW && inst.src == EBPF_PSEUDO_MAP_IDX) {
+            uintptr_t addr = (uint32_t)inst.imm | ((uint64_t)prog->insts[i+1].imm << 32);
+            int j;
+            for (j = 0; j < prog->num_maps; j++) {
+                if ((uintptr_t)prog->maps[j] == addr) {
+                    return prog->maps[j];
+                }
+            }
+            return NULL;
+        } else {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Replace a call to ubpf_map_lookup on a known array map with the lookup
+ * itself: r0 = *(uint32_t *)r2 < max_entries ? values + key * stride : 0,
+ * without a branch. The clobbered argument registers are left as they are.
+ */
+static bool
+emit_inline_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    struct ebpf_inst inst = prog->insts[pc];
+    if (prog->vm->ext_funcs[inst.imm] != (ext_func)ubpf_map_lookup) {
+        return false;
+    }
+
+    const struct ubpf_map *map = known_map_arg(prog, state, pc);
+    if (!map || map->type != UBPF_MAP_TYPE_ARRAY ||
+            map->max_entries > INT32_MAX || map->stride > INT32_MAX) {
+        return false;
+    }
+
+    int r0 = map_register(0);
+    emit_load(state, S32, map_register(2), r0, 0, TMP);
+    emit_cmp_imm(state, true, r0, map->max_entries, TMP);
+    /* Neither the multiply nor the add change the flags */
+    emit_load_imm(state, TMP, map->stride);
+    emit_madd(state, true, false, r0, r0, TMP, XZR);
+    emit_load_addr(state, TMP, UBPF_RELOC_MAP_STORAGE, vm_map_index(prog, map), map->storage);
+    emit_addsub(state, 0x0b000000, true, r0, r0, TMP, 0);
+    emit_csel(state, r0, r0, XZR, COND_LO);
+    return true;
+}
+
+/* Emit a binary search of the sorted keys in [lo, hi) of a sparse case table */
+static void
+emit_switch_search(struct jit_state *state, const struct ubpf_switch *sw, int dst, uint32_t lo, uint32_t hi)
+{
+    while (hi - lo > 4) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        emit_cmp_imm(state, true, dst, sw->keys[mid], TMP);
+        emit_jcc(state, COND_EQ, sw->targets[mid]);
+
+        /* b.hi over the lower half */
+        uint32_t upper_loc = emit_forward_jcc(state, COND_HI);
+        emit_switch_search(state, sw, dst, lo, mid);
+        patch_branch(state, upper_loc, false);
+        lo = mid + 1;
+    }
+
+    for (; lo < hi; lo++) {
+        emit_cmp_imm(state, true, dst, sw->keys[lo], TMP);
+        emit_jcc(state, COND_EQ, sw->targets[lo]);
+    }
+    emit_jmp(state, sw->default_pc);
+}
+
+/*
+ * Emit a jswitch. Dense case tables become an indirect jump into a table
+ * of b instructions, which follows the jump.
+ */
+static void
+emit_switch(const struct ubpf_prog *prog, struct jit_state *state, struct ebpf_inst inst)
+{
+    const struct ubpf_switch *sw = &prog->switches[inst.imm];
+    int dst = map_register(inst.dst);
+    uint32_t i;
+
+    if (!sw->dense) {
+        emit_switch_search(state, sw, dst, 0, sw->num_entries);
+        return;
+    }
+
+    /* The keys are sign-extended immediates, so min fits one too */
+    emit_add_imm(state, true, TMP, dst, -(int64_t)sw->min, TMP2);
+    emit_cmp_imm(state, true, TMP, sw->num_entries - 1, TMP2);
+    emit_jcc(state, COND_HI, sw->default_pc);
+
+    /* adr tmp2, table; add tmp2, tmp2, tmp, lsl #2; br tmp2 */
+    emit4(state, 0x10000000 | (3 << 5) | TMP2);
+    emit_addsub(state, 0x0b000000, true, TMP2, TMP2, TMP, 2);
+    emit4(state, 0xd61f0000 | (TMP2 << 5));
+
+    for (i = 0; i < sw->num_entries; i++) {
+        emit_jmp(state, sw->targets[i]);
+    }
+}
+
+static void
+div_by_zero(const struct ubpf_prog *prog, uint64_t pc)
+{
+    ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, pc);
+}
+
+static void
+budget_exhausted(const struct ubpf_prog *prog, uint64_t pc)
+{
+    ubpf_report_error_at(prog->vm, UBPF_ERROR_BUDGET, pc);
+}
+
+/* Take one from the budget, leaving the PC in TMP2 for the handler if it was used up */
+static void
+emit_budget_check(struct jit_state *state, uint16_t pc)
+{
+    emit_load(state, S64, X29, TMP, BUDGET, TMP);
+    /* subs tmp, tmp, #1 */
+    emit4(state, 0xf1000400 | (TMP << 5) | TMP);
+    emit_store(state, S64, TMP, X29, BUDGET, TMP2);
+    /* Neither the store nor the move sets the flags */
+    emit_load_imm(state, TMP2, pc);
+    emit_jcc(state, COND_LO, TARGET_PC_BUDGET);
+}
+
+static void
+bounds_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, void *mem, size_t mem_len, void *stack)
+{
+    struct ubpf_runtime_error error = {
+        .kind = UBPF_ERROR_OUT_OF_BOUNDS, .pc = info & 0xffff, .addr = addr, .size = (info >> 16) & 0xff,
+        .store = (info >> 24) & 1, .mem = mem, .mem_len = mem_len, .stack = stack, .stack_size = prog->stack_size,
+    };
+    ubpf_report_error(prog->vm, &error);
+}
+
+static void
+mem_arg_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, uint64_t size, void *mem, size_t mem_len, void *stack)
+{
+    struct ubpf_runtime_error error = {
+        .kind = UBPF_ERROR_MEM_ARG, .pc = info & 0xffff, .addr = addr, .size = size, .reg = (info >> 16) & 0xff,
+        .mem = mem, .mem_len = mem_len, .stack = stack, .stack_size = prog->stack_size,
+    };
+    ubpf_report_error(prog->vm, &error);
+}
+
+/*
+ * udiv leaves 0 on division by zero rather than trapping, so a zero
+ * divisor register is checked first, and msub turns the quotient into the
+ * remainder.
+ */
+static void
+divmod(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm)
+{
+    bool mod = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK);
+    bool is64 = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool reg = opcode & EBPF_SRC_REG;
+
+    if (reg) {
+        emit_load_imm(state, DIV_PC, ubpf_orig_pc(prog, pc));
+        emit_cbz(state, is64, src, TARGET_PC_DIV_BY_ZERO);
+    } else {
+        emit_load_imm(state, TMP, is64 ? (int64_t)imm : (int64_t)(uint32_t)imm);
+        src = TMP;
+    }
+
+    if (mod) {
+        /* udiv tmp2, dst, src; msub dst, tmp2, src, dst */
+        emit_dp2(state, 0x1ac00800, is64, TMP2, dst, src);
+        emit_madd(state, is64, true, dst, TMP2, src, dst);
+    } else {
+        emit_dp2(state, 0x1ac00800, is64, dst, dst, src);
+    }
+}
+
+static uint32_t
+jump_target_loc(struct jit_state *state, int32_t target_pc)
+{
+    if (target_pc == TARGET_PC_EXIT) {
+        return state->exit_loc;
+    } else if (target_pc == TARGET_PC_DIV_BY_ZERO) {
+        return state->div_by_zero_loc;
+    } else if (target_pc == TARGET_PC_BATCH_LOOP) {
+        return state->batch_loop_loc;
+    } else if (target_pc == TARGET_PC_BATCH_DONE) {
+        return state->batch_done_loc;
+    } else if (target_pc == TARGET_PC_BUDGET) {
+        return state->budget_loc;
+    } else if (target_pc <= TARGET_PC_BOUNDS_STUB(0)) {
+        return state->bounds_stubs[TARGET_PC_BOUNDS_STUB(0) - target_pc].loc;
+    } else {
+        return state->pc_locs[target_pc];
+    }
+}
+
+/* Whether the jump fits its offset field, which for b.cond and cbz is a signed 19-bit count of instructions */
+static bool
+jump_in_range(struct jit_state *state, struct jump jump)
+{
+    int64_t rel = ((int64_t)jump_target_loc(state, jump.target_pc) - jump.inst_loc) / 4;
+    int64_t max = jump.imm26 ? 1 << 25 : 1 << 18;
+    return rel >= -max && rel < max;
+}
+
+static void
+resolve_jumps(struct jit_state *state)
+{
+    int i;
+    for (i = 0; i < state->num_jumps; i++) {
+        struct jump jump = state->jumps[i];
+        uint32_t target_loc = jump_target_loc(state, jump.target_pc);
+        patch_inst(state, jump.inst_loc, branch_imm(jump.inst_loc, target_loc, jump.imm26));
+    }
+}
+
+/*
+ * Mark the conditional jumps of a translation that are out of range, for
+ * the next translation to emit them around a b. Jumps only get longer, so
+ * one that fits then may stop fitting, and this is repeated until every
+ * jump fits. Returns the number of jumps newly marked.
+ */
+static int
+find_far_jumps(struct jit_state *state)
+{
+    int count = 0;
+    int i;
+
+    if (!state->far_jumps) {
+        state->far_jumps = calloc(state->num_jumps, sizeof(state->far_jumps[0]));
+        if (!state->far_jumps) {
+            state->oom = true;
+            return 0;
+        }
+        state->num_far_jumps = state->num_jumps;
+    }
+
+    for (i = 0; i < state->num_jumps && i < state->num_far_jumps; i++) {
+        if (!state->far_jumps[i] && !jump_in_range(state, state->jumps[i])) {
+            state->far_jumps[i] = 1;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* Whether the CPU has the instructions the inline code for an intrinsic uses */
+static bool
+cpu_has_intrinsic(enum ubpf_intrinsic intrinsic)
+{
+    switch (intrinsic) {
+    case UBPF_INTRINSIC_CRC32C_U8:
+    case UBPF_INTRINSIC_CRC32C_U32:
+    case UBPF_INTRINSIC_CRC32C_U64:
+#ifdef HWCAP_CRC32
+        return getauxval(AT_HWCAP) & HWCAP_CRC32;
+#else
+        return false;
+#endif
+    default:
+        /* Advanced SIMD and floating point are part of the base architecture */
+        return true;
+    }
+}
+
+/*
+ * The intrinsics compute r0 from r1 and r2 without calling out. They leave
+ * r1 to r5 alone, which the call was free to clobber, and use v0 as a
+ * scratch register.
+ */
+static bool
+emit_intrinsic(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    const struct ubpf_ext_func_info *info = &prog->vm->ext_func_info[prog->insts[pc].imm];
+    int r0 = map_register(0), r1 = map_register(1), r2 = map_register(2);
+
+    if (!info->intrinsic || !cpu_has_intrinsic(info->intrinsic - 1)) {
+        return false;
+    }
+
+    switch (info->intrinsic - 1) {
+    case UBPF_INTRINSIC_BSWAP16:
+        /* rev16, then zero-extend the low half */
+        emit_dp1(state, 0x5ac00400, r0, r1);
+        emit_bfm(state, false, false, r0, r0, 0, 15);
+        break;
+    case UBPF_INTRINSIC_BSWAP32:
+        emit_dp1(state, 0x5ac00800, r0, r1);
+        break;
+    case UBPF_INTRINSIC_BSWAP64:
+        emit_dp1(state, 0xdac00c00, r0, r1);
+        break;
+    case UBPF_INTRINSIC_POPCNT:
+        /* fmov d0, r1; cnt v0.8b, v0.8b; addv b0, v0.8b; fmov r0w, s0 */
+        emit_dp1(state, 0x9e670000, 0, r1);
+        emit4(state, 0x0e205800);
+        emit4(state, 0x0e31b800);
+        emit_dp1(state, 0x1e260000, r0, 0);
+        break;
+    case UBPF_INTRINSIC_CRC32C_U8:
+        /* crc32cb r0w, r1w, r2w */
+        emit_dp2(state, 0x1ac05000, false, r0, r1, r2);
+        break;
+    case UBPF_INTRINSIC_CRC32C_U32:
+        /* crc32cw r0w, r1w, r2w */
+        emit_dp2(state, 0x1ac05800, false, r0, r1, r2);
+        break;
+    case UBPF_INTRINSIC_CRC32C_U64:
+        /* crc32cx r0w, r1w, r2 */
+        emit_dp2(state, 0x1ac05c00, true, r0, r1, r2);
+        break;
+    case UBPF_INTRINSIC_SQRT_U32:
+        /* ucvtf d0, r1w; fsqrt d0, d0; fcvtzu r0w, d0 */
+        emit_dp1(state, 0x1e630000, 0, r1);
+        emit4(state, 0x1e61c000);
+        emit_dp1(state, 0x1e790000, r0, 0);
+        break;
+    case UBPF_INTRINSIC_SQRT_F64:
+        /* fmov d0, r1; fsqrt d0, d0; fmov r0, d0 */
+        emit_dp1(state, 0x9e670000, 0, r1);
+        emit4(state, 0x1e61c000);
+        emit_dp1(state, 0x9e660000, r0, 0);
+        break;
+    }
+    return true;
+}
+
+/* The address a relocation refers to in this process, or NULL if there is none */
+static void *
+reloc_target(const struct ubpf_prog *prog, const struct ubpf_reloc *reloc)
+{
+    const struct ubpf_vm *vm = prog->vm;
+
+    switch (reloc->kind) {
+    case UBPF_RELOC_HELPER:
+        return reloc->index < vm->num_ext_funcs ? (void *)vm->ext_funcs[reloc->index] : NULL;
+    case UBPF_RELOC_MAP:
+        return reloc->index < MAX_MAPS ? vm->maps[reloc->index] : NULL;
+    case UBPF_RELOC_MAP_STORAGE:
+        return reloc->index < MAX_MAPS && vm->maps[reloc->index] ? vm->maps[reloc->index]->storage : NULL;
+    case UBPF_RELOC_INTERNAL:
+        switch (reloc->index) {
+        case INTERNAL_PROG:
+            return (void *)prog;
+        case INTERNAL_DIV_BY_ZERO:
+            return div_by_zero;
+        case INTERNAL_BOUNDS_CHECK_FAILED:
+            return bounds_check_failed;
+        case INTERNAL_MEM_ARG_CHECK_FAILED:
+            return mem_arg_check_failed;
+        case INTERNAL_BUDGET_EXHAUSTED:
+            return budget_exhausted;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Fill in the absolute addresses of an image and copy it to executable
+ * memory. The image may come from another process, so every relocation is
+ * checked first. Calls load their target like any other address, so
+ * there are no stubs and the code may be placed anywhere.
+ */
+static void *
+place(const struct ubpf_prog *prog, struct ubpf_jit_image *image, char **errmsg)
+{
+    uint32_t i;
+
+    for (i = 0; i < image->num_relocs; i++) {
+        const struct ubpf_reloc *reloc = &image->relocs[i];
+        uint64_t addr = (uintptr_t)reloc_target(prog, reloc);
+        if (!addr || reloc->call || reloc->loc > image->size || image->size - reloc->loc < 8) {
+            *errmsg = ubpf_error("bad relocation in compiled code");
+            return NULL;
+        }
+        memcpy(image->code + reloc->loc, &addr, sizeof(addr));
+    }
+
+    uint8_t *jitted = ubpf_code_alloc(image->size, NULL);
+    if (!jitted) {
+        *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    /* Also makes the new instructions visible to instruction fetch */
+    if (ubpf_code_write(jitted, image->code, image->size) < 0) {
+        *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
+        ubpf_code_free(jitted, image->size);
+        return NULL;
+    }
+
+    return jitted;
+}
+
+/*
+ * Translate prog into an image, with its absolute addresses as
+ * relocations. On success the caller frees the arrays.
+ */
+static int
+compile_image(struct ubpf_prog *prog, bool batch, struct ubpf_jit_image *image, char **errmsg)
+{
+    struct jit_state state;
+    int rv = -1;
+
+    /* Start from a typical code size per instruction; emit_bytes grows the buffer as needed */
+    state.offset = 0;
+    state.size = prog->num_insts * 16 + 512;
+    state.oom = false;
+    state.buf = malloc(state.size);
+    state.pc_locs = ubpf_scratch_calloc(prog->num_insts+1, sizeof(state.pc_locs[0]));
+    state.num_jumps = 0;
+    state.max_jumps = prog->num_insts;
+    state.jumps = malloc(state.max_jumps * sizeof(state.jumps[0]));
+    state.num_relocs = 0;
+    state.max_relocs = 0;
+    state.relocs = NULL;
+    state.live_out = ubpf_scratch_calloc(prog->num_insts, sizeof(state.live_out[0]));
+    state.defined_in = ubpf_scratch_calloc(prog->num_insts, sizeof(state.defined_in[0]));
+    state.leaders = ubpf_scratch_calloc(prog->num_insts, sizeof(state.leaders[0]));
+    state.bounds_check = prog->vm->bounds_check_enabled;
+    state.stack_size = prog->stack_size;
+    state.counters = prog->vm->profiling_enabled ? prog->counters : NULL;
+    state.bounds_stubs = ubpf_scratch_calloc(prog->num_insts, sizeof(state.bounds_stubs[0]));
+    state.num_bounds_stubs = 0;
+    state.far_jumps = NULL;
+    state.num_far_jumps = 0;
+    state.blocks = ubpf_scratch_calloc(prog->num_insts, sizeof(state.blocks[0]));
+
+    if (!state.buf || !state.pc_locs || !state.jumps ||
+            !state.live_out || !state.defined_in || !state.leaders ||
+            !state.bounds_stubs || !state.blocks) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    ubpf_analyze_registers(prog, state.live_out, state.defined_in);
+    ubpf_find_leaders(prog, state.leaders);
+
+    if (ubpf_layout_blocks(prog, state.leaders, state.counters != NULL, state.blocks, &state.num_blocks) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    if (translate(prog, &state, batch, errmsg) < 0) {
+        goto out;
+    }
+
+    /* Translate again while any conditional jump is out of range, now that the distances are known */
+    while (!state.oom && find_far_jumps(&state) > 0) {
+        state.offset = 0;
+        state.num_jumps = 0;
+        state.num_relocs = 0;
+        state.num_bounds_stubs = 0;
+        if (translate(prog, &state, batch, errmsg) < 0) {
+            goto out;
+        }
+    }
+
+    if (state.oom) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    resolve_jumps(&state);
+
+    image->code = state.buf;
+    image->size = state.offset;
+    image->relocs = state.relocs;
+    image->num_relocs = state.num_relocs;
+    state.buf = NULL;
+    state.relocs = NULL;
+    rv = 0;
+
+out:
+    free(state.buf);
+    ubpf_scratch_free(state.pc_locs);
+    free(state.jumps);
+    free(state.relocs);
+    ubpf_scratch_free(state.live_out);
+    ubpf_scratch_free(state.defined_in);
+    ubpf_scratch_free(state.leaders);
+    ubpf_scratch_free(state.bounds_stubs);
+    free(state.far_jumps);
+    ubpf_scratch_free(state.blocks);
+    return rv;
+}
+
+/* The settings compiled code depends on beyond the program and the VM's tables */
+struct jit_variant {
+    /* Tells this backend's code apart from others' in a shared cache directory */
+    char arch[8];
+    uint8_t batch;
+    uint8_t bounds_check;
+    uint8_t register_map[REGISTER_MAP_SIZE];
+    /* Whether the CPU has the instructions for each intrinsic */
+    uint8_t intrinsics[NUM_INTRINSICS];
+    /* Whether each registered function is ubpf_map_lookup, whose calls may be inlined */
+    uint8_t map_lookup[];
+};
+
+/*
+ * Code compiled with profiling counters refers to them and may be laid out
+ * from them, so is neither looked up in the cache nor saved there.
+ */
+static void *
+compile(struct ubpf_prog *prog, bool batch, size_t *size, char **errmsg)
+{
+    struct ubpf_jit_image image = { 0 };
+    struct jit_variant *variant = NULL;
+    size_t variant_size = sizeof(*variant) + prog->vm->num_ext_funcs;
+    bool cache = prog->vm->cache_dir && !prog->counters;
+    void *jitted = NULL;
+    int i;
+
+    /* Without memory for the variant, compile without the cache */
+    if (cache && !(variant = calloc(1, variant_size))) {
+        cache = false;
+    }
+
+    if (cache) {
+        memcpy(variant->arch, "arm64", sizeof("arm64"));
+        variant->batch = batch;
+        variant->bounds_check = prog->vm->bounds_check_enabled;
+        for (i = 0; i < REGISTER_MAP_SIZE; i++) {
+            variant->register_map[i] = register_map[i];
+        }
+        for (i = 0; i < NUM_INTRINSICS; i++) {
+            variant->intrinsics[i] = cpu_has_intrinsic(i);
+        }
+        for (i = 0; i < prog->vm->num_ext_funcs; i++) {
+            variant->map_lookup[i] = prog->vm->ext_funcs[i] == (ext_func)ubpf_map_lookup;
+        }
+
+        if (ubpf_cache_load(prog, variant, variant_size, &image) == 0) {
+            jitted = place(prog, &image, errmsg);
+            if (jitted) {
+                *size = image.size;
+                goto out;
+            }
+            /* Compile it afresh instead */
+            free(*errmsg);
+            *errmsg = NULL;
+            free(image.code);
+            free(image.relocs);
+        }
+    }
+
+    if (compile_image(prog, batch, &image, errmsg) < 0) {
+        goto out;
+    }
+
+    if (cache) {
+        ubpf_cache_store(prog, variant, variant_size, &image);
+    }
+
+    jitted = place(prog, &image, errmsg);
+    if (jitted) {
+        *size = image.size;
+    }
+
+out:
+    free(variant);
+    free(image.code);
+    free(image.relocs);
+    return jitted;
+}
+
+int
+ubpf_compile_prog(struct ubpf_prog *prog, bool batch, char **errmsg)
+{
+    if (batch && !prog->jitted_batch) {
+        ubpf_jit_batch_fn jitted = compile(prog, true, &prog->jitted_batch_size, errmsg);
+        if (!jitted) {
+            return -1;
+        }
+        __atomic_store_n(&prog->jitted_batch, jitted, __ATOMIC_RELEASE);
+    } else if (!batch && !prog->jitted) {
+        ubpf_jit_fn jitted = compile(prog, false, &prog->jitted_size, errmsg);
+        if (!jitted) {
+            return -1;
+        }
+        __atomic_store_n(&prog->jitted, jitted, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Threads that find no code compile it one at a time under vm->lock, so
+ * only the first does any work. The release store publishing the code
+ * pairs with the acquire load, so a caller that sees the pointer also sees
+ * the code and its size. The read section only covers the fast path:
+ * holding the lock keeps vm->prog from being replaced, and ubpf_replace
+ * never waits for readers while holding it.
+ */
+static void *
+compile_current(struct ubpf_vm *vm, bool batch, char **errmsg)
+{
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    void *jitted = NULL;
+
+    if (prog) {
+        jitted = batch ? (void *)__atomic_load_n(&prog->jitted_batch, __ATOMIC_ACQUIRE) :
+            (void *)__atomic_load_n(&prog->jitted, __ATOMIC_ACQUIRE);
+    }
+    ubpf_read_unlock(vm, &section);
+    if (jitted) {
+        return jitted;
+    }
+
+    *errmsg = NULL;
+
+    pthread_mutex_lock(&vm->lock);
+    if (!vm->prog) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+    } else if (ubpf_compile_prog(vm->prog, batch, errmsg) == 0) {
+        jitted = batch ? (void *)vm->prog->jitted_batch : (void *)vm->prog->jitted;
+    }
+    pthread_mutex_unlock(&vm->lock);
+    return jitted;
+}
+
+ubpf_jit_fn
+ubpf_compile(struct ubpf_vm *vm, char **errmsg)
+{
+    return (ubpf_jit_fn)compile_current(vm, false, errmsg);
+}
+
+ubpf_jit_batch_fn
+ubpf_compile_batch(struct ubpf_vm *vm, char **errmsg)
+{
+    return (ubpf_jit_batch_fn)compile_current(vm, true, errmsg);
+}
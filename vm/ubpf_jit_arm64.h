@@ -0,0 +1,686 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Generic AArch64 code generation functions
+ *
+ * Every instruction is 32 bits. Register 31 is SP as the base of a load or
+ * store and as either operand of add and sub with an immediate, and is XZR
+ * everywhere else.
+ */
+
+#ifndef UBPF_JIT_ARM64_H
+#define UBPF_JIT_ARM64_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X0  0
+#define X1  1
+#define X2  2
+#define X3  3
+#define X4  4
+#define X5  5
+#define X6  6
+#define X9  9
+#define X10 10
+#define X11 11
+#define X16 16
+#define X17 17
+#define X19 19
+#define X20 20
+#define X21 21
+#define X22 22
+#define X23 23
+#define X24 24
+#define X25 25
+#define X26 26
+#define X27 27
+#define X28 28
+#define X29 29
+#define X30 30
+#define SP  31
+#define XZR 31
+
+/* Condition codes, where flipping the low bit negates the condition */
+enum condition {
+    COND_EQ = 0x0,
+    COND_NE = 0x1,
+    COND_HS = 0x2,
+    COND_LO = 0x3,
+    COND_HI = 0x8,
+    COND_LS = 0x9,
+    COND_GE = 0xa,
+    COND_LT = 0xb,
+    COND_GT = 0xc,
+    COND_LE = 0xd,
+};
+
+enum operand_size {
+    S8,
+    S16,
+    S32,
+    S64,
+};
+
+struct jump {
+    /* The b, bl, b.cond or cbz to patch */
+    uint32_t inst_loc;
+    int32_t target_pc;
+    /* Whether the offset is the 26-bit one of b and bl rather than the 19-bit one of b.cond and cbz */
+    bool imm26;
+};
+
+/* Cold path for a failed inline bounds check of the access at pc */
+struct bounds_stub {
+    /* Where the cold path starts, which the b.hs taken when the access is not within mem jumps to */
+    uint32_t loc;
+    uint32_t resume_loc;
+    uint16_t pc;
+};
+
+struct jit_state {
+    uint8_t *buf;
+    uint32_t offset;
+    uint32_t size;
+    /* Set when growing buf, jumps or relocs fails; the output is then unusable */
+    bool oom;
+    uint32_t *pc_locs;
+    uint32_t exit_loc;
+    uint32_t div_by_zero_loc;
+    uint32_t budget_loc;
+    uint32_t batch_loop_loc;
+    uint32_t batch_done_loc;
+    uint32_t bounds_fail_loc;
+    struct jump *jumps;
+    int num_jumps;
+    int max_jumps;
+    /*
+     * Indexed like jumps, nonzero for the conditional ones found by an
+     * earlier pass to be out of range of a 19-bit offset, which are then
+     * emitted as the opposite condition around a b
+     */
+    uint8_t *far_jumps;
+    int num_far_jumps;
+    /* Absolute addresses emitted, including those of calls */
+    struct ubpf_reloc *relocs;
+    int num_relocs;
+    int max_relocs;
+    /* Register dataflow from ubpf_analyze_registers, indexed by PC */
+    uint16_t *live_out;
+    uint16_t *defined_in;
+    /* Nonzero for PCs that are the target of a jump */
+    uint8_t *leaders;
+    /* Bytes of stack below r10 on entry, from prog->stack_size */
+    uint32_t stack_size;
+    /* Inline bounds checking, enabled from vm->bounds_check_enabled */
+    bool bounds_check;
+    struct bounds_stub *bounds_stubs;
+    int num_bounds_stubs;
+    /* Profiling counters to update, from prog->counters if profiling is enabled */
+    struct ubpf_counters *counters;
+    /* Basic blocks in the order they are emitted */
+    struct ubpf_code_block *blocks;
+    int num_blocks;
+    /*
+     * Targets that follow the current instruction in the program and in the
+     * emitted code, either a PC or TARGET_PC_EXIT for the epilogue
+     */
+    int32_t fallthrough_pc;
+    int32_t next_pc;
+};
+
+/* Double the capacity of a jit_state array, setting oom on failure */
+static inline bool
+grow_array(struct jit_state *state, void **array, int *max, size_t elem_size)
+{
+    int new_max = *max > 0 ? *max * 2 : 16;
+    void *p = realloc(*array, new_max * elem_size);
+    if (!p) {
+        state->oom = true;
+        return false;
+    }
+    *array = p;
+    *max = new_max;
+    return true;
+}
+
+/*
+ * Append to the code buffer, growing it as needed. Once an allocation has
+ * failed nothing more is emitted and state->oom stays set.
+ */
+static inline void
+emit_bytes(struct jit_state *state, void *data, uint32_t len)
+{
+    if (state->oom) {
+        return;
+    }
+
+    if (len > state->size - state->offset) {
+        uint32_t new_size = state->size;
+        while (len > new_size - state->offset) {
+            if (new_size > UINT32_MAX / 2) {
+                state->oom = true;
+                return;
+            }
+            new_size *= 2;
+        }
+        uint8_t *buf = realloc(state->buf, new_size);
+        if (!buf) {
+            state->oom = true;
+            return;
+        }
+        state->buf = buf;
+        state->size = new_size;
+    }
+
+    memcpy(state->buf + state->offset, data, len);
+    state->offset += len;
+}
+
+/* Emit one instruction */
+static inline void
+emit4(struct jit_state *state, uint32_t x)
+{
+    emit_bytes(state, &x, sizeof(x));
+}
+
+static inline void
+emit8(struct jit_state *state, uint64_t x)
+{
+    emit_bytes(state, &x, sizeof(x));
+}
+
+/* Or 'bits' into the instruction at 'loc', ignoring one that was never emitted */
+static inline void
+patch_inst(struct jit_state *state, uint32_t loc, uint32_t bits)
+{
+    uint32_t inst;
+    if (loc <= state->offset && sizeof(inst) <= state->offset - loc) {
+        memcpy(&inst, state->buf + loc, sizeof(inst));
+        inst |= bits;
+        memcpy(state->buf + loc, &inst, sizeof(inst));
+    }
+}
+
+/* The offset field of a branch at 'from' to 'to', which must be in range */
+static inline uint32_t
+branch_imm(uint32_t from, uint32_t to, bool imm26)
+{
+    int32_t rel = ((int32_t)to - (int32_t)from) / 4;
+    if (imm26) {
+        assert(rel >= -(1 << 25) && rel < (1 << 25));
+        return rel & 0x3ffffff;
+    }
+    assert(rel >= -(1 << 18) && rel < (1 << 18));
+    return (rel & 0x7ffff) << 5;
+}
+
+/* Patch a forward b.cond, cbz or b at 'loc' to land at the current offset */
+static inline void
+patch_branch(struct jit_state *state, uint32_t loc, bool imm26)
+{
+    patch_inst(state, loc, branch_imm(loc, state->offset, imm26));
+}
+
+/* Whether the conditional jump to be emitted next was found out of 19-bit range */
+static inline bool
+next_jump_is_far(struct jit_state *state)
+{
+    return state->num_jumps < state->num_far_jumps && state->far_jumps[state->num_jumps];
+}
+
+/* Emit the branch 'inst' with a zero offset and record it for resolve_jumps */
+static inline void
+emit_jump_inst(struct jit_state *state, uint32_t inst, int32_t target_pc, bool imm26)
+{
+    if (state->num_jumps == state->max_jumps &&
+            !grow_array(state, (void **)&state->jumps, &state->max_jumps, sizeof(state->jumps[0]))) {
+        return;
+    }
+    struct jump *jump = &state->jumps[state->num_jumps++];
+    jump->inst_loc = state->offset;
+    jump->target_pc = target_pc;
+    jump->imm26 = imm26;
+    emit4(state, inst);
+}
+
+static inline void
+emit_jmp(struct jit_state *state, int32_t target_pc)
+{
+    /* b */
+    emit_jump_inst(state, 0x14000000, target_pc, true);
+}
+
+/*
+ * Emit a conditional branch of the form 'inst', a b.cond, cbz or cbnz with
+ * a zero offset, where flipping bit 'negate' negates the condition. Far
+ * ones skip over a b instead, which is recorded in the same jump slot.
+ */
+static inline void
+emit_cond_branch(struct jit_state *state, uint32_t inst, uint32_t negate, int32_t target_pc)
+{
+    if (next_jump_is_far(state)) {
+        /* Skip the b below */
+        emit4(state, (inst ^ negate) | (2 << 5));
+        emit_jmp(state, target_pc);
+    } else {
+        emit_jump_inst(state, inst, target_pc, false);
+    }
+}
+
+/* b.cond */
+static inline void
+emit_jcc(struct jit_state *state, enum condition cond, int32_t target_pc)
+{
+    emit_cond_branch(state, 0x54000000 | cond, 1, target_pc);
+}
+
+/* cbz of the low 32 or all 64 bits of reg */
+static inline void
+emit_cbz(struct jit_state *state, bool is64, int reg, int32_t target_pc)
+{
+    emit_cond_branch(state, (is64 ? 0xb4000000 : 0x34000000) | reg, 1 << 24, target_pc);
+}
+
+/* bl to the function of the program at 'target_pc' */
+static inline void
+emit_call_pc(struct jit_state *state, int32_t target_pc)
+{
+    emit_jump_inst(state, 0x94000000, target_pc, true);
+}
+
+/* Unconditional branch to a location already emitted */
+static inline void
+emit_branch_back(struct jit_state *state, uint32_t loc)
+{
+    emit4(state, 0x14000000 | branch_imm(state->offset, loc, true));
+}
+
+/* Forward b.cond whose offset the caller patches, returning its location */
+static inline uint32_t
+emit_forward_jcc(struct jit_state *state, enum condition cond)
+{
+    uint32_t loc = state->offset;
+    emit4(state, 0x54000000 | cond);
+    return loc;
+}
+
+static inline uint32_t
+emit_forward_jmp(struct jit_state *state)
+{
+    uint32_t loc = state->offset;
+    emit4(state, 0x14000000);
+    return loc;
+}
+
+static inline uint32_t
+emit_forward_cbz(struct jit_state *state, int reg)
+{
+    uint32_t loc = state->offset;
+    emit4(state, 0xb4000000 | reg);
+    return loc;
+}
+
+/* add or sub (shifted register), op being 0x0b000000 for add and 0x4b000000 for sub, or with 0x20000000 to set flags */
+static inline void
+emit_addsub(struct jit_state *state, uint32_t op, bool is64, int rd, int rn, int rm, int lsl)
+{
+    emit4(state, op | ((uint32_t)is64 << 31) | (rm << 16) | (lsl << 10) | (rn << 5) | rd);
+}
+
+/* and, orr, eor or ands (shifted register): 0x0a000000, 0x2a000000, 0x4a000000 or 0x6a000000 */
+static inline void
+emit_logical(struct jit_state *state, uint32_t op, bool is64, int rd, int rn, int rm)
+{
+    emit4(state, op | ((uint32_t)is64 << 31) | (rm << 16) | (rn << 5) | rd);
+}
+
+/* Data processing with two sources, such as udiv, lslv and crc32c, given by 'op' */
+static inline void
+emit_dp2(struct jit_state *state, uint32_t op, bool is64, int rd, int rn, int rm)
+{
+    emit4(state, op | ((uint32_t)is64 << 31) | (rm << 16) | (rn << 5) | rd);
+}
+
+/* Data processing with one source, such as rev, given by 'op' */
+static inline void
+emit_dp1(struct jit_state *state, uint32_t op, int rd, int rn)
+{
+    emit4(state, op | (rn << 5) | rd);
+}
+
+/* rd = ra + rn * rm, or rd = ra - rn * rm with 'sub' */
+static inline void
+emit_madd(struct jit_state *state, bool is64, bool sub, int rd, int rn, int rm, int ra)
+{
+    emit4(state, 0x1b000000 | ((uint32_t)is64 << 31) | (rm << 16) | ((uint32_t)sub << 15) | (ra << 10) | (rn << 5) | rd);
+}
+
+/* ubfm or sbfm, from which the immediate shifts and zero extensions are made */
+static inline void
+emit_bfm(struct jit_state *state, bool is64, bool sign, int rd, int rn, int immr, int imms)
+{
+    uint32_t op = sign ? 0x13000000 : 0x53000000;
+    emit4(state, op | ((uint32_t)is64 << 31) | ((uint32_t)is64 << 22) | (immr << 16) | (imms << 10) | (rn << 5) | rd);
+}
+
+/* csel rd, rn, rm, cond */
+static inline void
+emit_csel(struct jit_state *state, int rd, int rn, int rm, enum condition cond)
+{
+    emit4(state, 0x9a800000 | (rm << 16) | (cond << 12) | (rn << 5) | rd);
+}
+
+/* Register to register mov, which for 32 bits zero-extends */
+static inline void
+emit_mov(struct jit_state *state, bool is64, int src, int dst)
+{
+    emit_logical(state, 0x2a000000, is64, dst, XZR, src);
+}
+
+/* mov to or from SP, which are add with an immediate of 0 */
+static inline void
+emit_mov_sp(struct jit_state *state, int src, int dst)
+{
+    emit4(state, 0x91000000 | (src << 5) | dst);
+}
+
+/*
+ * movz, movk or movn, op being 0x52800000, 0x72800000 or 0x12800000, of a
+ * 16-bit immediate shifted left 16 times 'hw'
+ */
+static inline void
+emit_movw(struct jit_state *state, uint32_t op, bool is64, int rd, uint16_t imm, int hw)
+{
+    emit4(state, op | ((uint32_t)is64 << 31) | (hw << 21) | ((uint32_t)imm << 5) | rd);
+}
+
+/*
+ * Load an immediate, starting with a movn if most of its halfwords are all
+ * ones and a movz otherwise, then a movk for each other halfword that
+ * differs from what that left.
+ */
+static inline void
+emit_load_imm(struct jit_state *state, int rd, int64_t imm)
+{
+    uint64_t x = imm;
+    int zeros = 0, ones = 0, hw;
+
+    for (hw = 0; hw < 4; hw++) {
+        uint16_t half = x >> (16 * hw);
+        zeros += half == 0;
+        ones += half == 0xffff;
+    }
+
+    bool inverted = ones > zeros;
+    uint16_t fill = inverted ? 0xffff : 0;
+    bool first = true;
+    for (hw = 0; hw < 4; hw++) {
+        uint16_t half = x >> (16 * hw);
+        if (half == fill) {
+            continue;
+        }
+        if (first) {
+            emit_movw(state, inverted ? 0x12800000 : 0x52800000, true, rd, inverted ? ~half : half, hw);
+            first = false;
+        } else {
+            emit_movw(state, 0x72800000, true, rd, half, hw);
+        }
+    }
+    if (first) {
+        /* All halfwords are the fill */
+        emit_movw(state, inverted ? 0x12800000 : 0x52800000, true, rd, 0, 0);
+    }
+}
+
+/*
+ * Load the address of what 'kind' and 'index' refer to from a literal
+ * emitted inline, 8-byte aligned, so it can be relocated:
+ * ldr rd, literal; b over; [nop;] literal: .quad addr
+ */
+static inline void
+emit_load_addr(struct jit_state *state, int rd, enum ubpf_reloc_kind kind, uint16_t index, const void *addr)
+{
+    if (state->num_relocs == state->max_relocs &&
+            !grow_array(state, (void **)&state->relocs, &state->max_relocs, sizeof(state->relocs[0]))) {
+        return;
+    }
+    bool pad = (state->offset + 8) % 8 != 0;
+    /* ldr rd, literal */
+    emit4(state, 0x58000000 | ((pad ? 3 : 2) << 5) | rd);
+    /* b over the literal */
+    emit4(state, 0x14000000 | (pad ? 4 : 3));
+    if (pad) {
+        /* nop */
+        emit4(state, 0xd503201f);
+    }
+    struct ubpf_reloc *reloc = &state->relocs[state->num_relocs++];
+    reloc->loc = state->offset;
+    reloc->stub_loc = 0;
+    reloc->index = index;
+    reloc->kind = kind;
+    reloc->call = false;
+    emit8(state, (uintptr_t)addr);
+}
+
+/* Call what 'kind' and 'index' refer to through X16, which like X17 may be clobbered by any call */
+static inline void
+emit_call(struct jit_state *state, enum ubpf_reloc_kind kind, uint16_t index, void *target)
+{
+    emit_load_addr(state, X16, kind, index, target);
+    /* blr x16 */
+    emit4(state, 0xd63f0000 | (X16 << 5));
+}
+
+/* str x30, [sp, #-16]!, keeping SP 16-byte aligned */
+static inline void
+emit_push_lr(struct jit_state *state)
+{
+    emit4(state, 0xf81f0ffe);
+}
+
+/* ldr x30, [sp], #16 */
+static inline void
+emit_pop_lr(struct jit_state *state)
+{
+    emit4(state, 0xf84107fe);
+}
+
+static inline void
+emit_ret(struct jit_state *state)
+{
+    emit4(state, 0xd65f03c0);
+}
+
+/*
+ * Add a signed immediate to rn, into rd. Either may be SP. Immediates of
+ * up to 24 bits take one or two instructions, larger ones go through
+ * 'tmp', which may not be SP.
+ */
+static inline void
+emit_add_imm(struct jit_state *state, bool is64, int rd, int rn, int64_t imm, int tmp)
+{
+    uint32_t op = imm < 0 ? 0x51000000 : 0x11000000;
+    uint64_t mag = imm < 0 ? -(uint64_t)imm : (uint64_t)imm;
+    uint32_t sf = (uint32_t)is64 << 31;
+
+    if (mag >= (1 << 24)) {
+        assert(rd != SP && rn != SP);
+        emit_load_imm(state, tmp, imm);
+        emit_addsub(state, 0x0b000000, is64, rd, rn, tmp, 0);
+        return;
+    }
+    if (mag >> 12) {
+        /* With lsl #12 */
+        emit4(state, op | sf | (1 << 22) | ((mag >> 12) << 10) | (rn << 5) | rd);
+        rn = rd;
+        mag &= 0xfff;
+        if (!mag) {
+            return;
+        }
+    }
+    if (mag || rd != rn) {
+        emit4(state, op | sf | (mag << 10) | (rn << 5) | rd);
+    }
+}
+
+/* Compare rn with a sign-extended immediate, through 'tmp' if it does not fit 12 bits */
+static inline void
+emit_cmp_imm(struct jit_state *state, bool is64, int rn, int64_t imm, int tmp)
+{
+    uint32_t sf = (uint32_t)is64 << 31;
+    if (imm >= 0 && imm < 4096) {
+        /* subs xzr, rn, #imm */
+        emit4(state, 0x71000000 | sf | (imm << 10) | (rn << 5) | XZR);
+    } else if (imm < 0 && imm > -4096) {
+        /* adds xzr, rn, #-imm */
+        emit4(state, 0x31000000 | sf | ((-imm) << 10) | (rn << 5) | XZR);
+    } else {
+        emit_load_imm(state, tmp, imm);
+        emit_addsub(state, 0x6b000000, is64, XZR, rn, tmp, 0);
+    }
+}
+
+static inline void
+emit_cmp(struct jit_state *state, bool is64, int rn, int rm)
+{
+    emit_addsub(state, 0x6b000000, is64, XZR, rn, rm, 0);
+}
+
+/*
+ * The N:immr:imms encoding of 'imm' as a logical immediate, which is a
+ * rotated run of ones repeated in elements of 2 to 64 bits, or -1 if it is
+ * not one. 32-bit immediates are repeated to 64 bits first.
+ */
+static inline int32_t
+logical_imm(bool is64, uint64_t imm)
+{
+    if (!is64) {
+        imm = (uint32_t)imm | (imm << 32);
+    }
+    if (imm == 0 || imm == UINT64_MAX) {
+        return -1;
+    }
+
+    int size = 64;
+    while (size > 2) {
+        int half = size / 2;
+        uint64_t mask = (1ULL << half) - 1;
+        if ((imm & mask) != ((imm >> half) & mask)) {
+            break;
+        }
+        size = half;
+    }
+
+    uint64_t mask = size == 64 ? UINT64_MAX : (1ULL << size) - 1;
+    uint64_t elem = imm & mask;
+    int ones = __builtin_popcountll(elem);
+    uint64_t run = (1ULL << ones) - 1;
+    int rot;
+    for (rot = 0; rot < size; rot++) {
+        uint64_t rotated = rot ? ((run >> rot) | (run << (size - rot))) & mask : run;
+        if (rotated == elem) {
+            int n = size == 64;
+            int imms = ((~(size * 2 - 1)) & 0x3f) | (ones - 1);
+            return (n << 12) | (rot << 6) | imms;
+        }
+    }
+    return -1;
+}
+
+/*
+ * and, orr, eor or ands with an immediate: 0x12000000, 0x32000000,
+ * 0x52000000 or 0x72000000, going through 'tmp' if it is no logical
+ * immediate. The shifted register form is the same less 0x08000000.
+ */
+static inline void
+emit_logical_imm(struct jit_state *state, uint32_t op, bool is64, int rd, int rn, int64_t imm, int tmp)
+{
+    int32_t enc = logical_imm(is64, imm);
+    if (enc >= 0) {
+        emit4(state, op | ((uint32_t)is64 << 31) | ((uint32_t)enc << 10) | (rn << 5) | rd);
+    } else {
+        emit_load_imm(state, tmp, imm);
+        emit_logical(state, op - 0x08000000, is64, rd, rn, tmp);
+    }
+}
+
+/*
+ * The opcode of a load or store of an operand size with an unsigned
+ * scaled offset. The unscaled and register offset forms differ in bits
+ * 24 and 21 to 10.
+ */
+static inline uint32_t
+load_store_op(enum operand_size size, bool load)
+{
+    return 0x39000000 | ((uint32_t)size << 30) | ((uint32_t)load << 22);
+}
+
+/*
+ * Load or store rt of an operand size at [rn + offset], which needs 'tmp'
+ * for offsets neither a small multiple of the size nor within 9 bits.
+ * Loads zero-extend.
+ */
+static inline void
+emit_load_store(struct jit_state *state, enum operand_size size, bool load, int rt, int rn, int32_t offset, int tmp)
+{
+    uint32_t op = load_store_op(size, load);
+    if (offset >= 0 && offset % (1 << size) == 0 && (offset >> size) < 4096) {
+        emit4(state, op | ((offset >> size) << 10) | (rn << 5) | rt);
+    } else if (offset >= -256 && offset < 256) {
+        /* ldur or stur */
+        emit4(state, (op & ~0x01000000) | ((offset & 0x1ff) << 12) | (rn << 5) | rt);
+    } else {
+        emit_load_imm(state, tmp, offset);
+        /* Register offset */
+        emit4(state, (op & ~0x01000000) | 0x00206800 | (tmp << 16) | (rn << 5) | rt);
+    }
+}
+
+static inline void
+emit_load(struct jit_state *state, enum operand_size size, int src, int dst, int32_t offset, int tmp)
+{
+    emit_load_store(state, size, true, dst, src, offset, tmp);
+}
+
+static inline void
+emit_store(struct jit_state *state, enum operand_size size, int src, int dst, int32_t offset, int tmp)
+{
+    emit_load_store(state, size, false, src, dst, offset, tmp);
+}
+
+/* stp or ldp of two 64-bit registers at [rn + offset] */
+static inline void
+emit_pair(struct jit_state *state, bool load, int rt, int rt2, int rn, int32_t offset)
+{
+    emit4(state, (load ? 0xa9400000 : 0xa9000000) | (((offset / 8) & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt);
+}
+
+/* Increment the 64-bit counter at 'counter', clobbering X16 and X17 but not the flags */
+static inline void
+emit_counter_inc(struct jit_state *state, uint64_t *counter)
+{
+    emit_load_imm(state, X16, (uintptr_t)counter);
+    emit_load(state, S64, X16, X17, 0, X17);
+    emit_add_imm(state, true, X17, X17, 1, X17);
+    emit_store(state, S64, X17, X16, 0, X17);
+}
+
+#endif
@@ -21,7 +21,6 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <inttypes.h>
-#include <sys/mman.h>
 #include <errno.h>
 #include <assert.h>
 #include "ubpf_int.h"
@@ -30,8 +29,60 @@
 /* Special values for target_pc in struct jump */
 #define TARGET_PC_EXIT -1
 #define TARGET_PC_DIV_BY_ZERO -2
+#define TARGET_PC_BATCH_LOOP -3
+#define TARGET_PC_BATCH_DONE -4
+#define TARGET_PC_BUDGET -5
 
-static void muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm);
+/*
+ * Stack slots used by the batch entry point, below the saved registers.
+ * The size is a multiple of 16 so the eBPF stack stays aligned.
+ */
+#define BATCH_MEMS 0
+#define BATCH_LENS 8
+#define BATCH_RESULTS 16
+#define BATCH_REMAINING 24
+#define BATCH_FRAME_SIZE 32
+
+/*
+ * Stack slots used for inline bounds checks, below the eBPF stack.
+ * BOUNDS_LIMIT(size) is one past the highest offset from mem at which an
+ * access of that operand size still fits, or 0 if none does. BOUNDS_STACK
+ * is the lowest address of the stack, which every function's frame is in.
+ */
+#define BOUNDS_MEM 0
+#define BOUNDS_MEM_LEN 8
+#define BOUNDS_LIMIT(size) (16 + 8 * (size))
+#define BOUNDS_STACK 48
+#define BOUNDS_FRAME_SIZE 64
+
+/* Stack slot of the budget left, above the bounds check slots if there are any */
+#define BUDGET_FRAME_SIZE 16
+
+/* Indexes of UBPF_RELOC_INTERNAL relocations */
+enum {
+    INTERNAL_PROG,
+    INTERNAL_DIV_BY_ZERO,
+    INTERNAL_BOUNDS_CHECK_FAILED,
+    INTERNAL_MEM_ARG_CHECK_FAILED,
+    INTERNAL_BUDGET_EXHAUSTED,
+    NUM_INTERNAL,
+};
+
+static void divmod(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm);
+static void emit_shift_count(struct jit_state *state, int bpf_src);
+static void emit_bounds_check(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, int bpf_base, int16_t offset, enum operand_size size);
+static void emit_bounds_stubs(const struct ubpf_prog *prog, struct jit_state *state);
+static void div_by_zero(const struct ubpf_prog *prog, uint64_t pc);
+static void emit_budget_check(struct jit_state *state, uint16_t pc);
+static void budget_exhausted(const struct ubpf_prog *prog, uint64_t pc);
+static void bounds_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, const uint8_t *frame);
+static void emit_mem_arg_checks(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static void mem_arg_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, uint64_t size, const uint8_t *frame);
+static bool emit_inline_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static bool emit_intrinsic(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static void emit_switch(const struct ubpf_prog *prog, struct jit_state *state, struct ebpf_inst inst);
+static void emit_local_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc);
+static int vm_map_index(const struct ubpf_prog *prog, const struct ubpf_map *map);
 
 #define REGISTER_MAP_SIZE 11
 static int register_map[REGISTER_MAP_SIZE] = {
@@ -56,6 +107,27 @@ map_register(int r)
     return register_map[r % REGISTER_MAP_SIZE];
 }
 
+/* Return the eBPF register held in the given x86 register, or -1 */
+static int
+unmap_register(int x86)
+{
+    int i;
+    for (i = 0; i < REGISTER_MAP_SIZE; i++) {
+        if (register_map[i] == x86) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Whether the x86 register holds an eBPF register that is live after 'pc' */
+static bool
+x86_reg_live_out(struct jit_state *state, uint16_t pc, int x86)
+{
+    int r = unmap_register(x86);
+    return r >= 0 && (state->live_out[pc] & (1 << r));
+}
+
 /* For testing, this changes the mapping between x86 and eBPF registers */
 void
 ubpf_set_register_offset(int x)
@@ -79,14 +151,81 @@ ubpf_set_register_offset(int x)
     }
 }
 
+/* Whether execution can only continue after the instruction by jumping */
+static bool
+ends_block(struct ebpf_inst inst)
+{
+    return (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_CALL;
+}
+
+/*
+ * Emit a conditional jump to 'target_pc' for the current instruction. If
+ * the code emitted next is the jump target rather than the fall-through,
+ * the condition is inverted, and if it is neither the fall-through needs a
+ * jump of its own. 'code' is the second byte of the rel32 jcc, and flipping
+ * its low bit negates the condition.
+ */
+static void
+emit_cond_jump(struct jit_state *state, int code, int32_t target_pc)
+{
+    if (state->next_pc == state->fallthrough_pc) {
+        emit_jcc(state, code, target_pc);
+    } else if (state->next_pc == target_pc) {
+        emit_jcc(state, code ^ 1, state->fallthrough_pc);
+    } else {
+        emit_jcc(state, code, target_pc);
+        emit_jmp(state, state->fallthrough_pc);
+    }
+}
+
 static int
-translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
+translate(struct ubpf_prog *prog, struct jit_state *state, bool batch, char **errmsg)
 {
+    /*
+     * Keep RSP 16-byte aligned for calls. With local calls R12 is pushed
+     * too, to hold RSP while they move it, which takes 8 more bytes.
+     */
+    bool local_calls = prog->num_funcs > 1;
+    int frame_size = ((state->stack_size + 15) & ~15) + (state->bounds_check ? BOUNDS_FRAME_SIZE : 0) +
+        (prog->budget_points ? BUDGET_FRAME_SIZE : 0) + (local_calls ? 8 : 0);
+    state->frame_reg = local_calls ? R12 : RSP;
+    state->budget_slot = state->bounds_check ? BOUNDS_FRAME_SIZE : 0;
+
     emit_push(state, RBP);
     emit_push(state, RBX);
     emit_push(state, R13);
     emit_push(state, R14);
     emit_push(state, R15);
+    if (local_calls) {
+        emit_push(state, R12);
+    }
+
+    if (batch) {
+        /* Save the batch arguments and return early if n == 0 */
+        emit_alu64_imm32(state, 0x81, 5, RSP, BATCH_FRAME_SIZE);
+        emit_store(state, S64, RDI, RSP, BATCH_MEMS);
+        emit_store(state, S64, RSI, RSP, BATCH_LENS);
+        emit_store(state, S64, RDX, RSP, BATCH_RESULTS);
+        emit_store(state, S64, RCX, RSP, BATCH_REMAINING);
+        emit_alu64(state, 0x85, RCX, RCX);
+        emit_jcc(state, 0x84, TARGET_PC_BATCH_DONE);
+
+        /* Load mems[i] into rdi and lens[i] into rsi, then advance */
+        state->batch_loop_loc = state->offset;
+        emit_load(state, S64, RSP, R11, BATCH_MEMS);
+        emit_load(state, S64, R11, RDI, 0);
+        emit_alu64_imm32(state, 0x81, 0, R11, 8);
+        emit_store(state, S64, R11, RSP, BATCH_MEMS);
+        emit_load(state, S64, RSP, R11, BATCH_LENS);
+        emit_load(state, S64, R11, RSI, 0);
+        emit_alu64_imm32(state, 0x81, 0, R11, 8);
+        emit_store(state, S64, R11, RSP, BATCH_LENS);
+    }
+
+    /* Keep mem_len, since rsi may be overwritten by the move below */
+    if (state->bounds_check) {
+        emit_mov(state, RSI, R11);
+    }
 
     /* Move rdi into register 1 */
     if (map_register(1) != RDI) {
@@ -97,331 +236,467 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
     emit_mov(state, RSP, map_register(10));
 
     /* Allocate stack space */
-    emit_alu64_imm32(state, 0x81, 5, RSP, STACK_SIZE);
+    emit_alu64_imm32(state, 0x81, 5, RSP, frame_size);
+    if (local_calls) {
+        emit_mov(state, RSP, R12);
+    }
 
-    int i;
-    for (i = 0; i < vm->num_insts; i++) {
-        struct ebpf_inst inst = vm->insts[i];
-        state->pc_locs[i] = state->offset;
+    if (state->bounds_check) {
+        /* A NULL mem has no accessible bytes, whatever mem_len says */
+        emit_store(state, S64, map_register(1), RSP, BOUNDS_MEM);
+        emit_alu64(state, 0x85, map_register(1), map_register(1));
+        emit_cmov(state, 0x4, map_register(1), R11);
+        emit_store(state, S64, R11, RSP, BOUNDS_MEM_LEN);
 
-        int dst = map_register(inst.dst);
-        int src = map_register(inst.src);
-        uint32_t target_pc = i + inst.offset + 1;
+        /* Precompute the limit for each operand size, clamped at 0 */
+        emit_alu32(state, 0x31, RCX, RCX);
+        enum operand_size size;
+        for (size = S8; size <= S64; size++) {
+            emit_mov(state, R11, R10);
+            if (size != S8) {
+                emit_alu64_imm32(state, 0x81, 5, R10, (1 << size) - 1);
+                emit_cmov(state, 0x2, RCX, R10);
+            }
+            emit_store(state, S64, R10, RSP, BOUNDS_LIMIT(size));
+        }
 
-        switch (inst.opcode) {
-        case EBPF_OP_ADD_IMM:
-            emit_alu32_imm32(state, 0x81, 0, dst, inst.imm);
-            break;
-        case EBPF_OP_ADD_REG:
-            emit_alu32(state, 0x01, src, dst);
-            break;
-        case EBPF_OP_SUB_IMM:
-            emit_alu32_imm32(state, 0x81, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_SUB_REG:
-            emit_alu32(state, 0x29, src, dst);
-            break;
-        case EBPF_OP_MUL_IMM:
-        case EBPF_OP_MUL_REG:
-        case EBPF_OP_DIV_IMM:
-        case EBPF_OP_DIV_REG:
-        case EBPF_OP_MOD_IMM:
-        case EBPF_OP_MOD_REG:
-            muldivmod(state, i, inst.opcode, src, dst, inst.imm);
-            break;
-        case EBPF_OP_OR_IMM:
-            emit_alu32_imm32(state, 0x81, 1, dst, inst.imm);
-            break;
-        case EBPF_OP_OR_REG:
-            emit_alu32(state, 0x09, src, dst);
-            break;
-        case EBPF_OP_AND_IMM:
-            emit_alu32_imm32(state, 0x81, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_AND_REG:
-            emit_alu32(state, 0x21, src, dst);
-            break;
-        case EBPF_OP_LSH_IMM:
-            emit_alu32_imm8(state, 0xc1, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_LSH_REG:
-            emit_mov(state, src, RCX);
-            emit_alu32(state, 0xd3, 4, dst);
-            break;
-        case EBPF_OP_RSH_IMM:
-            emit_alu32_imm8(state, 0xc1, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_RSH_REG:
-            emit_mov(state, src, RCX);
-            emit_alu32(state, 0xd3, 5, dst);
-            break;
-        case EBPF_OP_NEG:
-            emit_alu32(state, 0xf7, 3, dst);
-            break;
-        case EBPF_OP_XOR_IMM:
-            emit_alu32_imm32(state, 0x81, 6, dst, inst.imm);
-            break;
-        case EBPF_OP_XOR_REG:
-            emit_alu32(state, 0x31, src, dst);
-            break;
-        case EBPF_OP_MOV_IMM:
-            emit_alu32_imm32(state, 0xc7, 0, dst, inst.imm);
-            break;
-        case EBPF_OP_MOV_REG:
-            emit_mov(state, src, dst);
-            break;
-        case EBPF_OP_ARSH_IMM:
-            emit_alu32_imm8(state, 0xc1, 7, dst, inst.imm);
-            break;
-        case EBPF_OP_ARSH_REG:
-            emit_mov(state, src, RCX);
-            emit_alu32(state, 0xd3, 7, dst);
-            break;
+        emit_lea(state, map_register(10), R11, -(int32_t)state->stack_size);
+        emit_store(state, S64, R11, RSP, BOUNDS_STACK);
+    }
 
-        case EBPF_OP_LE:
-            /* No-op */
-            break;
-        case EBPF_OP_BE:
-            if (inst.imm == 16) {
-                /* rol */
-                emit1(state, 0x66); /* 16-bit override */
-                emit_alu32_imm8(state, 0xc1, 0, dst, 8);
-                /* and */
-                emit_alu32_imm32(state, 0x81, 4, dst, 0xffff);
-            } else if (inst.imm == 32 || inst.imm == 64) {
-                /* bswap */
-                emit_basic_rex(state, inst.imm == 64, 0, dst);
-                emit1(state, 0x0f);
-                emit1(state, 0xc8 | (dst & 7));
+    /* The budget starts over for each buffer of a batch */
+    if (prog->budget_points) {
+        emit_load_imm(state, R11, prog->budget);
+        emit_store(state, S64, R11, RSP, state->budget_slot);
+    }
+
+    int b, i;
+    for (b = 0; b < state->num_blocks; b++) {
+        struct ubpf_code_block block = state->blocks[b];
+        int32_t next_block = b + 1 < state->num_blocks ? (int32_t)state->blocks[b+1].start : TARGET_PC_EXIT;
+
+        /* Blocks may be entered from anywhere once they are reordered */
+        state->rcx_reg = -1;
+        memset(state->checked, 0, sizeof(state->checked));
+
+        for (i = block.start; i < block.end; i++) {
+            struct ebpf_inst inst = prog->insts[i];
+            int len = inst.opcode == EBPF_OP_LDDW ? 2 : 1;
+            bool last = i + len == block.end;
+            state->pc_locs[i] = state->offset;
+            state->fallthrough_pc = i + len < prog->num_insts ? i + len : TARGET_PC_EXIT;
+            state->next_pc = last ? next_block : i + len;
+
+            if (state->leaders[i]) {
+                state->rcx_reg = -1;
             }
-            break;
 
-        case EBPF_OP_ADD64_IMM:
-            emit_alu64_imm32(state, 0x81, 0, dst, inst.imm);
-            break;
-        case EBPF_OP_ADD64_REG:
-            emit_alu64(state, 0x01, src, dst);
-            break;
-        case EBPF_OP_SUB64_IMM:
-            emit_alu64_imm32(state, 0x81, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_SUB64_REG:
-            emit_alu64(state, 0x29, src, dst);
-            break;
-        case EBPF_OP_MUL64_IMM:
-        case EBPF_OP_MUL64_REG:
-        case EBPF_OP_DIV64_IMM:
-        case EBPF_OP_DIV64_REG:
-        case EBPF_OP_MOD64_IMM:
-        case EBPF_OP_MOD64_REG:
-            muldivmod(state, i, inst.opcode, src, dst, inst.imm);
-            break;
-        case EBPF_OP_OR64_IMM:
-            emit_alu64_imm32(state, 0x81, 1, dst, inst.imm);
-            break;
-        case EBPF_OP_OR64_REG:
-            emit_alu64(state, 0x09, src, dst);
-            break;
-        case EBPF_OP_AND64_IMM:
-            emit_alu64_imm32(state, 0x81, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_AND64_REG:
-            emit_alu64(state, 0x21, src, dst);
-            break;
-        case EBPF_OP_LSH64_IMM:
-            emit_alu64_imm8(state, 0xc1, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_LSH64_REG:
-            emit_mov(state, src, RCX);
-            emit_alu64(state, 0xd3, 4, dst);
-            break;
-        case EBPF_OP_RSH64_IMM:
-            emit_alu64_imm8(state, 0xc1, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_RSH64_REG:
-            emit_mov(state, src, RCX);
-            emit_alu64(state, 0xd3, 5, dst);
-            break;
-        case EBPF_OP_NEG64:
-            emit_alu64(state, 0xf7, 3, dst);
-            break;
-        case EBPF_OP_XOR64_IMM:
-            emit_alu64_imm32(state, 0x81, 6, dst, inst.imm);
-            break;
-        case EBPF_OP_XOR64_REG:
-            emit_alu64(state, 0x31, src, dst);
-            break;
-        case EBPF_OP_MOV64_IMM:
-            emit_load_imm(state, dst, inst.imm);
-            break;
-        case EBPF_OP_MOV64_REG:
-            emit_mov(state, src, dst);
-            break;
-        case EBPF_OP_ARSH64_IMM:
-            emit_alu64_imm8(state, 0xc1, 7, dst, inst.imm);
-            break;
-        case EBPF_OP_ARSH64_REG:
-            emit_mov(state, src, RCX);
-            emit_alu64(state, 0xd3, 7, dst);
-            break;
+            /* Jumps land on the counter, so it sees every entry to the block */
+            if (state->counters && (i == 0 || state->leaders[i])) {
+                emit_counter_inc(state, &state->counters->jit_blocks[i]);
+            }
 
-        /* TODO use 8 bit immediate when possible */
-        case EBPF_OP_JA:
-            emit_jmp(state, target_pc);
-            break;
-        case EBPF_OP_JEQ_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x84, target_pc);
-            break;
-        case EBPF_OP_JEQ_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x84, target_pc);
-            break;
-        case EBPF_OP_JGT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x87, target_pc);
-            break;
-        case EBPF_OP_JGT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x87, target_pc);
-            break;
-        case EBPF_OP_JGE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x83, target_pc);
-            break;
-        case EBPF_OP_JGE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x83, target_pc);
-            break;
-        case EBPF_OP_JLT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x82, target_pc);
-            break;
-        case EBPF_OP_JLT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x82, target_pc);
-            break;
-        case EBPF_OP_JLE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x86, target_pc);
-            break;
-        case EBPF_OP_JLE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x86, target_pc);
-            break;
-        case EBPF_OP_JSET_IMM:
-            emit_alu64_imm32(state, 0xf7, 0, dst, inst.imm);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JSET_REG:
-            emit_alu64(state, 0x85, src, dst);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JNE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JNE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JSGT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8f, target_pc);
-            break;
-        case EBPF_OP_JSGT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8f, target_pc);
-            break;
-        case EBPF_OP_JSGE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8d, target_pc);
-            break;
-        case EBPF_OP_JSGE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8d, target_pc);
-            break;
-        case EBPF_OP_JSLT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8c, target_pc);
-            break;
-        case EBPF_OP_JSLT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8c, target_pc);
-            break;
-        case EBPF_OP_JSLE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8e, target_pc);
-            break;
-        case EBPF_OP_JSLE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8e, target_pc);
-            break;
-        case EBPF_OP_CALL:
-            /* We reserve RCX for shifts */
-            emit_mov(state, R9, RCX);
-            emit_call(state, vm->ext_funcs[inst.imm]);
-            break;
-        case EBPF_OP_EXIT:
-            if (i != vm->num_insts - 1) {
-                emit_jmp(state, TARGET_PC_EXIT);
+            if (prog->budget_points && prog->budget_points[i]) {
+                emit_budget_check(state, ubpf_orig_pc(prog, i));
             }
-            break;
 
-        case EBPF_OP_LDXW:
-            emit_load(state, S32, src, dst, inst.offset);
-            break;
-        case EBPF_OP_LDXH:
-            emit_load(state, S16, src, dst, inst.offset);
-            break;
-        case EBPF_OP_LDXB:
-            emit_load(state, S8, src, dst, inst.offset);
-            break;
-        case EBPF_OP_LDXDW:
-            emit_load(state, S64, src, dst, inst.offset);
-            break;
+            int dst = map_register(inst.dst);
+            int src = map_register(inst.src);
+            uint32_t target_pc = i + inst.offset + 1;
 
-        case EBPF_OP_STW:
-            emit_store_imm32(state, S32, dst, inst.offset, inst.imm);
-            break;
-        case EBPF_OP_STH:
-            emit_store_imm32(state, S16, dst, inst.offset, inst.imm);
-            break;
-        case EBPF_OP_STB:
-            emit_store_imm32(state, S8, dst, inst.offset, inst.imm);
-            break;
-        case EBPF_OP_STDW:
-            emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
-            break;
+            switch (inst.opcode) {
+            case EBPF_OP_ADD_IMM:
+                emit_alu32_imm32(state, 0x81, 0, dst, inst.imm);
+                break;
+            case EBPF_OP_ADD_REG:
+                emit_alu32(state, 0x01, src, dst);
+                break;
+            case EBPF_OP_SUB_IMM:
+                emit_alu32_imm32(state, 0x81, 5, dst, inst.imm);
+                break;
+            case EBPF_OP_SUB_REG:
+                emit_alu32(state, 0x29, src, dst);
+                break;
+            case EBPF_OP_MUL_IMM:
+                emit_imul_imm32(state, 0, dst, inst.imm);
+                break;
+            case EBPF_OP_MUL_REG:
+                emit_imul(state, 0, src, dst);
+                break;
+            case EBPF_OP_DIV_IMM:
+            case EBPF_OP_DIV_REG:
+            case EBPF_OP_MOD_IMM:
+            case EBPF_OP_MOD_REG:
+                divmod(prog, state, i, inst.opcode, src, dst, inst.imm);
+                break;
+            case EBPF_OP_OR_IMM:
+                emit_alu32_imm32(state, 0x81, 1, dst, inst.imm);
+                break;
+            case EBPF_OP_OR_REG:
+                emit_alu32(state, 0x09, src, dst);
+                break;
+            case EBPF_OP_AND_IMM:
+                emit_alu32_imm32(state, 0x81, 4, dst, inst.imm);
+                break;
+            case EBPF_OP_AND_REG:
+                emit_alu32(state, 0x21, src, dst);
+                break;
+            case EBPF_OP_LSH_IMM:
+                emit_alu32_imm8(state, 0xc1, 4, dst, inst.imm);
+                break;
+            case EBPF_OP_LSH_REG:
+                emit_shift_count(state, inst.src);
+                emit_alu32(state, 0xd3, 4, dst);
+                break;
+            case EBPF_OP_RSH_IMM:
+                emit_alu32_imm8(state, 0xc1, 5, dst, inst.imm);
+                break;
+            case EBPF_OP_RSH_REG:
+                emit_shift_count(state, inst.src);
+                emit_alu32(state, 0xd3, 5, dst);
+                break;
+            case EBPF_OP_NEG:
+                emit_alu32(state, 0xf7, 3, dst);
+                break;
+            case EBPF_OP_XOR_IMM:
+                emit_alu32_imm32(state, 0x81, 6, dst, inst.imm);
+                break;
+            case EBPF_OP_XOR_REG:
+                emit_alu32(state, 0x31, src, dst);
+                break;
+            case EBPF_OP_MOV_IMM:
+                emit_alu32_imm32(state, 0xc7, 0, dst, inst.imm);
+                break;
+            case EBPF_OP_MOV_REG:
+                /* A 32-bit mov clears the upper half */
+                emit_alu32(state, 0x89, src, dst);
+                break;
+            case EBPF_OP_ARSH_IMM:
+                emit_alu32_imm8(state, 0xc1, 7, dst, inst.imm);
+                break;
+            case EBPF_OP_ARSH_REG:
+                emit_shift_count(state, inst.src);
+                emit_alu32(state, 0xd3, 7, dst);
+                break;
 
-        case EBPF_OP_STXW:
-            emit_store(state, S32, src, dst, inst.offset);
-            break;
-        case EBPF_OP_STXH:
-            emit_store(state, S16, src, dst, inst.offset);
-            break;
-        case EBPF_OP_STXB:
-            emit_store(state, S8, src, dst, inst.offset);
-            break;
-        case EBPF_OP_STXDW:
-            emit_store(state, S64, src, dst, inst.offset);
-            break;
+            case EBPF_OP_LE:
+                /* Truncate to the size, as the bytes are already in order */
+                if (inst.imm == 16) {
+                    /* movzx */
+                    emit_basic_rex(state, 0, dst, dst);
+                    emit1(state, 0x0f);
+                    emit1(state, 0xb7);
+                    emit_modrm_reg2reg(state, dst, dst);
+                } else if (inst.imm == 32) {
+                    /* mov */
+                    emit_alu32(state, 0x89, dst, dst);
+                }
+                break;
+            case EBPF_OP_BE:
+                if (inst.imm == 16) {
+                    /* rol */
+                    emit1(state, 0x66); /* 16-bit override */
+                    emit_alu32_imm8(state, 0xc1, 0, dst, 8);
+                    /* and */
+                    emit_alu32_imm32(state, 0x81, 4, dst, 0xffff);
+                } else if (inst.imm == 32 || inst.imm == 64) {
+                    /* bswap */
+                    emit_basic_rex(state, inst.imm == 64, 0, dst);
+                    emit1(state, 0x0f);
+                    emit1(state, 0xc8 | (dst & 7));
+                }
+                break;
 
-        case EBPF_OP_LDDW: {
-            struct ebpf_inst inst2 = vm->insts[++i];
-            uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
-            emit_load_imm(state, dst, imm);
-            break;
-        }
+            case EBPF_OP_ADD64_IMM:
+                emit_alu64_imm32(state, 0x81, 0, dst, inst.imm);
+                break;
+            case EBPF_OP_ADD64_REG:
+                emit_alu64(state, 0x01, src, dst);
+                break;
+            case EBPF_OP_SUB64_IMM:
+                emit_alu64_imm32(state, 0x81, 5, dst, inst.imm);
+                break;
+            case EBPF_OP_SUB64_REG:
+                emit_alu64(state, 0x29, src, dst);
+                break;
+            case EBPF_OP_MUL64_IMM:
+                emit_imul_imm32(state, 1, dst, inst.imm);
+                break;
+            case EBPF_OP_MUL64_REG:
+                emit_imul(state, 1, src, dst);
+                break;
+            case EBPF_OP_DIV64_IMM:
+            case EBPF_OP_DIV64_REG:
+            case EBPF_OP_MOD64_IMM:
+            case EBPF_OP_MOD64_REG:
+                divmod(prog, state, i, inst.opcode, src, dst, inst.imm);
+                break;
+            case EBPF_OP_OR64_IMM:
+                emit_alu64_imm32(state, 0x81, 1, dst, inst.imm);
+                break;
+            case EBPF_OP_OR64_REG:
+                emit_alu64(state, 0x09, src, dst);
+                break;
+            case EBPF_OP_AND64_IMM:
+                emit_alu64_imm32(state, 0x81, 4, dst, inst.imm);
+                break;
+            case EBPF_OP_AND64_REG:
+                emit_alu64(state, 0x21, src, dst);
+                break;
+            case EBPF_OP_LSH64_IMM:
+                emit_alu64_imm8(state, 0xc1, 4, dst, inst.imm);
+                break;
+            case EBPF_OP_LSH64_REG:
+                emit_shift_count(state, inst.src);
+                emit_alu64(state, 0xd3, 4, dst);
+                break;
+            case EBPF_OP_RSH64_IMM:
+                emit_alu64_imm8(state, 0xc1, 5, dst, inst.imm);
+                break;
+            case EBPF_OP_RSH64_REG:
+                emit_shift_count(state, inst.src);
+                emit_alu64(state, 0xd3, 5, dst);
+                break;
+            case EBPF_OP_NEG64:
+                emit_alu64(state, 0xf7, 3, dst);
+                break;
+            case EBPF_OP_XOR64_IMM:
+                emit_alu64_imm32(state, 0x81, 6, dst, inst.imm);
+                break;
+            case EBPF_OP_XOR64_REG:
+                emit_alu64(state, 0x31, src, dst);
+                break;
+            case EBPF_OP_MOV64_IMM:
+                emit_load_imm(state, dst, inst.imm);
+                break;
+            case EBPF_OP_MOV64_REG:
+                emit_mov(state, src, dst);
+                break;
+            case EBPF_OP_ARSH64_IMM:
+                emit_alu64_imm8(state, 0xc1, 7, dst, inst.imm);
+                break;
+            case EBPF_OP_ARSH64_REG:
+                emit_shift_count(state, inst.src);
+                emit_alu64(state, 0xd3, 7, dst);
+                break;
 
-        default:
-            *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
-            return -1;
+            case EBPF_OP_JA:
+                if ((int32_t)target_pc != state->next_pc) {
+                    emit_jmp(state, target_pc);
+                }
+                break;
+            case EBPF_OP_JEQ_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x84, target_pc);
+                break;
+            case EBPF_OP_JEQ_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x84, target_pc);
+                break;
+            case EBPF_OP_JGT_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x87, target_pc);
+                break;
+            case EBPF_OP_JGT_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x87, target_pc);
+                break;
+            case EBPF_OP_JGE_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x83, target_pc);
+                break;
+            case EBPF_OP_JGE_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x83, target_pc);
+                break;
+            case EBPF_OP_JLT_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x82, target_pc);
+                break;
+            case EBPF_OP_JLT_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x82, target_pc);
+                break;
+            case EBPF_OP_JLE_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x86, target_pc);
+                break;
+            case EBPF_OP_JLE_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x86, target_pc);
+                break;
+            case EBPF_OP_JSET_IMM:
+                emit_alu64_imm32(state, 0xf7, 0, dst, inst.imm);
+                emit_cond_jump(state, 0x85, target_pc);
+                break;
+            case EBPF_OP_JSET_REG:
+                emit_alu64(state, 0x85, src, dst);
+                emit_cond_jump(state, 0x85, target_pc);
+                break;
+            case EBPF_OP_JNE_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x85, target_pc);
+                break;
+            case EBPF_OP_JNE_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x85, target_pc);
+                break;
+            case EBPF_OP_JSGT_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x8f, target_pc);
+                break;
+            case EBPF_OP_JSGT_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x8f, target_pc);
+                break;
+            case EBPF_OP_JSGE_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x8d, target_pc);
+                break;
+            case EBPF_OP_JSGE_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x8d, target_pc);
+                break;
+            case EBPF_OP_JSLT_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x8c, target_pc);
+                break;
+            case EBPF_OP_JSLT_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x8c, target_pc);
+                break;
+            case EBPF_OP_JSLE_IMM:
+                emit_cmp_imm32(state, dst, inst.imm);
+                emit_cond_jump(state, 0x8e, target_pc);
+                break;
+            case EBPF_OP_JSLE_REG:
+                emit_cmp(state, src, dst);
+                emit_cond_jump(state, 0x8e, target_pc);
+                break;
+            case EBPF_OP_JSWITCH:
+                if (state->counters) {
+                    /* Counted like the chain of jeq it replaced */
+                    emit_cmp_imm32(state, dst, prog->switches[inst.imm].first_imm);
+                    emit_cond_jump(state, 0x84, target_pc);
+                } else {
+                    emit_switch(prog, state, inst);
+                }
+                break;
+            case EBPF_OP_CALL:
+                if (ubpf_is_local_call(inst)) {
+                    emit_local_call(prog, state, i);
+                    break;
+                }
+                if (emit_inline_call(prog, state, i) || emit_intrinsic(prog, state, i)) {
+                    break;
+                }
+                emit_mem_arg_checks(prog, state, i);
+                /* We reserve RCX for shifts, so r4 is kept in R9 until the call */
+                if ((state->defined_in[i] & (1 << 4)) && prog->vm->ext_func_info[inst.imm].num_args >= 4) {
+                    emit_mov(state, R9, RCX);
+                }
+                emit_call(state, UBPF_RELOC_HELPER, inst.imm, prog->vm->ext_funcs[inst.imm]);
+                state->rcx_reg = -1;
+                break;
+            case EBPF_OP_EXIT:
+                if (i >= prog->funcs[0].end) {
+                    /* Return from a local call */
+                    emit1(state, 0xc3);
+                } else if (state->next_pc != TARGET_PC_EXIT) {
+                    emit_jmp(state, TARGET_PC_EXIT);
+                }
+                break;
+
+            case EBPF_OP_LDXW:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S32);
+                emit_load(state, S32, src, dst, inst.offset);
+                break;
+            case EBPF_OP_LDXH:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S16);
+                emit_load(state, S16, src, dst, inst.offset);
+                break;
+            case EBPF_OP_LDXB:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S8);
+                emit_load(state, S8, src, dst, inst.offset);
+                break;
+            case EBPF_OP_LDXDW:
+                emit_bounds_check(prog, state, i, inst.src, inst.offset, S64);
+                emit_load(state, S64, src, dst, inst.offset);
+                break;
+
+            case EBPF_OP_STW:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S32);
+                emit_store_imm32(state, S32, dst, inst.offset, inst.imm);
+                break;
+            case EBPF_OP_STH:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S16);
+                emit_store_imm32(state, S16, dst, inst.offset, inst.imm);
+                break;
+            case EBPF_OP_STB:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S8);
+                emit_store_imm32(state, S8, dst, inst.offset, inst.imm);
+                break;
+            case EBPF_OP_STDW:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S64);
+                emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
+                break;
+
+            case EBPF_OP_STXW:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S32);
+                emit_store(state, S32, src, dst, inst.offset);
+                break;
+            case EBPF_OP_STXH:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S16);
+                emit_store(state, S16, src, dst, inst.offset);
+                break;
+            case EBPF_OP_STXB:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S8);
+                emit_store(state, S8, src, dst, inst.offset);
+                break;
+            case EBPF_OP_STXDW:
+                emit_bounds_check(prog, state, i, inst.dst, inst.offset, S64);
+                emit_store(state, S64, src, dst, inst.offset);
+                break;
+
+            case EBPF_OP_LDDW: {
+                struct ebpf_inst inst2 = prog->insts[++i];
+                uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+                if (inst.src == EBPF_PSEUDO_MAP_IDX) {
+                    const struct ubpf_map *map = (const struct ubpf_map *)(uintptr_t)imm;
+                    emit_load_addr(state, dst, UBPF_RELOC_MAP, vm_map_index(prog, map), map);
+                } else {
+                    emit_load_imm(state, dst, imm);
+                }
+                break;
+            }
+
+            default:
+                *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+                return -1;
+            }
+
+            /* Only reached when a conditional jump falls through */
+            if (state->counters && (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP &&
+                    inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_CALL && inst.opcode != EBPF_OP_EXIT) {
+                emit_counter_inc(state, &state->counters->jit_not_taken[i]);
+            }
+
+            if (state->rcx_reg >= 0 && (ubpf_inst_defs(inst) & (1 << state->rcx_reg))) {
+                state->rcx_reg = -1;
+            }
+
+            /* A block that ends without a jump may no longer be followed by its successor */
+            if (last && !ends_block(inst) && state->next_pc != state->fallthrough_pc) {
+                emit_jmp(state, state->fallthrough_pc);
+            }
         }
     }
 
-    /* Epilogue */
+    /* Epilogue, which errors may jump to from within local calls */
     state->exit_loc = state->offset;
+    if (local_calls) {
+        emit_mov(state, R12, RSP);
+    }
 
     /* Move register 0 into rax */
     if (map_register(0) != RAX) {
@@ -429,8 +704,26 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
     }
 
     /* Deallocate stack space */
-    emit_alu64_imm32(state, 0x81, 0, RSP, STACK_SIZE);
+    emit_alu64_imm32(state, 0x81, 0, RSP, frame_size);
+
+    if (batch) {
+        /* Store rax into *results++ and loop until no buffers remain */
+        emit_load(state, S64, RSP, R11, BATCH_RESULTS);
+        emit_store(state, S64, RAX, R11, 0);
+        emit_alu64_imm32(state, 0x81, 0, R11, 8);
+        emit_store(state, S64, R11, RSP, BATCH_RESULTS);
+        emit_load(state, S64, RSP, R11, BATCH_REMAINING);
+        emit_alu64_imm32(state, 0x81, 5, R11, 1);
+        emit_store(state, S64, R11, RSP, BATCH_REMAINING);
+        emit_jcc(state, 0x85, TARGET_PC_BATCH_LOOP);
+
+        state->batch_done_loc = state->offset;
+        emit_alu64_imm32(state, 0x81, 0, RSP, BATCH_FRAME_SIZE);
+    }
 
+    if (local_calls) {
+        emit_pop(state, R12);
+    }
     emit_pop(state, R15);
     emit_pop(state, R14);
     emit_pop(state, R13);
@@ -440,158 +733,1360 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
     emit1(state, 0xc3); /* ret */
 
     /* Division by zero handler */
-    const char *div_by_zero_fmt = "uBPF error: division by zero at PC %u\n";
     state->div_by_zero_loc = state->offset;
-    emit_load_imm(state, RDI, (uintptr_t)stderr);
-    emit_load_imm(state, RSI, (uintptr_t)div_by_zero_fmt);
-    emit_mov(state, RCX, RDX); /* muldivmod stored pc in RCX */
-    emit_call(state, fprintf);
+    emit_load_addr(state, RDI, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+    emit_mov(state, RCX, RSI); /* divmod stored pc in RCX */
+    emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_DIV_BY_ZERO, div_by_zero);
     emit_load_imm(state, map_register(0), -1);
     emit_jmp(state, TARGET_PC_EXIT);
 
+    if (prog->budget_points) {
+        /* Budget exhausted handler, entered with the PC in R10 */
+        state->budget_loc = state->offset;
+        emit_load_addr(state, RDI, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+        emit_mov(state, R10, RSI);
+        emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_BUDGET_EXHAUSTED, budget_exhausted);
+        emit_load_imm(state, map_register(0), (int64_t)UBPF_BUDGET_EXHAUSTED);
+        emit_jmp(state, TARGET_PC_EXIT);
+    }
+
+    if (state->bounds_check) {
+        /* Out of bounds handler, entered with the check info in R10 and the address in R11 */
+        state->bounds_fail_loc = state->offset;
+        emit_load_addr(state, RDI, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+        emit_mov(state, R10, RSI);
+        emit_mov(state, R11, RDX);
+        emit_mov(state, state->frame_reg, RCX);
+        emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_BOUNDS_CHECK_FAILED, bounds_check_failed);
+        emit_load_imm(state, map_register(0), -1);
+        emit_jmp(state, TARGET_PC_EXIT);
+
+        emit_bounds_stubs(prog, state);
+    }
+
+    emit_call_stubs(state);
+
     return 0;
 }
 
+/* Load the shift count for a register shift into CL, unless it is already there */
 static void
-muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm)
+emit_shift_count(struct jit_state *state, int bpf_src)
 {
-    bool mul = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MUL_IMM & EBPF_ALU_OP_MASK);
-    bool div = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK);
-    bool mod = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK);
-    bool is64 = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    if (state->rcx_reg != bpf_src) {
+        emit_mov(state, map_register(bpf_src), RCX);
+        state->rcx_reg = bpf_src;
+    }
+}
 
-    if (div || mod) {
-        emit_load_imm(state, RCX, pc);
+/*
+ * Call a function of the program, which runs on the same native stack with
+ * the same register mapping. Its frame is below the caller's, so r10 moves
+ * down by the caller's frame size around the call. The callee may use any
+ * register, so those of r6 to r9 still needed are saved, and RSP is kept so
+ * that it is 16-byte aligned again once the call pushes the return address.
+ */
+static void
+emit_local_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    uint32_t frame = prog->funcs[ubpf_find_func(prog, pc)].stack_size;
+    int saved[4];
+    int i, n = 0;
 
-        /* test src,src */
-        if (is64) {
-            emit_alu64(state, 0x85, src, src);
-        } else {
-            emit_alu32(state, 0x85, src, src);
+    for (i = 6; i <= 9; i++) {
+        if (state->live_out[pc] & (1 << i)) {
+            saved[n++] = map_register(i);
         }
-
-        /* jz div_by_zero */
-        emit_jcc(state, 0x84, TARGET_PC_DIV_BY_ZERO);
     }
-
-    if (dst != RAX) {
-        emit_push(state, RAX);
+    for (i = 0; i < n; i++) {
+        emit_push(state, saved[i]);
     }
-    if (dst != RDX) {
-        emit_push(state, RDX);
+    if (n % 2 == 0) {
+        emit_alu64_imm32(state, 0x81, 5, RSP, 8);
     }
-    if (imm) {
-        emit_load_imm(state, RCX, imm);
-    } else {
-        emit_mov(state, src, RCX);
+    if (frame) {
+        emit_alu64_imm32(state, 0x81, 5, map_register(10), frame);
     }
 
-    emit_mov(state, dst, RAX);
+    emit_call_pc(state, pc + 1 + prog->insts[pc].imm);
 
-    if (div || mod) {
-        /* xor %edx,%edx */
-        emit_alu32(state, 0x31, RDX, RDX);
+    if (frame) {
+        emit_alu64_imm32(state, 0x81, 0, map_register(10), frame);
     }
-
-    if (is64) {
-        emit_rex(state, 1, 0, 0, 0);
+    if (n % 2 == 0) {
+        emit_alu64_imm32(state, 0x81, 0, RSP, 8);
     }
+    for (i = n - 1; i >= 0; i--) {
+        emit_pop(state, saved[i]);
+    }
+    state->rcx_reg = -1;
+}
 
-    /* mul %ecx or div %ecx */
-    emit_alu32(state, 0xf7, mul ? 4 : 6, RCX);
-
-    if (dst != RDX) {
-        if (mod) {
-            emit_mov(state, RDX, dst);
-        }
-        emit_pop(state, RDX);
+/* If inst is a load or store, return its base register, access size and kind */
+static bool
+mem_access(struct ebpf_inst inst, int *base, int *size, bool *store)
+{
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    if (cls != EBPF_CLS_LDX && cls != EBPF_CLS_ST && cls != EBPF_CLS_STX) {
+        return false;
     }
-    if (dst != RAX) {
-        if (div || mul) {
-            emit_mov(state, RAX, dst);
-        }
-        emit_pop(state, RAX);
+
+    switch (inst.opcode & 0x18) {
+    case EBPF_SIZE_B: *size = 1; break;
+    case EBPF_SIZE_H: *size = 2; break;
+    case EBPF_SIZE_W: *size = 4; break;
+    default: *size = 8; break;
     }
+
+    *store = cls != EBPF_CLS_LDX;
+    *base = *store ? inst.dst : inst.src;
+    return true;
 }
 
-static void
-resolve_jumps(struct jit_state *state)
+/*
+ * Find the accesses through bpf_base that can share the check for the access
+ * at 'pc': those later in the same basic block, up to anything that redefines
+ * bpf_base or could stop the program or have visible effects before them.
+ * A store ends the group but is part of it. Returns the last PC in the group
+ * and the union of the accessed offsets in lo and hi.
+ */
+static uint16_t
+find_check_group(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, int bpf_base, int32_t *lo, int32_t *hi)
 {
+    uint16_t last = pc;
     int i;
-    for (i = 0; i < state->num_jumps; i++) {
-        struct jump jump = state->jumps[i];
 
-        int target_loc;
-        if (jump.target_pc == TARGET_PC_EXIT) {
-            target_loc = state->exit_loc;
-        } else if (jump.target_pc == TARGET_PC_DIV_BY_ZERO) {
-            target_loc = state->div_by_zero_loc;
-        } else {
-            target_loc = state->pc_locs[jump.target_pc];
+    for (i = pc; i < prog->num_insts; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        int base, size;
+        bool store;
+
+        if (i > pc && state->leaders[i]) {
+            break;
         }
 
-        /* Assumes jump offset is at end of instruction */
-        uint32_t rel = target_loc - (jump.offset_loc + sizeof(uint32_t));
+        if (mem_access(inst, &base, &size, &store)) {
+            if (base == bpf_base && !prog->safe_accesses[i]) {
+                *lo = inst.offset < *lo ? inst.offset : *lo;
+                *hi = inst.offset + size > *hi ? inst.offset + size : *hi;
+                last = i;
+            }
+            if (store) {
+                break;
+            }
+        }
 
-        uint8_t *offset_ptr = &state->buf[jump.offset_loc];
-        memcpy(offset_ptr, &rel, sizeof(uint32_t));
+        int cls = inst.opcode & EBPF_CLS_MASK;
+        int op = inst.opcode & EBPF_ALU_OP_MASK;
+        if (cls == EBPF_CLS_JMP) {
+            break;
+        }
+        if ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) && (inst.opcode & EBPF_SRC_REG) &&
+                (op == (EBPF_OP_DIV_REG & EBPF_ALU_OP_MASK) || op == (EBPF_OP_MOD_REG & EBPF_ALU_OP_MASK))) {
+            break;
+        }
+        if (ubpf_inst_defs(inst) & (1 << bpf_base)) {
+            break;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        }
     }
+
+    return last;
 }
 
-ubpf_jit_fn
-ubpf_compile(struct ubpf_vm *vm, char **errmsg)
+/* Patch a forward rel8 jump at 'loc' to land at the current offset */
+static void
+patch_rel8(struct jit_state *state, uint32_t loc)
 {
-    void *jitted = NULL;
-    size_t jitted_size;
-    struct jit_state state;
+    uint8_t rel = state->offset - (loc + 1);
+    patch_bytes(state, loc, &rel, sizeof(rel));
+}
+
+/*
+ * Emit a check that [base + offset, base + offset + span) lies within mem or
+ * the stack. Execution falls through if it does, otherwise it takes a rel32
+ * jump whose offset location is returned for the caller to patch.
+ */
+static uint32_t
+emit_range_check(struct jit_state *state, int base, int32_t offset, int32_t span)
+{
+    uint32_t stack_loc = 0;
+    uint32_t ok_loc;
+    uint32_t fail_loc;
 
-    if (vm->jitted) {
-        return vm->jitted;
+    /* addr - mem < mem_len - span + 1, as an unsigned comparison */
+    emit_lea(state, base, R11, offset);
+    emit_alu64_mem(state, 0x2b, R11, state->frame_reg, BOUNDS_MEM);
+    if (span == 1 || span == 2 || span == 4 || span == 8) {
+        emit_alu64_mem(state, 0x3b, R11, state->frame_reg, BOUNDS_LIMIT(__builtin_ctz(span)));
+    } else {
+        emit_load(state, S64, state->frame_reg, R10, BOUNDS_MEM_LEN);
+        emit_alu64_imm32(state, 0x81, 5, R10, span - 1);
+        /* jb stack */
+        emit1(state, 0x72);
+        stack_loc = state->offset;
+        emit1(state, 0);
+        emit_cmp(state, R10, R11);
     }
+    /* jb ok */
+    emit1(state, 0x72);
+    ok_loc = state->offset;
+    emit1(state, 0);
 
-    *errmsg = NULL;
+    if (stack_loc) {
+        patch_rel8(state, stack_loc);
+    }
 
-    if (!vm->insts) {
-        *errmsg = ubpf_error("code has not been loaded into this VM");
-        return NULL;
+    if (span <= (int32_t)state->stack_size) {
+        /* addr - stack <= stack_size - span, as an unsigned comparison */
+        emit_lea(state, base, R11, offset);
+        emit_alu64_mem(state, 0x2b, R11, state->frame_reg, BOUNDS_STACK);
+        emit_cmp_imm32(state, R11, state->stack_size - span);
+        /* ja fail */
+        emit1(state, 0x0f);
+        emit1(state, 0x87);
+    } else {
+        /* jmp fail */
+        emit1(state, 0xe9);
     }
+    fail_loc = state->offset;
+    emit4(state, 0);
 
-    state.offset = 0;
-    state.size = 65536;
-    state.buf = calloc(state.size, 1);
-    state.pc_locs = calloc(MAX_INSTS+1, sizeof(state.pc_locs[0]));
-    state.jumps = calloc(MAX_INSTS, sizeof(state.jumps[0]));
-    state.num_jumps = 0;
+    patch_rel8(state, ok_loc);
+    return fail_loc;
+}
 
-    if (translate(vm, &state, errmsg) < 0) {
-        goto out;
-    }
+/*
+ * Check that the access at 'pc' through eBPF register bpf_base lies within
+ * mem or the stack. Accesses ubpf_analyze_ranges proved safe need none. One
+ * check covers the union of the accesses grouped by find_check_group, and the
+ * later members need none of their own. Since mem and the stack are each
+ * contiguous, the union passing means every member does; if it fails, a cold
+ * stub checks the members one by one so the error names the same access as
+ * the interpreter would.
+ */
+static void
+emit_bounds_check(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, int bpf_base, int16_t offset, enum operand_size size)
+{
+    struct checked_range *checked = &state->checked[bpf_base];
+    int32_t lo = offset;
+    int32_t hi = offset + (1 << size);
 
-    resolve_jumps(&state);
+    if (!state->bounds_check || prog->safe_accesses[pc]) {
+        return;
+    }
 
-    jitted_size = state.offset;
-    jitted = mmap(0, jitted_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (jitted == MAP_FAILED) {
-        *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
-        goto out;
+    if (pc <= checked->end_pc && lo >= checked->lo && hi <= checked->hi) {
+        return;
     }
 
-    memcpy(jitted, state.buf, jitted_size);
+    struct bounds_stub *stub = &state->bounds_stubs[state->num_bounds_stubs++];
+    stub->pc = pc;
+    stub->end_pc = find_check_group(prog, state, pc, bpf_base, &lo, &hi);
+    stub->base = bpf_base;
+    stub->jump_loc = emit_range_check(state, map_register(bpf_base), lo, hi - lo);
+    stub->resume_loc = state->offset;
 
-    if (mprotect(jitted, jitted_size, PROT_READ | PROT_EXEC) < 0) {
-        *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
-        goto out;
-    }
+    checked->lo = lo;
+    checked->hi = hi;
+    checked->end_pc = stub->end_pc;
+}
 
-    vm->jitted = jitted;
-    vm->jitted_size = jitted_size;
+/* Load the failure info for the access at 'pc' and jump to the common handler */
+static void
+emit_bounds_fail(struct jit_state *state, struct ebpf_inst inst, uint16_t pc)
+{
+    int base = 0, size = 0;
+    bool store = false;
+    mem_access(inst, &base, &size, &store);
+
+    emit_lea(state, map_register(base), R11, inst.offset);
+    emit_alu32_imm32(state, 0xc7, 0, R10, pc | (size << 16) | (store << 24));
+    /* jmp bounds_fail */
+    emit1(state, 0xe9);
+    emit4(state, state->bounds_fail_loc - (state->offset + sizeof(uint32_t)));
+}
+
+/*
+ * Turn the offset in R11 from the start of a map's storage into the offset
+ * from the start of the value in the same slot, which is past the end of
+ * the value, as an unsigned number, for an offset into the state word or
+ * key of a hash slot. Clobbers R10.
+ */
+static void
+emit_value_offset(struct jit_state *state, const struct ubpf_map *map)
+{
+    if (!(map->stride & (map->stride - 1))) {
+        /* and r11, stride - 1 */
+        emit_alu64_imm32(state, 0x81, 4, R11, map->stride - 1);
+    } else {
+        /* div clobbers RAX and RDX */
+        emit_push(state, RAX);
+        emit_push(state, RDX);
+        emit_mov(state, R11, RAX);
+        emit_alu32(state, 0x31, RDX, RDX);
+        emit_load_imm(state, R10, map->stride);
+        /* div r10 */
+        emit_alu64(state, 0xf7, 6, R10);
+        emit_mov(state, RDX, R11);
+        emit_pop(state, RDX);
+        emit_pop(state, RAX);
+    }
+    if (map->value_offset) {
+        /* sub r11, value_offset */
+        emit_alu64_imm32(state, 0x81, 5, R11, map->value_offset);
+    }
+}
+
+/*
+ * Emit checks that the access 'inst' lies within a value of a map the
+ * program refers to. Each takes a rel32 jump if it does, whose offset
+ * location is stored in 'ok_locs' for the caller to patch. Returns how many.
+ */
+static int
+emit_map_checks(const struct ubpf_prog *prog, struct jit_state *state, struct ebpf_inst inst, uint32_t *ok_locs)
+{
+    int base = 0, size = 0;
+    bool store = false;
+    int i, n = 0;
+    mem_access(inst, &base, &size, &store);
+
+    for (i = 0; i < prog->num_maps; i++) {
+        const struct ubpf_map *map = prog->maps[i];
+        if (map->value_size < size) {
+            continue;
+        }
+
+        /* addr - storage <= storage_size - size, as an unsigned comparison */
+        emit_lea(state, map_register(base), R11, inst.offset);
+        emit_load_addr(state, R10, UBPF_RELOC_MAP_STORAGE, vm_map_index(prog, map), map->storage);
+        emit_alu64(state, 0x29, R10, R11);
+        emit_load_imm(state, R10, map->storage_size - size);
+        emit_cmp(state, R10, R11);
+        /* ja next */
+        emit1(state, 0x77);
+        uint32_t next_loc = state->offset;
+        emit1(state, 0);
+
+        /* and then within the value of its slot */
+        emit_value_offset(state, map);
+        emit_cmp_imm32(state, R11, map->value_size - size);
+        /* jbe ok */
+        emit1(state, 0x0f);
+        emit1(state, 0x86);
+        ok_locs[n++] = state->offset;
+        emit4(state, 0);
+        patch_rel8(state, next_loc);
+    }
+
+    return n;
+}
+
+static void
+patch_rel32(struct jit_state *state, uint32_t loc)
+{
+    uint32_t rel = state->offset - (loc + sizeof(uint32_t));
+    patch_bytes(state, loc, &rel, sizeof(rel));
+}
+
+/*
+ * Emit the cold paths taken when a grouped bounds check fails. Accesses
+ * outside mem and the stack may still be within a map, which is left to
+ * the stubs so the inline checks stay the same.
+ */
+static void
+emit_bounds_stubs(const struct ubpf_prog *prog, struct jit_state *state)
+{
+    uint32_t ok_locs[MAX_MAPS];
+    int i, j, k, n;
+    for (i = 0; i < state->num_bounds_stubs; i++) {
+        struct bounds_stub *stub = &state->bounds_stubs[i];
+        patch_rel32(state, stub->jump_loc);
+
+        if (stub->end_pc == stub->pc) {
+            n = emit_map_checks(prog, state, prog->insts[stub->pc], ok_locs);
+            emit_bounds_fail(state, prog->insts[stub->pc], ubpf_orig_pc(prog, stub->pc));
+            if (n == 0) {
+                continue;
+            }
+            for (k = 0; k < n; k++) {
+                patch_rel32(state, ok_locs[k]);
+            }
+            emit1(state, 0xe9);
+            emit4(state, stub->resume_loc - (state->offset + sizeof(uint32_t)));
+            continue;
+        }
+
+        /* Recheck each member in program order and report the first failure */
+        for (j = stub->pc; j <= stub->end_pc; j++) {
+            struct ebpf_inst inst = prog->insts[j];
+            int base, size;
+            bool store;
+
+            if (!mem_access(inst, &base, &size, &store) || base != stub->base ||
+                    prog->safe_accesses[j]) {
+                continue;
+            }
+
+            uint32_t fail_loc = emit_range_check(state, map_register(base), inst.offset, size);
+            /* jmp next */
+            emit1(state, 0xe9);
+            uint32_t next_loc = state->offset;
+            emit4(state, 0);
+
+            patch_rel32(state, fail_loc);
+            n = emit_map_checks(prog, state, inst, ok_locs);
+            emit_bounds_fail(state, inst, ubpf_orig_pc(prog, j));
+
+            patch_rel32(state, next_loc);
+            for (k = 0; k < n; k++) {
+                patch_rel32(state, ok_locs[k]);
+            }
+        }
+
+        /* Every member is in bounds after all, so carry on */
+        emit1(state, 0xe9);
+        emit4(state, stub->resume_loc - (state->offset + sizeof(uint32_t)));
+    }
+}
+
+/*
+ * Emit checks of the memory a helper from ubpf_simd.c reads through its
+ * pointer arguments, unless ubpf_analyze_ranges proved it in bounds. The
+ * lengths are only known at runtime, so each range is compared with what
+ * is left of mem, the stack and the values of each map the program refers
+ * to past its start. Empty ranges pass.
+ */
+static void
+emit_mem_arg_checks(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    const struct ubpf_ext_func_info *info = &prog->vm->ext_func_info[prog->insts[pc].imm];
+    uint32_t ok_locs[3 + MAX_MAPS];
+    uint32_t next_loc;
+    int i, j, k, n;
+
+    if (!state->bounds_check || prog->safe_accesses[pc]) {
+        return;
+    }
+
+    for (i = 0; i < UBPF_MAX_MEM_ARGS && info->mem_args[i][0]; i++) {
+        int ptr = map_register(info->mem_args[i][0]);
+        int len = map_register(info->mem_args[i][1]);
+        n = 0;
+
+        /* test len, len; jz ok */
+        emit_alu64(state, 0x85, len, len);
+        emit1(state, 0x0f);
+        emit1(state, 0x84);
+        ok_locs[n++] = state->offset;
+        emit4(state, 0);
+
+        /* ptr - base <= size && len <= size - (ptr - base), as unsigned comparisons */
+        for (j = -2; j < prog->num_maps; j++) {
+            emit_mov(state, ptr, R11);
+            if (j == -2) {
+                emit_alu64_mem(state, 0x2b, R11, state->frame_reg, BOUNDS_MEM);
+                emit_load(state, S64, state->frame_reg, R10, BOUNDS_MEM_LEN);
+            } else if (j == -1) {
+                emit_alu64_mem(state, 0x2b, R11, state->frame_reg, BOUNDS_STACK);
+                emit_load_imm(state, R10, state->stack_size);
+            } else {
+                /* For a map, the base and size are those of the value in the slot ptr is in */
+                const struct ubpf_map *map = prog->maps[j];
+                emit_load_addr(state, R10, UBPF_RELOC_MAP_STORAGE, vm_map_index(prog, map), map->storage);
+                emit_alu64(state, 0x29, R10, R11);
+                emit_load_imm(state, R10, map->storage_size);
+                emit_cmp(state, R10, R11);
+                /* jae next */
+                emit1(state, 0x73);
+                next_loc = state->offset;
+                emit1(state, 0);
+                emit_value_offset(state, map);
+                emit_load_imm(state, R10, map->value_size);
+                emit_cmp(state, R10, R11);
+                /* ja next */
+                emit1(state, 0x77);
+                uint32_t past_loc = state->offset;
+                emit1(state, 0);
+                emit_alu64(state, 0x29, R11, R10);
+                emit_cmp(state, R10, len);
+                /* jbe ok */
+                emit1(state, 0x0f);
+                emit1(state, 0x86);
+                ok_locs[n++] = state->offset;
+                emit4(state, 0);
+                patch_rel8(state, next_loc);
+                patch_rel8(state, past_loc);
+                continue;
+            }
+            emit_cmp(state, R10, R11);
+            /* ja next */
+            emit1(state, 0x77);
+            next_loc = state->offset;
+            emit1(state, 0);
+            emit_alu64(state, 0x29, R11, R10);
+            emit_cmp(state, R10, len);
+            /* jbe ok */
+            emit1(state, 0x0f);
+            emit1(state, 0x86);
+            ok_locs[n++] = state->offset;
+            emit4(state, 0);
+            patch_rel8(state, next_loc);
+        }
+
+        emit_mov(state, ptr, R11);
+        emit_mov(state, len, R10);
+        emit_mov(state, R11, RDX);
+        emit_mov(state, R10, RCX);
+        emit_load_imm(state, RSI, ubpf_orig_pc(prog, pc) | (info->mem_args[i][0] << 16));
+        emit_load_addr(state, RDI, UBPF_RELOC_INTERNAL, INTERNAL_PROG, prog);
+        emit_mov(state, state->frame_reg, R8);
+        emit_call(state, UBPF_RELOC_INTERNAL, INTERNAL_MEM_ARG_CHECK_FAILED, mem_arg_check_failed);
+        emit_load_imm(state, map_register(0), -1);
+        emit_jmp(state, TARGET_PC_EXIT);
+
+        for (k = 0; k < n; k++) {
+            patch_rel32(state, ok_locs[k]);
+        }
+    }
+}
+
+/* The index the map is registered with, by which relocations refer to it */
+static int
+vm_map_index(const struct ubpf_prog *prog, const struct ubpf_map *map)
+{
+    int i;
+    for (i = 0; i < MAX_MAPS && prog->vm->maps[i] != map; i++);
+    return i;
+}
+
+/*
+ * The map that r1 points to at the call at 'pc', if it was loaded in the
+ * same basic block, directly or through moves, or NULL.
+ */
+static const struct ubpf_map *
+known_map_arg(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    int reg = 1;
+    int i = pc;
+
+    while (i > 0 && !state->leaders[i]) {
+        i--;
+        if (i > 0 && prog->insts[i].opcode == 0 && prog->insts[i-1].opcode == EBPF_OP_LDDW) {
+            i--;
+        }
+
+        struct ebpf_inst inst = prog->insts[i];
+        if (ends_block(inst)) {
+            return NULL;
+        }
+        if (!(ubpf_inst_defs(inst) & (1 << reg))) {
+            continue;
+        }
+
+        if (inst.opcode == EBPF_OP_MOV64_REG) {
+            reg = inst.src;
+        } else if (inst.opcode == EBPF_OP_LDDW && inst.src == EBPF_PSEUDO_MAP_IDX) {
+            uintptr_t addr = (uint32_t)inst.imm | ((uint64_t)prog->insts[i+1].imm << 32);
+            int j;
+            for (j = 0; j < prog->num_maps; j++) {
+                if ((uintptr_t)prog->maps[j] == addr) {
+                    return prog->maps[j];
+                }
+            }
+            return NULL;
+        } else {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Replace a call to ubpf_map_lookup on a known array map with the lookup
+ * itself: r0 = *(uint32_t *)r2 < max_entries ? values + key * stride : 0.
+ * The clobbered argument registers are left as they are.
+ */
+static bool
+emit_inline_call(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    struct ebpf_inst inst = prog->insts[pc];
+    if (prog->vm->ext_funcs[inst.imm] != (ext_func)ubpf_map_lookup) {
+        return false;
+    }
+
+    const struct ubpf_map *map = known_map_arg(prog, state, pc);
+    if (!map || map->type != UBPF_MAP_TYPE_ARRAY ||
+            map->max_entries > INT32_MAX || map->stride > INT32_MAX) {
+        return false;
+    }
+
+    int r0 = map_register(0);
+    emit_load(state, S32, map_register(2), r0, 0);
+    emit_cmp_imm32(state, r0, map->max_entries);
+    /* jae null */
+    emit1(state, 0x73);
+    uint32_t null_loc = state->offset;
+    emit1(state, 0);
+    emit_imul_imm32(state, 1, r0, map->stride);
+    emit_load_addr(state, R11, UBPF_RELOC_MAP_STORAGE, vm_map_index(prog, map), map->storage);
+    emit_alu64(state, 0x01, R11, r0);
+    /* jmp done */
+    emit1(state, 0xeb);
+    uint32_t done_loc = state->offset;
+    emit1(state, 0);
+    patch_rel8(state, null_loc);
+    emit_alu32(state, 0x31, r0, r0);
+    patch_rel8(state, done_loc);
+    return true;
+}
+
+/* Emit a binary search of the sorted keys in [lo, hi) of a sparse case table */
+static void
+emit_switch_search(struct jit_state *state, const struct ubpf_switch *sw, int dst, uint32_t lo, uint32_t hi)
+{
+    while (hi - lo > 4) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        emit_cmp_imm32(state, dst, sw->keys[mid]);
+        emit_jcc(state, 0x84, sw->targets[mid]);
+
+        /* ja over the lower half */
+        emit1(state, 0x0f);
+        emit1(state, 0x87);
+        uint32_t upper_loc = state->offset;
+        emit4(state, 0);
+        emit_switch_search(state, sw, dst, lo, mid);
+        patch_rel32(state, upper_loc);
+        lo = mid + 1;
+    }
+
+    for (; lo < hi; lo++) {
+        emit_cmp_imm32(state, dst, sw->keys[lo]);
+        emit_jcc(state, 0x84, sw->targets[lo]);
+    }
+    emit_jmp(state, sw->default_pc);
+}
+
+/*
+ * Emit a jswitch. Dense case tables become an indirect jump through a
+ * table of rel32 offsets, each from the end of its own entry, which follows
+ * the jump.
+ */
+static void
+emit_switch(const struct ubpf_prog *prog, struct jit_state *state, struct ebpf_inst inst)
+{
+    const struct ubpf_switch *sw = &prog->switches[inst.imm];
+    int dst = map_register(inst.dst);
+    uint32_t i;
+
+    if (!sw->dense) {
+        emit_switch_search(state, sw, dst, 0, sw->num_entries);
+        return;
+    }
+
+    /* The keys are sign-extended immediates, so min fits one too */
+    emit_mov(state, dst, R10);
+    emit_alu64_imm32(state, 0x81, 5, R10, sw->min);
+    emit_cmp_imm32(state, R10, sw->num_entries - 1);
+    emit_jcc(state, 0x87, sw->default_pc);
+
+    /* lea table(%rip), %r11 */
+    emit1(state, 0x4c);
+    emit1(state, 0x8d);
+    emit1(state, 0x1d);
+    uint32_t table_loc = state->offset;
+    emit4(state, 0);
+
+    /* lea (%r11,%r10,4), %r11; movslq (%r11), %r10; lea 4(%r11,%r10), %r11; jmp *%r11 */
+    static const uint8_t dispatch[] = {
+        0x4f, 0x8d, 0x1c, 0x93,
+        0x4d, 0x63, 0x13,
+        0x4f, 0x8d, 0x5c, 0x13, 0x04,
+        0x41, 0xff, 0xe3,
+    };
+    emit_bytes(state, (void *)dispatch, sizeof(dispatch));
+    patch_rel32(state, table_loc);
+
+    for (i = 0; i < sw->num_entries; i++) {
+        emit_jump_offset(state, state->offset, sw->targets[i], false);
+    }
+}
+
+static void
+div_by_zero(const struct ubpf_prog *prog, uint64_t pc)
+{
+    ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, pc);
+}
+
+static void
+budget_exhausted(const struct ubpf_prog *prog, uint64_t pc)
+{
+    ubpf_report_error_at(prog->vm, UBPF_ERROR_BUDGET, pc);
+}
+
+/* Take one from the budget, leaving the PC in R10 for the handler if it was used up */
+static void
+emit_budget_check(struct jit_state *state, uint16_t pc)
+{
+    emit_alu32_imm32(state, 0xc7, 0, R10, pc);
+    /* sub qword [frame_reg + budget_slot], 1 */
+    emit_alu64_mem(state, 0x83, 5, state->frame_reg, state->budget_slot);
+    emit1(state, 1);
+    emit_jcc(state, 0x82, TARGET_PC_BUDGET);
+}
+
+/* Read what the program may access from the bounds check slots at 'frame' */
+static void
+frame_bounds(const struct ubpf_prog *prog, const uint8_t *frame, struct ubpf_runtime_error *error)
+{
+    memcpy(&error->mem, frame + BOUNDS_MEM, sizeof(error->mem));
+    memcpy(&error->mem_len, frame + BOUNDS_MEM_LEN, sizeof(error->mem_len));
+    memcpy(&error->stack, frame + BOUNDS_STACK, sizeof(error->stack));
+    error->stack_size = prog->stack_size;
+}
+
+/* Report a failed inline bounds check the same way the interpreter does */
+static void
+bounds_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, const uint8_t *frame)
+{
+    struct ubpf_runtime_error error = {
+        .kind = UBPF_ERROR_OUT_OF_BOUNDS, .pc = info & 0xffff, .addr = addr, .size = (info >> 16) & 0xff,
+        .store = (info >> 24) & 1,
+    };
+    frame_bounds(prog, frame, &error);
+    ubpf_report_error(prog->vm, &error);
+}
+
+static void
+mem_arg_check_failed(const struct ubpf_prog *prog, uint64_t info, void *addr, uint64_t size, const uint8_t *frame)
+{
+    struct ubpf_runtime_error error = {
+        .kind = UBPF_ERROR_MEM_ARG, .pc = info & 0xffff, .addr = addr, .size = size, .reg = (info >> 16) & 0xff,
+    };
+    frame_bounds(prog, frame, &error);
+    ubpf_report_error(prog->vm, &error);
+}
+
+static void
+divmod(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm)
+{
+    bool div = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK);
+    bool mod = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK);
+    bool is64 = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool reg = opcode & EBPF_SRC_REG;
+
+    /* div clobbers RAX and RDX; only preserve them if the value is still needed */
+    bool save_rax = dst != RAX && x86_reg_live_out(state, pc, RAX);
+    bool save_rdx = dst != RDX && x86_reg_live_out(state, pc, RDX);
+
+    state->rcx_reg = -1;
+
+    if (reg) {
+        emit_load_imm(state, RCX, ubpf_orig_pc(prog, pc));
+
+        /* test src,src */
+        if (is64) {
+            emit_alu64(state, 0x85, src, src);
+        } else {
+            emit_alu32(state, 0x85, src, src);
+        }
+
+        /* jz div_by_zero */
+        emit_jcc(state, 0x84, TARGET_PC_DIV_BY_ZERO);
+    }
+
+    if (save_rax) {
+        emit_push(state, RAX);
+    }
+    if (save_rdx) {
+        emit_push(state, RDX);
+    }
+    if (reg) {
+        emit_mov(state, src, RCX);
+    } else {
+        emit_load_imm(state, RCX, imm);
+    }
+
+    emit_mov(state, dst, RAX);
+
+    /* xor %edx,%edx */
+    emit_alu32(state, 0x31, RDX, RDX);
+
+    if (is64) {
+        emit_rex(state, 1, 0, 0, 0);
+    }
+
+    /* div %ecx */
+    emit_alu32(state, 0xf7, 6, RCX);
+
+    if (dst != RDX) {
+        if (mod) {
+            emit_mov(state, RDX, dst);
+        }
+        if (save_rdx) {
+            emit_pop(state, RDX);
+        }
+    }
+    if (dst != RAX) {
+        if (div) {
+            emit_mov(state, RAX, dst);
+        }
+        if (save_rax) {
+            emit_pop(state, RAX);
+        }
+    }
+}
+
+static uint32_t
+jump_target_loc(struct jit_state *state, int32_t target_pc)
+{
+    if (target_pc == TARGET_PC_EXIT) {
+        return state->exit_loc;
+    } else if (target_pc == TARGET_PC_DIV_BY_ZERO) {
+        return state->div_by_zero_loc;
+    } else if (target_pc == TARGET_PC_BATCH_LOOP) {
+        return state->batch_loop_loc;
+    } else if (target_pc == TARGET_PC_BATCH_DONE) {
+        return state->batch_done_loc;
+    } else if (target_pc == TARGET_PC_BUDGET) {
+        return state->budget_loc;
+    } else {
+        return state->pc_locs[target_pc];
+    }
+}
+
+static void
+resolve_jumps(struct jit_state *state)
+{
+    int i;
+    for (i = 0; i < state->num_jumps; i++) {
+        struct jump jump = state->jumps[i];
+        uint32_t target_loc = jump_target_loc(state, jump.target_pc);
+
+        /* Assumes jump offset is at end of instruction */
+        if (jump.rel8) {
+            int32_t rel = target_loc - (jump.offset_loc + sizeof(uint8_t));
+            assert(rel >= INT8_MIN && rel <= INT8_MAX);
+            int8_t rel8 = rel;
+            patch_bytes(state, jump.offset_loc, &rel8, sizeof(rel8));
+        } else {
+            uint32_t rel = target_loc - (jump.offset_loc + sizeof(uint32_t));
+            patch_bytes(state, jump.offset_loc, &rel, sizeof(uint32_t));
+        }
+    }
+}
+
+/*
+ * Mark the jumps of a translation that would fit a rel8 offset, for the
+ * next translation to emit them so. Nothing else changes between the two,
+ * and a jump never gets longer, so no distance grows and a jump that fits
+ * now still fits then. Returns the number of jumps marked.
+ */
+static int
+find_short_jumps(struct jit_state *state)
+{
+    int count = 0;
+    int i;
+
+    state->short_jumps = calloc(state->num_jumps, sizeof(state->short_jumps[0]));
+    if (!state->short_jumps) {
+        return 0;
+    }
+    state->num_short_jumps = state->num_jumps;
+
+    for (i = 0; i < state->num_jumps; i++) {
+        struct jump jump = state->jumps[i];
+        int64_t rel = (int64_t)jump_target_loc(state, jump.target_pc) - (jump.inst_loc + 2);
+        if (!jump.call && rel >= INT8_MIN && rel <= INT8_MAX) {
+            state->short_jumps[i] = 1;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* Whether the CPU has the instructions the inline code for an intrinsic uses */
+static bool
+cpu_has_intrinsic(enum ubpf_intrinsic intrinsic)
+{
+    switch (intrinsic) {
+    case UBPF_INTRINSIC_POPCNT:
+        return __builtin_cpu_supports("popcnt");
+    case UBPF_INTRINSIC_CRC32C_U8:
+    case UBPF_INTRINSIC_CRC32C_U32:
+    case UBPF_INTRINSIC_CRC32C_U64:
+        return __builtin_cpu_supports("sse4.2");
+    default:
+        return true;
+    }
+}
+
+/* Emit an SSE instruction between xmm0 and 'reg', where 'prefix' is its mandatory prefix */
+static void
+emit_sse(struct jit_state *state, uint8_t prefix, int w, uint8_t opcode, int reg)
+{
+    emit1(state, prefix);
+    emit_basic_rex(state, w, 0, reg);
+    emit1(state, 0x0f);
+    emit1(state, opcode);
+    emit_modrm_reg2reg(state, 0, reg);
+}
+
+/*
+ * The intrinsics compute r0 from r1 and r2 without calling out. They leave
+ * r1 to r5 alone, which the call was free to clobber, and use xmm0 and R11
+ * as scratch registers.
+ */
+static bool
+emit_intrinsic(const struct ubpf_prog *prog, struct jit_state *state, uint16_t pc)
+{
+    const struct ubpf_ext_func_info *info = &prog->vm->ext_func_info[prog->insts[pc].imm];
+    int r0 = map_register(0), r1 = map_register(1), r2 = map_register(2);
+
+    if (!info->intrinsic || !cpu_has_intrinsic(info->intrinsic - 1)) {
+        return false;
+    }
+
+    switch (info->intrinsic - 1) {
+    case UBPF_INTRINSIC_BSWAP16:
+        /* bswap, then shift the swapped low half down */
+        emit_alu32(state, 0x89, r1, r0);
+        emit_basic_rex(state, 0, 0, r0);
+        emit1(state, 0x0f);
+        emit1(state, 0xc8 | (r0 & 7));
+        emit_alu32_imm8(state, 0xc1, 5, r0, 16);
+        break;
+    case UBPF_INTRINSIC_BSWAP32:
+    case UBPF_INTRINSIC_BSWAP64: {
+        int w = info->intrinsic - 1 == UBPF_INTRINSIC_BSWAP64;
+        if (w) {
+            emit_mov(state, r1, r0);
+        } else {
+            emit_alu32(state, 0x89, r1, r0);
+        }
+        emit_basic_rex(state, w, 0, r0);
+        emit1(state, 0x0f);
+        emit1(state, 0xc8 | (r0 & 7));
+        break;
+    }
+    case UBPF_INTRINSIC_POPCNT:
+        emit1(state, 0xf3);
+        emit_basic_rex(state, 1, r0, r1);
+        emit1(state, 0x0f);
+        emit1(state, 0xb8);
+        emit_modrm_reg2reg(state, r0, r1);
+        break;
+    case UBPF_INTRINSIC_CRC32C_U8:
+    case UBPF_INTRINSIC_CRC32C_U32:
+    case UBPF_INTRINSIC_CRC32C_U64: {
+        int size = info->intrinsic - 1;
+        /* crc32 r0d, r2 of the operand size, with the CRC in the low 32 bits of r0 */
+        emit_alu32(state, 0x89, r1, r0);
+        emit1(state, 0xf2);
+        if (size == UBPF_INTRINSIC_CRC32C_U8) {
+            /* Always a REX prefix, so the low byte of RSI or RDI rather than DH or BH */
+            emit_rex(state, 0, !!(r0 & 8), 0, !!(r2 & 8));
+        } else {
+            emit_basic_rex(state, size == UBPF_INTRINSIC_CRC32C_U64, r0, r2);
+        }
+        emit1(state, 0x0f);
+        emit1(state, 0x38);
+        emit1(state, size == UBPF_INTRINSIC_CRC32C_U8 ? 0xf0 : 0xf1);
+        emit_modrm_reg2reg(state, r0, r2);
+        break;
+    }
+    case UBPF_INTRINSIC_SQRT_U32:
+        /* cvtsi2sd of the zero-extended value, sqrtsd, cvttsd2si */
+        emit_alu32(state, 0x89, r1, R11);
+        emit_sse(state, 0xf2, 1, 0x2a, R11);
+        emit_sse(state, 0xf2, 0, 0x51, 0);
+        emit1(state, 0xf2);
+        emit_basic_rex(state, 1, r0, 0);
+        emit1(state, 0x0f);
+        emit1(state, 0x2c);
+        emit_modrm_reg2reg(state, r0, 0);
+        break;
+    case UBPF_INTRINSIC_SQRT_F64:
+        /* movq xmm0, r1; sqrtsd; movq r0, xmm0 */
+        emit_sse(state, 0x66, 1, 0x6e, r1);
+        emit_sse(state, 0xf2, 0, 0x51, 0);
+        emit_sse(state, 0x66, 1, 0x7e, r0);
+        break;
+    }
+    return true;
+}
+
+/* The address a relocation refers to in this process, or NULL if there is none */
+static void *
+reloc_target(const struct ubpf_prog *prog, const struct ubpf_reloc *reloc)
+{
+    const struct ubpf_vm *vm = prog->vm;
+
+    switch (reloc->kind) {
+    case UBPF_RELOC_HELPER:
+        return reloc->index < vm->num_ext_funcs ? (void *)vm->ext_funcs[reloc->index] : NULL;
+    case UBPF_RELOC_MAP:
+        return reloc->index < MAX_MAPS ? vm->maps[reloc->index] : NULL;
+    case UBPF_RELOC_MAP_STORAGE:
+        return reloc->index < MAX_MAPS && vm->maps[reloc->index] ? vm->maps[reloc->index]->storage : NULL;
+    case UBPF_RELOC_INTERNAL:
+        switch (reloc->index) {
+        case INTERNAL_PROG:
+            return (void *)prog;
+        case INTERNAL_DIV_BY_ZERO:
+            return div_by_zero;
+        case INTERNAL_BOUNDS_CHECK_FAILED:
+            return bounds_check_failed;
+        case INTERNAL_MEM_ARG_CHECK_FAILED:
+            return mem_arg_check_failed;
+        case INTERNAL_BUDGET_EXHAUSTED:
+            return budget_exhausted;
+        }
+    }
+    return NULL;
+}
+
+/* The most frequently called target, which the code should be placed near */
+static void *
+hot_call_target(const struct ubpf_prog *prog, const struct ubpf_jit_image *image)
+{
+    void *target = NULL;
+    int best = 0;
+    uint32_t i, j;
+
+    for (i = 0; i < image->num_relocs; i++) {
+        const struct ubpf_reloc *reloc = &image->relocs[i];
+        int count = 0;
+        if (!reloc->call) {
+            continue;
+        }
+        for (j = 0; j < image->num_relocs; j++) {
+            count += image->relocs[j].call && image->relocs[j].kind == reloc->kind &&
+                image->relocs[j].index == reloc->index;
+        }
+        if (count > best) {
+            best = count;
+            target = reloc_target(prog, reloc);
+        }
+    }
+
+    return target;
+}
+
+/*
+ * Fill in the absolute addresses of an image and copy it to executable
+ * memory, pointing each call directly at its target if reachable from
+ * there, else at its stub. The image may come from another process, so
+ * every relocation is checked first.
+ */
+static void *
+place(const struct ubpf_prog *prog, struct ubpf_jit_image *image, char **errmsg)
+{
+    uint32_t i;
+
+    for (i = 0; i < image->num_relocs; i++) {
+        const struct ubpf_reloc *reloc = &image->relocs[i];
+        uint64_t addr = (uintptr_t)reloc_target(prog, reloc);
+        /* A stub is a movabs of the target then an indirect jump */
+        if (!addr || reloc->loc > image->size || image->size - reloc->loc < (reloc->call ? 4 : 8) ||
+                (reloc->call && (reloc->stub_loc > image->size || image->size - reloc->stub_loc < 12))) {
+            *errmsg = ubpf_error("bad relocation in compiled code");
+            return NULL;
+        }
+        if (!reloc->call) {
+            memcpy(image->code + reloc->loc, &addr, sizeof(addr));
+        }
+    }
+
+    uint8_t *jitted = ubpf_code_alloc(image->size, hot_call_target(prog, image));
+    if (!jitted) {
+        *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    for (i = 0; i < image->num_relocs; i++) {
+        const struct ubpf_reloc *reloc = &image->relocs[i];
+        if (!reloc->call) {
+            continue;
+        }
+        intptr_t next = (intptr_t)jitted + reloc->loc + sizeof(uint32_t);
+        intptr_t rel = (intptr_t)reloc_target(prog, reloc) - next;
+
+        if (rel < INT32_MIN || rel > INT32_MAX) {
+            rel = (intptr_t)reloc->stub_loc - (reloc->loc + sizeof(uint32_t));
+        }
+
+        int32_t rel32 = rel;
+        memcpy(image->code + reloc->loc, &rel32, sizeof(rel32));
+    }
+
+    if (ubpf_code_write(jitted, image->code, image->size) < 0) {
+        *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
+        ubpf_code_free(jitted, image->size);
+        return NULL;
+    }
+
+    return jitted;
+}
+
+/*
+ * Translate prog into an image, with its calls and other absolute
+ * addresses as relocations. On success the caller frees the arrays.
+ */
+static int
+compile_image(struct ubpf_prog *prog, bool batch, struct ubpf_jit_image *image, char **errmsg)
+{
+    struct jit_state state;
+    int rv = -1;
+    int i;
+
+    /* Start from a typical code size per instruction; emit_bytes grows the buffer as needed */
+    state.offset = 0;
+    state.size = prog->num_insts * 16 + 512;
+    state.oom = false;
+    state.buf = malloc(state.size);
+    state.pc_locs = ubpf_scratch_calloc(prog->num_insts+1, sizeof(state.pc_locs[0]));
+    state.num_jumps = 0;
+    state.max_jumps = prog->num_insts;
+    state.jumps = malloc(state.max_jumps * sizeof(state.jumps[0]));
+    state.num_calls = 0;
+    state.max_calls = 0;
+    state.calls = NULL;
+    state.num_relocs = 0;
+    state.max_relocs = 0;
+    state.relocs = NULL;
+    state.live_out = ubpf_scratch_calloc(prog->num_insts, sizeof(state.live_out[0]));
+    state.defined_in = ubpf_scratch_calloc(prog->num_insts, sizeof(state.defined_in[0]));
+    state.leaders = ubpf_scratch_calloc(prog->num_insts, sizeof(state.leaders[0]));
+    state.bounds_check = prog->vm->bounds_check_enabled;
+    state.stack_size = prog->stack_size;
+    state.counters = prog->vm->profiling_enabled ? prog->counters : NULL;
+    state.bounds_stubs = ubpf_scratch_calloc(prog->num_insts, sizeof(state.bounds_stubs[0]));
+    state.num_bounds_stubs = 0;
+    memset(state.checked, 0, sizeof(state.checked));
+    state.short_jumps = NULL;
+    state.num_short_jumps = 0;
+    state.blocks = ubpf_scratch_calloc(prog->num_insts, sizeof(state.blocks[0]));
+
+    if (!state.buf || !state.pc_locs || !state.jumps ||
+            !state.live_out || !state.defined_in || !state.leaders ||
+            !state.bounds_stubs || !state.blocks) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    ubpf_analyze_registers(prog, state.live_out, state.defined_in);
+    ubpf_find_leaders(prog, state.leaders);
+
+    if (ubpf_layout_blocks(prog, state.leaders, state.counters != NULL, state.blocks, &state.num_blocks) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    if (translate(prog, &state, batch, errmsg) < 0) {
+        goto out;
+    }
+
+    /* Translate again if any jump can use a rel8 offset, now that the distances are known */
+    if (!state.oom && find_short_jumps(&state) > 0) {
+        state.offset = 0;
+        state.num_jumps = 0;
+        state.num_calls = 0;
+        state.num_relocs = 0;
+        state.num_bounds_stubs = 0;
+        if (translate(prog, &state, batch, errmsg) < 0) {
+            goto out;
+        }
+    }
+
+    /* The calls become relocations too */
+    for (i = 0; !state.oom && i < state.num_calls; i++) {
+        if (state.num_relocs == state.max_relocs &&
+                !grow_array(&state, (void **)&state.relocs, &state.max_relocs, sizeof(state.relocs[0]))) {
+            break;
+        }
+        struct ubpf_reloc *reloc = &state.relocs[state.num_relocs++];
+        reloc->loc = state.calls[i].offset_loc;
+        reloc->stub_loc = state.calls[i].stub_loc;
+        reloc->index = state.calls[i].index;
+        reloc->kind = state.calls[i].kind;
+        reloc->call = true;
+    }
+
+    if (state.oom) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    resolve_jumps(&state);
+
+    image->code = state.buf;
+    image->size = state.offset;
+    image->relocs = state.relocs;
+    image->num_relocs = state.num_relocs;
+    state.buf = NULL;
+    state.relocs = NULL;
+    rv = 0;
 
 out:
     free(state.buf);
-    free(state.pc_locs);
+    ubpf_scratch_free(state.pc_locs);
     free(state.jumps);
-    if (jitted && vm->jitted == NULL) {
-        munmap(jitted, jitted_size);
+    free(state.calls);
+    free(state.relocs);
+    ubpf_scratch_free(state.live_out);
+    ubpf_scratch_free(state.defined_in);
+    ubpf_scratch_free(state.leaders);
+    ubpf_scratch_free(state.bounds_stubs);
+    free(state.short_jumps);
+    ubpf_scratch_free(state.blocks);
+    return rv;
+}
+
+/* The settings compiled code depends on beyond the program and the VM's tables */
+struct jit_variant {
+    uint8_t batch;
+    uint8_t bounds_check;
+    uint8_t register_map[REGISTER_MAP_SIZE];
+    /* Whether the CPU has the instructions for each intrinsic */
+    uint8_t intrinsics[NUM_INTRINSICS];
+    /* Whether each registered function is ubpf_map_lookup, whose calls may be inlined */
+    uint8_t map_lookup[];
+};
+
+/*
+ * Code compiled with profiling counters refers to them and may be laid out
+ * from them, so is neither looked up in the cache nor saved there.
+ */
+static void *
+compile(struct ubpf_prog *prog, bool batch, size_t *size, char **errmsg)
+{
+    struct ubpf_jit_image image = { 0 };
+    struct jit_variant *variant = NULL;
+    size_t variant_size = sizeof(*variant) + prog->vm->num_ext_funcs;
+    bool cache = prog->vm->cache_dir && !prog->counters;
+    void *jitted = NULL;
+    int i;
+
+    /* Without memory for the variant, compile without the cache */
+    if (cache && !(variant = calloc(1, variant_size))) {
+        cache = false;
     }
-    return vm->jitted;
+
+    if (cache) {
+        variant->batch = batch;
+        variant->bounds_check = prog->vm->bounds_check_enabled;
+        for (i = 0; i < REGISTER_MAP_SIZE; i++) {
+            variant->register_map[i] = register_map[i];
+        }
+        for (i = 0; i < NUM_INTRINSICS; i++) {
+            variant->intrinsics[i] = cpu_has_intrinsic(i);
+        }
+        for (i = 0; i < prog->vm->num_ext_funcs; i++) {
+            variant->map_lookup[i] = prog->vm->ext_funcs[i] == (ext_func)ubpf_map_lookup;
+        }
+
+        if (ubpf_cache_load(prog, variant, variant_size, &image) == 0) {
+            jitted = place(prog, &image, errmsg);
+            if (jitted) {
+                *size = image.size;
+                goto out;
+            }
+            /* Compile it afresh instead */
+            free(*errmsg);
+            *errmsg = NULL;
+            free(image.code);
+            free(image.relocs);
+        }
+    }
+
+    if (compile_image(prog, batch, &image, errmsg) < 0) {
+        goto out;
+    }
+
+    if (cache) {
+        ubpf_cache_store(prog, variant, variant_size, &image);
+    }
+
+    jitted = place(prog, &image, errmsg);
+    if (jitted) {
+        *size = image.size;
+    }
+
+out:
+    free(variant);
+    free(image.code);
+    free(image.relocs);
+    return jitted;
+}
+
+int
+ubpf_compile_prog(struct ubpf_prog *prog, bool batch, char **errmsg)
+{
+    if (batch && !prog->jitted_batch) {
+        ubpf_jit_batch_fn jitted = compile(prog, true, &prog->jitted_batch_size, errmsg);
+        if (!jitted) {
+            return -1;
+        }
+        __atomic_store_n(&prog->jitted_batch, jitted, __ATOMIC_RELEASE);
+    } else if (!batch && !prog->jitted) {
+        ubpf_jit_fn jitted = compile(prog, false, &prog->jitted_size, errmsg);
+        if (!jitted) {
+            return -1;
+        }
+        __atomic_store_n(&prog->jitted, jitted, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Threads that find no code compile it one at a time under vm->lock, so
+ * only the first does any work. The release store publishing the code
+ * pairs with the acquire load, so a caller that sees the pointer also sees
+ * the code and its size. The read section only covers the fast path:
+ * holding the lock keeps vm->prog from being replaced, and ubpf_replace
+ * never waits for readers while holding it.
+ */
+static void *
+compile_current(struct ubpf_vm *vm, bool batch, char **errmsg)
+{
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    void *jitted = NULL;
+
+    if (prog) {
+        jitted = batch ? (void *)__atomic_load_n(&prog->jitted_batch, __ATOMIC_ACQUIRE) :
+            (void *)__atomic_load_n(&prog->jitted, __ATOMIC_ACQUIRE);
+    }
+    ubpf_read_unlock(vm, &section);
+    if (jitted) {
+        return jitted;
+    }
+
+    *errmsg = NULL;
+
+    pthread_mutex_lock(&vm->lock);
+    if (!vm->prog) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+    } else if (ubpf_compile_prog(vm->prog, batch, errmsg) == 0) {
+        jitted = batch ? (void *)vm->prog->jitted_batch : (void *)vm->prog->jitted;
+    }
+    pthread_mutex_unlock(&vm->lock);
+    return jitted;
+}
+
+ubpf_jit_fn
+ubpf_compile(struct ubpf_vm *vm, char **errmsg)
+{
+    return (ubpf_jit_fn)compile_current(vm, false, errmsg);
+}
+
+ubpf_jit_batch_fn
+ubpf_compile_batch(struct ubpf_vm *vm, char **errmsg)
+{
+    return (ubpf_jit_batch_fn)compile_current(vm, true, errmsg);
 }
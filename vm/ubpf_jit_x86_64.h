@@ -22,7 +22,9 @@
 #define UBPF_JIT_X86_64_H
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define RAX 0
@@ -50,29 +52,155 @@ enum operand_size {
 };
 
 struct jump {
+    uint32_t inst_loc;
     uint32_t offset_loc;
     uint32_t target_pc;
+    /* Whether the offset is a rel8 rather than a rel32 */
+    bool rel8;
+    /* Whether it is the call of a function of the program, which is always a rel32 */
+    bool call;
+};
+
+/* A call whose rel32 is patched once the code's final address is known */
+struct call {
+    uint32_t offset_loc;
+    uint32_t stub_loc;
+    void *target;
+    /* What target is, see struct ubpf_reloc */
+    uint8_t kind;
+    uint16_t index;
+};
+
+/* Cold path for a failed inline bounds check covering the accesses in [pc, end_pc] */
+struct bounds_stub {
+    uint32_t jump_loc;
+    uint32_t resume_loc;
+    uint16_t pc;
+    uint16_t end_pc;
+    int base;
+};
+
+/* Offsets from an eBPF register covered by the check of a group ending at end_pc */
+struct checked_range {
+    int32_t lo;
+    int32_t hi;
+    uint16_t end_pc;
 };
 
 struct jit_state {
     uint8_t *buf;
     uint32_t offset;
     uint32_t size;
+    /* Set when growing buf, jumps or calls fails; the output is then unusable */
+    bool oom;
     uint32_t *pc_locs;
     uint32_t exit_loc;
     uint32_t div_by_zero_loc;
+    uint32_t budget_loc;
+    uint32_t batch_loop_loc;
+    uint32_t batch_done_loc;
     struct jump *jumps;
     int num_jumps;
+    int max_jumps;
+    /* Indexed like jumps, nonzero for those found to fit a rel8 offset by an earlier pass */
+    uint8_t *short_jumps;
+    int num_short_jumps;
+    struct call *calls;
+    int num_calls;
+    int max_calls;
+    /* Absolute addresses emitted, other than those of calls */
+    struct ubpf_reloc *relocs;
+    int num_relocs;
+    int max_relocs;
+    /* Register dataflow from ubpf_analyze_registers, indexed by PC */
+    uint16_t *live_out;
+    uint16_t *defined_in;
+    /* Nonzero for PCs that are the target of a jump */
+    uint8_t *leaders;
+    /* eBPF register whose value is currently in RCX, or -1 */
+    int rcx_reg;
+    /* Bytes of stack below r10 on entry, from prog->stack_size */
+    uint32_t stack_size;
+    /* Register the stack slots of the prologue are addressed from: RSP, or R12 if local calls move it */
+    int frame_reg;
+    /* Inline bounds checking, enabled from vm->bounds_check_enabled */
+    bool bounds_check;
+    /* Offset from frame_reg of the budget left, if prog->budget_points is set */
+    uint32_t budget_slot;
+    uint32_t bounds_fail_loc;
+    struct bounds_stub *bounds_stubs;
+    int num_bounds_stubs;
+    struct checked_range checked[11];
+    /* Profiling counters to update, from prog->counters if profiling is enabled */
+    struct ubpf_counters *counters;
+    /* Basic blocks in the order they are emitted */
+    struct ubpf_code_block *blocks;
+    int num_blocks;
+    /*
+     * Targets that follow the current instruction in the program and in the
+     * emitted code, either a PC or TARGET_PC_EXIT for the epilogue
+     */
+    int32_t fallthrough_pc;
+    int32_t next_pc;
 };
 
+/* Double the capacity of a jit_state array, setting oom on failure */
+static inline bool
+grow_array(struct jit_state *state, void **array, int *max, size_t elem_size)
+{
+    int new_max = *max > 0 ? *max * 2 : 16;
+    void *p = realloc(*array, new_max * elem_size);
+    if (!p) {
+        state->oom = true;
+        return false;
+    }
+    *array = p;
+    *max = new_max;
+    return true;
+}
+
+/*
+ * Append to the code buffer, growing it as needed. Once an allocation has
+ * failed nothing more is emitted and state->oom stays set.
+ */
 static inline void
 emit_bytes(struct jit_state *state, void *data, uint32_t len)
 {
-    assert(state->offset <= state->size - len);
+    if (state->oom) {
+        return;
+    }
+
+    if (len > state->size - state->offset) {
+        uint32_t new_size = state->size;
+        while (len > new_size - state->offset) {
+            if (new_size > UINT32_MAX / 2) {
+                state->oom = true;
+                return;
+            }
+            new_size *= 2;
+        }
+        uint8_t *buf = realloc(state->buf, new_size);
+        if (!buf) {
+            state->oom = true;
+            return;
+        }
+        state->buf = buf;
+        state->size = new_size;
+    }
+
     memcpy(state->buf + state->offset, data, len);
     state->offset += len;
 }
 
+/* Overwrite previously emitted bytes, ignoring any that were never emitted */
+static inline void
+patch_bytes(struct jit_state *state, uint32_t loc, void *data, uint32_t len)
+{
+    if (loc <= state->offset && len <= state->offset - loc) {
+        memcpy(state->buf + loc, data, len);
+    }
+}
+
 static inline void
 emit1(struct jit_state *state, uint8_t x)
 {
@@ -97,13 +225,32 @@ emit8(struct jit_state *state, uint64_t x)
     emit_bytes(state, &x, sizeof(x));
 }
 
+/* Whether the next jump to be emitted was found to fit a rel8 offset */
+static inline bool
+next_jump_is_short(struct jit_state *state)
+{
+    return state->num_jumps < state->num_short_jumps && state->short_jumps[state->num_jumps];
+}
+
+/* Record a jump starting at inst_loc and emit its offset, patched by resolve_jumps */
 static inline void
-emit_jump_offset(struct jit_state *state, int32_t target_pc)
+emit_jump_offset(struct jit_state *state, uint32_t inst_loc, int32_t target_pc, bool rel8)
 {
+    if (state->num_jumps == state->max_jumps &&
+            !grow_array(state, (void **)&state->jumps, &state->max_jumps, sizeof(state->jumps[0]))) {
+        return;
+    }
     struct jump *jump = &state->jumps[state->num_jumps++];
+    jump->inst_loc = inst_loc;
     jump->offset_loc = state->offset;
     jump->target_pc = target_pc;
-    emit4(state, 0);
+    jump->rel8 = rel8;
+    jump->call = false;
+    if (rel8) {
+        emit1(state, 0);
+    } else {
+        emit4(state, 0);
+    }
 }
 
 static inline void
@@ -122,13 +269,22 @@ emit_modrm_reg2reg(struct jit_state *state, int r, int m)
 static inline void
 emit_modrm_and_displacement(struct jit_state *state, int r, int m, int32_t d)
 {
+    int mod;
     if (d == 0 && (m & 7) != RBP) {
-        emit_modrm(state, 0x00, r, m);
+        mod = 0x00;
     } else if (d >= -128 && d <= 127) {
-        emit_modrm(state, 0x40, r, m);
-        emit1(state, d);
+        mod = 0x40;
     } else {
-        emit_modrm(state, 0x80, r, m);
+        mod = 0x80;
+    }
+    emit_modrm(state, mod, r, m);
+    if ((m & 7) == RSP) {
+        /* SIB byte with no index, required for RSP/R12 base */
+        emit1(state, 0x24);
+    }
+    if (mod == 0x40) {
+        emit1(state, d);
+    } else if (mod == 0x80) {
         emit4(state, d);
     }
 }
@@ -242,12 +398,65 @@ emit_cmp(struct jit_state *state, int src, int dst)
     emit_alu64(state, 0x39, src, dst);
 }
 
+/* 'code' is the second byte of the rel32 form, 0x80 | cc */
 static inline void
 emit_jcc(struct jit_state *state, int code, int32_t target_pc)
 {
+    uint32_t inst_loc = state->offset;
+    if (next_jump_is_short(state)) {
+        emit1(state, 0x70 | (code & 0x0f));
+        emit_jump_offset(state, inst_loc, target_pc, true);
+    } else {
+        emit1(state, 0x0f);
+        emit1(state, code);
+        emit_jump_offset(state, inst_loc, target_pc, false);
+    }
+}
+
+/* Signed multiply of dst by src, truncated to the operand size */
+static inline void
+emit_imul(struct jit_state *state, int w, int src, int dst)
+{
+    emit_basic_rex(state, w, dst, src);
     emit1(state, 0x0f);
-    emit1(state, code);
-    emit_jump_offset(state, target_pc);
+    emit1(state, 0xaf);
+    emit_modrm_reg2reg(state, dst, src);
+}
+
+/* Signed multiply of dst by a sign-extended 32-bit immediate */
+static inline void
+emit_imul_imm32(struct jit_state *state, int w, int dst, int32_t imm)
+{
+    emit_basic_rex(state, w, dst, dst);
+    emit1(state, 0x69);
+    emit_modrm_reg2reg(state, dst, dst);
+    emit4(state, imm);
+}
+
+/* Conditional move of src into dst, 'cc' is the low nibble of the jcc opcode */
+static inline void
+emit_cmov(struct jit_state *state, int cc, int src, int dst)
+{
+    emit_basic_rex(state, 1, dst, src);
+    emit1(state, 0x0f);
+    emit1(state, 0x40 | cc);
+    emit_modrm_reg2reg(state, dst, src);
+}
+
+/* 64-bit ALU operation between reg and [base + offset], using the RM encoding */
+static inline void
+emit_alu64_mem(struct jit_state *state, int op, int reg, int base, int32_t offset)
+{
+    emit_basic_rex(state, 1, reg, base);
+    emit1(state, op);
+    emit_modrm_and_displacement(state, reg, base, offset);
+}
+
+/* Load the address base + offset into dst */
+static inline void
+emit_lea(struct jit_state *state, int base, int dst, int32_t offset)
+{
+    emit_alu64_mem(state, 0x8d, dst, base, offset);
 }
 
 /* Load [src + offset] into dst */
@@ -282,6 +491,38 @@ emit_load_imm(struct jit_state *state, int dst, int64_t imm)
     }
 }
 
+/* Load the address of what 'kind' and 'index' refer to, always as a 64-bit immediate so it can be relocated */
+static inline void
+emit_load_addr(struct jit_state *state, int dst, enum ubpf_reloc_kind kind, uint16_t index, const void *addr)
+{
+    if (state->num_relocs == state->max_relocs &&
+            !grow_array(state, (void **)&state->relocs, &state->max_relocs, sizeof(state->relocs[0]))) {
+        return;
+    }
+    /* movabs $addr,dst */
+    emit_basic_rex(state, 1, 0, dst);
+    emit1(state, 0xb8 | (dst & 7));
+    struct ubpf_reloc *reloc = &state->relocs[state->num_relocs++];
+    reloc->loc = state->offset;
+    reloc->stub_loc = 0;
+    reloc->index = index;
+    reloc->kind = kind;
+    reloc->call = false;
+    emit8(state, (uintptr_t)addr);
+}
+
+/* Increment the 64-bit counter at 'counter', clobbering R11 and the flags */
+static inline void
+emit_counter_inc(struct jit_state *state, uint64_t *counter)
+{
+    emit_load_imm(state, R11, (uintptr_t)counter);
+    /* add qword [r11], 1 */
+    emit_basic_rex(state, 1, 0, R11);
+    emit1(state, 0x83);
+    emit_modrm_and_displacement(state, 0, R11, 0);
+    emit1(state, 1);
+}
+
 /* Store register src to [dst + offset] */
 static inline void
 emit_store(struct jit_state *state, enum operand_size size, int src, int dst, int32_t offset)
@@ -316,21 +557,77 @@ emit_store_imm32(struct jit_state *state, enum operand_size size, int dst, int32
     }
 }
 
+/*
+ * Direct call to target
+ *
+ * The displacement is filled in after the code is placed in memory. If the
+ * target turns out to be out of rel32 range the call goes through a stub
+ * emitted by emit_call_stubs instead.
+ */
 static inline void
-emit_call(struct jit_state *state, void *target)
+emit_call(struct jit_state *state, enum ubpf_reloc_kind kind, uint16_t index, void *target)
 {
-    /* TODO use direct call when possible */
-    emit_load_imm(state, RAX, (uintptr_t)target);
-    /* callq *%rax */
-    emit1(state, 0xff);
-    emit1(state, 0xd0);
+    if (state->num_calls == state->max_calls &&
+            !grow_array(state, (void **)&state->calls, &state->max_calls, sizeof(state->calls[0]))) {
+        return;
+    }
+    struct call *call = &state->calls[state->num_calls++];
+    /* callq rel32 */
+    emit1(state, 0xe8);
+    call->offset_loc = state->offset;
+    call->target = target;
+    call->kind = kind;
+    call->index = index;
+    emit4(state, 0);
+}
+
+/* Emit one 'movabs $target, %rax; jmp *%rax' stub for each distinct call target */
+static inline void
+emit_call_stubs(struct jit_state *state)
+{
+    int i, j;
+    for (i = 0; i < state->num_calls; i++) {
+        struct call *call = &state->calls[i];
+        for (j = 0; j < i; j++) {
+            if (state->calls[j].kind == call->kind && state->calls[j].index == call->index) {
+                break;
+            }
+        }
+        if (j < i) {
+            call->stub_loc = state->calls[j].stub_loc;
+            continue;
+        }
+        call->stub_loc = state->offset;
+        emit_load_addr(state, RAX, call->kind, call->index, call->target);
+        /* jmp *%rax */
+        emit1(state, 0xff);
+        emit1(state, 0xe0);
+    }
+}
+
+/* Emit a call of the function of the program at 'target_pc' */
+static inline void
+emit_call_pc(struct jit_state *state, int32_t target_pc)
+{
+    uint32_t inst_loc = state->offset;
+    emit1(state, 0xe8);
+    emit_jump_offset(state, inst_loc, target_pc, false);
+    if (!state->oom) {
+        state->jumps[state->num_jumps - 1].call = true;
+    }
 }
 
 static inline void
 emit_jmp(struct jit_state *state, uint32_t target_pc)
 {
-    emit1(state, 0xe9);
-    emit_jump_offset(state, target_pc);
+    uint32_t inst_loc = state->offset;
+    if (next_jump_is_short(state)) {
+        emit1(state, 0xeb);
+        emit_jump_offset(state, inst_loc, target_pc, true);
+    } else {
+        emit1(state, 0xe9);
+        emit_jump_offset(state, inst_loc, target_pc, false);
+    }
 }
 
 #endif
@@ -21,6 +21,11 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ubpf_int.h"
 #include <elf.h>
 
@@ -30,6 +35,14 @@
 #define EM_BPF 247
 #endif
 
+#ifndef R_BPF_64_64
+#define R_BPF_64_64 1
+#define R_BPF_64_32 10
+#endif
+
+/* The type of call relocations before R_BPF_64_32, still accepted for helpers */
+#define R_BPF_CALL 2
+
 struct bounds {
     const void *base;
     uint64_t size;
@@ -41,6 +54,13 @@ struct section {
     uint64_t size;
 };
 
+static bool
+is_text(const struct section *section)
+{
+    return section->shdr->sh_type == SHT_PROGBITS &&
+        section->shdr->sh_flags == (SHF_ALLOC|SHF_EXECINSTR) && section->size > 0;
+}
+
 static const void *
 bounds_check(struct bounds *bounds, uint64_t offset, uint64_t size)
 {
@@ -54,7 +74,9 @@ int
 ubpf_load_elf(struct ubpf_vm *vm, const void *elf, size_t elf_size, char **errmsg)
 {
     struct bounds b = { .base=elf, .size=elf_size };
-    void *text_copy = NULL;
+    struct ubpf_patch *patches = NULL;
+    uint32_t num_patches = 0;
+    uint64_t max_patches = 0;
     int i;
 
     const Elf64_Ehdr *ehdr = bounds_check(&b, 0, sizeof(*ehdr));
@@ -124,13 +146,10 @@ ubpf_load_elf(struct ubpf_vm *vm, const void *elf, size_t elf_size, char **errms
         sections[i].size = shdr->sh_size;
     }
 
-    /* Find first text section */
+    /* Find first text section, where execution starts */
     int text_shndx = 0;
     for (i = 0; i < ehdr->e_shnum; i++) {
-        const Elf64_Shdr *shdr = sections[i].shdr;
-        if (shdr->sh_type == SHT_PROGBITS &&
-                shdr->sh_flags == (SHF_ALLOC|SHF_EXECINSTR) &&
-                ((&sections[i])->size > 0)) {
+        if (is_text(&sections[i])) {
             text_shndx = i;
             break;
         }
@@ -148,86 +167,206 @@ ubpf_load_elf(struct ubpf_vm *vm, const void *elf, size_t elf_size, char **errms
         goto error;
     }
 
-    /* May need to modify text for relocations, so make a copy */
-    text_copy = malloc(text->size);
-    if (!text_copy) {
-        *errmsg = ubpf_error("failed to allocate memory");
+    if (text->size > UINT32_MAX) {
+        *errmsg = ubpf_error("text section too large");
         goto error;
     }
-    memcpy(text_copy, text->data, text->size);
 
-    /* Process each relocation section */
+    /*
+     * Text sections are linked in the order calls into them are found,
+     * each starting at 'base' in the program, which is one past the end if
+     * not linked. All of them are loaded from the file as they are.
+     */
+    uint64_t base[MAX_SECTIONS];
+    int linked[MAX_SECTIONS];
+    int num_linked = 0;
+    uint64_t num_insts = text->size / sizeof(struct ebpf_inst);
     for (i = 0; i < ehdr->e_shnum; i++) {
-        struct section *rel = &sections[i];
-        if (rel->shdr->sh_type != SHT_REL) {
-            continue;
-        } else if (rel->shdr->sh_info != text_shndx) {
-            continue;
+        base[i] = UINT64_MAX;
+    }
+    base[text_shndx] = 0;
+    linked[num_linked++] = text_shndx;
+
+    int l;
+    for (l = 0; l < num_linked; l++) {
+        int shndx = linked[l];
+        text = &sections[shndx];
+
+        /* Relocations become patches applied as the code is loaded, leaving the file as it is */
+        uint64_t num_rels = 0;
+        for (i = 0; i < ehdr->e_shnum; i++) {
+            if (sections[i].shdr->sh_type == SHT_REL && sections[i].shdr->sh_info == shndx) {
+                num_rels += sections[i].size / sizeof(Elf64_Rel);
+            }
         }
-
-        const Elf64_Rel *rs = rel->data;
-
-        if (rel->shdr->sh_link >= ehdr->e_shnum) {
-            *errmsg = ubpf_error("bad symbol table section index");
+        if (num_rels > text->size / sizeof(struct ebpf_inst)) {
+            *errmsg = ubpf_error("too many relocations");
             goto error;
         }
-
-        struct section *symtab = &sections[rel->shdr->sh_link];
-        const Elf64_Sym *syms = symtab->data;
-        uint32_t num_syms = symtab->size/sizeof(syms[0]);
-
-        if (symtab->shdr->sh_link >= ehdr->e_shnum) {
-            *errmsg = ubpf_error("bad string table section index");
+        struct ubpf_patch *grown = realloc(patches, (max_patches + num_rels) * sizeof(patches[0]) + 1);
+        if (!grown) {
+            *errmsg = ubpf_error("failed to allocate memory");
             goto error;
         }
-
-        struct section *strtab = &sections[symtab->shdr->sh_link];
-        const char *strings = strtab->data;
-
-        int j;
-        for (j = 0; j < rel->size/sizeof(Elf64_Rel); j++) {
-            const Elf64_Rel *r = &rs[j];
-
-            if (ELF64_R_TYPE(r->r_info) != 2) {
-                *errmsg = ubpf_error("bad relocation type %u", ELF64_R_TYPE(r->r_info));
-                goto error;
+        patches = grown;
+        max_patches += num_rels;
+
+        /* Process each relocation section */
+        for (i = 0; i < ehdr->e_shnum; i++) {
+            struct section *rel = &sections[i];
+            if (rel->shdr->sh_type != SHT_REL) {
+                continue;
+            } else if (rel->shdr->sh_info != shndx) {
+                continue;
             }
 
-            uint32_t sym_idx = ELF64_R_SYM(r->r_info);
-            if (sym_idx >= num_syms) {
-                *errmsg = ubpf_error("bad symbol index");
-                goto error;
-            }
+            const Elf64_Rel *rs = rel->data;
 
-            const Elf64_Sym *sym = &syms[sym_idx];
-
-            if (sym->st_name >= strtab->size) {
-                *errmsg = ubpf_error("bad symbol name");
+            if (rel->shdr->sh_link >= ehdr->e_shnum) {
+                *errmsg = ubpf_error("bad symbol table section index");
                 goto error;
             }
 
-            const char *sym_name = strings + sym->st_name;
+            struct section *symtab = &sections[rel->shdr->sh_link];
+            const Elf64_Sym *syms = symtab->data;
+            uint32_t num_syms = symtab->size/sizeof(syms[0]);
 
-            if (r->r_offset + 8 > text->size) {
-                *errmsg = ubpf_error("bad relocation offset");
+            if (symtab->shdr->sh_link >= ehdr->e_shnum) {
+                *errmsg = ubpf_error("bad string table section index");
                 goto error;
             }
 
-            unsigned int imm = ubpf_lookup_registered_function(vm, sym_name);
-            if (imm == -1) {
-                *errmsg = ubpf_error("function '%s' not found", sym_name);
-                goto error;
+            struct section *strtab = &sections[symtab->shdr->sh_link];
+            const char *strings = strtab->data;
+
+            int j;
+            for (j = 0; j < rel->size/sizeof(Elf64_Rel); j++) {
+                const Elf64_Rel *r = &rs[j];
+                uint32_t type = ELF64_R_TYPE(r->r_info);
+
+                if (type != R_BPF_64_64 && type != R_BPF_CALL && type != R_BPF_64_32) {
+                    *errmsg = ubpf_error("bad relocation type %u", type);
+                    goto error;
+                }
+
+                uint32_t sym_idx = ELF64_R_SYM(r->r_info);
+                if (sym_idx >= num_syms) {
+                    *errmsg = ubpf_error("bad symbol index");
+                    goto error;
+                }
+
+                const Elf64_Sym *sym = &syms[sym_idx];
+
+                if (sym->st_name >= strtab->size) {
+                    *errmsg = ubpf_error("bad symbol name");
+                    goto error;
+                }
+
+                const char *sym_name = strings + sym->st_name;
+
+                if (r->r_offset + 8 > text->size || r->r_offset % sizeof(struct ebpf_inst)) {
+                    *errmsg = ubpf_error("bad relocation offset");
+                    goto error;
+                }
+
+                const struct ebpf_inst *inst = text->data + r->r_offset;
+                struct ubpf_patch *patch = &patches[num_patches++];
+                patch->pc = base[shndx] + r->r_offset / sizeof(struct ebpf_inst);
+
+                if (type == R_BPF_64_64) {
+                    /* A 64-bit address of a map, loaded by lddw */
+                    if (r->r_offset + 16 > text->size || inst->opcode != EBPF_OP_LDDW) {
+                        *errmsg = ubpf_error("bad relocation offset");
+                        goto error;
+                    }
+
+                    unsigned int idx = ubpf_lookup_registered_map(vm, sym_name);
+                    if (idx == -1) {
+                        *errmsg = ubpf_error("map '%s' not found", sym_name);
+                        goto error;
+                    }
+
+                    patch->kind = UBPF_PATCH_MAP;
+                    patch->value = idx;
+                    continue;
+                }
+
+                /* A call of a function defined in a text section, which is linked in if not yet */
+                if (inst->opcode == EBPF_OP_CALL && sym->st_shndx != SHN_UNDEF) {
+                    if (sym->st_shndx >= ehdr->e_shnum || !is_text(&sections[sym->st_shndx]) ||
+                            sym->st_value % sizeof(struct ebpf_inst) || sym->st_value >= sections[sym->st_shndx].size) {
+                        *errmsg = ubpf_error("bad call relocation for '%s'", sym_name);
+                        goto error;
+                    }
+                    if (base[sym->st_shndx] == UINT64_MAX) {
+                        base[sym->st_shndx] = num_insts;
+                        linked[num_linked++] = sym->st_shndx;
+                        num_insts += sections[sym->st_shndx].size / sizeof(struct ebpf_inst);
+                        if (num_insts > UINT32_MAX) {
+                            *errmsg = ubpf_error("text section too large");
+                            goto error;
+                        }
+                    }
+                    patch->kind = UBPF_PATCH_LOCAL;
+                    patch->value = base[sym->st_shndx] + sym->st_value / sizeof(struct ebpf_inst) + inst->imm + 1;
+                    continue;
+                }
+
+                unsigned int imm = ubpf_lookup_registered_function(vm, sym_name);
+                if (imm == -1) {
+                    *errmsg = ubpf_error("function '%s' not found", sym_name);
+                    goto error;
+                }
+
+                patch->kind = UBPF_PATCH_HELPER;
+                patch->value = imm;
             }
-
-            *(uint32_t *)(text_copy + r->r_offset + 4) = imm;
         }
     }
 
-    int rv = ubpf_load(vm, text_copy, sections[text_shndx].size, errmsg);
-    free(text_copy);
+    struct ubpf_segment segments[MAX_SECTIONS];
+    for (l = 0; l < num_linked; l++) {
+        segments[l].code = sections[linked[l]].data;
+        segments[l].len = sections[linked[l]].size;
+    }
+
+    int rv = ubpf_load_patched(vm, segments, num_linked, patches, num_patches, errmsg);
+    free(patches);
     return rv;
 
 error:
-    free(text_copy);
+    free(patches);
     return -1;
 }
+
+int
+ubpf_load_elf_file(struct ubpf_vm *vm, const char *path, char **errmsg)
+{
+    struct stat st;
+    void *elf = NULL;
+    int rv;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        *errmsg = ubpf_error("failed to open %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (elf == MAP_FAILED) {
+        *errmsg = ubpf_error("failed to map %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    rv = ubpf_load_elf(vm, elf, st.st_size, errmsg);
+    if (elf) {
+        munmap(elf, st.st_size);
+    }
+    return rv;
+}
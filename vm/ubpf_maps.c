@@ -0,0 +1,605 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Maps shared between programs and the host
+ *
+ * Arrays are plain memory. Hash maps use open addressing with linear
+ * probing over slots that are never freed, each guarded by a state word
+ * holding the hash of its key, a generation and a tag. Writers take a slot
+ * for themselves by moving its tag to INSERTING or UPDATING with a
+ * compare-and-swap and publish it by storing FULL. Lookups take no locks:
+ * they compare the key of a FULL or UPDATING slot with a matching hash and
+ * then check that the state word has not changed, since the slot may have
+ * been reused for another key meanwhile. A new generation on each reuse
+ * makes that check reliable.
+ *
+ * Deleted slots keep their place in probe sequences until reused, unless
+ * the slot after them is empty, when they are emptied too, working
+ * backwards. The table has at least twice as many slots as entries, so
+ * after churn probes still end at an empty slot rather than going through
+ * every deleted one. An insert takes the first free slot along the probe
+ * sequence and then looks for other copies of its key inserted
+ * concurrently: the copy in the earliest slot stays and the others are
+ * removed.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "ubpf_int.h"
+
+#define SLOT_EMPTY     0
+#define SLOT_INSERTING 1
+#define SLOT_FULL      2
+#define SLOT_UPDATING  3
+#define SLOT_DELETED   4
+
+/* State words: the hash of the key in the upper half, then a generation and a three-bit tag */
+#define STATE_TAG(s)   ((s) & 7)
+#define STATE_IDENT(s) ((s) & ~(uint64_t)7)
+#define STATE_HASH(s)  ((uint32_t)((s) >> 32))
+#define GEN_MASK       ((1u << 29) - 1)
+
+/* FULL slots an LRU hash map compares to choose the one to evict */
+#define LRU_SAMPLES 8
+
+/* Followed by the key and the value, each padded to 8 bytes */
+struct hash_slot {
+    uint64_t state;
+    /* For LRU hash maps, the clock when last inserted or looked up */
+    uint64_t used;
+    uint64_t key[];
+};
+
+static uint32_t
+round8(uint32_t x)
+{
+    return (x + 7) & ~7u;
+}
+
+static bool
+is_hash(const struct ubpf_map *map)
+{
+    return map->type == UBPF_MAP_TYPE_HASH || map->type == UBPF_MAP_TYPE_LRU_HASH;
+}
+
+struct ubpf_map *
+ubpf_map_create(enum ubpf_map_type type, uint32_t key_size, uint32_t value_size, uint32_t max_entries)
+{
+    if (value_size == 0 || value_size > UINT16_MAX || max_entries == 0) {
+        return NULL;
+    }
+
+    struct ubpf_map *map = calloc(1, sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->type = type;
+    map->key_size = key_size;
+    map->value_size = value_size;
+    map->max_entries = max_entries;
+    map->ncpus = 1;
+
+    switch (type) {
+    case UBPF_MAP_TYPE_PERCPU_ARRAY: {
+        long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+        map->ncpus = ncpus > 0 ? ncpus : 1;
+    }
+    /* fallthrough */
+    case UBPF_MAP_TYPE_ARRAY:
+        if (key_size != sizeof(uint32_t)) {
+            goto error;
+        }
+        map->stride = round8(value_size);
+        if (max_entries > SIZE_MAX / map->stride / map->ncpus) {
+            goto error;
+        }
+        map->storage_size = (size_t)max_entries * map->stride * map->ncpus;
+        break;
+
+    case UBPF_MAP_TYPE_HASH:
+    case UBPF_MAP_TYPE_LRU_HASH:
+        if (key_size == 0 || key_size > UINT16_MAX || max_entries > (1u << 30)) {
+            goto error;
+        }
+        map->value_offset = sizeof(struct hash_slot) + round8(key_size);
+        map->stride = map->value_offset + round8(value_size);
+        for (map->capacity = 1; map->capacity < 2 * max_entries; map->capacity *= 2);
+        if (map->capacity > SIZE_MAX / map->stride) {
+            goto error;
+        }
+        map->storage_size = (size_t)map->capacity * map->stride;
+        break;
+
+    default:
+        goto error;
+    }
+
+    /* Values are 8-byte aligned, like the stack */
+    map->storage = calloc(1, map->storage_size);
+    if (map->storage == NULL) {
+        goto error;
+    }
+    return map;
+
+error:
+    free(map);
+    return NULL;
+}
+
+void
+ubpf_map_destroy(struct ubpf_map *map)
+{
+    if (map) {
+        free(map->storage);
+        free(map);
+    }
+}
+
+/*
+ * Whether the 'size' bytes at 'addr' lie within a single value. The state
+ * words and keys of hash slots are in the same storage, and left to the
+ * map's own code.
+ */
+bool
+ubpf_map_contains(const struct ubpf_map *map, const void *addr, uint64_t size)
+{
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)map->storage;
+    if ((uintptr_t)addr < (uintptr_t)map->storage || off >= map->storage_size) {
+        return false;
+    }
+    /* Past the end of the value, as an unsigned number, if in the state word or key */
+    off = off % map->stride - map->value_offset;
+    return off <= map->value_size && size <= map->value_size - off;
+}
+
+static void *
+array_value(struct ubpf_map *map, const void *key, uint32_t cpu)
+{
+    uint32_t idx;
+    memcpy(&idx, key, sizeof(idx));
+    if (idx >= map->max_entries) {
+        return NULL;
+    }
+    return map->storage + ((size_t)cpu * map->max_entries + idx) * map->stride;
+}
+
+static uint32_t
+current_cpu(const struct ubpf_map *map)
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (uint32_t)cpu % map->ncpus;
+}
+
+static struct hash_slot *
+get_slot(const struct ubpf_map *map, uint32_t pos)
+{
+    return map->storage + (size_t)(pos & (map->capacity - 1)) * map->stride;
+}
+
+static void *
+slot_value(const struct ubpf_map *map, struct hash_slot *slot)
+{
+    return (char *)slot->key + round8(map->key_size);
+}
+
+static uint32_t
+hash_key(const struct ubpf_map *map, const void *key)
+{
+    const uint8_t *p = key;
+    uint64_t h = map->key_size;
+    uint32_t i;
+
+    for (i = 0; i < map->key_size; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, map->key_size - i < 8 ? map->key_size - i : 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return h ^ (h >> 32);
+}
+
+/*
+ * Keys are compared and written a word at a time with atomic accesses, so
+ * that a lookup racing with the reuse of a slot reads each word whole and,
+ * having read any word of the new key, sees the new state word when it
+ * checks again. The padding after a key is always zero.
+ */
+static bool
+key_equal(const struct ubpf_map *map, struct hash_slot *slot, const void *key)
+{
+    const uint8_t *p = key;
+    uint32_t i;
+
+    for (i = 0; i < map->key_size; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, map->key_size - i < 8 ? map->key_size - i : 8);
+        if (__atomic_load_n(&slot->key[i / 8], __ATOMIC_ACQUIRE) != w) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+write_key(const struct ubpf_map *map, struct hash_slot *slot, const void *key)
+{
+    const uint8_t *p = key;
+    uint32_t i;
+
+    for (i = 0; i < map->key_size; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, map->key_size - i < 8 ? map->key_size - i : 8);
+        __atomic_store_n(&slot->key[i / 8], w, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+touch(struct ubpf_map *map, struct hash_slot *slot)
+{
+    if (map->type == UBPF_MAP_TYPE_LRU_HASH) {
+        uint64_t now = __atomic_load_n(&map->clock, __ATOMIC_RELAXED);
+        /* Avoid writing a shared cache line on every lookup */
+        if (__atomic_load_n(&slot->used, __ATOMIC_RELAXED) != now) {
+            __atomic_store_n(&slot->used, now, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Wait for a writer that has taken a slot for itself */
+static uint64_t
+wait_slot(struct hash_slot *slot)
+{
+    uint64_t state;
+    while ((state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)),
+            STATE_TAG(state) == SLOT_INSERTING || STATE_TAG(state) == SLOT_UPDATING) {
+        sched_yield();
+    }
+    return state;
+}
+
+/*
+ * The first slot holding 'key', or NULL, in which case 'free' is the first
+ * slot an insert could take. Writers pass 'wait' so as not to miss a copy
+ * of the key that is still being inserted. State words are loaded with
+ * sequential consistency so that of two inserts of the same key racing
+ * through keep_first_copy, at least one sees the other.
+ */
+static struct hash_slot *
+hash_find(struct ubpf_map *map, uint32_t hash, const void *key, bool wait, uint64_t *ident, struct hash_slot **free)
+{
+    uint32_t i;
+
+    if (free) {
+        *free = NULL;
+    }
+
+    for (i = 0; i < map->capacity; i++) {
+        struct hash_slot *slot = get_slot(map, hash + i);
+        uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+        int tag = STATE_TAG(state);
+
+        if (tag == SLOT_EMPTY || tag == SLOT_DELETED) {
+            if (free && !*free) {
+                *free = slot;
+            }
+            if (tag == SLOT_EMPTY) {
+                break;
+            }
+            continue;
+        }
+
+        if (STATE_HASH(state) != hash) {
+            continue;
+        }
+
+        if (tag == SLOT_INSERTING) {
+            if (!wait) {
+                continue;
+            }
+            state = wait_slot(slot);
+            tag = STATE_TAG(state);
+            if (tag != SLOT_FULL || STATE_HASH(state) != hash) {
+                continue;
+            }
+        }
+
+        if (key_equal(map, slot, key) &&
+                STATE_IDENT(__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST)) == STATE_IDENT(state)) {
+            if (ident) {
+                *ident = STATE_IDENT(state);
+            }
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/* Move a FULL slot to 'tag', once any writer holding it is done, unless its key changes */
+static bool
+take_slot(struct hash_slot *slot, uint64_t ident, int tag)
+{
+    uint64_t state = wait_slot(slot);
+    while (STATE_IDENT(state) == ident && STATE_TAG(state) == SLOT_FULL) {
+        if (__atomic_compare_exchange_n(&slot->state, &state, ident | tag, false,
+                    __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        state = wait_slot(slot);
+    }
+    return false;
+}
+
+/* The state word of an empty slot taking the place of 'state', in a new generation */
+static uint64_t
+next_generation(uint64_t state)
+{
+    return (state & ~((uint64_t)GEN_MASK << 3 | 7)) | ((((state >> 3) + 1) & GEN_MASK) << 3) | SLOT_EMPTY;
+}
+
+/*
+ * Empty the deleted slots ending at position 'pos' that an empty slot
+ * follows, since no probe goes on past them. The empty slot is held as
+ * INSERTING meanwhile, so no insert takes it while the slot before it
+ * becomes empty, and given back in a new generation, so no insert that
+ * saw it empty before takes it after.
+ */
+static void
+reclaim_slots(struct ubpf_map *map, uint32_t pos)
+{
+    uint32_t i;
+
+    for (i = 0; i < map->capacity; i++, pos--) {
+        struct hash_slot *slot = get_slot(map, pos);
+        struct hash_slot *next = get_slot(map, pos + 1);
+        uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+        uint64_t next_state = __atomic_load_n(&next->state, __ATOMIC_SEQ_CST);
+
+        if (STATE_TAG(state) != SLOT_DELETED || STATE_TAG(next_state) != SLOT_EMPTY ||
+                !__atomic_compare_exchange_n(&next->state, &next_state, STATE_IDENT(next_state) | SLOT_INSERTING,
+                    false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return;
+        }
+        bool emptied = __atomic_compare_exchange_n(&slot->state, &state, STATE_IDENT(state) | SLOT_EMPTY, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&next->state, next_generation(next_state), __ATOMIC_SEQ_CST);
+        if (!emptied) {
+            return;
+        }
+    }
+}
+
+static bool
+remove_slot(struct ubpf_map *map, struct hash_slot *slot, uint64_t ident)
+{
+    if (!take_slot(slot, ident, SLOT_DELETED)) {
+        return false;
+    }
+    __atomic_fetch_sub(&map->count, 1, __ATOMIC_RELAXED);
+    reclaim_slots(map, ((uint8_t *)slot - (uint8_t *)map->storage) / map->stride);
+    return true;
+}
+
+/*
+ * Settle a race between inserts of the same key, which may each have taken
+ * a free slot: the copy in the earliest slot along the probe sequence wins.
+ * Removes the later copies and returns true if 'own' is the earliest.
+ */
+static bool
+keep_first_copy(struct ubpf_map *map, uint32_t hash, const void *key, struct hash_slot *own)
+{
+    bool seen_own = false;
+    uint32_t i;
+
+    for (i = 0; i < map->capacity; i++) {
+        struct hash_slot *slot = get_slot(map, hash + i);
+        if (slot == own) {
+            seen_own = true;
+            continue;
+        }
+
+        uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+        if (STATE_TAG(state) == SLOT_EMPTY) {
+            break;
+        }
+        if (STATE_HASH(state) != hash || STATE_TAG(state) == SLOT_DELETED) {
+            continue;
+        }
+        state = wait_slot(slot);
+        if (STATE_TAG(state) != SLOT_FULL || STATE_HASH(state) != hash) {
+            continue;
+        }
+        if (key_equal(map, slot, key) &&
+                STATE_IDENT(__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST)) == STATE_IDENT(state)) {
+            if (!seen_own) {
+                return false;
+            }
+            remove_slot(map, slot, STATE_IDENT(state));
+        }
+    }
+
+    return true;
+}
+
+/* Evict one of the least recently used of a few entries, starting from a cursor shared by all evictions */
+static void
+lru_evict(struct ubpf_map *map)
+{
+    uint32_t start = __atomic_fetch_add(&map->cursor, LRU_SAMPLES, __ATOMIC_RELAXED);
+    struct hash_slot *victim = NULL;
+    uint64_t victim_state = 0, victim_used = 0;
+    uint32_t i, found = 0;
+
+    for (i = 0; i < map->capacity && found < LRU_SAMPLES; i++) {
+        struct hash_slot *slot = get_slot(map, start + i);
+        uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (STATE_TAG(state) != SLOT_FULL) {
+            continue;
+        }
+        uint64_t used = __atomic_load_n(&slot->used, __ATOMIC_RELAXED);
+        if (!victim || used < victim_used) {
+            victim = slot;
+            victim_state = state;
+            victim_used = used;
+        }
+        found++;
+    }
+
+    if (victim) {
+        remove_slot(map, victim, STATE_IDENT(victim_state));
+    }
+}
+
+static int
+hash_update(struct ubpf_map *map, const void *key, const void *value, uint64_t flags)
+{
+    uint32_t hash = hash_key(map, key);
+
+    for (;;) {
+        struct hash_slot *free;
+        uint64_t ident;
+        struct hash_slot *slot = hash_find(map, hash, key, true, &ident, &free);
+
+        if (slot) {
+            if (flags == UBPF_NOEXIST) {
+                return -1;
+            }
+            if (!take_slot(slot, ident, SLOT_UPDATING)) {
+                continue;
+            }
+            memcpy(slot_value(map, slot), value, map->value_size);
+            touch(map, slot);
+            __atomic_store_n(&slot->state, ident | SLOT_FULL, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        if (flags == UBPF_EXIST) {
+            return -1;
+        }
+
+        if (__atomic_fetch_add(&map->count, 1, __ATOMIC_RELAXED) >= map->max_entries) {
+            __atomic_fetch_sub(&map->count, 1, __ATOMIC_RELAXED);
+            if (map->type != UBPF_MAP_TYPE_LRU_HASH) {
+                return -1;
+            }
+            lru_evict(map);
+            continue;
+        }
+
+        /* A slot reused for another key gets a new generation */
+        uint64_t state = free ? __atomic_load_n(&free->state, __ATOMIC_ACQUIRE) : 0;
+        ident = (uint64_t)hash << 32 | ((((state >> 3) + 1) & GEN_MASK) << 3);
+        if (!free || (STATE_TAG(state) != SLOT_EMPTY && STATE_TAG(state) != SLOT_DELETED) ||
+                !__atomic_compare_exchange_n(&free->state, &state, ident | SLOT_INSERTING, false,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            __atomic_fetch_sub(&map->count, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        write_key(map, free, key);
+        memcpy(slot_value(map, free), value, map->value_size);
+        if (map->type == UBPF_MAP_TYPE_LRU_HASH) {
+            __atomic_store_n(&free->used, __atomic_add_fetch(&map->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&free->state, ident | SLOT_FULL, __ATOMIC_SEQ_CST);
+
+        if (keep_first_copy(map, hash, key, free)) {
+            return 0;
+        }
+        remove_slot(map, free, ident);
+        if (flags == UBPF_NOEXIST) {
+            return -1;
+        }
+    }
+}
+
+static int
+hash_delete(struct ubpf_map *map, const void *key)
+{
+    uint32_t hash = hash_key(map, key);
+
+    for (;;) {
+        uint64_t ident;
+        struct hash_slot *slot = hash_find(map, hash, key, true, &ident, NULL);
+        if (!slot) {
+            return -1;
+        }
+        if (remove_slot(map, slot, ident)) {
+            return 0;
+        }
+    }
+}
+
+void *
+ubpf_map_lookup(struct ubpf_map *map, const void *key)
+{
+    switch (map->type) {
+    case UBPF_MAP_TYPE_ARRAY:
+        return array_value(map, key, 0);
+    case UBPF_MAP_TYPE_PERCPU_ARRAY:
+        return array_value(map, key, current_cpu(map));
+    default: {
+        struct hash_slot *slot = hash_find(map, hash_key(map, key), key, false, NULL, NULL);
+        if (!slot) {
+            return NULL;
+        }
+        touch(map, slot);
+        return slot_value(map, slot);
+    }
+    }
+}
+
+void *
+ubpf_map_lookup_cpu(struct ubpf_map *map, const void *key, uint32_t cpu)
+{
+    if (map->type != UBPF_MAP_TYPE_PERCPU_ARRAY || cpu >= map->ncpus) {
+        return NULL;
+    }
+    return array_value(map, key, cpu);
+}
+
+int
+ubpf_map_update(struct ubpf_map *map, const void *key, const void *value, uint64_t flags)
+{
+    if (flags > UBPF_EXIST) {
+        return -1;
+    }
+
+    if (is_hash(map)) {
+        return hash_update(map, key, value, flags);
+    }
+
+    void *dst = ubpf_map_lookup(map, key);
+    if (!dst || flags == UBPF_NOEXIST) {
+        return -1;
+    }
+    memcpy(dst, value, map->value_size);
+    return 0;
+}
+
+int
+ubpf_map_delete(struct ubpf_map *map, const void *key)
+{
+    if (!is_hash(map)) {
+        return -1;
+    }
+    return hash_delete(map, key);
+}
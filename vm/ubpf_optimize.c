@@ -0,0 +1,987 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Peephole optimizer
+ *
+ * Each pass computes what is known about every register at every PC (a
+ * constant, or another register plus an offset) and rewrites instructions
+ * with it, threads jumps, and turns dead or unreachable instructions into
+ * nops. Passes repeat until nothing changes, then the nops are removed and
+ * prog->orig_pc records where each instruction came from so runtime errors
+ * keep reporting the PCs of the loaded code. Finally, long chains of jeq on
+ * one register become a single jswitch through a case table.
+ *
+ * Nothing that can fail at runtime is removed or reordered: loads, stores,
+ * calls and divisions by a register stay, unless a division is rewritten
+ * to use a known nonzero immediate. Calls of registered functions declared
+ * without side effects are removed if their result is unused, and those of
+ * pure functions are replaced by their result if all arguments are known.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+#include "ubpf_int.h"
+
+#define NUM_REGS 11
+#define MAX_PASSES 8
+#define MAX_JUMP_CHAIN 16
+/* Shorter chains of jeq run about as fast as a table lookup */
+#define MIN_SWITCH_CASES 8
+/* Dense case tables have at most this many entries per case */
+#define MAX_SWITCH_SPREAD 2
+
+enum value_kind {
+    VALUE_UNKNOWN,
+    VALUE_CONST,
+    VALUE_COPY,
+};
+
+/* A register holds either an unknown value, the constant k, or reg + k */
+struct value {
+    uint8_t kind;
+    uint8_t reg;
+    int64_t k;
+};
+
+struct optimizer {
+    struct ubpf_prog *prog;
+    struct value (*in)[NUM_REGS];
+    bool *reached;
+    uint16_t *live_out;
+    uint8_t *leaders;
+    int *stack;
+};
+
+static const struct ebpf_inst nop = { .opcode = EBPF_OP_JA };
+
+static bool
+is_nop(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_JA && inst.offset == 0;
+}
+
+static bool
+is_cond_jmp(struct ebpf_inst inst)
+{
+    return (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_JA &&
+        inst.opcode != EBPF_OP_CALL && inst.opcode != EBPF_OP_EXIT;
+}
+
+static bool
+is_div_reg(struct ebpf_inst inst)
+{
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    int op = inst.opcode & EBPF_ALU_OP_MASK;
+    return (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) && (inst.opcode & EBPF_SRC_REG) &&
+        (op == (EBPF_OP_DIV_REG & EBPF_ALU_OP_MASK) || op == (EBPF_OP_MOD_REG & EBPF_ALU_OP_MASK));
+}
+
+static bool
+fits_int32(uint64_t x)
+{
+    return (int64_t)x == (int32_t)x;
+}
+
+static bool
+fits_int16(int64_t x)
+{
+    return x >= INT16_MIN && x <= INT16_MAX;
+}
+
+static uint64_t
+u32(uint64_t x)
+{
+    return x & UINT32_MAX;
+}
+
+static struct value
+constant(uint64_t k)
+{
+    struct value v = { VALUE_CONST, 0, k };
+    return v;
+}
+
+static bool
+value_equal(struct value a, struct value b)
+{
+    if (a.kind != b.kind) {
+        return false;
+    }
+    switch (a.kind) {
+    case VALUE_CONST: return a.k == b.k;
+    case VALUE_COPY: return a.reg == b.reg && a.k == b.k;
+    default: return true;
+    }
+}
+
+/*
+ * Evaluates an ALU instruction with the interpreter's semantics, where 'src'
+ * is the register value or the sign-extended immediate. Returns false for
+ * operations whose result differs between the interpreter and the JIT, or
+ * that could fail at runtime.
+ */
+static bool
+eval_alu(struct ebpf_inst inst, uint64_t dst, uint64_t src, uint64_t *result)
+{
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    unsigned width = is64 ? 64 : 32;
+    uint64_t r;
+
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_OP_ADD_IMM & EBPF_ALU_OP_MASK: r = dst + src; break;
+    case EBPF_OP_SUB_IMM & EBPF_ALU_OP_MASK: r = dst - src; break;
+    case EBPF_OP_MUL_IMM & EBPF_ALU_OP_MASK: r = dst * src; break;
+    case EBPF_OP_OR_IMM & EBPF_ALU_OP_MASK: r = dst | src; break;
+    case EBPF_OP_AND_IMM & EBPF_ALU_OP_MASK: r = dst & src; break;
+    case EBPF_OP_XOR_IMM & EBPF_ALU_OP_MASK: r = dst ^ src; break;
+    case EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK: r = src; break;
+    case EBPF_OP_NEG & EBPF_ALU_OP_MASK: r = -dst; break;
+    case EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK:
+    case EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK:
+        if (src == 0 || (!is64 && u32(src) == 0)) {
+            return false;
+        }
+        if ((inst.opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK)) {
+            r = is64 ? dst / src : u32(dst) / u32(src);
+        } else {
+            r = is64 ? dst % src : u32(dst) % u32(src);
+        }
+        break;
+    case EBPF_OP_LSH_IMM & EBPF_ALU_OP_MASK:
+        if (src >= width) {
+            return false;
+        }
+        r = dst << src;
+        break;
+    case EBPF_OP_RSH_IMM & EBPF_ALU_OP_MASK:
+        if (src >= width) {
+            return false;
+        }
+        r = is64 ? dst >> src : u32(dst) >> src;
+        break;
+    case EBPF_OP_ARSH_IMM & EBPF_ALU_OP_MASK:
+        if (src >= width) {
+            return false;
+        }
+        r = is64 ? (uint64_t)((int64_t)dst >> src) : (uint64_t)((int32_t)dst >> src);
+        break;
+    case EBPF_OP_LE & EBPF_ALU_OP_MASK:
+        if (is64) {
+            return false;
+        }
+        if (inst.opcode == EBPF_OP_LE) {
+            r = inst.imm == 16 ? htole16(dst) : inst.imm == 32 ? htole32(dst) : htole64(dst);
+        } else {
+            r = inst.imm == 16 ? htobe16(dst) : inst.imm == 32 ? htobe32(dst) : htobe64(dst);
+        }
+        /* Byte swaps are not truncated to 32 bits */
+        *result = r;
+        return true;
+    default:
+        return false;
+    }
+
+    *result = is64 ? r : u32(r);
+    return true;
+}
+
+/* Evaluates a conditional jump, where 'src' is the register value or the sign-extended immediate */
+static bool
+eval_jmp(struct ebpf_inst inst, uint64_t dst, uint64_t src)
+{
+    switch (inst.opcode & ~EBPF_SRC_REG) {
+    case EBPF_OP_JEQ_IMM: return dst == src;
+    case EBPF_OP_JGT_IMM: return dst > src;
+    case EBPF_OP_JGE_IMM: return dst >= src;
+    case EBPF_OP_JLT_IMM: return dst < src;
+    case EBPF_OP_JLE_IMM: return dst <= src;
+    case EBPF_OP_JSET_IMM: return dst & src;
+    case EBPF_OP_JNE_IMM: return dst != src;
+    case EBPF_OP_JSGT_IMM: return (int64_t)dst > (int64_t)src;
+    case EBPF_OP_JSGE_IMM: return (int64_t)dst >= (int64_t)src;
+    case EBPF_OP_JSLT_IMM: return (int64_t)dst < (int64_t)src;
+    case EBPF_OP_JSLE_IMM: return (int64_t)dst <= (int64_t)src;
+    default: return false;
+    }
+}
+
+/*
+ * The interpreter zero-extends the immediate of unsigned comparisons while
+ * the JIT sign-extends it, so only nonnegative immediates mean the same.
+ */
+static bool
+jmp_imm_ok(struct ebpf_inst inst, uint64_t k)
+{
+    switch (inst.opcode & ~EBPF_SRC_REG) {
+    case EBPF_OP_JGT_IMM:
+    case EBPF_OP_JGE_IMM:
+    case EBPF_OP_JLT_IMM:
+    case EBPF_OP_JLE_IMM:
+        return k <= INT32_MAX;
+    default:
+        return fits_int32(k);
+    }
+}
+
+/* The condition that holds exactly when 'opcode' does not, or 0 if there is none */
+static uint8_t
+invert_jmp(uint8_t opcode)
+{
+    uint8_t src = opcode & EBPF_SRC_REG;
+    switch (opcode & ~EBPF_SRC_REG) {
+    case EBPF_OP_JEQ_IMM: return EBPF_OP_JNE_IMM | src;
+    case EBPF_OP_JNE_IMM: return EBPF_OP_JEQ_IMM | src;
+    case EBPF_OP_JGT_IMM: return EBPF_OP_JLE_IMM | src;
+    case EBPF_OP_JLE_IMM: return EBPF_OP_JGT_IMM | src;
+    case EBPF_OP_JGE_IMM: return EBPF_OP_JLT_IMM | src;
+    case EBPF_OP_JLT_IMM: return EBPF_OP_JGE_IMM | src;
+    case EBPF_OP_JSGT_IMM: return EBPF_OP_JSLE_IMM | src;
+    case EBPF_OP_JSLE_IMM: return EBPF_OP_JSGT_IMM | src;
+    case EBPF_OP_JSGE_IMM: return EBPF_OP_JSLT_IMM | src;
+    case EBPF_OP_JSLT_IMM: return EBPF_OP_JSGE_IMM | src;
+    default: return 0;
+    }
+}
+
+/* Builds a single instruction setting dst to k, if one exists */
+static bool
+make_mov_imm(int dst, uint64_t k, struct ebpf_inst *inst)
+{
+    struct ebpf_inst mov = { .dst = dst, .imm = (int32_t)k };
+    if (fits_int32(k)) {
+        mov.opcode = EBPF_OP_MOV64_IMM;
+    } else if (k <= UINT32_MAX) {
+        /* 32-bit moves zero-extend */
+        mov.opcode = EBPF_OP_MOV_IMM;
+    } else {
+        return false;
+    }
+    *inst = mov;
+    return true;
+}
+
+static void
+set_reg(struct value *regs, int r, struct value v)
+{
+    int i;
+    /* Values expressed in terms of r are stale once it changes */
+    for (i = 0; i < NUM_REGS; i++) {
+        if (regs[i].kind == VALUE_COPY && regs[i].reg == r) {
+            regs[i].kind = VALUE_UNKNOWN;
+        }
+    }
+    regs[r] = v;
+}
+
+/* Applies the effect of the instruction at 'pc' to 'regs' */
+static void
+transfer(const struct ubpf_prog *prog, int pc, struct value *regs)
+{
+    struct ebpf_inst inst = prog->insts[pc];
+    struct value unknown = { VALUE_UNKNOWN };
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    int i;
+
+    if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) {
+        bool is64 = cls == EBPF_CLS_ALU64;
+        int op = inst.opcode & EBPF_ALU_OP_MASK;
+        struct value d = regs[inst.dst];
+        struct value s = (inst.opcode & EBPF_SRC_REG) ? regs[inst.src] : constant((int64_t)inst.imm);
+        uint64_t k;
+
+        if (inst.opcode == EBPF_OP_MOV64_REG) {
+            if (inst.src == inst.dst) {
+                return;
+            }
+            if (s.kind == VALUE_UNKNOWN || (s.kind == VALUE_COPY && s.reg == inst.dst)) {
+                s.kind = VALUE_COPY;
+                s.reg = inst.src;
+                s.k = 0;
+            }
+            set_reg(regs, inst.dst, s);
+        } else if (s.kind == VALUE_CONST && (op == (EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK) || d.kind == VALUE_CONST) &&
+                eval_alu(inst, d.k, s.k, &k)) {
+            set_reg(regs, inst.dst, constant(k));
+        } else if (is64 && s.kind == VALUE_CONST && d.kind == VALUE_COPY &&
+                (op == (EBPF_OP_ADD_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_SUB_IMM & EBPF_ALU_OP_MASK))) {
+            d.k = op == (EBPF_OP_ADD_IMM & EBPF_ALU_OP_MASK) ? d.k + s.k : d.k - s.k;
+            set_reg(regs, inst.dst, d);
+        } else if ((inst.opcode == EBPF_OP_NEG || inst.opcode == EBPF_OP_NEG64 ||
+                    inst.opcode == EBPF_OP_LE || inst.opcode == EBPF_OP_BE) &&
+                d.kind == VALUE_CONST && eval_alu(inst, d.k, 0, &k)) {
+            set_reg(regs, inst.dst, constant(k));
+        } else {
+            set_reg(regs, inst.dst, unknown);
+        }
+    } else if (inst.opcode == EBPF_OP_LDDW && inst.src == EBPF_PSEUDO_MAP_IDX) {
+        /* A map's address differs between processes, so is kept out of other instructions */
+        set_reg(regs, inst.dst, unknown);
+    } else if (inst.opcode == EBPF_OP_LDDW) {
+        set_reg(regs, inst.dst, constant((uint32_t)inst.imm | ((uint64_t)prog->insts[pc+1].imm << 32)));
+    } else if (cls == EBPF_CLS_LDX) {
+        set_reg(regs, inst.dst, unknown);
+    } else if (inst.opcode == EBPF_OP_CALL) {
+        for (i = 0; i <= 5; i++) {
+            set_reg(regs, i, unknown);
+        }
+    }
+}
+
+/* Computes opt->in[pc], what is known about each register before 'pc' */
+static void
+analyze_values(struct optimizer *opt)
+{
+    const struct ubpf_prog *prog = opt->prog;
+    struct value regs[NUM_REGS];
+    int succs[2];
+    bool changed;
+    int i, j, r, n;
+
+    memset(opt->reached, 0, prog->num_insts * sizeof(opt->reached[0]));
+    memset(opt->in, 0, prog->num_insts * sizeof(opt->in[0]));
+    for (i = 0; i < prog->num_funcs; i++) {
+        opt->reached[prog->funcs[i].start] = true;
+    }
+
+    do {
+        changed = false;
+        for (i = 0; i < prog->num_insts; i++) {
+            if (!opt->reached[i]) {
+                continue;
+            }
+            memcpy(regs, opt->in[i], sizeof(regs));
+            transfer(prog, i, regs);
+
+            n = ubpf_successors(prog, i, succs);
+            for (j = 0; j < n; j++) {
+                struct value *in = opt->in[succs[j]];
+                if (!opt->reached[succs[j]]) {
+                    opt->reached[succs[j]] = true;
+                    memcpy(in, regs, sizeof(regs));
+                    changed = true;
+                    continue;
+                }
+                for (r = 0; r < NUM_REGS; r++) {
+                    if (in[r].kind != VALUE_UNKNOWN && !value_equal(in[r], regs[r])) {
+                        in[r].kind = VALUE_UNKNOWN;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    } while (changed);
+}
+
+/* Constant folding and copy propagation for the instruction at 'pc' */
+static void
+rewrite(struct optimizer *opt, int pc)
+{
+    struct ebpf_inst *inst = &opt->prog->insts[pc];
+    const struct value *regs = opt->in[pc];
+    int cls = inst->opcode & EBPF_CLS_MASK;
+    struct value d = regs[inst->dst];
+    struct value s = regs[inst->src];
+    uint64_t k;
+
+    if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) {
+        bool is64 = cls == EBPF_CLS_ALU64;
+        int op = inst->opcode & EBPF_ALU_OP_MASK;
+        struct ebpf_inst folded;
+
+        if (!(inst->opcode & EBPF_SRC_REG)) {
+            s = constant((int64_t)inst->imm);
+        }
+
+        bool unary = inst->opcode == EBPF_OP_NEG || inst->opcode == EBPF_OP_NEG64 ||
+            inst->opcode == EBPF_OP_LE || inst->opcode == EBPF_OP_BE;
+        bool is_mov = op == (EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK);
+
+        if ((unary || s.kind == VALUE_CONST) && (is_mov || d.kind == VALUE_CONST) &&
+                eval_alu(*inst, d.k, unary ? 0 : s.k, &k) &&
+                make_mov_imm(inst->dst, k, &folded)) {
+            *inst = folded;
+            return;
+        }
+
+        if (!(inst->opcode & EBPF_SRC_REG) || unary) {
+            return;
+        }
+
+        if (s.kind == VALUE_CONST) {
+            /* Switch to the immediate form when it behaves identically */
+            bool ok = is64 ? fits_int32(s.k) : true;
+            if (op == (EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK)) {
+                ok = ok && s.k != 0 && u32(s.k) != 0;
+            } else if (op == (EBPF_OP_LSH_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_RSH_IMM & EBPF_ALU_OP_MASK) ||
+                    op == (EBPF_OP_ARSH_IMM & EBPF_ALU_OP_MASK)) {
+                ok = s.k < (is64 ? 64 : 32);
+            }
+            if (ok) {
+                inst->opcode &= ~EBPF_SRC_REG;
+                inst->imm = (int32_t)s.k;
+                inst->src = 0;
+                return;
+            }
+        }
+
+        if (s.kind == VALUE_COPY && s.k == 0) {
+            inst->src = s.reg;
+        }
+
+        if (inst->opcode == EBPF_OP_MOV64_REG && inst->src == inst->dst) {
+            *inst = nop;
+        }
+    } else if (inst->opcode == EBPF_OP_LDDW && inst->src != EBPF_PSEUDO_MAP_IDX) {
+        k = (uint32_t)inst->imm | ((uint64_t)inst[1].imm << 32);
+        if (make_mov_imm(inst->dst, k, inst)) {
+            inst[1] = nop;
+        }
+    } else if (cls == EBPF_CLS_LDX) {
+        if (s.kind == VALUE_COPY && fits_int16(inst->offset + s.k)) {
+            inst->src = s.reg;
+            inst->offset += s.k;
+        }
+    } else if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+        if (d.kind == VALUE_COPY && fits_int16(inst->offset + d.k)) {
+            inst->dst = d.reg;
+            inst->offset += d.k;
+        }
+        if (cls == EBPF_CLS_STX) {
+            if (s.kind == VALUE_CONST && (fits_int32(s.k) || inst->opcode != EBPF_OP_STXDW)) {
+                inst->opcode = (inst->opcode & ~EBPF_CLS_MASK) | EBPF_CLS_ST;
+                inst->imm = (int32_t)s.k;
+                inst->src = 0;
+            } else if (s.kind == VALUE_COPY && s.k == 0) {
+                inst->src = s.reg;
+            }
+        }
+    } else if (is_cond_jmp(*inst)) {
+        bool reg = inst->opcode & EBPF_SRC_REG;
+        if (!reg) {
+            s = constant((int64_t)inst->imm);
+        }
+
+        if (d.kind == VALUE_CONST && s.kind == VALUE_CONST && (reg || jmp_imm_ok(*inst, s.k))) {
+            if (eval_jmp(*inst, d.k, s.k)) {
+                inst->opcode = EBPF_OP_JA;
+                inst->dst = inst->src = 0;
+                inst->imm = 0;
+            } else {
+                *inst = nop;
+            }
+            return;
+        }
+
+        if (reg && s.kind == VALUE_CONST && jmp_imm_ok(*inst, s.k)) {
+            inst->opcode &= ~EBPF_SRC_REG;
+            inst->imm = (int32_t)s.k;
+            inst->src = 0;
+        } else if (reg && s.kind == VALUE_COPY && s.k == 0) {
+            inst->src = s.reg;
+        }
+
+        /* r10 is not a valid jump operand */
+        if (d.kind == VALUE_COPY && d.k == 0 && d.reg != 10) {
+            inst->dst = d.reg;
+        }
+    } else if (inst->opcode == EBPF_OP_CALL && !ubpf_is_local_call(*inst)) {
+        const struct ubpf_vm *vm = opt->prog->vm;
+        const struct ubpf_ext_func_info *info = &vm->ext_func_info[inst->imm];
+        uint64_t args[5] = { 0 };
+        struct ebpf_inst folded;
+        int i;
+
+        if (!(info->flags & UBPF_HELPER_PURE)) {
+            return;
+        }
+        for (i = 0; i < info->num_args; i++) {
+            if (regs[i+1].kind != VALUE_CONST) {
+                return;
+            }
+            args[i] = regs[i+1].k;
+        }
+        k = vm->ext_funcs[inst->imm](args[0], args[1], args[2], args[3], args[4]);
+        if (make_mov_imm(0, k, &folded)) {
+            *inst = folded;
+        }
+    }
+}
+
+static int
+jump_target(const struct ubpf_prog *prog, int pc)
+{
+    return pc + 1 + prog->insts[pc].offset;
+}
+
+/* Follows unconditional jumps and nops from 'target' */
+static int
+final_target(const struct ubpf_prog *prog, int target)
+{
+    int i;
+    for (i = 0; i < MAX_JUMP_CHAIN && prog->insts[target].opcode == EBPF_OP_JA; i++) {
+        int next = jump_target(prog, target);
+        if (next == target || next >= prog->num_insts) {
+            break;
+        }
+        target = next;
+    }
+    return target;
+}
+
+static void
+thread_jumps(struct optimizer *opt)
+{
+    struct ubpf_prog *prog = opt->prog;
+    int i;
+
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst *inst = &prog->insts[i];
+        if (inst->opcode == EBPF_OP_LDDW) {
+            i++;
+            continue;
+        }
+        if (inst->opcode != EBPF_OP_JA && !is_cond_jmp(*inst)) {
+            continue;
+        }
+        if (is_nop(*inst)) {
+            continue;
+        }
+
+        int target = final_target(prog, jump_target(prog, i));
+        if (inst->opcode == EBPF_OP_JA && prog->insts[target].opcode == EBPF_OP_EXIT) {
+            inst->opcode = EBPF_OP_EXIT;
+            inst->offset = 0;
+            continue;
+        }
+        if (fits_int16(target - i - 1)) {
+            inst->offset = target - i - 1;
+        }
+
+        /* A conditional jump to where it would fall through does nothing */
+        if (is_cond_jmp(*inst) && final_target(prog, i + 1) == jump_target(prog, i) && i != prog->num_insts - 1) {
+            *inst = nop;
+        }
+    }
+
+    /* 'jcc +1; ja L' becomes 'j!cc L' when nothing else jumps to the ja */
+    memset(opt->leaders, 0, prog->num_insts * sizeof(opt->leaders[0]));
+    for (i = 0; i < prog->num_insts; i++) {
+        if (prog->insts[i].opcode == EBPF_OP_LDDW) {
+            i++;
+        } else if (prog->insts[i].opcode == EBPF_OP_JA || is_cond_jmp(prog->insts[i])) {
+            opt->leaders[jump_target(prog, i)] = 1;
+        }
+    }
+    for (i = 0; i + 2 < prog->num_insts; i++) {
+        struct ebpf_inst *inst = &prog->insts[i];
+        struct ebpf_inst *next = &prog->insts[i+1];
+        if (!is_cond_jmp(*inst) || inst->offset != 1 || !invert_jmp(inst->opcode) ||
+                next->opcode != EBPF_OP_JA || is_nop(*next) || opt->leaders[i+1]) {
+            continue;
+        }
+        int target = jump_target(prog, i + 1);
+        if (!fits_int16(target - i - 1) || target == i + 1) {
+            continue;
+        }
+        inst->opcode = invert_jmp(inst->opcode);
+        inst->offset = target - i - 1;
+        *next = nop;
+    }
+}
+
+/* Whether an instruction's only effect is setting the registers it defines */
+static bool
+is_pure(const struct ubpf_prog *prog, struct ebpf_inst inst)
+{
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    return ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) && !is_div_reg(inst)) ||
+        inst.opcode == EBPF_OP_LDDW ||
+        (inst.opcode == EBPF_OP_CALL && !ubpf_is_local_call(inst) &&
+         (prog->vm->ext_func_info[inst.imm].flags & UBPF_HELPER_NO_SIDE_EFFECTS));
+}
+
+/* Turns unreachable instructions, including functions never called, and pure ones with dead results into nops */
+static void
+remove_dead(struct optimizer *opt)
+{
+    struct ubpf_prog *prog = opt->prog;
+    int last = prog->num_insts - 1;
+    int succs[2];
+    int i, j, n, sp = 0;
+
+    memset(opt->reached, 0, prog->num_insts * sizeof(opt->reached[0]));
+    opt->reached[0] = true;
+    opt->stack[sp++] = 0;
+    while (sp > 0) {
+        i = opt->stack[--sp];
+        n = ubpf_successors(prog, i, succs);
+        /* Functions are reached through the calls to them */
+        if (ubpf_is_local_call(prog->insts[i])) {
+            succs[n++] = i + 1 + prog->insts[i].imm;
+        }
+        for (j = 0; j < n; j++) {
+            if (!opt->reached[succs[j]]) {
+                opt->reached[succs[j]] = true;
+                opt->stack[sp++] = succs[j];
+            }
+        }
+    }
+
+    ubpf_analyze_registers(prog, opt->live_out, NULL);
+
+    for (i = 0; i < last; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        bool lddw = inst.opcode == EBPF_OP_LDDW;
+
+        if (!opt->reached[i]) {
+            /* Leave the second half of a reachable lddw alone */
+            if (!(inst.opcode == 0 && i > 0 && opt->reached[i-1] && prog->insts[i-1].opcode == EBPF_OP_LDDW)) {
+                prog->insts[i] = nop;
+            }
+        } else if (is_pure(prog, inst) && !(ubpf_inst_defs(inst) & opt->live_out[i])) {
+            prog->insts[i] = nop;
+            if (lddw) {
+                prog->insts[i+1] = nop;
+            }
+        }
+
+        if (lddw) {
+            i++;
+        }
+    }
+}
+
+/* Whether any instruction other than the last is a nop */
+static bool
+has_nops(const struct ubpf_prog *prog)
+{
+    int i;
+    for (i = 0; i < prog->num_insts - 1; i++) {
+        if (is_nop(prog->insts[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Removes nops, fixing up jump offsets, local calls and prog->orig_pc. The
+ * entry of a function that was a nop moves to what followed it, so
+ * prog->funcs is found again afterwards. A jump over nothing
+ * but nops becomes a nop itself, so this repeats until none are left.
+ */
+static int
+compact(struct optimizer *opt)
+{
+    struct ubpf_prog *prog = opt->prog;
+    int num_insts = prog->num_insts;
+    int *new_pc = opt->stack;
+    int i, n = 0;
+
+    for (i = 0; i < num_insts; i++) {
+        new_pc[i] = n;
+        if (!is_nop(prog->insts[i]) || i == num_insts - 1) {
+            n++;
+        }
+    }
+
+    uint16_t *orig_pc = calloc(n, sizeof(orig_pc[0]));
+    if (!orig_pc) {
+        return -1;
+    }
+
+    for (i = 0; i < num_insts; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        if (is_nop(inst) && i != num_insts - 1) {
+            continue;
+        }
+        if ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_CALL &&
+                inst.opcode != EBPF_OP_EXIT) {
+            inst.offset = new_pc[jump_target(prog, i)] - new_pc[i] - 1;
+        } else if (ubpf_is_local_call(inst)) {
+            inst.imm = new_pc[i + 1 + inst.imm] - new_pc[i] - 1;
+        }
+        prog->insts[new_pc[i]] = inst;
+        orig_pc[new_pc[i]] = ubpf_orig_pc(prog, i);
+    }
+
+    free(prog->orig_pc);
+    prog->orig_pc = orig_pc;
+    prog->num_insts = n;
+    return has_nops(prog) ? compact(opt) : 0;
+}
+
+void
+ubpf_free_switches(struct ubpf_prog *prog)
+{
+    int i;
+    for (i = 0; i < prog->num_switches; i++) {
+        free(prog->switches[i].keys);
+        free(prog->switches[i].targets);
+    }
+    free(prog->switches);
+    prog->switches = NULL;
+    prog->num_switches = 0;
+}
+
+/* Turns each jswitch back into the jeq it replaced, so the chain is optimized again */
+static void
+unlower_switches(struct ubpf_prog *prog)
+{
+    int i;
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst *inst = &prog->insts[i];
+        if (inst->opcode == EBPF_OP_JSWITCH) {
+            inst->opcode = EBPF_OP_JEQ_IMM;
+            inst->imm = prog->switches[inst->imm].first_imm;
+        }
+    }
+    ubpf_free_switches(prog);
+}
+
+static int
+compare_keys(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Where the chain of jeq in [start, end) takes 'value', or -1 if it could
+ * loop. Jumps within the chain are followed, since they run more of it.
+ */
+static int
+chain_target(const struct ubpf_prog *prog, int start, int end, uint64_t value)
+{
+    int pc = start;
+    int steps;
+    for (steps = 0; pc >= start && pc < end; steps++) {
+        if (steps > end - start) {
+            return -1;
+        }
+        pc = value == (uint64_t)(int64_t)prog->insts[pc].imm ? jump_target(prog, pc) : pc + 1;
+    }
+    return pc;
+}
+
+/*
+ * Builds the case table for the chain of jeq in [start, end) and makes the
+ * first a jswitch. The rest stay, for jumps into the middle of the chain.
+ * Returns -1 if out of memory, and 0 without lowering a chain that loops.
+ */
+static int
+lower_switch(struct ubpf_prog *prog, int start, int end)
+{
+    struct ubpf_switch sw = { .first_imm = prog->insts[start].imm, .default_pc = end };
+    uint32_t n = 0;
+    uint32_t i;
+    int pc;
+
+    sw.keys = calloc(end - start, sizeof(sw.keys[0]));
+    sw.targets = calloc(end - start, sizeof(sw.targets[0]));
+    if (!sw.keys || !sw.targets) {
+        goto fail;
+    }
+
+    for (pc = start; pc < end; pc++) {
+        sw.keys[n++] = (int64_t)prog->insts[pc].imm;
+    }
+    qsort(sw.keys, n, sizeof(sw.keys[0]), compare_keys);
+    uint32_t unique = 0;
+    for (i = 0; i < n; i++) {
+        if (unique == 0 || sw.keys[i] != sw.keys[unique-1]) {
+            sw.keys[unique++] = sw.keys[i];
+        }
+    }
+    n = unique;
+
+    for (i = 0; i < n; i++) {
+        int target = chain_target(prog, start, end, sw.keys[i]);
+        if (target < 0) {
+            free(sw.keys);
+            free(sw.targets);
+            return 0;
+        }
+        sw.targets[i] = target;
+    }
+
+    uint64_t spread = sw.keys[n-1] - sw.keys[0];
+    if (spread < (uint64_t)n * MAX_SWITCH_SPREAD) {
+        uint16_t *targets = calloc(spread + 1, sizeof(targets[0]));
+        if (!targets) {
+            goto fail;
+        }
+        for (i = 0; i <= spread; i++) {
+            targets[i] = sw.default_pc;
+        }
+        for (i = 0; i < n; i++) {
+            targets[sw.keys[i] - sw.keys[0]] = sw.targets[i];
+        }
+        sw.dense = true;
+        sw.min = sw.keys[0];
+        sw.num_entries = spread + 1;
+        free(sw.keys);
+        free(sw.targets);
+        sw.keys = NULL;
+        sw.targets = targets;
+    } else {
+        sw.num_entries = n;
+    }
+
+    struct ubpf_switch *switches = realloc(prog->switches, (prog->num_switches + 1) * sizeof(switches[0]));
+    if (!switches) {
+        goto fail;
+    }
+    prog->switches = switches;
+    prog->switches[prog->num_switches] = sw;
+    prog->insts[start].opcode = EBPF_OP_JSWITCH;
+    prog->insts[start].imm = prog->num_switches++;
+    return 0;
+
+fail:
+    free(sw.keys);
+    free(sw.targets);
+    return -1;
+}
+
+/* Lowers each chain of at least MIN_SWITCH_CASES jeq on the same register */
+static int
+lower_switches(struct ubpf_prog *prog)
+{
+    int i, end;
+
+    for (i = 0; i < prog->num_insts; i = end) {
+        struct ebpf_inst inst = prog->insts[i];
+        end = i + (inst.opcode == EBPF_OP_LDDW ? 2 : 1);
+        if (inst.opcode != EBPF_OP_JEQ_IMM) {
+            continue;
+        }
+        while (end < prog->num_insts && prog->insts[end].opcode == EBPF_OP_JEQ_IMM &&
+                prog->insts[end].dst == inst.dst) {
+            end++;
+        }
+        if (end - i >= MIN_SWITCH_CASES && end < prog->num_insts && lower_switch(prog, i, end) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Optimizes prog in place, which must not be running yet */
+int
+ubpf_optimize_prog(struct ubpf_prog *prog, char **errmsg)
+{
+    struct optimizer opt = { .prog = prog };
+    int rv = -1;
+    int pass, i;
+
+    opt.in = ubpf_scratch_calloc(prog->num_insts, sizeof(opt.in[0]));
+    opt.reached = ubpf_scratch_calloc(prog->num_insts, sizeof(opt.reached[0]));
+    opt.live_out = ubpf_scratch_calloc(prog->num_insts, sizeof(opt.live_out[0]));
+    opt.leaders = ubpf_scratch_calloc(prog->num_insts, sizeof(opt.leaders[0]));
+    opt.stack = ubpf_scratch_calloc(prog->num_insts, sizeof(opt.stack[0]));
+    struct ebpf_inst *prev = ubpf_scratch_calloc(prog->num_insts, sizeof(prev[0]));
+    unlower_switches(prog);
+    if (!opt.in || !opt.reached || !opt.live_out || !opt.leaders || !opt.stack || !prev) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    for (pass = 0; pass < MAX_PASSES; pass++) {
+        memcpy(prev, prog->insts, prog->num_insts * sizeof(prev[0]));
+
+        analyze_values(&opt);
+        for (i = 0; i < prog->num_insts; i++) {
+            bool lddw = prog->insts[i].opcode == EBPF_OP_LDDW;
+            if (opt.reached[i] && i != prog->num_insts - 1) {
+                rewrite(&opt, i);
+            }
+            if (lddw) {
+                i++;
+            }
+        }
+
+        thread_jumps(&opt);
+        remove_dead(&opt);
+
+        if (!memcmp(prev, prog->insts, prog->num_insts * sizeof(prev[0]))) {
+            break;
+        }
+    }
+
+    /* Counts collected so far are for the old PCs */
+    free(prog->counters);
+    prog->counters = NULL;
+
+    if (compact(&opt) < 0 || lower_switches(prog) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    if (ubpf_find_funcs(prog, errmsg) < 0 || ubpf_analyze_ranges(prog, prog->vm->stack_limit, errmsg) < 0) {
+        goto out;
+    }
+
+    if (ubpf_find_budget_points(prog) < 0 || ubpf_threaded_decode(prog) < 0 ||
+            (prog->vm->profiling_enabled && ubpf_alloc_counters(prog) < 0)) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    rv = 0;
+
+out:
+    /* The counters may be gone, even on failure */
+    ubpf_select_interpreter(prog);
+    ubpf_scratch_free(opt.in);
+    ubpf_scratch_free(opt.reached);
+    ubpf_scratch_free(opt.live_out);
+    ubpf_scratch_free(opt.leaders);
+    ubpf_scratch_free(opt.stack);
+    ubpf_scratch_free(prev);
+    return rv;
+}
+
+int
+ubpf_optimize(struct ubpf_vm *vm, char **errmsg)
+{
+    struct ubpf_prog *prog = vm->prog;
+
+    *errmsg = NULL;
+
+    if (!prog) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return -1;
+    }
+
+    if (vm->sealed) {
+        *errmsg = ubpf_error("VM is sealed");
+        return -1;
+    }
+
+    if (prog->jitted || prog->jitted_batch) {
+        *errmsg = ubpf_error("code has already been compiled");
+        return -1;
+    }
+
+    return ubpf_optimize_prog(prog, errmsg);
+}
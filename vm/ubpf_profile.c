@@ -0,0 +1,338 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Execution profiles
+ *
+ * The interpreter counts every instruction it executes, while JIT compiled
+ * code only counts entries to PC 0 and to jump targets, plus fall-throughs
+ * of conditional jumps. Together those give the count of every basic
+ * block, since any other instruction runs exactly as often as the one
+ * before it. ubpf_get_profile adds up both into per-instruction counts.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+static bool
+is_cond_jmp(struct ebpf_inst inst)
+{
+    return (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_JA &&
+        inst.opcode != EBPF_OP_CALL && inst.opcode != EBPF_OP_EXIT;
+}
+
+/* Whether execution can only continue after the instruction by jumping */
+static bool
+ends_block(struct ebpf_inst inst)
+{
+    return (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_CALL;
+}
+
+int
+ubpf_alloc_counters(struct ubpf_prog *prog)
+{
+    if (prog->counters) {
+        return 0;
+    }
+
+    /* MAX_INSTS is small enough that this cannot overflow */
+    struct ubpf_counters *counters = calloc(1, sizeof(*counters) + 4 * prog->num_insts * sizeof(uint64_t));
+    if (!counters) {
+        return -1;
+    }
+
+    counters->insts = (uint64_t *)(counters + 1);
+    counters->not_taken = counters->insts + prog->num_insts;
+    counters->jit_blocks = counters->not_taken + prog->num_insts;
+    counters->jit_not_taken = counters->jit_blocks + prog->num_insts;
+    prog->counters = counters;
+    return 0;
+}
+
+int
+ubpf_get_prog_profile(const struct ubpf_prog *prog, struct ubpf_profile *profile)
+{
+    const struct ubpf_counters *counters = prog->counters;
+    uint32_t n = prog->num_insts;
+    uint32_t i;
+
+    memset(profile, 0, sizeof(*profile));
+
+    if (!counters) {
+        return -1;
+    }
+
+    uint64_t *buf = calloc(3 * n + prog->vm->num_ext_funcs + 1, sizeof(uint64_t));
+    if (!buf) {
+        return -1;
+    }
+
+    profile->num_insts = n;
+    profile->insts = buf;
+    profile->taken = buf + n;
+    profile->not_taken = buf + 2 * n;
+    profile->num_funcs = prog->vm->num_ext_funcs;
+    profile->calls = buf + 3 * n;
+
+    /*
+     * Track the JIT count of the current basic block along the code. A jump
+     * target's counter includes entries by falling through into it, and is
+     * only zero if its predecessor never ran either.
+     */
+    uint64_t block = counters->jit_blocks[0];
+    for (i = 0; i < n; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+
+        if (i > 0) {
+            struct ebpf_inst prev = prog->insts[i-1];
+            if (counters->jit_blocks[i]) {
+                block = counters->jit_blocks[i];
+            } else if (is_cond_jmp(prev)) {
+                block = counters->jit_not_taken[i-1];
+            } else if ((prev.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && prev.opcode != EBPF_OP_CALL) {
+                /* Only reachable by a jump, which never happened */
+                block = 0;
+            }
+        }
+
+        profile->insts[i] = counters->insts[i] + block;
+
+        if (inst.opcode == EBPF_OP_JA) {
+            profile->taken[i] = profile->insts[i];
+        } else if (is_cond_jmp(inst)) {
+            profile->not_taken[i] = counters->not_taken[i] + counters->jit_not_taken[i];
+            profile->taken[i] = profile->insts[i] - profile->not_taken[i];
+        } else if (inst.opcode == EBPF_OP_CALL && !ubpf_is_local_call(inst) &&
+                inst.imm >= 0 && inst.imm < profile->num_funcs) {
+            profile->calls[inst.imm] += profile->insts[i];
+        } else if (inst.opcode == EBPF_OP_LDDW && i + 1 < n) {
+            /* The second half is not an instruction of its own */
+            i++;
+        }
+    }
+
+    return 0;
+}
+
+int
+ubpf_get_profile(const struct ubpf_vm *vm, struct ubpf_profile *profile)
+{
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    int ret = -1;
+
+    if (prog) {
+        ret = ubpf_get_prog_profile(prog, profile);
+    } else {
+        memset(profile, 0, sizeof(*profile));
+    }
+    ubpf_read_unlock(vm, &section);
+    return ret;
+}
+
+void
+ubpf_free_profile(struct ubpf_profile *profile)
+{
+    free(profile->insts);
+    memset(profile, 0, sizeof(*profile));
+}
+
+void
+ubpf_reset_profile(struct ubpf_vm *vm)
+{
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    struct ubpf_counters *counters = prog ? prog->counters : NULL;
+    if (counters) {
+        size_t size = prog->num_insts * sizeof(uint64_t);
+        memset(counters->insts, 0, size);
+        memset(counters->not_taken, 0, size);
+        memset(counters->jit_blocks, 0, size);
+        memset(counters->jit_not_taken, 0, size);
+    }
+    ubpf_read_unlock(vm, &section);
+}
+
+/* Mark the targets of jumps and local calls, which start basic blocks */
+void
+ubpf_find_leaders(const struct ubpf_prog *prog, uint8_t *leaders)
+{
+    int i;
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        if ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP &&
+                inst.opcode != EBPF_OP_CALL && inst.opcode != EBPF_OP_EXIT) {
+            leaders[i + 1 + inst.offset] = 1;
+        } else if (ubpf_is_local_call(inst)) {
+            leaders[i + 1 + inst.imm] = 1;
+        }
+    }
+}
+
+struct block_count {
+    uint64_t count;
+    uint32_t block;
+};
+
+/* Hottest first, then in program order */
+static int
+compare_block_counts(const void *a, const void *b)
+{
+    const struct block_count *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/*
+ * The PC of the block that should be emitted after 'block', or -1 if none
+ * should: its most frequent successor, unless that never ran or is already
+ * placed. Ties go to the fall-through, so equal branches keep their order.
+ */
+static int32_t
+hot_successor(const struct ubpf_prog *prog, const struct ubpf_profile *profile,
+              struct ubpf_code_block block, const uint32_t *block_index, const uint8_t *placed)
+{
+    uint32_t last = block.end - 1;
+    if (last > block.start && prog->insts[last].opcode == 0) {
+        /* Second half of an lddw */
+        last--;
+    }
+
+    struct ebpf_inst inst = prog->insts[last];
+    int32_t succs[2] = { -1, -1 };
+    uint64_t counts[2] = { 0, 0 };
+
+    if (inst.opcode == EBPF_OP_EXIT) {
+        return -1;
+    } else if (inst.opcode == EBPF_OP_JA) {
+        succs[1] = last + 1 + inst.offset;
+        counts[1] = profile->taken[last];
+    } else if (ends_block(inst)) {
+        succs[0] = block.end;
+        counts[0] = profile->not_taken[last];
+        succs[1] = last + 1 + inst.offset;
+        counts[1] = profile->taken[last];
+    } else {
+        succs[0] = block.end;
+        counts[0] = profile->insts[last];
+    }
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (succs[i] < 0 || succs[i] >= prog->num_insts || placed[block_index[succs[i]]]) {
+            counts[i] = 0;
+        }
+    }
+
+    if (!counts[0] && !counts[1]) {
+        return -1;
+    }
+    return counts[0] >= counts[1] ? succs[0] : succs[1];
+}
+
+/*
+ * Choose the order to emit the basic blocks in. Without a profile the whole
+ * program is one block. With one, each chain of blocks starts at the
+ * hottest block not yet placed, beginning with the entry, and continues
+ * with its most frequent successor, so the hot path is contiguous and its
+ * conditional jumps are mostly not taken. Blocks that never ran are left
+ * at the end in program order. Code that updates profiling counters, as
+ * when 'counting', keeps the program order, since it counts fall-throughs
+ * of conditional jumps. 'order' has room for a block per instruction.
+ */
+int
+ubpf_layout_blocks(const struct ubpf_prog *prog, const uint8_t *leaders, bool counting,
+                   struct ubpf_code_block *order, int *num_order)
+{
+    struct ubpf_profile profile;
+    uint32_t n = prog->num_insts;
+
+    order[0].start = 0;
+    order[0].end = n;
+    *num_order = 1;
+
+    if (counting || !prog->counters || ubpf_get_prog_profile(prog, &profile) < 0) {
+        return 0;
+    }
+
+    if (!profile.insts[0]) {
+        ubpf_free_profile(&profile);
+        return 0;
+    }
+
+    struct ubpf_code_block *blocks = calloc(n, sizeof(blocks[0]));
+    uint32_t *block_index = calloc(n, sizeof(block_index[0]));
+    struct block_count *by_count = calloc(n, sizeof(by_count[0]));
+    uint8_t *placed = calloc(n, sizeof(placed[0]));
+    int rv = -1;
+
+    if (!blocks || !block_index || !by_count || !placed) {
+        goto out;
+    }
+
+    /* Blocks start at the entry, at jump targets and after jumps */
+    uint32_t num_blocks = 0;
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        if (i == 0 || leaders[i] || ends_block(prog->insts[i-1])) {
+            if (num_blocks > 0) {
+                blocks[num_blocks-1].end = i;
+            }
+            blocks[num_blocks].start = i;
+            by_count[num_blocks].count = profile.insts[i];
+            by_count[num_blocks].block = num_blocks;
+            num_blocks++;
+        }
+        block_index[i] = num_blocks - 1;
+        if (prog->insts[i].opcode == EBPF_OP_LDDW && i + 1 < n) {
+            block_index[++i] = num_blocks - 1;
+        }
+    }
+    blocks[num_blocks-1].end = n;
+
+    qsort(by_count, num_blocks, sizeof(by_count[0]), compare_block_counts);
+
+    uint32_t next_seed = 0;
+    int32_t pc = 0;
+    *num_order = 0;
+    while (*num_order < (int)num_blocks) {
+        uint32_t b;
+        if (pc >= 0) {
+            b = block_index[pc];
+        } else {
+            while (placed[by_count[next_seed].block]) {
+                next_seed++;
+            }
+            b = by_count[next_seed].block;
+        }
+        placed[b] = 1;
+        order[(*num_order)++] = blocks[b];
+        pc = hot_successor(prog, &profile, blocks[b], block_index, placed);
+    }
+    rv = 0;
+
+out:
+    ubpf_free_profile(&profile);
+    free(blocks);
+    free(block_index);
+    free(by_count);
+    free(placed);
+    return rv;
+}
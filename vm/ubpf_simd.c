@@ -0,0 +1,447 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Memory helpers for scanning packets
+ *
+ * Programs call these like any function registered with ubpf_register.
+ * Each has versions for wider vector units, and the widest the CPU has is
+ * picked on the first call. Every version computes exactly what the
+ * portable one does. ubpf_mem_helpers tells the verifier which memory each
+ * reads, so calls can be bounds checked like loads.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* Most non-empty patterns ubpf_memmatch looks for with vectors, before falling back to one offset at a time */
+#define MAX_VECTOR_PATTERNS 8
+
+enum simd_level {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+};
+
+static int level = -1;
+static bool has_pclmul;
+
+static int
+simd_level(void)
+{
+    if (level < 0) {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        has_pclmul = __builtin_cpu_supports("pclmul");
+        level = __builtin_cpu_supports("avx512bw") ? SIMD_AVX512 :
+            __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#else
+        level = SIMD_NONE;
+#endif
+    }
+    return level;
+}
+
+// Portable versions, which also finish off what the vector loops leave
+
+static uint64_t
+memchr_scalar(const uint8_t *p, uint64_t len, uint8_t c)
+{
+    uint64_t i;
+    for (i = 0; i < len && p[i] != c; i++);
+    return i;
+}
+
+static int64_t
+memcmp_scalar(const uint8_t *a, const uint8_t *b, uint64_t len)
+{
+    uint64_t i;
+    for (i = 0; i < len; i++) {
+        if (a[i] != b[i]) {
+            return (int64_t)a[i] - b[i];
+        }
+    }
+    return 0;
+}
+
+/* The index of the first pattern matching at 'off', or -1 */
+static int64_t
+match_at(const uint8_t *p, uint64_t len, uint64_t off, const uint8_t *patterns, uint64_t patterns_len)
+{
+    uint64_t i = 0;
+    int64_t index;
+
+    for (index = 0; i < patterns_len; index++) {
+        uint8_t n = patterns[i++];
+        if (n > patterns_len - i) {
+            break;
+        }
+        if (n > 0 && n <= len - off && !memcmp(p + off, patterns + i, n)) {
+            return index;
+        }
+        i += n;
+    }
+    return -1;
+}
+
+static uint64_t
+memmatch_scalar(const uint8_t *p, uint64_t len, uint64_t off, const uint8_t *patterns, uint64_t patterns_len)
+{
+    for (; off < len; off++) {
+        int64_t index = match_at(p, len, off, patterns, patterns_len);
+        if (index >= 0) {
+            return off | (uint64_t)index << 32;
+        }
+    }
+    return UINT64_MAX;
+}
+
+/* The sum of the bytes as 32-bit words, then a 16-bit word and a byte for what is left */
+static uint64_t
+csum_scalar(const uint8_t *p, uint64_t len)
+{
+    uint64_t sum = 0;
+    uint32_t w32;
+    uint16_t w16;
+    uint64_t i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        memcpy(&w32, p + i, sizeof(w32));
+        sum += w32;
+    }
+    if (i + 2 <= len) {
+        memcpy(&w16, p + i, sizeof(w16));
+        sum += w16;
+        i += 2;
+    }
+    if (i < len) {
+        /* Padded with a zero byte after it */
+        w16 = 0;
+        memcpy(&w16, p + i, 1);
+        sum += w16;
+    }
+    return sum;
+}
+
+/* The 64 bits of the key from byte 'i', the first most significant, with zeroes past its end */
+static uint64_t
+key_window(const uint8_t *key, uint64_t key_len, uint64_t i)
+{
+    uint64_t w = 0;
+    int j;
+    for (j = 0; j < 8; j++) {
+        w = w << 8 | (i + j < key_len ? key[i + j] : 0);
+    }
+    return w;
+}
+
+/*
+ * Each set bit of the data, the most significant of the first byte first,
+ * adds the 32 bits of the key starting at the same bit.
+ */
+static uint32_t
+toeplitz_scalar(const uint8_t *key, uint64_t key_len, const uint8_t *data, uint64_t i, uint64_t len)
+{
+    uint32_t hash = 0;
+    int b;
+
+    for (; i < len; i++) {
+        uint64_t k = key_window(key, key_len, i);
+        for (b = 0; b < 8; b++) {
+            hash ^= (uint32_t)(k >> (32 - b)) & -(uint32_t)((data[i] >> (7 - b)) & 1);
+        }
+    }
+    return hash;
+}
+
+#if defined(__x86_64__)
+
+// Vector versions
+
+#define LOAD_SSE2(p) _mm_loadu_si128((const __m128i *)(p))
+#define SPLAT_SSE2(c) _mm_set1_epi8((char)(c))
+#define EQ_SSE2(a, b) ((uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)))
+
+#define LOAD_AVX2(p) _mm256_loadu_si256((const __m256i *)(p))
+#define SPLAT_AVX2(c) _mm256_set1_epi8((char)(c))
+#define EQ_AVX2(a, b) ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+
+#define LOAD_AVX512(p) _mm512_loadu_si512((const void *)(p))
+#define SPLAT_AVX512(c) _mm512_set1_epi8((char)(c))
+#define EQ_AVX512(a, b) ((uint64_t)_mm512_cmpeq_epi8_mask(a, b))
+
+/*
+ * Defines the byte scanning functions for one vector width, given how to
+ * load 'width' bytes, fill a vector with one byte and get a mask of the
+ * bytes equal in two vectors. ubpf_memmatch first finds the offsets at
+ * which some pattern's first two bytes match, then checks only those.
+ */
+#define DEFINE_SCANS(suffix, isa, vec, width, load, splat, eq) \
+    static __attribute__((target(isa))) uint64_t \
+    memchr_##suffix(const uint8_t *p, uint64_t len, uint8_t c) \
+    { \
+        vec v = splat(c); \
+        uint64_t i; \
+        for (i = 0; i + (width) <= len; i += (width)) { \
+            uint64_t m = eq(load(p + i), v); \
+            if (m) { \
+                return i + __builtin_ctzll(m); \
+            } \
+        } \
+        return i + memchr_scalar(p + i, len - i, c); \
+    } \
+    \
+    static __attribute__((target(isa))) int64_t \
+    memcmp_##suffix(const uint8_t *a, const uint8_t *b, uint64_t len) \
+    { \
+        uint64_t i; \
+        for (i = 0; i + (width) <= len; i += (width)) { \
+            uint64_t m = ~eq(load(a + i), load(b + i)) & (UINT64_MAX >> (64 - (width))); \
+            if (m) { \
+                i += __builtin_ctzll(m); \
+                return (int64_t)a[i] - b[i]; \
+            } \
+        } \
+        return memcmp_scalar(a + i, b + i, len - i); \
+    } \
+    \
+    static __attribute__((target(isa))) uint64_t \
+    memmatch_##suffix(const uint8_t *p, uint64_t len, const uint8_t *patterns, uint64_t patterns_len, \
+                      const uint8_t (*firsts)[2], const uint8_t *lens, int n) \
+    { \
+        vec first[MAX_VECTOR_PATTERNS], second[MAX_VECTOR_PATTERNS]; \
+        uint64_t off; \
+        int k; \
+        for (k = 0; k < n; k++) { \
+            first[k] = splat(firsts[k][0]); \
+            second[k] = splat(firsts[k][1]); \
+        } \
+        for (off = 0; off + (width) + 1 <= len; off += (width)) { \
+            vec v0 = load(p + off), v1 = load(p + off + 1); \
+            uint64_t candidates = 0; \
+            for (k = 0; k < n; k++) { \
+                uint64_t m = eq(v0, first[k]); \
+                if (lens[k] > 1) { \
+                    m &= eq(v1, second[k]); \
+                } \
+                candidates |= m; \
+            } \
+            while (candidates) { \
+                uint64_t at = off + __builtin_ctzll(candidates); \
+                int64_t index = match_at(p, len, at, patterns, patterns_len); \
+                if (index >= 0) { \
+                    return at | (uint64_t)index << 32; \
+                } \
+                candidates &= candidates - 1; \
+            } \
+        } \
+        return memmatch_scalar(p, len, off, patterns, patterns_len); \
+    }
+
+DEFINE_SCANS(sse2, "sse2", __m128i, 16, LOAD_SSE2, SPLAT_SSE2, EQ_SSE2)
+DEFINE_SCANS(avx2, "avx2", __m256i, 32, LOAD_AVX2, SPLAT_AVX2, EQ_AVX2)
+DEFINE_SCANS(avx512, "avx512bw", __m512i, 64, LOAD_AVX512, SPLAT_AVX512, EQ_AVX512)
+
+/* Sums the same 32-bit words as csum_scalar, four lanes at a time */
+static __attribute__((target("avx2"))) uint64_t
+csum_avx2(const uint8_t *p, uint64_t len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    uint64_t lanes[4];
+    uint64_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = LOAD_AVX2(p + i);
+        acc = _mm256_add_epi64(acc, _mm256_blend_epi32(v, zero, 0xaa));
+        acc = _mm256_add_epi64(acc, _mm256_srli_epi64(v, 32));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + csum_scalar(p + i, len - i);
+}
+
+/*
+ * Toeplitz hashing 4 bytes at a time. With the bits of each byte reversed,
+ * the data is a polynomial whose carry-less product with the key's next 64
+ * bits holds the hash of those bytes in bits 32 to 63.
+ */
+static __attribute__((target("pclmul"))) uint32_t
+toeplitz_pclmul(const uint8_t *key, uint64_t key_len, const uint8_t *data, uint64_t len)
+{
+    uint32_t hash = 0;
+    uint64_t i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        uint32_t d;
+        uint64_t k;
+        memcpy(&d, data + i, sizeof(d));
+        d = ((d >> 1) & 0x55555555) | ((d & 0x55555555) << 1);
+        d = ((d >> 2) & 0x33333333) | ((d & 0x33333333) << 2);
+        d = ((d >> 4) & 0x0f0f0f0f) | ((d & 0x0f0f0f0f) << 4);
+        if (i + 8 <= key_len) {
+            memcpy(&k, key + i, sizeof(k));
+            k = __builtin_bswap64(k);
+        } else {
+            k = key_window(key, key_len, i);
+        }
+        __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(d), _mm_cvtsi64_si128(k), 0);
+        hash ^= (uint32_t)((uint64_t)_mm_cvtsi128_si64(product) >> 32);
+    }
+    return hash ^ toeplitz_scalar(key, key_len, data, i, len);
+}
+
+#endif
+
+// Entry points
+
+uint64_t
+ubpf_memchr(const void *p, uint64_t len, uint64_t c)
+{
+    switch (simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        return memchr_avx512(p, len, c);
+    case SIMD_AVX2:
+        return memchr_avx2(p, len, c);
+    case SIMD_SSE2:
+        return memchr_sse2(p, len, c);
+#endif
+    default:
+        return memchr_scalar(p, len, c);
+    }
+}
+
+int64_t
+ubpf_memcmp(const void *a, const void *b, uint64_t len)
+{
+    switch (simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        return memcmp_avx512(a, b, len);
+    case SIMD_AVX2:
+        return memcmp_avx2(a, b, len);
+    case SIMD_SSE2:
+        return memcmp_sse2(a, b, len);
+#endif
+    default:
+        return memcmp_scalar(a, b, len);
+    }
+}
+
+uint64_t
+ubpf_memmatch(const void *p, uint64_t len, const void *patterns, uint64_t patterns_len)
+{
+    const uint8_t *pat = patterns;
+    uint8_t firsts[MAX_VECTOR_PATTERNS][2];
+    uint8_t lens[MAX_VECTOR_PATTERNS];
+    uint64_t i = 0;
+    int n = 0;
+
+    /* The first two bytes of each non-empty pattern, if there are few enough */
+    while (i < patterns_len && n <= MAX_VECTOR_PATTERNS) {
+        uint8_t m = pat[i++];
+        if (m > patterns_len - i) {
+            break;
+        }
+        if (m > 0 && n < MAX_VECTOR_PATTERNS) {
+            firsts[n][0] = pat[i];
+            firsts[n][1] = m > 1 ? pat[i + 1] : 0;
+            lens[n] = m;
+        }
+        n += m > 0;
+        i += m;
+    }
+    if (n == 0) {
+        return UINT64_MAX;
+    }
+
+    switch (n > MAX_VECTOR_PATTERNS ? SIMD_NONE : simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        return memmatch_avx512(p, len, patterns, patterns_len, (const uint8_t (*)[2])firsts, lens, n);
+    case SIMD_AVX2:
+        return memmatch_avx2(p, len, patterns, patterns_len, (const uint8_t (*)[2])firsts, lens, n);
+    case SIMD_SSE2:
+        return memmatch_sse2(p, len, patterns, patterns_len, (const uint8_t (*)[2])firsts, lens, n);
+#endif
+    default:
+        return memmatch_scalar(p, len, 0, patterns, patterns_len);
+    }
+}
+
+uint64_t
+ubpf_csum(const void *p, uint64_t len, uint64_t sum)
+{
+    uint64_t data;
+
+    switch (simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+    case SIMD_AVX2:
+        data = csum_avx2(p, len);
+        break;
+#endif
+    default:
+        data = csum_scalar(p, len);
+        break;
+    }
+
+    /* Ones' complement addition, folding each carry back in */
+    sum += data;
+    sum += sum < data;
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+uint64_t
+ubpf_toeplitz(const void *key, uint64_t key_len, const void *data, uint64_t len)
+{
+#if defined(__x86_64__)
+    if (simd_level() && has_pclmul) {
+        return toeplitz_pclmul(key, key_len, data, len);
+    }
+#endif
+    return toeplitz_scalar(key, key_len, data, 0, len);
+}
+
+const struct ubpf_mem_helper ubpf_mem_helpers[NUM_MEM_HELPERS] = {
+    { (ext_func)ubpf_memchr, 3, { { 1, 2 } } },
+    { (ext_func)ubpf_memcmp, 3, { { 1, 3 }, { 2, 3 } } },
+    { (ext_func)ubpf_memmatch, 4, { { 1, 2 }, { 3, 4 } } },
+    { (ext_func)ubpf_csum, 3, { { 1, 2 } } },
+    { (ext_func)ubpf_toeplitz, 4, { { 1, 2 }, { 3, 4 } } },
+};
+
+const struct ubpf_mem_helper *
+ubpf_find_mem_helper(ext_func fn)
+{
+    int i;
+    for (i = 0; i < NUM_MEM_HELPERS; i++) {
+        if (ubpf_mem_helpers[i].fn == fn) {
+            return &ubpf_mem_helpers[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,696 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Threaded interpreter
+ *
+ * ubpf_load pre-decodes the program into an array of ubpf_threaded_inst,
+ * one per eBPF instruction, so that dispatch is a single indirect jump
+ * through the handler stored in each entry. The array is indexed exactly
+ * like prog->insts, which keeps PCs in error messages identical to ubpf_exec.
+ *
+ * Frequent instruction pairs are fused: the entry for the first instruction
+ * of a pair gets a handler that executes both and skips the second, saving
+ * a dispatch. The second entry keeps its own handler, so jumps into the
+ * middle of a pair still work. Only the first instruction of a pair may
+ * fail at runtime, so errors are always reported at the entry's own PC.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <endian.h>
+#include "ubpf_int.h"
+
+#if defined(__GNUC__)
+#define UBPF_COMPUTED_GOTO 1
+#endif
+
+struct ubpf_threaded_inst {
+#ifdef UBPF_COMPUTED_GOTO
+    const void *handler;
+#else
+    uint16_t opcode; /* eBPF opcode or FUSED_* */
+#endif
+    int64_t imm; /* Sign-extended, or the full 64-bit value for lddw */
+    int16_t offset; /* Or for local calls, the callee's index in prog->funcs */
+    uint8_t dst;
+    uint8_t src;
+    /* Whether the access is proven in bounds, from prog->safe_accesses */
+    bool safe;
+};
+
+#define OPCODES(X) \
+    X(ADD_IMM) X(ADD_REG) X(SUB_IMM) X(SUB_REG) \
+    X(MUL_IMM) X(MUL_REG) X(DIV_IMM) X(DIV_REG) \
+    X(OR_IMM) X(OR_REG) X(AND_IMM) X(AND_REG) \
+    X(LSH_IMM) X(LSH_REG) X(RSH_IMM) X(RSH_REG) \
+    X(NEG) X(MOD_IMM) X(MOD_REG) X(XOR_IMM) X(XOR_REG) \
+    X(MOV_IMM) X(MOV_REG) X(ARSH_IMM) X(ARSH_REG) \
+    X(LE) X(BE) \
+    X(ADD64_IMM) X(ADD64_REG) X(SUB64_IMM) X(SUB64_REG) \
+    X(MUL64_IMM) X(MUL64_REG) X(DIV64_IMM) X(DIV64_REG) \
+    X(OR64_IMM) X(OR64_REG) X(AND64_IMM) X(AND64_REG) \
+    X(LSH64_IMM) X(LSH64_REG) X(RSH64_IMM) X(RSH64_REG) \
+    X(NEG64) X(MOD64_IMM) X(MOD64_REG) X(XOR64_IMM) X(XOR64_REG) \
+    X(MOV64_IMM) X(MOV64_REG) X(ARSH64_IMM) X(ARSH64_REG) \
+    X(LDXW) X(LDXH) X(LDXB) X(LDXDW) \
+    X(STW) X(STH) X(STB) X(STDW) \
+    X(STXW) X(STXH) X(STXB) X(STXDW) \
+    X(LDDW) \
+    X(JA) X(JEQ_IMM) X(JEQ_REG) X(JGT_IMM) X(JGT_REG) \
+    X(JGE_IMM) X(JGE_REG) X(JLT_IMM) X(JLT_REG) \
+    X(JLE_IMM) X(JLE_REG) X(JSET_IMM) X(JSET_REG) \
+    X(JNE_IMM) X(JNE_REG) X(JSGT_IMM) X(JSGT_REG) \
+    X(JSGE_IMM) X(JSGE_REG) X(JSLT_IMM) X(JSLT_REG) \
+    X(JSLE_IMM) X(JSLE_REG) X(JSWITCH) \
+    X(EXIT) X(CALL)
+
+/*
+ * Fused pairs, picked from the packet parsing idioms that dominate real
+ * programs: header field loads compared against constants, byte swapped
+ * loads, multi-byte values assembled with shifts, and loop counters.
+ *
+ * Profiles of the tests/ corpus from test -P do not suggest other pairs.
+ * Most of the pairs executed there come from the long jeq chains of two
+ * tests, which the optimizer lowers to jump tables, and most other tests
+ * run each instruction once. The most executed pair outside those tests,
+ * mov64 then add64 forming a stack pointer, is already listed.
+ */
+#define FUSED_PAIRS(X) \
+    X(LDXB, JEQ_IMM) X(LDXB, JNE_IMM) X(LDXH, JEQ_IMM) X(LDXH, JNE_IMM) \
+    X(LDXW, JEQ_IMM) X(LDXW, JNE_IMM) X(LDXH, BE) X(LDXW, BE) \
+    X(LDXB, LSH64_IMM) X(LSH64_IMM, OR64_REG) \
+    X(MOV64_IMM, JEQ_REG) X(MOV64_IMM, JNE_REG) \
+    X(MOV64_REG, ADD64_IMM) X(ADD64_IMM, JNE_REG) X(ADD64_IMM, JLT_REG)
+
+enum {
+    FUSED_BASE = 255,
+#define FUSED_ID(a, b) FUSED_##a##_##b,
+    FUSED_PAIRS(FUSED_ID)
+#undef FUSED_ID
+    /* A call with EBPF_PSEUDO_CALL, sharing its opcode with helper calls */
+    LOCAL_CALL,
+    /* Uses up the budget, then runs the instruction, which is never fused */
+    BUDGET,
+    NUM_HANDLERS
+};
+
+static uint32_t
+u32(uint64_t x)
+{
+    return x;
+}
+
+/*
+ * Runs the pre-decoded program.
+ *
+ * When 'table' is non-NULL nothing is executed; instead the handler table
+ * used by ubpf_threaded_decode is returned through it.
+ */
+static uint64_t
+threaded_run(const struct ubpf_prog *prog, void *mem, size_t mem_len, const void *const **table)
+{
+#ifdef UBPF_COMPUTED_GOTO
+#define LABEL(op) [EBPF_OP_##op] = &&op_##op,
+#define FUSED_LABEL(a, b) [FUSED_##a##_##b] = &&op_##a##_##b,
+    static const void *const labels[NUM_HANDLERS] = {
+        OPCODES(LABEL) FUSED_PAIRS(FUSED_LABEL) [LOCAL_CALL] = &&op_LOCAL_CALL, [BUDGET] = &&op_BUDGET,
+    };
+#undef LABEL
+#undef FUSED_LABEL
+
+    if (table) {
+        *table = labels;
+        return 0;
+    }
+
+#define DISPATCH() goto *ip->handler
+#define DISPATCH_TO(handler) goto *labels[handler]
+#else
+#define CASE(op) case EBPF_OP_##op: goto op_##op;
+#define FUSED_CASE(a, b) case FUSED_##a##_##b: goto op_##a##_##b;
+#define DISPATCH_TO(handler) \
+    do { \
+        switch (handler) { \
+        OPCODES(CASE) \
+        FUSED_PAIRS(FUSED_CASE) \
+        case LOCAL_CALL: goto op_LOCAL_CALL; \
+        case BUDGET: goto op_BUDGET; \
+        default: return UINT64_MAX; \
+        } \
+    } while (0)
+#define DISPATCH() DISPATCH_TO(ip->opcode)
+
+    if (table) {
+        *table = NULL;
+        return 0;
+    }
+#endif
+
+    const struct ubpf_threaded_inst *code = prog->threaded;
+    const struct ubpf_threaded_inst *ip = code;
+    uint64_t reg[16] = {0};
+    uint64_t stack[prog->stack_size / 8];
+    /* The callers of the running function, and the registers a call preserves for them */
+    struct {
+        const struct ubpf_threaded_inst *return_ip;
+        int func;
+        uint64_t saved[4];
+    } frames[MAX_CALL_FRAMES - 1];
+    int depth = 0;
+    int func = 0;
+    uint64_t budget = prog->budget;
+    bool checked = prog->vm->bounds_check_enabled;
+
+    if (!code) {
+        /* Code must be loaded before we can execute */
+        return UINT64_MAX;
+    }
+
+    reg[1] = (uintptr_t)mem;
+    reg[10] = (uintptr_t)stack + sizeof(stack);
+
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define JUMP_IF(cond) do { ip += (cond) ? 1 + ip->offset : 1; DISPATCH(); } while (0)
+#define CUR_PC ((uint16_t)(ip - code))
+#define DIV_BY_ZERO_CHECK(divisor) \
+    do { \
+        if ((divisor) == 0) { \
+            ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, ubpf_orig_pc(prog, CUR_PC)); \
+            return UINT64_MAX; \
+        } \
+    } while (0)
+#define BOUNDS_CHECK_LOAD(size) \
+    do { \
+        if (checked && !ip->safe && !ubpf_bounds_check(prog, (void *)(uintptr_t)reg[ip->src] + ip->offset, size, false, CUR_PC, mem, mem_len, stack)) { \
+            return UINT64_MAX; \
+        } \
+    } while (0)
+#define BOUNDS_CHECK_STORE(size) \
+    do { \
+        if (checked && !ip->safe && !ubpf_bounds_check(prog, (void *)(uintptr_t)reg[ip->dst] + ip->offset, size, true, CUR_PC, mem, mem_len, stack)) { \
+            return UINT64_MAX; \
+        } \
+    } while (0)
+
+    DISPATCH();
+
+op_ADD_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] + ip->imm);
+    NEXT();
+op_ADD_REG:
+    reg[ip->dst] = u32(reg[ip->dst] + reg[ip->src]);
+    NEXT();
+op_SUB_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] - ip->imm);
+    NEXT();
+op_SUB_REG:
+    reg[ip->dst] = u32(reg[ip->dst] - reg[ip->src]);
+    NEXT();
+op_MUL_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] * ip->imm);
+    NEXT();
+op_MUL_REG:
+    reg[ip->dst] = u32(reg[ip->dst] * reg[ip->src]);
+    NEXT();
+op_DIV_IMM:
+    reg[ip->dst] = u32(reg[ip->dst]) / u32(ip->imm);
+    NEXT();
+op_DIV_REG:
+    DIV_BY_ZERO_CHECK(u32(reg[ip->src]));
+    reg[ip->dst] = u32(reg[ip->dst]) / u32(reg[ip->src]);
+    NEXT();
+op_OR_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] | ip->imm);
+    NEXT();
+op_OR_REG:
+    reg[ip->dst] = u32(reg[ip->dst] | reg[ip->src]);
+    NEXT();
+op_AND_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] & ip->imm);
+    NEXT();
+op_AND_REG:
+    reg[ip->dst] = u32(reg[ip->dst] & reg[ip->src]);
+    NEXT();
+op_LSH_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] << ip->imm);
+    NEXT();
+op_LSH_REG:
+    reg[ip->dst] = u32(reg[ip->dst] << reg[ip->src]);
+    NEXT();
+op_RSH_IMM:
+    reg[ip->dst] = u32(reg[ip->dst]) >> ip->imm;
+    NEXT();
+op_RSH_REG:
+    reg[ip->dst] = u32(u32(reg[ip->dst]) >> reg[ip->src]);
+    NEXT();
+op_NEG:
+    reg[ip->dst] = u32(-reg[ip->dst]);
+    NEXT();
+op_MOD_IMM:
+    reg[ip->dst] = u32(reg[ip->dst]) % u32(ip->imm);
+    NEXT();
+op_MOD_REG:
+    DIV_BY_ZERO_CHECK(u32(reg[ip->src]));
+    reg[ip->dst] = u32(reg[ip->dst]) % u32(reg[ip->src]);
+    NEXT();
+op_XOR_IMM:
+    reg[ip->dst] = u32(reg[ip->dst] ^ ip->imm);
+    NEXT();
+op_XOR_REG:
+    reg[ip->dst] = u32(reg[ip->dst] ^ reg[ip->src]);
+    NEXT();
+op_MOV_IMM:
+    reg[ip->dst] = u32(ip->imm);
+    NEXT();
+op_MOV_REG:
+    reg[ip->dst] = u32(reg[ip->src]);
+    NEXT();
+op_ARSH_IMM:
+    reg[ip->dst] = u32((int32_t)reg[ip->dst] >> ip->imm);
+    NEXT();
+op_ARSH_REG:
+    reg[ip->dst] = u32((int32_t)reg[ip->dst] >> u32(reg[ip->src]));
+    NEXT();
+
+op_LE:
+    if (ip->imm == 16) {
+        reg[ip->dst] = htole16(reg[ip->dst]);
+    } else if (ip->imm == 32) {
+        reg[ip->dst] = htole32(reg[ip->dst]);
+    } else if (ip->imm == 64) {
+        reg[ip->dst] = htole64(reg[ip->dst]);
+    }
+    NEXT();
+op_BE:
+    if (ip->imm == 16) {
+        reg[ip->dst] = htobe16(reg[ip->dst]);
+    } else if (ip->imm == 32) {
+        reg[ip->dst] = htobe32(reg[ip->dst]);
+    } else if (ip->imm == 64) {
+        reg[ip->dst] = htobe64(reg[ip->dst]);
+    }
+    NEXT();
+
+op_ADD64_IMM:
+    reg[ip->dst] += ip->imm;
+    NEXT();
+op_ADD64_REG:
+    reg[ip->dst] += reg[ip->src];
+    NEXT();
+op_SUB64_IMM:
+    reg[ip->dst] -= ip->imm;
+    NEXT();
+op_SUB64_REG:
+    reg[ip->dst] -= reg[ip->src];
+    NEXT();
+op_MUL64_IMM:
+    reg[ip->dst] *= ip->imm;
+    NEXT();
+op_MUL64_REG:
+    reg[ip->dst] *= reg[ip->src];
+    NEXT();
+op_DIV64_IMM:
+    reg[ip->dst] /= (uint64_t)ip->imm;
+    NEXT();
+op_DIV64_REG:
+    DIV_BY_ZERO_CHECK(reg[ip->src]);
+    reg[ip->dst] /= reg[ip->src];
+    NEXT();
+op_OR64_IMM:
+    reg[ip->dst] |= ip->imm;
+    NEXT();
+op_OR64_REG:
+    reg[ip->dst] |= reg[ip->src];
+    NEXT();
+op_AND64_IMM:
+    reg[ip->dst] &= ip->imm;
+    NEXT();
+op_AND64_REG:
+    reg[ip->dst] &= reg[ip->src];
+    NEXT();
+op_LSH64_IMM:
+    reg[ip->dst] <<= ip->imm;
+    NEXT();
+op_LSH64_REG:
+    reg[ip->dst] <<= reg[ip->src];
+    NEXT();
+op_RSH64_IMM:
+    reg[ip->dst] >>= ip->imm;
+    NEXT();
+op_RSH64_REG:
+    reg[ip->dst] >>= reg[ip->src];
+    NEXT();
+op_NEG64:
+    reg[ip->dst] = -reg[ip->dst];
+    NEXT();
+op_MOD64_IMM:
+    reg[ip->dst] %= (uint64_t)ip->imm;
+    NEXT();
+op_MOD64_REG:
+    DIV_BY_ZERO_CHECK(reg[ip->src]);
+    reg[ip->dst] %= reg[ip->src];
+    NEXT();
+op_XOR64_IMM:
+    reg[ip->dst] ^= ip->imm;
+    NEXT();
+op_XOR64_REG:
+    reg[ip->dst] ^= reg[ip->src];
+    NEXT();
+op_MOV64_IMM:
+    reg[ip->dst] = ip->imm;
+    NEXT();
+op_MOV64_REG:
+    reg[ip->dst] = reg[ip->src];
+    NEXT();
+op_ARSH64_IMM:
+    reg[ip->dst] = (int64_t)reg[ip->dst] >> ip->imm;
+    NEXT();
+op_ARSH64_REG:
+    reg[ip->dst] = (int64_t)reg[ip->dst] >> reg[ip->src];
+    NEXT();
+
+op_LDXW:
+    BOUNDS_CHECK_LOAD(4);
+    reg[ip->dst] = *(uint32_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    NEXT();
+op_LDXH:
+    BOUNDS_CHECK_LOAD(2);
+    reg[ip->dst] = *(uint16_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    NEXT();
+op_LDXB:
+    BOUNDS_CHECK_LOAD(1);
+    reg[ip->dst] = *(uint8_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    NEXT();
+op_LDXDW:
+    BOUNDS_CHECK_LOAD(8);
+    reg[ip->dst] = *(uint64_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    NEXT();
+
+op_STW:
+    BOUNDS_CHECK_STORE(4);
+    *(uint32_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = ip->imm;
+    NEXT();
+op_STH:
+    BOUNDS_CHECK_STORE(2);
+    *(uint16_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = ip->imm;
+    NEXT();
+op_STB:
+    BOUNDS_CHECK_STORE(1);
+    *(uint8_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = ip->imm;
+    NEXT();
+op_STDW:
+    BOUNDS_CHECK_STORE(8);
+    *(uint64_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = ip->imm;
+    NEXT();
+
+op_STXW:
+    BOUNDS_CHECK_STORE(4);
+    *(uint32_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = reg[ip->src];
+    NEXT();
+op_STXH:
+    BOUNDS_CHECK_STORE(2);
+    *(uint16_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = reg[ip->src];
+    NEXT();
+op_STXB:
+    BOUNDS_CHECK_STORE(1);
+    *(uint8_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = reg[ip->src];
+    NEXT();
+op_STXDW:
+    BOUNDS_CHECK_STORE(8);
+    *(uint64_t *)(uintptr_t)(reg[ip->dst] + ip->offset) = reg[ip->src];
+    NEXT();
+
+op_LDDW:
+    reg[ip->dst] = ip->imm;
+    ip += 2;
+    DISPATCH();
+
+op_JA:
+    JUMP_IF(true);
+op_JEQ_IMM:
+    JUMP_IF(reg[ip->dst] == (uint64_t)ip->imm);
+op_JEQ_REG:
+    JUMP_IF(reg[ip->dst] == reg[ip->src]);
+op_JGT_IMM:
+    JUMP_IF(reg[ip->dst] > (uint32_t)ip->imm);
+op_JGT_REG:
+    JUMP_IF(reg[ip->dst] > reg[ip->src]);
+op_JGE_IMM:
+    JUMP_IF(reg[ip->dst] >= (uint32_t)ip->imm);
+op_JGE_REG:
+    JUMP_IF(reg[ip->dst] >= reg[ip->src]);
+op_JLT_IMM:
+    JUMP_IF(reg[ip->dst] < (uint32_t)ip->imm);
+op_JLT_REG:
+    JUMP_IF(reg[ip->dst] < reg[ip->src]);
+op_JLE_IMM:
+    JUMP_IF(reg[ip->dst] <= (uint32_t)ip->imm);
+op_JLE_REG:
+    JUMP_IF(reg[ip->dst] <= reg[ip->src]);
+op_JSET_IMM:
+    JUMP_IF(reg[ip->dst] & ip->imm);
+op_JSET_REG:
+    JUMP_IF(reg[ip->dst] & reg[ip->src]);
+op_JNE_IMM:
+    JUMP_IF(reg[ip->dst] != (uint64_t)ip->imm);
+op_JNE_REG:
+    JUMP_IF(reg[ip->dst] != reg[ip->src]);
+op_JSGT_IMM:
+    JUMP_IF((int64_t)reg[ip->dst] > ip->imm);
+op_JSGT_REG:
+    JUMP_IF((int64_t)reg[ip->dst] > (int64_t)reg[ip->src]);
+op_JSGE_IMM:
+    JUMP_IF((int64_t)reg[ip->dst] >= ip->imm);
+op_JSGE_REG:
+    JUMP_IF((int64_t)reg[ip->dst] >= (int64_t)reg[ip->src]);
+op_JSLT_IMM:
+    JUMP_IF((int64_t)reg[ip->dst] < ip->imm);
+op_JSLT_REG:
+    JUMP_IF((int64_t)reg[ip->dst] < (int64_t)reg[ip->src]);
+op_JSLE_IMM:
+    JUMP_IF((int64_t)reg[ip->dst] <= ip->imm);
+op_JSLE_REG:
+    JUMP_IF((int64_t)reg[ip->dst] <= (int64_t)reg[ip->src]);
+op_JSWITCH:
+    ip = code + ubpf_switch_target(&prog->switches[ip->imm], reg[ip->dst]);
+    DISPATCH();
+
+op_EXIT:
+    if (depth == 0) {
+        return reg[0];
+    }
+    depth--;
+    ip = frames[depth].return_ip;
+    func = frames[depth].func;
+    memcpy(&reg[6], frames[depth].saved, sizeof(frames[depth].saved));
+    reg[10] += prog->funcs[func].stack_size;
+    DISPATCH();
+op_CALL:
+    if (checked && !ip->safe && prog->vm->ext_func_info[ip->imm].mem_args[0][0] &&
+            !ubpf_check_mem_args(prog, reg, CUR_PC, mem, mem_len, stack)) {
+        return UINT64_MAX;
+    }
+    if (prog->vm->stats_enabled) {
+        ubpf_count(&prog->vm->stats[ubpf_current_shard()].helper_calls, 1);
+    }
+    reg[0] = prog->vm->ext_funcs[ip->imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
+    NEXT();
+op_LOCAL_CALL:
+    frames[depth].return_ip = ip + 1;
+    frames[depth].func = func;
+    memcpy(frames[depth].saved, &reg[6], sizeof(frames[depth].saved));
+    depth++;
+    reg[10] -= prog->funcs[func].stack_size;
+    func = ip->offset;
+    ip += 1 + ip->imm;
+    DISPATCH();
+op_BUDGET:
+    if (budget-- == 0) {
+        ubpf_report_error_at(prog->vm, UBPF_ERROR_BUDGET, ubpf_orig_pc(prog, CUR_PC));
+        return UBPF_BUDGET_EXHAUSTED;
+    }
+    DISPATCH_TO(ubpf_is_local_call(prog->insts[CUR_PC]) ? LOCAL_CALL : prog->insts[CUR_PC].opcode);
+
+    /* Fused pairs run the first instruction, then step to the second */
+op_LDXB_JEQ_IMM:
+    BOUNDS_CHECK_LOAD(1);
+    reg[ip->dst] = *(uint8_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    JUMP_IF(reg[ip->dst] == (uint64_t)ip->imm);
+op_LDXB_JNE_IMM:
+    BOUNDS_CHECK_LOAD(1);
+    reg[ip->dst] = *(uint8_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    JUMP_IF(reg[ip->dst] != (uint64_t)ip->imm);
+op_LDXH_JEQ_IMM:
+    BOUNDS_CHECK_LOAD(2);
+    reg[ip->dst] = *(uint16_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    JUMP_IF(reg[ip->dst] == (uint64_t)ip->imm);
+op_LDXH_JNE_IMM:
+    BOUNDS_CHECK_LOAD(2);
+    reg[ip->dst] = *(uint16_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    JUMP_IF(reg[ip->dst] != (uint64_t)ip->imm);
+op_LDXW_JEQ_IMM:
+    BOUNDS_CHECK_LOAD(4);
+    reg[ip->dst] = *(uint32_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    JUMP_IF(reg[ip->dst] == (uint64_t)ip->imm);
+op_LDXW_JNE_IMM:
+    BOUNDS_CHECK_LOAD(4);
+    reg[ip->dst] = *(uint32_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    JUMP_IF(reg[ip->dst] != (uint64_t)ip->imm);
+op_LDXH_BE:
+    BOUNDS_CHECK_LOAD(2);
+    reg[ip->dst] = *(uint16_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    goto op_BE;
+op_LDXW_BE:
+    BOUNDS_CHECK_LOAD(4);
+    reg[ip->dst] = *(uint32_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    goto op_BE;
+op_LDXB_LSH64_IMM:
+    BOUNDS_CHECK_LOAD(1);
+    reg[ip->dst] = *(uint8_t *)(uintptr_t)(reg[ip->src] + ip->offset);
+    ip++;
+    reg[ip->dst] <<= ip->imm;
+    NEXT();
+op_LSH64_IMM_OR64_REG:
+    reg[ip->dst] <<= ip->imm;
+    ip++;
+    reg[ip->dst] |= reg[ip->src];
+    NEXT();
+op_MOV64_IMM_JEQ_REG:
+    reg[ip->dst] = ip->imm;
+    ip++;
+    JUMP_IF(reg[ip->dst] == reg[ip->src]);
+op_MOV64_IMM_JNE_REG:
+    reg[ip->dst] = ip->imm;
+    ip++;
+    JUMP_IF(reg[ip->dst] != reg[ip->src]);
+op_MOV64_REG_ADD64_IMM:
+    reg[ip->dst] = reg[ip->src];
+    ip++;
+    reg[ip->dst] += ip->imm;
+    NEXT();
+op_ADD64_IMM_JNE_REG:
+    reg[ip->dst] += ip->imm;
+    ip++;
+    JUMP_IF(reg[ip->dst] != reg[ip->src]);
+op_ADD64_IMM_JLT_REG:
+    reg[ip->dst] += ip->imm;
+    ip++;
+    JUMP_IF(reg[ip->dst] < reg[ip->src]);
+
+#undef NEXT
+#undef JUMP_IF
+#undef CUR_PC
+#undef DIV_BY_ZERO_CHECK
+#undef BOUNDS_CHECK_LOAD
+#undef BOUNDS_CHECK_STORE
+#undef DISPATCH
+#undef DISPATCH_TO
+}
+
+static const struct {
+    uint8_t first;
+    uint8_t second;
+    uint16_t handler;
+} fused_pairs[] = {
+#define FUSED_PAIR(a, b) { EBPF_OP_##a, EBPF_OP_##b, FUSED_##a##_##b },
+    FUSED_PAIRS(FUSED_PAIR)
+#undef FUSED_PAIR
+};
+
+/* Returns the handler for the instruction at 'pc', fusing it with the next one if possible */
+static uint16_t
+select_handler(const struct ubpf_prog *prog, int pc)
+{
+    uint8_t opcode = prog->insts[pc].opcode;
+    int i;
+
+    if (prog->budget_points && prog->budget_points[pc]) {
+        return BUDGET;
+    }
+
+    if (ubpf_is_local_call(prog->insts[pc])) {
+        return LOCAL_CALL;
+    }
+
+    if (pc + 1 < prog->num_insts && !(prog->budget_points && prog->budget_points[pc + 1])) {
+        for (i = 0; i < sizeof(fused_pairs)/sizeof(fused_pairs[0]); i++) {
+            if (fused_pairs[i].first == opcode && fused_pairs[i].second == prog->insts[pc+1].opcode) {
+                return fused_pairs[i].handler;
+            }
+        }
+    }
+    return opcode;
+}
+
+int
+ubpf_threaded_decode(struct ubpf_prog *prog)
+{
+    const void *const *table;
+    struct ubpf_threaded_inst *code;
+    int i;
+
+    threaded_run(NULL, NULL, 0, &table);
+
+    code = calloc(prog->num_insts, sizeof(*code));
+    if (code == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        struct ubpf_threaded_inst *t = &code[i];
+
+#ifdef UBPF_COMPUTED_GOTO
+        t->handler = table[select_handler(prog, i)];
+#else
+        t->opcode = select_handler(prog, i);
+#endif
+        t->imm = inst.imm;
+        t->offset = inst.offset;
+        t->dst = inst.dst;
+        t->src = inst.src;
+        t->safe = prog->safe_accesses[i];
+
+        if (ubpf_is_local_call(inst)) {
+            t->offset = ubpf_find_func(prog, i + 1 + inst.imm);
+        } else if (inst.opcode == EBPF_OP_LDDW) {
+            /* validate() guarantees the second half exists */
+            t->imm = (uint32_t)inst.imm | ((uint64_t)prog->insts[i+1].imm << 32);
+        }
+    }
+
+    free(prog->threaded);
+    prog->threaded = code;
+    return 0;
+}
+
+uint64_t
+ubpf_threaded_exec(const struct ubpf_prog *prog, void *mem, size_t mem_len)
+{
+    return threaded_run(prog, mem, mem_len, NULL);
+}
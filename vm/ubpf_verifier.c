@@ -29,6 +29,9 @@
 
 // Helpers
 
+#define REG_MASK(r) ((uint16_t)1 << (r))
+#define CALL_CLOBBERED_MASK (REG_MASK(1) | REG_MASK(2) | REG_MASK(3) | REG_MASK(4) | REG_MASK(5))
+
 int isjmp(struct ebpf_inst inst)
 {
     if (((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP) && (inst.opcode != EBPF_OP_CALL)) {
@@ -77,76 +80,214 @@ int sets_dst(struct ebpf_inst inst)
     return true;
 }
 
-// Instruction Walker
+// Control Flow Graph
 
-typedef int (*WALKER)(struct ubpf_vm *vm, struct ebpf_inst inst, void *data, int inst_off, char *visited);
+#define BITSET_WORDS(n) (((n) + 63) / 64)
 
-enum ubpf_walk_action
+static bool
+bitset_test(const uint64_t *set, int i)
 {
-    UBPF_WALK_CONTINUE,
-    UBPF_WALK_STOP,
-    UBPF_WALK_INVALID,
-};
+    return (set[i / 64] >> (i % 64)) & 1;
+}
 
-int
-ubpf_walk_paths(struct ubpf_vm *vm, WALKER walk_fn, void *data, int inst_off, char *visited)
+static void
+bitset_set(uint64_t *set, int i)
 {
-    struct ebpf_inst inst = vm->insts[inst_off];
-    int cmd = walk_fn(vm, inst, data, inst_off, visited);
-    visited[inst_off] = 1;
-    if (cmd != UBPF_WALK_CONTINUE)
-        return cmd;
-    if (inst.opcode == EBPF_OP_EXIT) {
-        return UBPF_WALK_CONTINUE;
-    } else if (isjmp(inst)) {
-        int next_pc = inst_off+1+inst.offset;
-        if (next_pc == inst_off) {
-            fprintf(stderr, "Jump to self at offset %d\n", inst_off);
-            return UBPF_WALK_INVALID;
-        } else if ((next_pc < 0) || (next_pc > vm->num_insts-1)) {
-            fprintf(stderr, "Jump out-of-bounds at offset %d to %d\n", inst_off, next_pc);
-            return UBPF_WALK_INVALID;
-        }
-        if (visited[next_pc] == 0) {
-            cmd = ubpf_walk_paths(vm, walk_fn, data, next_pc, visited);
-            if (cmd == UBPF_WALK_STOP || cmd == UBPF_WALK_INVALID)
-                return cmd;
-        }
-    }
-    if (inst_off == vm->num_insts-1) {
-        return UBPF_WALK_CONTINUE;
-    } else {
-        return ubpf_walk_paths(vm, walk_fn, data, inst_off+1, visited);
-    }
+    set[i / 64] |= (uint64_t)1 << (i % 64);
 }
 
-int
-ubpf_walk_start(struct ubpf_vm *vm, WALKER walk_fn, void *data)
+static void
+bitset_clear(uint64_t *set, int i)
 {
-    char visited[vm->num_insts];
-    memset((void *)visited, 0, vm->num_insts);
-    return ubpf_walk_paths(vm, walk_fn, data, 0, visited);
+    set[i / 64] &= ~((uint64_t)1 << (i % 64));
 }
 
-// Verifier Passes
+/* A basic block of reachable instructions, from start to end inclusive */
+struct ubpf_block {
+    uint16_t start;
+    uint16_t end;
+    /* The jump target first, then the fall-through */
+    int succs[2];
+    int num_succs;
+};
 
-int
-_walker_no_dead_insts(struct ubpf_vm *vm, struct ebpf_inst inst, void *data, int inst_off, char *visited)
+/*
+ * The basic blocks reachable from the entry of a function, in PC order, built once and shared
+ * by the verifier passes. As the verifier always has, it counts the
+ * instruction after a ja as reachable, so code only jumped over is not
+ * dead, but the edges between blocks are only those execution can take.
+ */
+struct ubpf_cfg {
+    struct ubpf_block *blocks;
+    int num_blocks;
+    /* Block containing each PC, or -1 if unreachable */
+    int *block_of;
+    /* Reachable PCs, including the second half of each lddw */
+    uint64_t *reached;
+    /* The predecessors of block b are preds[pred_start[b]] to preds[pred_start[b + 1] - 1] */
+    int *pred_start;
+    int *preds;
+};
+
+static void
+cfg_free(struct ubpf_cfg *cfg)
 {
-    return UBPF_WALK_CONTINUE;
+    ubpf_scratch_free(cfg->blocks);
+    ubpf_scratch_free(cfg->block_of);
+    ubpf_scratch_free(cfg->reached);
+    ubpf_scratch_free(cfg->pred_start);
+    ubpf_scratch_free(cfg->preds);
+}
+
+/*
+ * Finds the reachable instructions with an explicit stack, visiting jump
+ * targets before fall-throughs, then splits them into blocks. Returns -1 on
+ * a jump to itself or out of the program, or if out of memory.
+ */
+static int
+cfg_build(const struct ubpf_prog *prog, struct ubpf_cfg *cfg)
+{
+    int n = prog->num_insts;
+    uint64_t *leaders = ubpf_scratch_calloc(BITSET_WORDS(n), sizeof(uint64_t));
+    int *stack = ubpf_scratch_calloc(n, sizeof(stack[0]));
+    int sp = 0;
+    int rv = -1;
+    int pc, i;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->reached = ubpf_scratch_calloc(BITSET_WORDS(n), sizeof(uint64_t));
+    cfg->block_of = ubpf_scratch_calloc(n, sizeof(cfg->block_of[0]));
+    cfg->blocks = ubpf_scratch_calloc(n, sizeof(cfg->blocks[0]));
+    if (!leaders || !stack || !cfg->reached || !cfg->block_of || !cfg->blocks) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < prog->num_funcs; i++) {
+        bitset_set(leaders, prog->funcs[i].start);
+        bitset_set(cfg->reached, prog->funcs[i].start);
+        stack[sp++] = prog->funcs[i].start;
+    }
+
+    while (sp > 0) {
+        int targets[2];
+        int num_targets = 0;
+
+        pc = stack[--sp];
+        struct ebpf_inst inst = prog->insts[pc];
+
+        if (inst.opcode == EBPF_OP_EXIT) {
+            continue;
+        } else if (inst.opcode == EBPF_OP_LDDW && pc + 1 < n) {
+            /* validate() guarantees the second half exists */
+            bitset_set(cfg->reached, ++pc);
+        }
+
+        /* Like a conditional jump, ja counts as reaching what follows it */
+        if (pc + 1 < n) {
+            targets[num_targets++] = pc + 1;
+        }
+        if (isjmp(inst)) {
+            int next_pc = pc + 1 + inst.offset;
+            if (next_pc == pc) {
+                fprintf(stderr, "Jump to self at offset %d\n", pc);
+                goto out;
+            } else if (next_pc < 0 || next_pc > n - 1) {
+                fprintf(stderr, "Jump out-of-bounds at offset %d to %d\n", pc, next_pc);
+                goto out;
+            }
+            if (pc + 1 < n) {
+                bitset_set(leaders, pc + 1);
+            }
+            bitset_set(leaders, next_pc);
+            /* Pushed last, so explored first */
+            targets[num_targets++] = next_pc;
+        }
+
+        for (i = 0; i < num_targets; i++) {
+            if (!bitset_test(cfg->reached, targets[i])) {
+                bitset_set(cfg->reached, targets[i]);
+                stack[sp++] = targets[i];
+            }
+        }
+    }
+
+    for (pc = 0; pc < n; pc++) {
+        if (!bitset_test(cfg->reached, pc)) {
+            cfg->block_of[pc] = -1;
+            continue;
+        }
+        if (pc == 0 || bitset_test(leaders, pc) || cfg->block_of[pc - 1] < 0) {
+            struct ubpf_block *block = &cfg->blocks[cfg->num_blocks++];
+            block->start = pc;
+            block->num_succs = 0;
+        }
+        struct ubpf_block *block = &cfg->blocks[cfg->num_blocks - 1];
+        struct ebpf_inst inst = prog->insts[pc];
+        cfg->block_of[pc] = cfg->num_blocks - 1;
+        block->end = pc;
+
+        /* The first half of an lddw never ends a block, and isjmp includes exit */
+        if (inst.opcode == EBPF_OP_LDDW || (!isjmp(inst) && pc + 1 < n &&
+                !bitset_test(leaders, pc + 1) && bitset_test(cfg->reached, pc + 1))) {
+            continue;
+        }
+
+        if (isjmp(inst) && inst.opcode != EBPF_OP_EXIT) {
+            block->succs[block->num_succs++] = pc + 1 + inst.offset;
+        }
+        if (inst.opcode != EBPF_OP_EXIT && inst.opcode != EBPF_OP_JA && pc + 1 < n) {
+            block->succs[block->num_succs++] = pc + 1;
+        }
+    }
+
+    /* Successors were recorded as PCs until every block existed */
+    cfg->pred_start = ubpf_scratch_calloc(cfg->num_blocks + 1, sizeof(cfg->pred_start[0]));
+    cfg->preds = ubpf_scratch_calloc(2 * cfg->num_blocks, sizeof(cfg->preds[0]));
+    if (!cfg->pred_start || !cfg->preds) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+    for (i = 0; i < cfg->num_blocks; i++) {
+        struct ubpf_block *block = &cfg->blocks[i];
+        int j;
+        for (j = 0; j < block->num_succs; j++) {
+            block->succs[j] = cfg->block_of[block->succs[j]];
+            cfg->pred_start[block->succs[j] + 1]++;
+        }
+    }
+    for (i = 0; i < cfg->num_blocks; i++) {
+        cfg->pred_start[i + 1] += cfg->pred_start[i];
+    }
+    /* Fill each list from its end, using stack[] as the counts left */
+    for (i = 0; i < cfg->num_blocks; i++) {
+        stack[i] = cfg->pred_start[i + 1];
+    }
+    for (i = 0; i < cfg->num_blocks; i++) {
+        int j;
+        for (j = 0; j < cfg->blocks[i].num_succs; j++) {
+            cfg->preds[--stack[cfg->blocks[i].succs[j]]] = i;
+        }
+    }
+    rv = 0;
+
+out:
+    if (rv < 0) {
+        cfg_free(cfg);
+    }
+    ubpf_scratch_free(leaders);
+    ubpf_scratch_free(stack);
+    return rv;
 }
 
+// Verifier Passes
+
 int
-ubpf_verify_no_dead_insts(struct ubpf_vm *vm)
+ubpf_verify_no_dead_insts(const struct ubpf_prog *prog, const struct ubpf_cfg *cfg)
 {
-    char visited[vm->num_insts];
-    memset((void *)visited, 0, vm->num_insts);
-    int ret = ubpf_walk_paths(vm, _walker_no_dead_insts, NULL, 0, visited);
-    if (ret)
-        return ret;
     int any_dead = 0;
-    for (int i = 0; i < vm->num_insts; i++) {
-        if (visited[i] == 0) {
+    for (int i = 0; i < prog->num_insts; i++) {
+        if (!bitset_test(cfg->reached, i)) {
             any_dead = 1;
             fprintf(stderr, "Dead instruction at offset %d\n", i);
         }
@@ -154,59 +295,1615 @@ ubpf_verify_no_dead_insts(struct ubpf_vm *vm)
     return any_dead;
 }
 
+struct back_edge {
+    int latch;
+    int header;
+    /* The backward jump to report if the loop cannot be bounded */
+    int pc;
+};
+
+struct range_analysis;
+static int loop_bounded(const struct ubpf_prog *prog, const struct ubpf_cfg *cfg, const uint64_t *live,
+        const struct back_edge *edges, int num_edges, int header, struct range_analysis *ra);
+static struct range_analysis *range_analysis_new(const struct ubpf_prog *prog);
+static void range_analysis_free(struct range_analysis *ra);
+
+/*
+ * Looks for cycles with a depth-first search over the blocks from the
+ * entry of each function, as calls do not return along CFG edges, and accepts
+ * those of loops that provably run a bounded number of times, see
+ * loop_bounded. A cycle must contain a backward jump, since every other
+ * edge goes forward, and that jump is reported.
+ */
 int
-_walker_no_loops(struct ubpf_vm *vm, struct ebpf_inst inst, void *data, int inst_off, char *visited)
+ubpf_verify_no_loops(const struct ubpf_prog *prog, const struct ubpf_cfg *cfg)
 {
-    if (isjmp(inst) && (inst_off+1+inst.offset < inst_off) && visited[inst_off+1+inst.offset]) {
-        fprintf(stderr, "Loop detected at offset %d\n", inst_off);
-        return UBPF_WALK_STOP;
+    uint64_t *visited = ubpf_scratch_calloc(BITSET_WORDS(cfg->num_blocks), sizeof(uint64_t));
+    uint64_t *on_path = ubpf_scratch_calloc(BITSET_WORDS(cfg->num_blocks), sizeof(uint64_t));
+    uint64_t *bounded = ubpf_scratch_calloc(BITSET_WORDS(cfg->num_blocks), sizeof(uint64_t));
+    /* The path from the entry, and the next successor to explore from each block on it */
+    int *path = ubpf_scratch_calloc(cfg->num_blocks, sizeof(path[0]));
+    int *next_succ = ubpf_scratch_calloc(cfg->num_blocks, sizeof(next_succ[0]));
+    struct back_edge *edges = ubpf_scratch_calloc(2 * cfg->num_blocks, sizeof(edges[0]));
+    struct range_analysis *ra = NULL;
+    int num_edges = 0;
+    int depth = 0;
+    int rv = 1;
+    int i, f;
+
+    if (!visited || !on_path || !bounded || !path || !next_succ || !edges) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
     }
-    return UBPF_WALK_CONTINUE;
-}
 
-int
-ubpf_verify_no_loops(struct ubpf_vm *vm)
-{
-    return ubpf_walk_start(vm, _walker_no_loops, NULL);
+    for (f = 0; f < prog->num_funcs; f++) {
+        int entry = cfg->block_of[prog->funcs[f].start];
+        bitset_set(visited, entry);
+        bitset_set(on_path, entry);
+        path[depth] = entry;
+        next_succ[depth++] = 0;
+
+        while (depth > 0) {
+            const struct ubpf_block *block = &cfg->blocks[path[depth - 1]];
+
+            if (next_succ[depth - 1] == block->num_succs) {
+                bitset_clear(on_path, path[--depth]);
+                continue;
+            }
+
+            int succ = block->succs[next_succ[depth - 1]++];
+            if (bitset_test(on_path, succ)) {
+                int to = succ;
+                i = depth - 1;
+                /* Walk back along the cycle to the edge that goes backward */
+                while (cfg->blocks[to].start > cfg->blocks[path[i]].end) {
+                    to = path[i--];
+                }
+                edges[num_edges].latch = path[depth - 1];
+                edges[num_edges].header = succ;
+                edges[num_edges++].pc = cfg->blocks[path[i]].end;
+                continue;
+            }
+            if (!bitset_test(visited, succ)) {
+                bitset_set(visited, succ);
+                bitset_set(on_path, succ);
+                path[depth] = succ;
+                next_succ[depth++] = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < num_edges; i++) {
+        int header = edges[i].header;
+        if (bitset_test(bounded, header)) {
+            continue;
+        }
+        if (!ra) {
+            ra = range_analysis_new(prog);
+            if (!ra) {
+                fprintf(stderr, "Out of memory\n");
+                goto out;
+            }
+        }
+        int ret = loop_bounded(prog, cfg, visited, edges, num_edges, header, ra);
+        if (ret < 0) {
+            fprintf(stderr, "Out of memory\n");
+            goto out;
+        } else if (!ret) {
+            fprintf(stderr, "Loop detected at offset %d\n", edges[i].pc);
+            goto out;
+        }
+        bitset_set(bounded, header);
+    }
+    rv = 0;
+
+out:
+    if (ra) {
+        range_analysis_free(ra);
+        ubpf_scratch_free(ra);
+    }
+    ubpf_scratch_free(visited);
+    ubpf_scratch_free(on_path);
+    ubpf_scratch_free(bounded);
+    ubpf_scratch_free(path);
+    ubpf_scratch_free(next_succ);
+    ubpf_scratch_free(edges);
+    return rv;
 }
 
-int
-_walker_no_uninit_regs(struct ubpf_vm *vm, struct ebpf_inst inst, void *data, int inst_off, char *visited)
+/*
+ * Applies an instruction to the set of initialized registers, returning
+ * false if it reads one that may not be.
+ */
+static bool
+init_regs_step(struct ebpf_inst inst, uint16_t *init)
 {
-    char *reg_init = (void *)data;
     if (((inst.opcode == EBPF_OP_XOR_REG) ||
          (inst.opcode == EBPF_OP_XOR64_REG)) &&
         (inst.dst == inst.src)) {
         // Special case `xor r0, r0`
-        reg_init[inst.dst] = 1;
-    } else if (uses_src(inst) && (reg_init[inst.src] == 0)) {
-        fprintf(stderr, "Uninitialized register r%d accessed at offset %d\n", inst.src, inst_off);
-        return UBPF_WALK_STOP;
+        *init |= REG_MASK(inst.dst);
+    } else if (uses_src(inst) && !(*init & REG_MASK(inst.src))) {
+        return false;
     } else if (sets_dst(inst)) {
-        reg_init[inst.dst] = 1;
+        *init |= REG_MASK(inst.dst);
     }
     if (inst.opcode == EBPF_OP_CALL)
-        reg_init[0] = 1;
-    return UBPF_WALK_CONTINUE;
+        *init |= REG_MASK(0);
+    return true;
+}
+
+/* Registers initialized after a block, given those initialized before it */
+static bool
+init_regs_block(const struct ubpf_prog *prog, const struct ubpf_block *block, uint16_t *init, int *bad_pc)
+{
+    for (int pc = block->start; pc <= block->end; pc++) {
+        struct ebpf_inst inst = prog->insts[pc];
+        if (!init_regs_step(inst, init)) {
+            *bad_pc = pc;
+            return false;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    return true;
+}
+
+/*
+ * Checks that every register read is initialized on all paths to it,
+ * intersecting the initialized sets where paths meet.
+ */
+int
+ubpf_verify_no_uninit_regs(const struct ubpf_prog *prog, const struct ubpf_cfg *cfg)
+{
+    uint16_t *in = ubpf_scratch_calloc(cfg->num_blocks, sizeof(in[0]));
+    int *worklist = ubpf_scratch_calloc(cfg->num_blocks, sizeof(worklist[0]));
+    uint64_t *queued = ubpf_scratch_calloc(BITSET_WORDS(cfg->num_blocks), sizeof(uint64_t));
+    int sp = 0;
+    int rv = 1;
+    int i, j, pc;
+
+    if (!in || !worklist || !queued) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < cfg->num_blocks; i++) {
+        in[i] = UINT16_MAX;
+    }
+    /* Functions other than the entry take their arguments in r1 to r5 */
+    for (i = 0; i < prog->num_funcs; i++) {
+        int entry = cfg->block_of[prog->funcs[i].start];
+        in[entry] = (i == 0 ? REG_MASK(1) : CALL_CLOBBERED_MASK) | REG_MASK(10);
+        bitset_set(queued, entry);
+        worklist[sp++] = entry;
+    }
+
+    while (sp > 0) {
+        int b = worklist[--sp];
+        uint16_t init = in[b];
+        bitset_clear(queued, b);
+
+        /* Reads of uninitialized registers are reported below, in PC order */
+        init_regs_block(prog, &cfg->blocks[b], &init, &pc);
+        for (j = 0; j < cfg->blocks[b].num_succs; j++) {
+            int succ = cfg->blocks[b].succs[j];
+            if ((in[succ] & init) != in[succ]) {
+                in[succ] &= init;
+                if (!bitset_test(queued, succ)) {
+                    bitset_set(queued, succ);
+                    worklist[sp++] = succ;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < cfg->num_blocks; i++) {
+        uint16_t init = in[i];
+        if (!init_regs_block(prog, &cfg->blocks[i], &init, &pc)) {
+            fprintf(stderr, "Uninitialized register r%d accessed at offset %d\n", prog->insts[pc].src, pc);
+            goto out;
+        }
+    }
+    rv = 0;
+
+out:
+    ubpf_scratch_free(in);
+    ubpf_scratch_free(worklist);
+    ubpf_scratch_free(queued);
+    return rv;
 }
 
 int
-ubpf_verify_no_uninit_regs(struct ubpf_vm *vm)
+ubpf_verify_prog(const struct ubpf_prog *prog)
 {
-    char reg_init[16] = {0};
-    reg_init[1] = 1;
-    reg_init[10] = 1;
-    return ubpf_walk_start(vm, _walker_no_uninit_regs, (void *)reg_init);
+    struct ubpf_cfg cfg;
+    int ret = 1;
+
+    if (cfg_build(prog, &cfg) < 0)
+        return 1;
+    if (!ubpf_verify_no_loops(prog, &cfg) &&
+        !ubpf_verify_no_dead_insts(prog, &cfg) &&
+        !ubpf_verify_no_uninit_regs(prog, &cfg))
+        ret = 0;
+    cfg_free(&cfg);
+    return ret;
 }
 
 int
 ubpf_verify(struct ubpf_vm *vm)
 {
-    if (ubpf_verify_no_loops(vm))
-        return 1;
-    if (ubpf_verify_no_dead_insts(vm))
-        return 1;
-    if (ubpf_verify_no_uninit_regs(vm))
-        return 1;
-    return 0;
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    int ret = prog ? ubpf_verify_prog(prog) : 1;
+    ubpf_read_unlock(vm, &section);
+    return ret;
+}
+
+// Register Dataflow
+
+/* Registers read by an instruction */
+uint16_t
+ubpf_inst_uses(struct ebpf_inst inst)
+{
+    uint16_t src = (inst.opcode & EBPF_SRC_REG) ? REG_MASK(inst.src) : 0;
+
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        if (inst.opcode == EBPF_OP_NEG || inst.opcode == EBPF_OP_NEG64 ||
+            inst.opcode == EBPF_OP_LE || inst.opcode == EBPF_OP_BE) {
+            return REG_MASK(inst.dst);
+        } else if ((inst.opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK)) {
+            return src;
+        }
+        return REG_MASK(inst.dst) | src;
+    case EBPF_CLS_LDX:
+        return REG_MASK(inst.src);
+    case EBPF_CLS_ST:
+        return REG_MASK(inst.dst);
+    case EBPF_CLS_STX:
+        return REG_MASK(inst.dst) | REG_MASK(inst.src);
+    case EBPF_CLS_JMP:
+        if (inst.opcode == EBPF_OP_JA) {
+            return 0;
+        } else if (inst.opcode == EBPF_OP_CALL) {
+            return CALL_CLOBBERED_MASK;
+        } else if (inst.opcode == EBPF_OP_EXIT) {
+            return REG_MASK(0);
+        }
+        return REG_MASK(inst.dst) | src;
+    default:
+        return 0;
+    }
+}
+
+/* Registers written by an instruction, including those clobbered by calls */
+uint16_t
+ubpf_inst_defs(struct ebpf_inst inst)
+{
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+    case EBPF_CLS_LDX:
+    case EBPF_CLS_LD:
+        return REG_MASK(inst.dst);
+    case EBPF_CLS_JMP:
+        if (inst.opcode == EBPF_OP_CALL) {
+            return REG_MASK(0) | CALL_CLOBBERED_MASK;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/* Fills 'succs' with the PCs that may execute after 'pc' and returns how many */
+int
+ubpf_successors(const struct ubpf_prog *prog, int pc, int succs[2])
+{
+    struct ebpf_inst inst = prog->insts[pc];
+    int targets[2];
+    int num_targets = 0;
+    int i, n = 0;
+
+    if (inst.opcode == EBPF_OP_EXIT) {
+        return 0;
+    } else if (inst.opcode == EBPF_OP_LDDW) {
+        targets[num_targets++] = pc + 2;
+    } else if (inst.opcode == EBPF_OP_JA) {
+        targets[num_targets++] = pc + 1 + inst.offset;
+    } else if (isjmp(inst)) {
+        targets[num_targets++] = pc + 1;
+        targets[num_targets++] = pc + 1 + inst.offset;
+    } else {
+        targets[num_targets++] = pc + 1;
+    }
+
+    for (i = 0; i < num_targets; i++) {
+        if (targets[i] >= 0 && targets[i] < prog->num_insts) {
+            succs[n++] = targets[i];
+        }
+    }
+    return n;
+}
+
+/* Registers read by the instruction at 'pc', where calls read only the arguments declared */
+static uint16_t
+prog_inst_uses(const struct ubpf_prog *prog, int pc)
+{
+    struct ebpf_inst inst = prog->insts[pc];
+    if (inst.opcode == EBPF_OP_CALL && !ubpf_is_local_call(inst) &&
+            inst.imm >= 0 && inst.imm < prog->vm->num_ext_funcs) {
+        return CALL_CLOBBERED_MASK & ((REG_MASK(prog->vm->ext_func_info[inst.imm].num_args) << 1) - 1);
+    }
+    return ubpf_inst_uses(inst);
+}
+
+/*
+ * Computes two per-instruction register sets, as bitmasks indexed by eBPF
+ * register number:
+ *
+ * live_out[pc]: registers that may be read after 'pc' before being written,
+ * where calls of registered functions read only the arguments declared.
+ * defined_in[pc]: registers that may have been written on some path
+ * reaching 'pc', counting the arguments of functions other than the entry
+ * as written. Calls leave r1-r5 undefined.
+ *
+ * Either array may be NULL. Both are iterated to a fixed point, so
+ * backward jumps are handled.
+ */
+void
+ubpf_analyze_registers(const struct ubpf_prog *prog, uint16_t *live_out, uint16_t *defined_in)
+{
+    int succs[2];
+    bool changed;
+    int i, j, n;
+
+    if (live_out) {
+        memset(live_out, 0, prog->num_insts * sizeof(live_out[0]));
+        do {
+            changed = false;
+            for (i = prog->num_insts - 1; i >= 0; i--) {
+                uint16_t out = 0;
+                n = ubpf_successors(prog, i, succs);
+                for (j = 0; j < n; j++) {
+                    struct ebpf_inst next = prog->insts[succs[j]];
+                    out |= prog_inst_uses(prog, succs[j]) | (live_out[succs[j]] & ~ubpf_inst_defs(next));
+                }
+                if (out != live_out[i]) {
+                    live_out[i] = out;
+                    changed = true;
+                }
+            }
+        } while (changed);
+    }
+
+    if (defined_in) {
+        memset(defined_in, 0, prog->num_insts * sizeof(defined_in[0]));
+        defined_in[0] = REG_MASK(1) | REG_MASK(10);
+        for (i = 1; i < prog->num_funcs; i++) {
+            defined_in[prog->funcs[i].start] = CALL_CLOBBERED_MASK | REG_MASK(10);
+        }
+        do {
+            changed = false;
+            for (i = 0; i < prog->num_insts; i++) {
+                struct ebpf_inst inst = prog->insts[i];
+                uint16_t out = defined_in[i] | ubpf_inst_defs(inst);
+                if (inst.opcode == EBPF_OP_CALL) {
+                    out &= ~CALL_CLOBBERED_MASK;
+                }
+                n = ubpf_successors(prog, i, succs);
+                for (j = 0; j < n; j++) {
+                    if ((defined_in[succs[j]] | out) != defined_in[succs[j]]) {
+                        defined_in[succs[j]] |= out;
+                        changed = true;
+                    }
+                }
+            }
+        } while (changed);
+    }
+}
+
+// Value Ranges
+
+enum range_type {
+    /* Anything, including pointers no longer followed */
+    RANGE_UNKNOWN,
+    RANGE_SCALAR,
+    /* mem, r1 on entry, whose size is only known at runtime */
+    RANGE_CTX,
+    /* r10 */
+    RANGE_STACK,
+    /* A map loaded by lddw, which only helpers may use */
+    RANGE_MAP,
+    /* A value in a map, found by a lookup checked against NULL */
+    RANGE_MAP_VALUE,
+    /* The result of a lookup not yet checked against NULL */
+    RANGE_MAP_OR_NULL,
+};
+
+/*
+ * What a register may hold: a scalar within [min, max], or a pointer plus
+ * an offset within [(int64_t)min, (int64_t)max]. Offsets stay within
+ * int32_t, so adding two of them cannot overflow.
+ */
+struct range {
+    uint8_t type;
+    /* Index in prog->maps */
+    uint8_t map;
+    /* The PC of the lookup, so a NULL check covers every copy of its result */
+    uint16_t id;
+    uint64_t min;
+    uint64_t max;
+};
+
+/* Times the ranges at a PC may grow before those still growing are given up on */
+#define MAX_RANGE_VISITS 16
+
+struct range_analysis {
+    const struct ubpf_prog *prog;
+    /* Ranges on entry to each PC */
+    struct range (*in)[11];
+    uint8_t *visits;
+    bool *reached;
+    /* Function of the PC being analyzed */
+    int func;
+    /* Set for a function once a pointer to its stack has been lost track of, so any of it may be accessed */
+    bool *stack_escaped;
+};
+
+static const struct range unknown_range = { RANGE_UNKNOWN };
+
+static struct range
+scalar_range(uint64_t min, uint64_t max)
+{
+    struct range r = { RANGE_SCALAR, 0, 0, min, max };
+    return r;
+}
+
+static bool
+is_pointer(struct range r)
+{
+    return r.type >= RANGE_CTX;
+}
+
+/* Forgets what a register holds */
+static void
+lose_range(struct range_analysis *ra, struct range *r)
+{
+    if (r->type == RANGE_STACK) {
+        ra->stack_escaped[ra->func] = true;
+    }
+    *r = unknown_range;
+}
+
+/* All ones up to the highest bit set in x */
+static uint64_t
+fill_bits(uint64_t x)
+{
+    return x ? UINT64_MAX >> __builtin_clzll(x) : 0;
+}
+
+/*
+ * The range of a 64-bit ALU operation on scalars, or of a 32-bit one whose
+ * operands fit in 32 bits, before truncation.
+ */
+static struct range
+scalar_alu(struct ebpf_inst inst, struct range dst, struct range src, unsigned width)
+{
+    bool known = dst.min == dst.max && src.min == src.max;
+    uint64_t hi;
+
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case EBPF_OP_ADD_IMM & EBPF_ALU_OP_MASK:
+        if (dst.max + src.max < dst.max) {
+            break;
+        }
+        return scalar_range(dst.min + src.min, dst.max + src.max);
+    case EBPF_OP_SUB_IMM & EBPF_ALU_OP_MASK:
+        if (dst.min < src.max) {
+            break;
+        }
+        return scalar_range(dst.min - src.max, dst.max - src.min);
+    case EBPF_OP_MUL_IMM & EBPF_ALU_OP_MASK:
+        if (__builtin_mul_overflow(dst.max, src.max, &hi)) {
+            break;
+        }
+        return scalar_range(dst.min * src.min, hi);
+    case EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK:
+        /* Division by zero stops the program */
+        if (src.min == 0) {
+            return scalar_range(0, dst.max);
+        }
+        return scalar_range(dst.min / src.max, dst.max / src.min);
+    case EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK:
+        if (src.max == 0 || dst.max < src.max) {
+            return scalar_range(0, dst.max);
+        }
+        return scalar_range(0, src.max - 1);
+    case EBPF_OP_OR_IMM & EBPF_ALU_OP_MASK:
+        if (known) {
+            return scalar_range(dst.min | src.min, dst.min | src.min);
+        }
+        return scalar_range(dst.min > src.min ? dst.min : src.min, fill_bits(dst.max | src.max));
+    case EBPF_OP_AND_IMM & EBPF_ALU_OP_MASK:
+        if (known) {
+            return scalar_range(dst.min & src.min, dst.min & src.min);
+        }
+        return scalar_range(0, dst.max < src.max ? dst.max : src.max);
+    case EBPF_OP_XOR_IMM & EBPF_ALU_OP_MASK:
+        if (known) {
+            return scalar_range(dst.min ^ src.min, dst.min ^ src.min);
+        }
+        return scalar_range(0, fill_bits(dst.max | src.max));
+    case EBPF_OP_LSH_IMM & EBPF_ALU_OP_MASK:
+        if (src.min != src.max || src.min >= width || (src.min && dst.max >> (64 - src.min))) {
+            break;
+        }
+        return scalar_range(dst.min << src.min, dst.max << src.min);
+    case EBPF_OP_RSH_IMM & EBPF_ALU_OP_MASK:
+        if (src.max >= width) {
+            break;
+        }
+        return scalar_range(dst.min >> src.max, dst.max >> src.min);
+    case EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK:
+        return src;
+    }
+
+    return scalar_range(0, UINT64_MAX);
+}
+
+/*
+ * The signed range [*lo, *hi] of a scalar added to a pointer, if it is
+ * small enough to follow: one known not to exceed INT32_MAX, or a constant
+ * that fits int32_t.
+ */
+static bool
+pointer_delta(struct range r, int64_t *lo, int64_t *hi)
+{
+    if (r.type != RANGE_SCALAR) {
+        return false;
+    }
+    if (r.max <= INT32_MAX) {
+        *lo = r.min;
+        *hi = r.max;
+        return true;
+    }
+    if (r.min == r.max && (int64_t)r.min >= INT32_MIN && (int64_t)r.min <= INT32_MAX) {
+        *lo = *hi = (int64_t)r.min;
+        return true;
+    }
+    return false;
+}
+
+/* Adds [lo, hi], or subtracts it, from the offset of a pointer */
+static void
+offset_pointer(struct range_analysis *ra, struct range *ptr, int64_t lo, int64_t hi, bool sub)
+{
+    int64_t min = (int64_t)ptr->min + (sub ? -hi : lo);
+    int64_t max = (int64_t)ptr->max + (sub ? -lo : hi);
+
+    if (ptr->type == RANGE_MAP || ptr->type == RANGE_MAP_OR_NULL ||
+            min < INT32_MIN || max > INT32_MAX) {
+        lose_range(ra, ptr);
+        return;
+    }
+    ptr->min = min;
+    ptr->max = max;
+}
+
+static void
+range_alu(struct range_analysis *ra, struct range *regs, struct ebpf_inst inst)
+{
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    unsigned width = is64 ? 64 : 32;
+    int op = inst.opcode & EBPF_ALU_OP_MASK;
+    struct range *dst = &regs[inst.dst];
+    struct range src;
+    int64_t lo, hi;
+
+    if (inst.opcode & EBPF_SRC_REG) {
+        src = regs[inst.src];
+    } else if (is64) {
+        src = scalar_range((int64_t)inst.imm, (int64_t)inst.imm);
+    } else {
+        src = scalar_range((uint32_t)inst.imm, (uint32_t)inst.imm);
+    }
+
+    if (inst.opcode == EBPF_OP_MOV64_REG) {
+        *dst = src;
+        return;
+    }
+
+    bool add = op == (EBPF_OP_ADD_IMM & EBPF_ALU_OP_MASK);
+    bool sub = op == (EBPF_OP_SUB_IMM & EBPF_ALU_OP_MASK);
+    if (is64 && (add || sub) && is_pointer(*dst) && pointer_delta(src, &lo, &hi)) {
+        offset_pointer(ra, dst, lo, hi, sub);
+        return;
+    }
+    if (is64 && add && is_pointer(src) && pointer_delta(*dst, &lo, &hi)) {
+        *dst = src;
+        offset_pointer(ra, dst, lo, hi, false);
+        return;
+    }
+
+    if (src.type == RANGE_STACK) {
+        ra->stack_escaped[ra->func] = true;
+    }
+    if (inst.opcode == EBPF_OP_LE || inst.opcode == EBPF_OP_BE) {
+        lose_range(ra, dst);
+        *dst = scalar_range(0, inst.imm >= 64 ? UINT64_MAX : ((uint64_t)1 << inst.imm) - 1);
+        return;
+    }
+    bool unary = op == (EBPF_OP_NEG & EBPF_ALU_OP_MASK) || op == (EBPF_OP_ARSH_IMM & EBPF_ALU_OP_MASK);
+    bool mov = op == (EBPF_OP_MOV_IMM & EBPF_ALU_OP_MASK);
+    if (unary || (!mov && dst->type != RANGE_SCALAR) || src.type != RANGE_SCALAR) {
+        lose_range(ra, dst);
+        *dst = scalar_range(0, is64 ? UINT64_MAX : UINT32_MAX);
+        return;
+    }
+
+    struct range d = mov ? scalar_range(0, 0) : *dst;
+    if (!is64) {
+        /* Only the low 32 bits of the operands are used */
+        if (d.max > UINT32_MAX) {
+            d = scalar_range(0, UINT32_MAX);
+        }
+        if (src.max > UINT32_MAX) {
+            src = scalar_range(0, UINT32_MAX);
+        }
+    }
+    *dst = scalar_alu(inst, d, src, width);
+    if (!is64 && dst->max > UINT32_MAX) {
+        *dst = scalar_range(0, UINT32_MAX);
+    }
+}
+
+static int
+access_size(struct ebpf_inst inst)
+{
+    switch (inst.opcode & 0x18) {
+    case EBPF_SIZE_B: return 1;
+    case EBPF_SIZE_H: return 2;
+    case EBPF_SIZE_W: return 4;
+    default: return 8;
+    }
+}
+
+/* The range after a call, of r0 and the clobbered argument registers */
+static void
+range_call(const struct ubpf_prog *prog, struct range *regs, int pc)
+{
+    int i;
+
+    if (ubpf_is_local_call(prog->insts[pc])) {
+        regs[0] = unknown_range;
+        for (i = 1; i <= 5; i++) {
+            regs[i] = unknown_range;
+        }
+        return;
+    }
+
+    ext_func fn = prog->vm->ext_funcs[prog->insts[pc].imm];
+    if ((fn == (ext_func)ubpf_map_lookup || fn == (ext_func)ubpf_map_lookup_cpu) &&
+            regs[1].type == RANGE_MAP) {
+        struct range r = { RANGE_MAP_OR_NULL, regs[1].map, pc, 0, 0 };
+        /* Copies of what an earlier run of this call returned are unrelated to the new result */
+        for (i = 6; i <= 9; i++) {
+            if (regs[i].type == RANGE_MAP_OR_NULL && regs[i].id == pc) {
+                regs[i] = unknown_range;
+            }
+        }
+        regs[0] = r;
+    } else {
+        regs[0] = scalar_range(0, UINT64_MAX);
+    }
+    for (i = 1; i <= 5; i++) {
+        regs[i] = unknown_range;
+    }
+}
+
+/*
+ * Narrows the ranges for one way out of a conditional jump, returning
+ * false if it cannot be taken. Unsigned comparisons with a negative
+ * immediate are left alone, since the interpreter zero-extends it and the
+ * JIT sign-extends it.
+ */
+static bool
+refine_range(struct range *regs, struct ebpf_inst inst, bool taken)
+{
+    struct range *r = &regs[inst.dst];
+    int op = inst.opcode & EBPF_ALU_OP_MASK;
+    bool eq = op == (EBPF_OP_JEQ_IMM & EBPF_ALU_OP_MASK);
+    bool ne = op == (EBPF_OP_JNE_IMM & EBPF_ALU_OP_MASK);
+    uint64_t k;
+    int i;
+
+    if (inst.opcode == EBPF_OP_JSWITCH) {
+        return true;
+    } else if (inst.opcode & EBPF_SRC_REG) {
+        if (regs[inst.src].type != RANGE_SCALAR || regs[inst.src].min != regs[inst.src].max) {
+            return true;
+        }
+        k = regs[inst.src].min;
+    } else if (eq || ne || inst.imm >= 0) {
+        k = (int64_t)inst.imm;
+    } else {
+        return true;
+    }
+
+    if (r->type == RANGE_MAP_OR_NULL && k == 0 && (eq || ne)) {
+        bool null = eq == taken;
+        struct range value = { RANGE_MAP_VALUE, r->map, 0, 0, 0 };
+        uint16_t id = r->id;
+        for (i = 0; i <= 10; i++) {
+            if (regs[i].type == RANGE_MAP_OR_NULL && regs[i].id == id) {
+                regs[i] = null ? scalar_range(0, 0) : value;
+            }
+        }
+        return true;
+    }
+
+    if (r->type != RANGE_SCALAR) {
+        return true;
+    }
+
+    /* Signed and unsigned order agree if neither side is negative */
+    bool nonneg = r->max <= INT64_MAX && k <= INT64_MAX;
+    switch (op) {
+    case EBPF_OP_JSGT_IMM & EBPF_ALU_OP_MASK:
+        op = nonneg ? EBPF_OP_JGT_IMM & EBPF_ALU_OP_MASK : -1;
+        break;
+    case EBPF_OP_JSGE_IMM & EBPF_ALU_OP_MASK:
+        op = nonneg ? EBPF_OP_JGE_IMM & EBPF_ALU_OP_MASK : -1;
+        break;
+    case EBPF_OP_JSLT_IMM & EBPF_ALU_OP_MASK:
+        op = nonneg ? EBPF_OP_JLT_IMM & EBPF_ALU_OP_MASK : -1;
+        break;
+    case EBPF_OP_JSLE_IMM & EBPF_ALU_OP_MASK:
+        op = nonneg ? EBPF_OP_JLE_IMM & EBPF_ALU_OP_MASK : -1;
+        break;
+    }
+
+    uint64_t min = r->min, max = r->max;
+    if ((eq && taken) || (ne && !taken)) {
+        min = k > min ? k : min;
+        max = k < max ? k : max;
+    } else if (eq || ne) {
+        if (min == k && max == k) {
+            return false;
+        }
+        min += min == k;
+        max -= max == k;
+    } else {
+        /* Turn each into x > k or x <= k, or x >= k or x < k */
+        bool gt = op == (EBPF_OP_JGT_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_JLE_IMM & EBPF_ALU_OP_MASK);
+        bool ge = op == (EBPF_OP_JGE_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_JLT_IMM & EBPF_ALU_OP_MASK);
+        bool upper = op == (EBPF_OP_JGT_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_JGE_IMM & EBPF_ALU_OP_MASK);
+        if (!gt && !ge) {
+            return true;
+        }
+        if (upper == taken) {
+            /* x > k or x >= k */
+            if (gt && k == UINT64_MAX) {
+                return false;
+            }
+            uint64_t lo = gt ? k + 1 : k;
+            min = lo > min ? lo : min;
+        } else {
+            /* x <= k or x < k */
+            if (ge && k == 0) {
+                return false;
+            }
+            uint64_t hi = ge ? k - 1 : k;
+            max = hi < max ? hi : max;
+        }
+    }
+
+    if (min > max) {
+        return false;
+    }
+    r->min = min;
+    r->max = max;
+    return true;
+}
+
+/*
+ * Merges 'from' into the ranges at a PC, returning whether they grew. Once
+ * widening, whatever still grows is given up on, so loops reach a fixpoint.
+ */
+static bool
+join_range(struct range_analysis *ra, struct range *into, struct range from, bool widen)
+{
+    if (into->type == from.type && into->map == from.map && into->id == from.id) {
+        uint64_t min, max;
+        if (into->type == RANGE_SCALAR) {
+            min = from.min < into->min ? from.min : into->min;
+            max = from.max > into->max ? from.max : into->max;
+        } else {
+            min = (int64_t)from.min < (int64_t)into->min ? from.min : into->min;
+            max = (int64_t)from.max > (int64_t)into->max ? from.max : into->max;
+        }
+        if (min == into->min && max == into->max) {
+            return false;
+        }
+        if (!widen) {
+            into->min = min;
+            into->max = max;
+        } else if (into->type == RANGE_SCALAR) {
+            *into = scalar_range(0, UINT64_MAX);
+        } else {
+            lose_range(ra, into);
+        }
+        return true;
+    }
+
+    if (from.type == RANGE_STACK) {
+        ra->stack_escaped[ra->func] = true;
+    }
+    if (into->type == RANGE_UNKNOWN) {
+        return false;
+    }
+    lose_range(ra, into);
+    return true;
+}
+
+static void
+propagate_ranges(struct range_analysis *ra, int next, const struct range *regs, int *stack, int *sp, bool *queued)
+{
+    bool changed = false;
+    int i;
+
+    if (!ra->reached[next]) {
+        memcpy(ra->in[next], regs, sizeof(ra->in[next]));
+        ra->reached[next] = true;
+        changed = true;
+    } else {
+        bool widen = ra->visits[next] >= MAX_RANGE_VISITS;
+        for (i = 0; i <= 10; i++) {
+            changed |= join_range(ra, &ra->in[next][i], regs[i], widen);
+        }
+        if (changed && !widen) {
+            ra->visits[next]++;
+        }
+    }
+
+    if (changed && !queued[next]) {
+        queued[next] = true;
+        stack[(*sp)++] = next;
+    }
+}
+
+/* The base register and range of the bytes accessed at 'pc', if it accesses memory */
+static bool
+accessed_range(const struct range *regs, struct ebpf_inst inst, struct range *base, int64_t *lo, int64_t *hi)
+{
+    int cls = inst.opcode & EBPF_CLS_MASK;
+
+    if (cls != EBPF_CLS_LDX && cls != EBPF_CLS_ST && cls != EBPF_CLS_STX) {
+        return false;
+    }
+    *base = regs[cls == EBPF_CLS_LDX ? inst.src : inst.dst];
+    *lo = (int64_t)base->min + inst.offset;
+    *hi = (int64_t)base->max + inst.offset + access_size(inst);
+    return true;
+}
+
+/*
+ * Whether the memory the helper called at 'pc' reads through its pointer
+ * arguments, if any, is within the stack or a map value, for any length
+ * its length arguments may hold.
+ */
+static bool
+mem_args_safe(const struct ubpf_prog *prog, const struct range *regs, int pc)
+{
+    const struct ubpf_ext_func_info *info = &prog->vm->ext_func_info[prog->insts[pc].imm];
+    int i;
+
+    for (i = 0; i < UBPF_MAX_MEM_ARGS && info->mem_args[i][0]; i++) {
+        struct range ptr = regs[info->mem_args[i][0]];
+        struct range len = regs[info->mem_args[i][1]];
+        if (len.type != RANGE_SCALAR || len.max > INT32_MAX) {
+            return false;
+        }
+        int64_t lo = (int64_t)ptr.min;
+        int64_t hi = (int64_t)ptr.max + (int64_t)len.max;
+        if (len.max == 0) {
+            continue;
+        } else if (ptr.type == RANGE_STACK) {
+            if (lo < -(int64_t)prog->funcs[ubpf_find_func(prog, pc)].stack_size || hi > 0) {
+                return false;
+            }
+        } else if (ptr.type != RANGE_MAP_VALUE || lo < 0 || hi > prog->maps[ptr.map]->value_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Applies the instruction at 'pc' to the ranges before it */
+static void
+range_step(struct range_analysis *ra, int pc, struct range *regs)
+{
+    const struct ubpf_prog *prog = ra->prog;
+    struct ebpf_inst inst = prog->insts[pc];
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    int j;
+
+    if (cls == EBPF_CLS_LDX) {
+        int size = access_size(inst);
+        regs[inst.dst] = scalar_range(0, size == 8 ? UINT64_MAX : ((uint64_t)1 << (size * 8)) - 1);
+    } else if (cls == EBPF_CLS_STX) {
+        if (regs[inst.src].type == RANGE_STACK) {
+            ra->stack_escaped[ra->func] = true;
+        }
+    } else if (inst.opcode == EBPF_OP_CALL) {
+        range_call(prog, regs, pc);
+    } else if (inst.opcode == EBPF_OP_LDDW) {
+        uint64_t imm = (uint32_t)inst.imm | ((uint64_t)prog->insts[pc + 1].imm << 32);
+        lose_range(ra, &regs[inst.dst]);
+        if (inst.src == EBPF_PSEUDO_MAP_IDX) {
+            for (j = 0; j < prog->num_maps && (uintptr_t)prog->maps[j] != imm; j++);
+            if (j < prog->num_maps) {
+                struct range r = { RANGE_MAP, j, 0, 0, 0 };
+                regs[inst.dst] = r;
+            }
+        } else {
+            regs[inst.dst] = scalar_range(imm, imm);
+        }
+    } else if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) {
+        range_alu(ra, regs, inst);
+    }
+}
+
+static void
+range_analysis_free(struct range_analysis *ra)
+{
+    ubpf_scratch_free(ra->in);
+    ubpf_scratch_free(ra->visits);
+    ubpf_scratch_free(ra->reached);
+    ubpf_scratch_free(ra->stack_escaped);
+}
+
+/*
+ * Runs the analysis from the entry of each function to a fixpoint, filling
+ * ra->in for each PC in ra->reached. Returns -1 if out of memory.
+ */
+static int
+range_fixpoint(const struct ubpf_prog *prog, struct range_analysis *ra)
+{
+    int *stack = ubpf_scratch_calloc(prog->num_insts, sizeof(stack[0]));
+    bool *queued = ubpf_scratch_calloc(prog->num_insts, sizeof(queued[0]));
+    int sp = 0;
+    int rv = -1;
+    int i, j, n;
+
+    memset(ra, 0, sizeof(*ra));
+    ra->prog = prog;
+    ra->in = ubpf_scratch_calloc(prog->num_insts, sizeof(ra->in[0]));
+    ra->visits = ubpf_scratch_calloc(prog->num_insts, sizeof(ra->visits[0]));
+    ra->reached = ubpf_scratch_calloc(prog->num_insts, sizeof(ra->reached[0]));
+    ra->stack_escaped = ubpf_scratch_calloc(prog->num_funcs, sizeof(ra->stack_escaped[0]));
+    if (!stack || !queued || !ra->in || !ra->visits || !ra->reached || !ra->stack_escaped) {
+        range_analysis_free(ra);
+        goto out;
+    }
+
+    /* Only the entry function is passed the context; the others' arguments are unknown */
+    for (j = 0; j < prog->num_funcs; j++) {
+        int start = prog->funcs[j].start;
+        for (i = 0; i <= 10; i++) {
+            ra->in[start][i] = unknown_range;
+        }
+        if (j == 0) {
+            ra->in[start][1].type = RANGE_CTX;
+        }
+        ra->in[start][10].type = RANGE_STACK;
+        ra->reached[start] = queued[start] = true;
+        stack[sp++] = start;
+    }
+
+    while (sp > 0) {
+        int pc = stack[--sp];
+        struct ebpf_inst inst = prog->insts[pc];
+        struct range regs[11];
+        int succs[2];
+
+        queued[pc] = false;
+        ra->func = ubpf_find_func(prog, pc);
+        memcpy(regs, ra->in[pc], sizeof(regs));
+        range_step(ra, pc, regs);
+
+        if (isjmp(inst) && inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_EXIT) {
+            for (j = 0; j < 2; j++) {
+                struct range out[11];
+                int next = j ? pc + 1 + inst.offset : pc + 1;
+                if (next < 0 || next >= prog->num_insts) {
+                    continue;
+                }
+                memcpy(out, regs, sizeof(out));
+                if (refine_range(out, inst, j)) {
+                    propagate_ranges(ra, next, out, stack, &sp, queued);
+                }
+            }
+        } else {
+            n = ubpf_successors(prog, pc, succs);
+            for (j = 0; j < n; j++) {
+                propagate_ranges(ra, succs[j], regs, stack, &sp, queued);
+            }
+        }
+    }
+    rv = 0;
+
+out:
+    ubpf_scratch_free(stack);
+    ubpf_scratch_free(queued);
+    return rv;
+}
+
+/* Runs the analysis into a new struct, or returns NULL if out of memory */
+static struct range_analysis *
+range_analysis_new(const struct ubpf_prog *prog)
+{
+    struct range_analysis *ra = ubpf_scratch_calloc(1, sizeof(*ra));
+
+    if (ra && range_fixpoint(prog, ra) < 0) {
+        ubpf_scratch_free(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+/*
+ * Longest sums of frame sizes along chains of calls: 'above' each function,
+ * over the callers that may be under it, and 'below', over the callees it
+ * may be under. Since chains are at most MAX_CALL_FRAMES long, relaxing
+ * every call that many times reaches them. 'level' is the most calls from
+ * a function no other calls, which orders callers before their callees.
+ */
+static void
+frame_sums(const struct ubpf_prog *prog, const int (*calls)[2], int num_calls,
+        uint32_t *above, uint32_t *below, int *level)
+{
+    int i, j;
+
+    memset(above, 0, prog->num_funcs * sizeof(above[0]));
+    memset(below, 0, prog->num_funcs * sizeof(below[0]));
+    memset(level, 0, prog->num_funcs * sizeof(level[0]));
+    for (i = 0; i < MAX_CALL_FRAMES; i++) {
+        for (j = 0; j < num_calls; j++) {
+            int caller = calls[j][0], callee = calls[j][1];
+            uint32_t a = above[caller] + prog->funcs[caller].stack_size;
+            uint32_t b = below[callee] + prog->funcs[callee].stack_size;
+            above[callee] = a > above[callee] ? a : above[callee];
+            below[caller] = b > below[caller] ? b : below[caller];
+            level[callee] = level[caller] + 1 > level[callee] ? level[caller] + 1 : level[callee];
+        }
+    }
+}
+
+/*
+ * Works out what each register may hold at each instruction: scalars
+ * within a range, or pointers to the context, stack or a map value with
+ * offsets within a range. From that it sets the stack_size of each of
+ * prog->funcs, the bytes below r10 the function may access, and
+ * prog->safe_accesses, the instructions whose memory accesses need no
+ * bounds check.
+ *
+ * Helpers and called functions are assumed to access only the stack above
+ * the pointers passed to them. When a function uses its stack in a way
+ * this cannot follow, such as a pointer into it being stored, it gets all
+ * of 'limit' that the deepest chain of calls through it leaves, callers
+ * first. prog->stack_size is what the deepest chain needs, which may not
+ * exceed 'limit'. Returns -1 if it does or if out of memory.
+ */
+int
+ubpf_analyze_ranges(struct ubpf_prog *prog, uint32_t limit, char **errmsg)
+{
+    struct range_analysis ra;
+    uint8_t *safe = calloc(prog->num_insts, sizeof(safe[0]));
+    int64_t *depth = ubpf_scratch_calloc(prog->num_funcs, sizeof(depth[0]));
+    uint32_t *above = ubpf_scratch_calloc(prog->num_funcs, sizeof(above[0]));
+    uint32_t *below = ubpf_scratch_calloc(prog->num_funcs, sizeof(below[0]));
+    int *level = ubpf_scratch_calloc(prog->num_funcs, sizeof(level[0]));
+    int (*calls)[2] = ubpf_scratch_calloc(prog->num_insts, sizeof(calls[0]));
+    struct range base;
+    int64_t lo, hi;
+    int num_calls = 0;
+    int rv = -1;
+    int i, j, f;
+
+    if (!safe || !depth || !above || !below || !level || !calls) {
+        *errmsg = ubpf_error("out of memory");
+        free(safe);
+        goto out;
+    }
+    if (range_fixpoint(prog, &ra) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        free(safe);
+        goto out;
+    }
+
+    for (i = 0; i < prog->num_insts; i++) {
+        f = ubpf_find_func(prog, i);
+        if (ubpf_is_local_call(prog->insts[i])) {
+            calls[num_calls][0] = f;
+            calls[num_calls++][1] = ubpf_find_func(prog, i + 1 + prog->insts[i].imm);
+        }
+        if (!ra.reached[i]) {
+            continue;
+        }
+        if (accessed_range(ra.in[i], prog->insts[i], &base, &lo, &hi) && base.type == RANGE_STACK) {
+            depth[f] = -lo > depth[f] ? -lo : depth[f];
+        } else if (prog->insts[i].opcode == EBPF_OP_CALL) {
+            for (j = 1; j <= 5; j++) {
+                if (ra.in[i][j].type == RANGE_STACK) {
+                    lo = (int64_t)ra.in[i][j].min;
+                    depth[f] = -lo > depth[f] ? -lo : depth[f];
+                }
+            }
+        }
+    }
+
+    /* The entry function always gets some stack, as it always has */
+    for (f = 0; f < prog->num_funcs; f++) {
+        if (depth[f] > limit) {
+            ra.stack_escaped[f] = true;
+            depth[f] = limit;
+        }
+        if (f == 0 && depth[f] < 8) {
+            depth[f] = 8;
+        }
+        prog->funcs[f].stack_size = (depth[f] + 7) & ~7;
+    }
+
+    /* What escaped functions get is only known once their callers have theirs */
+    for (i = 0; i < MAX_CALL_FRAMES; i++) {
+        frame_sums(prog, (const int (*)[2])calls, num_calls, above, below, level);
+        for (f = 0; f < prog->num_funcs; f++) {
+            uint32_t used = above[f] + below[f];
+            if (level[f] == i && ra.stack_escaped[f] && used < limit) {
+                prog->funcs[f].stack_size = limit - used;
+            }
+        }
+    }
+    frame_sums(prog, (const int (*)[2])calls, num_calls, above, below, level);
+
+    uint32_t total = 0;
+    for (f = 0; f < prog->num_funcs; f++) {
+        uint32_t chain = above[f] + prog->funcs[f].stack_size + below[f];
+        total = chain > total ? chain : total;
+    }
+    if (total > limit) {
+        *errmsg = ubpf_error("calls need %u bytes of stack, more than the limit of %u", total, limit);
+        free(safe);
+        range_analysis_free(&ra);
+        goto out;
+    }
+    prog->stack_size = total;
+
+    for (i = 0; i < prog->num_insts; i++) {
+        if (ra.reached[i] && prog->insts[i].opcode == EBPF_OP_CALL && !ubpf_is_local_call(prog->insts[i])) {
+            safe[i] = mem_args_safe(prog, ra.in[i], i);
+            continue;
+        }
+        if (!ra.reached[i] || !accessed_range(ra.in[i], prog->insts[i], &base, &lo, &hi)) {
+            continue;
+        }
+        if (base.type == RANGE_STACK) {
+            safe[i] = lo >= -(int64_t)prog->funcs[ubpf_find_func(prog, i)].stack_size && hi <= 0;
+        } else if (base.type == RANGE_MAP_VALUE) {
+            safe[i] = lo >= 0 && hi <= prog->maps[base.map]->value_size;
+        }
+    }
+
+    free(prog->safe_accesses);
+    prog->safe_accesses = safe;
+    range_analysis_free(&ra);
+    rv = 0;
+
+out:
+    ubpf_scratch_free(depth);
+    ubpf_scratch_free(above);
+    ubpf_scratch_free(below);
+    ubpf_scratch_free(level);
+    ubpf_scratch_free(calls);
+    return rv;
+}
+
+// Loop Bounds
+
+/* Most times a loop may be proven to go round each time it is entered */
+#define MAX_LOOP_ITERATIONS (1 << 20)
+
+/*
+ * A natural loop: the header and the blocks that reach one of its back
+ * edges without passing through it.
+ */
+struct loop {
+    const struct ubpf_cfg *cfg;
+    int header;
+    /* The only block jumping back to the header, if it has no other successor in the loop, else -1 */
+    int latch;
+    uint64_t *body;
+    /* Instructions in the body writing each register, and the last of them */
+    int num_defs[11];
+    int def_pc[11];
+};
+
+static bool
+in_loop(const struct loop *loop, int block)
+{
+    return block >= 0 && bitset_test(loop->body, block);
+}
+
+/* The last instruction of a block, taking an lddw as one */
+static int
+last_inst(const struct ubpf_prog *prog, const struct ubpf_block *block)
+{
+    if (block->end > block->start && prog->insts[block->end - 1].opcode == EBPF_OP_LDDW) {
+        return block->end - 1;
+    }
+    return block->end;
+}
+
+/*
+ * The range 'reg' may hold when the loop is entered: the join of what it
+ * holds along each edge into the header from outside. Sets *entered to
+ * false if no such edge can be taken.
+ */
+static struct range
+loop_entry_range(struct range_analysis *ra, const struct loop *loop, const uint64_t *live, int reg, bool *entered)
+{
+    const struct ubpf_cfg *cfg = loop->cfg;
+    int h_start = cfg->blocks[loop->header].start;
+    struct range entry = unknown_range;
+    int i;
+
+    *entered = false;
+    for (i = cfg->pred_start[loop->header]; i < cfg->pred_start[loop->header + 1]; i++) {
+        int p = cfg->preds[i];
+        int pc = last_inst(ra->prog, &cfg->blocks[p]);
+        struct ebpf_inst inst = ra->prog->insts[pc];
+        struct range regs[11];
+
+        if (in_loop(loop, p) || !bitset_test(live, p) || !ra->reached[pc]) {
+            continue;
+        }
+        memcpy(regs, ra->in[pc], sizeof(regs));
+        range_step(ra, pc, regs);
+        /* Unless both ways lead to the header, it holds what the jump there implies */
+        if (isjmp(inst) && inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_EXIT &&
+                inst.opcode != EBPF_OP_JSWITCH && inst.offset != 0 &&
+                !refine_range(regs, inst, pc + 1 + inst.offset == h_start)) {
+            continue;
+        }
+
+        if (!*entered) {
+            entry = regs[reg];
+            *entered = true;
+        } else if (entry.type != RANGE_SCALAR || regs[reg].type != RANGE_SCALAR) {
+            entry = unknown_range;
+        } else {
+            entry.min = regs[reg].min < entry.min ? regs[reg].min : entry.min;
+            entry.max = regs[reg].max > entry.max ? regs[reg].max : entry.max;
+        }
+    }
+    return entry;
+}
+
+/*
+ * Whether a variable that starts at a value in 'first' and changes by
+ * 'step' each time round can only keep the loop going for a bounded number
+ * of times, when it goes round while the unsigned comparison 'op' with a
+ * value in 'k' holds. The step stays the same, so the variable never wraps
+ * while the comparison still holds.
+ */
+static bool
+trips_bounded(int op, int64_t step, struct range k, bool first_known, struct range first)
+{
+    uint64_t d = step > 0 ? (uint64_t)step : -(uint64_t)step;
+    /* Times round after the first */
+    uint64_t rounds;
+
+    switch (op) {
+    case EBPF_OP_JEQ_IMM & EBPF_ALU_OP_MASK:
+        /* Once changed it differs */
+        return true;
+    case EBPF_OP_JLT_IMM & EBPF_ALU_OP_MASK:
+        if (step < 0 || (k.max > 0 && k.max - 1 > UINT64_MAX - d)) {
+            return false;
+        }
+        rounds = k.max / d;
+        break;
+    case EBPF_OP_JLE_IMM & EBPF_ALU_OP_MASK:
+        if (step < 0 || k.max > UINT64_MAX - d) {
+            return false;
+        }
+        rounds = k.max / d;
+        break;
+    case EBPF_OP_JNE_IMM & EBPF_ALU_OP_MASK:
+        /* It must meet k exactly, so starts on the right side of it */
+        if (d != 1 || !first_known) {
+            return false;
+        } else if (step > 0) {
+            if (first.max > k.min) {
+                return false;
+            }
+            rounds = k.max - first.min;
+        } else {
+            if (first.min < k.max) {
+                return false;
+            }
+            rounds = first.max - k.min;
+        }
+        break;
+    case EBPF_OP_JGT_IMM & EBPF_ALU_OP_MASK:
+        if (step > 0 || !first_known || (k.min < UINT64_MAX && d > k.min + 1)) {
+            return false;
+        }
+        rounds = first.max > k.min ? (first.max - k.min) / d : 0;
+        break;
+    case EBPF_OP_JGE_IMM & EBPF_ALU_OP_MASK:
+        if (step > 0 || !first_known || k.min < d) {
+            return false;
+        }
+        rounds = first.max >= k.min ? (first.max - k.min) / d : 0;
+        break;
+    default:
+        return false;
+    }
+
+    return rounds < MAX_LOOP_ITERATIONS;
+}
+
+/* The comparison with the operands swapped, or negated, or -1 if there is none */
+static int
+mirror_cond(int op, bool negate)
+{
+    static const struct { int op, swapped, negated; } conds[] = {
+        { EBPF_OP_JEQ_IMM, EBPF_OP_JEQ_IMM, EBPF_OP_JNE_IMM },
+        { EBPF_OP_JNE_IMM, EBPF_OP_JNE_IMM, EBPF_OP_JEQ_IMM },
+        { EBPF_OP_JGT_IMM, EBPF_OP_JLT_IMM, EBPF_OP_JLE_IMM },
+        { EBPF_OP_JGE_IMM, EBPF_OP_JLE_IMM, EBPF_OP_JLT_IMM },
+        { EBPF_OP_JLT_IMM, EBPF_OP_JGT_IMM, EBPF_OP_JGE_IMM },
+        { EBPF_OP_JLE_IMM, EBPF_OP_JGE_IMM, EBPF_OP_JGT_IMM },
+        { EBPF_OP_JSGT_IMM, EBPF_OP_JSLT_IMM, EBPF_OP_JSLE_IMM },
+        { EBPF_OP_JSGE_IMM, EBPF_OP_JSLE_IMM, EBPF_OP_JSLT_IMM },
+        { EBPF_OP_JSLT_IMM, EBPF_OP_JSGT_IMM, EBPF_OP_JSGE_IMM },
+        { EBPF_OP_JSLE_IMM, EBPF_OP_JSGE_IMM, EBPF_OP_JSGT_IMM },
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof(conds) / sizeof(conds[0]); i++) {
+        if ((conds[i].op & EBPF_ALU_OP_MASK) == op) {
+            return (negate ? conds[i].negated : conds[i].swapped) & EBPF_ALU_OP_MASK;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Whether the conditional jump ending block 'x' bounds the loop, comparing
+ * with 'iv' the value in 'k'. op is the comparison under which the loop
+ * goes on, with iv on the left.
+ */
+static bool
+test_bounds_loop(struct range_analysis *ra, const struct loop *loop, const uint64_t *live, int x, int op, int iv, struct range k)
+{
+    const struct ubpf_prog *prog = ra->prog;
+    struct ebpf_inst def;
+    struct range first;
+    bool entered;
+    int64_t step;
+
+    /* iv changes by the same amount, once each time round */
+    if (iv == 10 || loop->num_defs[iv] != 1) {
+        return false;
+    }
+    def = prog->insts[loop->def_pc[iv]];
+    int d = loop->cfg->block_of[loop->def_pc[iv]];
+    if ((def.opcode != EBPF_OP_ADD64_IMM && def.opcode != EBPF_OP_SUB64_IMM) || def.imm == 0 ||
+            (d != loop->header && d != loop->latch)) {
+        return false;
+    }
+    step = def.opcode == EBPF_OP_ADD64_IMM ? def.imm : -(int64_t)def.imm;
+
+    /* The value first compared, changed already unless that happens after the test */
+    first = loop_entry_range(ra, loop, live, iv, &entered);
+    if (!entered) {
+        return true;
+    }
+    bool first_known = first.type == RANGE_SCALAR;
+    if (first_known && !(d == loop->latch && x == loop->header && x != d)) {
+        if (step > 0 ? first.max > UINT64_MAX - step : first.min < (uint64_t)-step) {
+            first_known = false;
+        } else {
+            first.min += step;
+            first.max += step;
+        }
+    }
+
+    /* Signed and unsigned order agree while neither side is negative */
+    int unsigned_op = -1;
+    switch (op) {
+    case EBPF_OP_JSGT_IMM & EBPF_ALU_OP_MASK:
+        unsigned_op = EBPF_OP_JGT_IMM & EBPF_ALU_OP_MASK;
+        break;
+    case EBPF_OP_JSGE_IMM & EBPF_ALU_OP_MASK:
+        unsigned_op = EBPF_OP_JGE_IMM & EBPF_ALU_OP_MASK;
+        break;
+    case EBPF_OP_JSLT_IMM & EBPF_ALU_OP_MASK:
+        unsigned_op = EBPF_OP_JLT_IMM & EBPF_ALU_OP_MASK;
+        break;
+    case EBPF_OP_JSLE_IMM & EBPF_ALU_OP_MASK:
+        unsigned_op = EBPF_OP_JLE_IMM & EBPF_ALU_OP_MASK;
+        break;
+    }
+    if (unsigned_op >= 0) {
+        if (!first_known || first.max > INT64_MAX || k.max > INT64_MAX - (step > 0 ? (uint64_t)step : 0)) {
+            return false;
+        }
+        op = unsigned_op;
+    }
+
+    return trips_bounded(op, step, k, first_known, first);
+}
+
+/* Whether the conditional jump ending block 'x' bounds the loop */
+static bool
+exit_bounds_loop(struct range_analysis *ra, const struct loop *loop, const uint64_t *live, int x)
+{
+    const struct ubpf_prog *prog = ra->prog;
+    const struct ubpf_cfg *cfg = loop->cfg;
+    int pc = cfg->blocks[x].end;
+    struct ebpf_inst inst = prog->insts[pc];
+    int op = inst.opcode & EBPF_ALU_OP_MASK;
+
+    if (!isjmp(inst) || inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_EXIT ||
+            inst.opcode == EBPF_OP_JSWITCH || !ra->reached[pc]) {
+        return false;
+    }
+
+    /* One way stays in the loop and the other leaves it */
+    bool taken_in = in_loop(loop, cfg->block_of[pc + 1 + inst.offset]);
+    bool fall_in = pc + 1 < prog->num_insts && in_loop(loop, cfg->block_of[pc + 1]);
+    if (taken_in == fall_in) {
+        return false;
+    }
+    if (!taken_in) {
+        op = mirror_cond(op, true);
+    }
+    if (op < 0) {
+        return false;
+    }
+
+    if (!(inst.opcode & EBPF_SRC_REG)) {
+        bool eq = op == (EBPF_OP_JEQ_IMM & EBPF_ALU_OP_MASK) || op == (EBPF_OP_JNE_IMM & EBPF_ALU_OP_MASK);
+        /* The interpreter zero-extends the immediate of other comparisons, the JIT sign-extends it */
+        if (!eq && inst.imm < 0) {
+            return false;
+        }
+        return test_bounds_loop(ra, loop, live, x, op, inst.dst, scalar_range((int64_t)inst.imm, (int64_t)inst.imm));
+    }
+
+    /* Either register may be the variable, the other must not change in the loop */
+    struct range *regs = ra->in[pc];
+    if (loop->num_defs[inst.src] == 0 && regs[inst.src].type == RANGE_SCALAR &&
+            test_bounds_loop(ra, loop, live, x, op, inst.dst, regs[inst.src])) {
+        return true;
+    }
+    return loop->num_defs[inst.dst] == 0 && regs[inst.dst].type == RANGE_SCALAR &&
+        test_bounds_loop(ra, loop, live, x, mirror_cond(op, false), inst.src, regs[inst.dst]);
+}
+
+/*
+ * Whether the loop with this header goes round a bounded number of times
+ * each time it is entered. It must have no other entry, and a variable
+ * changed by a constant once each time round, in the header or the latch,
+ * that a comparison there against a constant, or a register the loop does
+ * not change, eventually stops. The number of times is bounded using the
+ * ranges of the values compared. Nested loops are each bounded in turn.
+ * A loop whose header range analysis never reaches never runs, so is
+ * bounded too. Returns -1 if out of memory.
+ */
+static int
+loop_bounded(const struct ubpf_prog *prog, const struct ubpf_cfg *cfg, const uint64_t *live,
+        const struct back_edge *edges, int num_edges, int header, struct range_analysis *ra)
+{
+    struct loop loop = { cfg, header, -1 };
+    int *stack = ubpf_scratch_calloc(cfg->num_blocks, sizeof(stack[0]));
+    int num_latches = 0;
+    int sp = 0;
+    int rv = -1;
+    int b, i, j;
+
+    loop.body = ubpf_scratch_calloc(BITSET_WORDS(cfg->num_blocks), sizeof(uint64_t));
+    if (!stack || !loop.body) {
+        goto out;
+    }
+
+    bitset_set(loop.body, header);
+    for (i = 0; i < num_edges; i++) {
+        if (edges[i].header == header) {
+            num_latches++;
+            loop.latch = edges[i].latch;
+            if (!bitset_test(loop.body, edges[i].latch)) {
+                bitset_set(loop.body, edges[i].latch);
+                stack[sp++] = edges[i].latch;
+            }
+        }
+    }
+    while (sp > 0) {
+        b = stack[--sp];
+        for (i = cfg->pred_start[b]; i < cfg->pred_start[b + 1]; i++) {
+            int p = cfg->preds[i];
+            if (bitset_test(live, p) && !bitset_test(loop.body, p)) {
+                bitset_set(loop.body, p);
+                stack[sp++] = p;
+            }
+        }
+    }
+
+    rv = 0;
+    for (b = 0; b < cfg->num_blocks; b++) {
+        if (!bitset_test(loop.body, b) || b == header) {
+            continue;
+        }
+        /* Entered other than through the header */
+        if (b == 0) {
+            goto out;
+        }
+        for (i = cfg->pred_start[b]; i < cfg->pred_start[b + 1]; i++) {
+            int p = cfg->preds[i];
+            if (bitset_test(live, p) && !bitset_test(loop.body, p)) {
+                goto out;
+            }
+        }
+    }
+
+    /* No path reaches the loop, which can only be entered through the header */
+    if (!ra->reached[cfg->blocks[header].start]) {
+        rv = 1;
+        goto out;
+    }
+
+    if (num_latches != 1) {
+        loop.latch = -1;
+    } else {
+        const struct ubpf_block *latch = &cfg->blocks[loop.latch];
+        for (j = 0; j < latch->num_succs; j++) {
+            if (latch->succs[j] != header && in_loop(&loop, latch->succs[j])) {
+                loop.latch = -1;
+            }
+        }
+    }
+
+    for (b = 0; b < cfg->num_blocks; b++) {
+        if (!bitset_test(loop.body, b)) {
+            continue;
+        }
+        for (i = cfg->blocks[b].start; i <= cfg->blocks[b].end; i++) {
+            uint16_t defs = ubpf_inst_defs(prog->insts[i]);
+            for (j = 0; j <= 10; j++) {
+                if (defs & REG_MASK(j)) {
+                    loop.num_defs[j]++;
+                    loop.def_pc[j] = i;
+                }
+            }
+            if (prog->insts[i].opcode == EBPF_OP_LDDW) {
+                i++;
+            }
+        }
+    }
+
+    rv = exit_bounds_loop(ra, &loop, live, header) ||
+        (loop.latch >= 0 && loop.latch != header && exit_bounds_loop(ra, &loop, live, loop.latch));
+
+out:
+    ubpf_scratch_free(stack);
+    ubpf_scratch_free(loop.body);
+    return rv;
 }
@@ -21,19 +21,56 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <inttypes.h>
-#include <sys/mman.h>
 #include <endian.h>
+#include <time.h>
 #include "ubpf_int.h"
 
-#define MAX_EXT_FUNCS 64
-
 static bool validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg);
-static bool bounds_check(const struct ubpf_vm *vm, void *addr, int size, const char *type, uint16_t cur_pc, void *mem, size_t mem_len, void *stack);
 
 bool toggle_bounds_check(struct ubpf_vm *vm, bool enable)
 {
   bool old = vm->bounds_check_enabled;
-  vm->bounds_check_enabled = enable;
+  if (!vm->sealed) {
+      vm->bounds_check_enabled = enable;
+      if (vm->prog) {
+          ubpf_select_interpreter(vm->prog);
+      }
+  }
+  return old;
+}
+
+bool toggle_threaded_exec(struct ubpf_vm *vm, bool enable)
+{
+  bool old = vm->threaded_enabled;
+  if (!vm->sealed) {
+      vm->threaded_enabled = enable;
+  }
+  return old;
+}
+
+bool toggle_profiling(struct ubpf_vm *vm, bool enable)
+{
+  bool old = vm->profiling_enabled;
+  if (vm->sealed) {
+      return old;
+  }
+  vm->profiling_enabled = enable;
+  /* Without counters nothing is counted, and ubpf_get_profile reports the failure */
+  if (enable && vm->prog) {
+      ubpf_alloc_counters(vm->prog);
+  }
+  if (vm->prog) {
+      ubpf_select_interpreter(vm->prog);
+  }
+  return old;
+}
+
+bool toggle_stats(struct ubpf_vm *vm, bool enable)
+{
+  bool old = vm->stats_enabled;
+  if (!vm->sealed) {
+      vm->stats_enabled = enable;
+  }
   return old;
 }
 
@@ -45,52 +82,306 @@ ubpf_create(void)
         return NULL;
     }
 
-    vm->ext_funcs = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_funcs));
-    if (vm->ext_funcs == NULL) {
+    if (pthread_mutex_init(&vm->lock, NULL)) {
+        free(vm);
+        return NULL;
+    }
+
+    vm->readers = ubpf_alloc_readers();
+    if (vm->readers == NULL) {
+        ubpf_destroy(vm);
+        return NULL;
+    }
+
+    if (posix_memalign((void **)&vm->stats, 64, UBPF_READER_SHARDS * sizeof(*vm->stats))) {
+        vm->stats = NULL;
+        ubpf_destroy(vm);
+        return NULL;
+    }
+    memset(vm->stats, 0, UBPF_READER_SHARDS * sizeof(*vm->stats));
+
+    vm->maps = calloc(MAX_MAPS, sizeof(*vm->maps));
+    if (vm->maps == NULL) {
         ubpf_destroy(vm);
         return NULL;
     }
 
-    vm->ext_func_names = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_func_names));
-    if (vm->ext_func_names == NULL) {
+    vm->map_names = calloc(MAX_MAPS, sizeof(*vm->map_names));
+    if (vm->map_names == NULL) {
         ubpf_destroy(vm);
         return NULL;
     }
 
     vm->bounds_check_enabled = true;
+    vm->stack_limit = DEFAULT_STACK_LIMIT;
     return vm;
 }
 
+static void
+prog_free(struct ubpf_prog *prog)
+{
+    if (prog->jitted) {
+        ubpf_code_free(prog->jitted, prog->jitted_size);
+    }
+    if (prog->jitted_batch) {
+        ubpf_code_free(prog->jitted_batch, prog->jitted_batch_size);
+    }
+    free(prog->insts);
+    free(prog->funcs);
+    free(prog->threaded);
+    free(prog->orig_pc);
+    free(prog->counters);
+    free(prog->safe_accesses);
+    free(prog->budget_points);
+    ubpf_free_switches(prog);
+    free(prog);
+}
+
 void
 ubpf_destroy(struct ubpf_vm *vm)
 {
-    if (vm->jitted) {
-        munmap(vm->jitted, vm->jitted_size);
+    if (vm->prog) {
+        prog_free(vm->prog);
+    }
+    if (vm->readers) {
+        ubpf_free_readers(vm->readers);
     }
-    free(vm->insts);
+    free(vm->stats);
     free(vm->ext_funcs);
-    free(vm->ext_func_names);
+    free(vm->ext_func_info);
+    free(vm->ext_func_buckets);
+    free(vm->maps);
+    free(vm->map_names);
+    free(vm->cache_dir);
+    pthread_mutex_destroy(&vm->lock);
     free(vm);
 }
 
+int
+ubpf_set_stack_limit(struct ubpf_vm *vm, uint32_t limit)
+{
+    if (limit == 0 || limit % 8 != 0 || limit > MAX_STACK_LIMIT || vm->sealed) {
+        return -1;
+    }
+
+    vm->stack_limit = limit;
+    return 0;
+}
+
+int
+ubpf_set_budget(struct ubpf_vm *vm, uint64_t budget)
+{
+    if (vm->sealed) {
+        return -1;
+    }
+
+    vm->budget = budget;
+    return 0;
+}
+
+int
+ubpf_set_cache_dir(struct ubpf_vm *vm, const char *dir)
+{
+    char *copy = NULL;
+
+    if (vm->sealed || (dir && !(copy = strdup(dir)))) {
+        return -1;
+    }
+
+    free(vm->cache_dir);
+    vm->cache_dir = copy;
+    return 0;
+}
+
+/* FNV-1a */
+static uint32_t
+name_hash(const char *name)
+{
+    uint32_t h = 0x811c9dc5;
+    for (; *name; name++) {
+        h = (h ^ (uint8_t)*name) * 0x01000193;
+    }
+    return h;
+}
+
+static uint32_t *
+name_bucket(const struct ubpf_vm *vm, const char *name)
+{
+    return &vm->ext_func_buckets[name_hash(name) & (vm->num_buckets - 1)];
+}
+
+/* Makes room for the functions at indices below n */
+static int
+grow_ext_funcs(struct ubpf_vm *vm, uint32_t n)
+{
+    uint32_t cap = vm->num_ext_funcs ? vm->num_ext_funcs : 64;
+    while (cap < n) {
+        cap *= 2;
+    }
+    if (cap > MAX_EXT_FUNCS) {
+        cap = MAX_EXT_FUNCS;
+    }
+
+    ext_func *funcs = realloc(vm->ext_funcs, cap * sizeof(*funcs));
+    if (!funcs) {
+        return -1;
+    }
+    vm->ext_funcs = funcs;
+    struct ubpf_ext_func_info *info = realloc(vm->ext_func_info, cap * sizeof(*info));
+    if (!info) {
+        return -1;
+    }
+    vm->ext_func_info = info;
+
+    memset(funcs + vm->num_ext_funcs, 0, (cap - vm->num_ext_funcs) * sizeof(*funcs));
+    memset(info + vm->num_ext_funcs, 0, (cap - vm->num_ext_funcs) * sizeof(*info));
+    vm->num_ext_funcs = cap;
+    return 0;
+}
+
+/* Doubles the buckets, for once there are as many names as buckets */
+static int
+grow_buckets(struct ubpf_vm *vm)
+{
+    uint32_t n = vm->num_buckets ? vm->num_buckets * 2 : 64;
+    uint32_t *buckets = malloc(n * sizeof(*buckets));
+    uint32_t i;
+
+    if (!buckets) {
+        return -1;
+    }
+    memset(buckets, 0xff, n * sizeof(*buckets));
+
+    free(vm->ext_func_buckets);
+    vm->ext_func_buckets = buckets;
+    vm->num_buckets = n;
+    for (i = 0; i < vm->num_ext_funcs; i++) {
+        if (vm->ext_func_info[i].name) {
+            uint32_t *bucket = name_bucket(vm, vm->ext_func_info[i].name);
+            vm->ext_func_info[i].next = *bucket;
+            *bucket = i;
+        }
+    }
+    return 0;
+}
+
+/* Removes the name registered at 'idx' from its bucket */
+static void
+unlink_name(struct ubpf_vm *vm, uint32_t idx)
+{
+    uint32_t *p = name_bucket(vm, vm->ext_func_info[idx].name);
+    while (*p != idx) {
+        p = &vm->ext_func_info[*p].next;
+    }
+    *p = vm->ext_func_info[idx].next;
+    vm->ext_func_info[idx].name = NULL;
+    vm->num_named--;
+}
+
 int
 ubpf_register(struct ubpf_vm *vm, unsigned int idx, const char *name, void *fn)
 {
-    if (idx >= MAX_EXT_FUNCS) {
+    const struct ubpf_mem_helper *helper = ubpf_find_mem_helper((ext_func)fn);
+    return ubpf_register_helper(vm, idx, name, fn, helper ? helper->num_args : 5, 0);
+}
+
+int
+ubpf_register_helper(struct ubpf_vm *vm, unsigned int idx, const char *name, void *fn,
+                     unsigned int num_args, unsigned int flags)
+{
+    if (idx >= MAX_EXT_FUNCS || num_args > 5 ||
+            (flags & ~(UBPF_HELPER_NO_SIDE_EFFECTS | UBPF_HELPER_PURE)) || vm->sealed) {
+        return -1;
+    }
+
+    if ((idx >= vm->num_ext_funcs && grow_ext_funcs(vm, idx + 1) < 0) ||
+            (name && vm->num_named >= vm->num_buckets && grow_buckets(vm) < 0)) {
         return -1;
     }
 
+    struct ubpf_ext_func_info *info = &vm->ext_func_info[idx];
+    if (info->name) {
+        unlink_name(vm, idx);
+    }
+    if (name) {
+        uint32_t *bucket = name_bucket(vm, name);
+        info->name = name;
+        info->next = *bucket;
+        *bucket = idx;
+        vm->num_named++;
+    }
+
+    /* Pure functions have no side effects either */
+    if (flags & UBPF_HELPER_PURE) {
+        flags |= UBPF_HELPER_NO_SIDE_EFFECTS;
+    }
+    /* The arguments the memory helpers are checked by are always read */
+    const struct ubpf_mem_helper *helper = ubpf_find_mem_helper((ext_func)fn);
+    memset(info->mem_args, 0, sizeof(info->mem_args));
+    if (helper) {
+        num_args = num_args > helper->num_args ? num_args : helper->num_args;
+        memcpy(info->mem_args, helper->mem_args, sizeof(info->mem_args));
+    }
+
     vm->ext_funcs[idx] = (ext_func)fn;
-    vm->ext_func_names[idx] = name;
+    info->num_args = num_args;
+    info->flags = flags;
+    info->intrinsic = 0;
+    return 0;
+}
+
+int
+ubpf_register_intrinsic(struct ubpf_vm *vm, unsigned int idx, const char *name, enum ubpf_intrinsic intrinsic)
+{
+    if ((unsigned int)intrinsic >= NUM_INTRINSICS) {
+        return -1;
+    }
+
+    const struct ubpf_intrinsic_impl *impl = &ubpf_intrinsics[intrinsic];
+    if (ubpf_register_helper(vm, idx, name, (void *)impl->fn, impl->num_args, UBPF_HELPER_PURE) < 0) {
+        return -1;
+    }
+    vm->ext_func_info[idx].intrinsic = intrinsic + 1;
     return 0;
 }
 
 unsigned int
 ubpf_lookup_registered_function(struct ubpf_vm *vm, const char *name)
+{
+    unsigned int found = -1;
+    uint32_t i;
+
+    if (!vm->num_buckets) {
+        return -1;
+    }
+
+    /* The lowest index if a name is registered more than once */
+    for (i = *name_bucket(vm, name); i != UINT32_MAX; i = vm->ext_func_info[i].next) {
+        if (i < found && !strcmp(vm->ext_func_info[i].name, name)) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+int
+ubpf_register_map(struct ubpf_vm *vm, unsigned int idx, const char *name, struct ubpf_map *map)
+{
+    if (idx >= MAX_MAPS || vm->sealed) {
+        return -1;
+    }
+
+    vm->maps[idx] = map;
+    vm->map_names[idx] = name;
+    return 0;
+}
+
+unsigned int
+ubpf_lookup_registered_map(struct ubpf_vm *vm, const char *name)
 {
     int i;
-    for (i = 0; i < MAX_EXT_FUNCS; i++) {
-        const char *other = vm->ext_func_names[i];
+    for (i = 0; i < MAX_MAPS; i++) {
+        const char *other = vm->map_names[i];
         if (other && !strcmp(other, name)) {
             return i;
         }
@@ -98,55 +389,244 @@ ubpf_lookup_registered_function(struct ubpf_vm *vm, const char *name)
     return -1;
 }
 
+/* Replaces the map indexes loaded by lddw with pointers to the maps */
+static void
+resolve_maps(struct ubpf_prog *prog)
+{
+    int i, j;
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst *inst = &prog->insts[i];
+        if (inst->opcode != EBPF_OP_LDDW) {
+            continue;
+        }
+        i++;
+        if (inst->src != EBPF_PSEUDO_MAP_IDX) {
+            continue;
+        }
+
+        struct ubpf_map *map = prog->vm->maps[inst->imm];
+        uint64_t addr = (uintptr_t)map;
+        inst[0].imm = (uint32_t)addr;
+        inst[1].imm = addr >> 32;
+
+        for (j = 0; j < prog->num_maps && prog->maps[j] != map; j++);
+        if (j == prog->num_maps) {
+            prog->maps[prog->num_maps++] = map;
+        }
+    }
+}
+
+/*
+ * Builds a program from the code of 'segments', one after another, with
+ * 'patches' applied, not yet published in vm->prog. The copy the program
+ * keeps is the only one made, and is validated once patched.
+ */
+static struct ubpf_prog *
+prog_create(struct ubpf_vm *vm, const struct ubpf_segment *segments, uint32_t num_segments,
+        const struct ubpf_patch *patches, uint32_t num_patches, char **errmsg)
+{
+    uint32_t code_len = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_segments; i++) {
+        if (segments[i].len % 8 != 0) {
+            *errmsg = ubpf_error("code_len must be a multiple of 8");
+            return NULL;
+        }
+        if (segments[i].len/8 >= MAX_INSTS - code_len/8) {
+            *errmsg = ubpf_error("too many instructions (max %u)", MAX_INSTS);
+            return NULL;
+        }
+        code_len += segments[i].len;
+    }
+
+    struct ubpf_prog *prog = calloc(1, sizeof(*prog));
+    if (prog == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        return NULL;
+    }
+    prog->vm = vm;
+    prog->budget = vm->budget;
+
+    prog->insts = malloc(code_len);
+    if (prog->insts == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        free(prog);
+        return NULL;
+    }
+
+    uint8_t *p = (uint8_t *)prog->insts;
+    for (i = 0; i < num_segments; i++) {
+        memcpy(p, segments[i].code, segments[i].len);
+        p += segments[i].len;
+    }
+    for (i = 0; i < num_patches; i++) {
+        struct ebpf_inst *inst = &prog->insts[patches[i].pc];
+        switch (patches[i].kind) {
+        case UBPF_PATCH_HELPER:
+            inst->imm = patches[i].value;
+            break;
+        case UBPF_PATCH_MAP:
+            inst[0].src = EBPF_PSEUDO_MAP_IDX;
+            inst[0].imm = patches[i].value;
+            inst[1].imm = 0;
+            break;
+        case UBPF_PATCH_LOCAL:
+            inst->src = EBPF_PSEUDO_CALL;
+            inst->imm = patches[i].value - patches[i].pc - 1;
+            break;
+        }
+    }
+
+    if (!validate(vm, prog->insts, code_len/8, errmsg)) {
+        prog_free(prog);
+        return NULL;
+    }
+
+    prog->num_insts = code_len/sizeof(prog->insts[0]);
+    if (ubpf_find_funcs(prog, errmsg) < 0) {
+        prog_free(prog);
+        return NULL;
+    }
+    resolve_maps(prog);
+
+    if (ubpf_analyze_ranges(prog, vm->stack_limit, errmsg) < 0) {
+        prog_free(prog);
+        return NULL;
+    }
+
+    if (ubpf_find_budget_points(prog) < 0 || ubpf_threaded_decode(prog) < 0 ||
+            (vm->profiling_enabled && ubpf_alloc_counters(prog) < 0)) {
+        *errmsg = ubpf_error("out of memory");
+        prog_free(prog);
+        return NULL;
+    }
+    ubpf_select_interpreter(prog);
+
+    return prog;
+}
+
 int
 ubpf_load(struct ubpf_vm *vm, const void *code, uint32_t code_len, char **errmsg)
+{
+    struct ubpf_segment segment = { code, code_len };
+    return ubpf_load_patched(vm, &segment, 1, NULL, 0, errmsg);
+}
+
+int
+ubpf_load_patched(struct ubpf_vm *vm, const struct ubpf_segment *segments, uint32_t num_segments,
+        const struct ubpf_patch *patches, uint32_t num_patches, char **errmsg)
 {
     *errmsg = NULL;
 
-    if (vm->insts) {
+    if (vm->prog) {
         *errmsg = ubpf_error("code has already been loaded into this VM");
         return -1;
     }
 
-    if (code_len % 8 != 0) {
-        *errmsg = ubpf_error("code_len must be a multiple of 8");
+    struct ubpf_prog *prog = prog_create(vm, segments, num_segments, patches, num_patches, errmsg);
+    if (prog == NULL) {
         return -1;
     }
 
-    if (!validate(vm, code, code_len/8, errmsg)) {
+    __atomic_store_n(&vm->prog, prog, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Everything that can fail or take long happens before the swap, so
+ * callers of ubpf_exec only ever wait for the atomic operations of their
+ * read section. Taking vm->lock for the swap keeps a concurrent
+ * ubpf_compile from working on the old program once it has been freed.
+ */
+int
+ubpf_replace(struct ubpf_vm *vm, const void *code, uint32_t code_len, int flags, char **errmsg)
+{
+    *errmsg = NULL;
+
+    struct ubpf_segment segment = { code, code_len };
+    struct ubpf_prog *prog = prog_create(vm, &segment, 1, NULL, 0, errmsg);
+    if (prog == NULL) {
         return -1;
     }
 
-    vm->insts = malloc(code_len);
-    if (vm->insts == NULL) {
-        *errmsg = ubpf_error("out of memory");
+    if ((flags & UBPF_REPLACE_VERIFY) && ubpf_verify_prog(prog)) {
+        *errmsg = ubpf_error("code failed verification");
+        prog_free(prog);
+        return -1;
+    }
+
+    if ((flags & UBPF_REPLACE_OPTIMIZE) && ubpf_optimize_prog(prog, errmsg) < 0) {
+        prog_free(prog);
         return -1;
     }
 
-    memcpy(vm->insts, code, code_len);
-    vm->num_insts = code_len/sizeof(vm->insts[0]);
+    if (flags & UBPF_REPLACE_JIT) {
+        if (ubpf_compile_prog(prog, false, errmsg) < 0) {
+            prog_free(prog);
+            return -1;
+        }
+        prog->exec_jitted = true;
+    }
+
+    pthread_mutex_lock(&vm->lock);
+    struct ubpf_prog *old = __atomic_exchange_n(&vm->prog, prog, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&vm->lock);
+
+    if (old) {
+        ubpf_synchronize(vm);
+        prog_free(old);
+    }
 
     return 0;
 }
 
+int
+ubpf_seal(struct ubpf_vm *vm)
+{
+    if (!vm->prog) {
+        return -1;
+    }
+
+    vm->sealed = true;
+    return 0;
+}
+
 static uint32_t
 u32(uint64_t x)
 {
     return x;
 }
 
-uint64_t
-ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/*
+ * Interprets the loaded program, updating 'counters' if non-NULL, using up
+ * the budget at 'budget_points' if non-NULL and checking memory accesses
+ * if 'checked'. This is inlined into each of the specializations below, so
+ * those without one of them have no checks for it at all.
+ */
+static ALWAYS_INLINE uint64_t
+interpret(const struct ubpf_prog *prog, void *mem, size_t mem_len, const struct ubpf_counters *counters,
+          const uint8_t *budget_points, bool checked)
 {
     uint16_t pc = 0;
-    const struct ebpf_inst *insts = vm->insts;
+    const struct ebpf_inst *insts = prog->insts;
     uint64_t reg[16] = {0};
-    uint64_t stack[(STACK_SIZE+7)/8];
-
-    if (!insts) {
-        /* Code must be loaded before we can execute */
-        return UINT64_MAX;
-    }
+    uint64_t stack[prog->stack_size / 8];
+    /* The callers of the running function, and the registers a call preserves for them */
+    struct {
+        uint16_t return_pc;
+        uint16_t func;
+        uint64_t saved[4];
+    } frames[MAX_CALL_FRAMES - 1];
+    int depth = 0;
+    int func = 0;
+    uint64_t budget = prog->budget;
 
     reg[1] = (uintptr_t)mem;
     reg[10] = (uintptr_t)stack + sizeof(stack);
@@ -155,6 +635,15 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
         const uint16_t cur_pc = pc;
         struct ebpf_inst inst = insts[pc++];
 
+        if (counters) {
+            counters->insts[cur_pc]++;
+        }
+
+        if (budget_points && budget_points[cur_pc] && budget-- == 0) {
+            ubpf_report_error_at(prog->vm, UBPF_ERROR_BUDGET, ubpf_orig_pc(prog, cur_pc));
+            return UBPF_BUDGET_EXHAUSTED;
+        }
+
         switch (inst.opcode) {
         case EBPF_OP_ADD_IMM:
             reg[inst.dst] += inst.imm;
@@ -185,8 +674,8 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_DIV_REG:
-            if (reg[inst.src] == 0) {
-                fprintf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
+            if (u32(reg[inst.src]) == 0) {
+                ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, ubpf_orig_pc(prog, cur_pc));
                 return UINT64_MAX;
             }
             reg[inst.dst] = u32(reg[inst.dst]) / u32(reg[inst.src]);
@@ -233,8 +722,8 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_MOD_REG:
-            if (reg[inst.src] == 0) {
-                fprintf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
+            if (u32(reg[inst.src]) == 0) {
+                ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, ubpf_orig_pc(prog, cur_pc));
                 return UINT64_MAX;
             }
             reg[inst.dst] = u32(reg[inst.dst]) % u32(reg[inst.src]);
@@ -307,7 +796,7 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
             break;
         case EBPF_OP_DIV64_REG:
             if (reg[inst.src] == 0) {
-                fprintf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
+                ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, ubpf_orig_pc(prog, cur_pc));
                 return UINT64_MAX;
             }
             reg[inst.dst] /= reg[inst.src];
@@ -344,7 +833,7 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
             break;
         case EBPF_OP_MOD64_REG:
             if (reg[inst.src] == 0) {
-                fprintf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
+                ubpf_report_error_at(prog->vm, UBPF_ERROR_DIV_BY_ZERO, ubpf_orig_pc(prog, cur_pc));
                 return UINT64_MAX;
             }
             reg[inst.dst] %= reg[inst.src];
@@ -369,19 +858,18 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
             break;
 
         /*
-         * HACK runtime bounds check
-         *
-         * Needed since we don't have a verifier yet.
+         * Runtime bounds check, for the accesses ubpf_analyze_ranges
+         * could not prove safe.
          */
 #define BOUNDS_CHECK_LOAD(size) \
     do { \
-        if (!bounds_check(vm, (void *)(uintptr_t)reg[inst.src] + inst.offset, size, "load", cur_pc, mem, mem_len, stack)) { \
+        if (checked && !prog->safe_accesses[cur_pc] && !ubpf_bounds_check(prog, (void *)(uintptr_t)reg[inst.src] + inst.offset, size, false, cur_pc, mem, mem_len, stack)) { \
             return UINT64_MAX; \
         } \
     } while (0)
 #define BOUNDS_CHECK_STORE(size) \
     do { \
-        if (!bounds_check(vm, (void *)(uintptr_t)reg[inst.dst] + inst.offset, size, "store", cur_pc, mem, mem_len, stack)) { \
+        if (checked && !prog->safe_accesses[cur_pc] && !ubpf_bounds_check(prog, (void *)(uintptr_t)reg[inst.dst] + inst.offset, size, true, cur_pc, mem, mem_len, stack)) { \
             return UINT64_MAX; \
         } \
     } while (0)
@@ -554,23 +1042,181 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
                 pc += inst.offset;
             }
             break;
+        case EBPF_OP_JSWITCH:
+            if (counters) {
+                /* Run the chain of jeq one by one so each of them is counted */
+                if (reg[inst.dst] == (uint64_t)(int64_t)prog->switches[inst.imm].first_imm) {
+                    pc += inst.offset;
+                }
+            } else {
+                pc = ubpf_switch_target(&prog->switches[inst.imm], reg[inst.dst]);
+            }
+            break;
         case EBPF_OP_EXIT:
-            return reg[0];
+            if (depth == 0) {
+                return reg[0];
+            }
+            depth--;
+            pc = frames[depth].return_pc;
+            func = frames[depth].func;
+            memcpy(&reg[6], frames[depth].saved, sizeof(frames[depth].saved));
+            reg[10] += prog->funcs[func].stack_size;
+            break;
         case EBPF_OP_CALL:
-            reg[0] = vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
+            if (inst.src == EBPF_PSEUDO_CALL) {
+                frames[depth].return_pc = pc;
+                frames[depth].func = func;
+                memcpy(frames[depth].saved, &reg[6], sizeof(frames[depth].saved));
+                depth++;
+                reg[10] -= prog->funcs[func].stack_size;
+                pc += inst.imm;
+                func = ubpf_find_func(prog, pc);
+                break;
+            }
+            if (checked && !prog->safe_accesses[cur_pc] && prog->vm->ext_func_info[inst.imm].mem_args[0][0] &&
+                    !ubpf_check_mem_args(prog, reg, cur_pc, mem, mem_len, stack)) {
+                return UINT64_MAX;
+            }
+            if (prog->vm->stats_enabled) {
+                ubpf_count(&prog->vm->stats[ubpf_current_shard()].helper_calls, 1);
+            }
+            reg[0] = prog->vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
             break;
         }
+
+        /* A conditional jump that left the PC on the next instruction fell through */
+        if (counters && pc == cur_pc + 1 && (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP &&
+                inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_CALL) {
+            counters->not_taken[cur_pc]++;
+        }
     }
 }
 
-static bool
-validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg)
+/*
+ * interpret specialized for each combination of profiling, a budget and
+ * bounds checking, given as 0 or 1 in that order
+ */
+#define INTERPRETERS(X) \
+    X(0, 0, 0) X(0, 0, 1) X(0, 1, 0) X(0, 1, 1) \
+    X(1, 0, 0) X(1, 0, 1) X(1, 1, 0) X(1, 1, 1)
+#define INTERPRETER(profile, budget, checked) \
+    static uint64_t \
+    interpret_##profile##budget##checked(const struct ubpf_prog *prog, void *mem, size_t mem_len) \
+    { \
+        return interpret(prog, mem, mem_len, profile ? prog->counters : NULL, \
+                         budget ? prog->budget_points : NULL, checked); \
+    }
+#define INTERPRETER_ENTRY(profile, budget, checked) \
+    [profile][budget][checked] = interpret_##profile##budget##checked,
+
+INTERPRETERS(INTERPRETER)
+
+static uint64_t (*const interpreters[2][2][2])(const struct ubpf_prog *prog, void *mem, size_t mem_len) = {
+    INTERPRETERS(INTERPRETER_ENTRY)
+};
+
+#undef INTERPRETERS
+#undef INTERPRETER
+#undef INTERPRETER_ENTRY
+
+void
+ubpf_select_interpreter(struct ubpf_prog *prog)
 {
-    if (num_insts >= MAX_INSTS) {
-        *errmsg = ubpf_error("too many instructions (max %u)", MAX_INSTS);
-        return false;
+    const struct ubpf_vm *vm = prog->vm;
+
+    prog->interpret = interpreters[vm->profiling_enabled && prog->counters][prog->budget_points != NULL]
+                                  [vm->bounds_check_enabled];
+}
+
+/* Runs prog with the backend selected when it was loaded and the VM's settings */
+static inline uint64_t
+exec_prog(const struct ubpf_prog *prog, void *mem, size_t mem_len)
+{
+    const struct ubpf_vm *vm = prog->vm;
+
+    /* prog->interpret is then the specialization with counters */
+    if (vm->profiling_enabled && prog->counters) {
+        return prog->interpret(prog, mem, mem_len);
+    }
+
+    if (prog->exec_jitted) {
+        return prog->jitted(mem, mem_len);
+    }
+
+    if (vm->threaded_enabled) {
+        return ubpf_threaded_exec(prog, mem, mem_len);
+    }
+
+    return prog->interpret(prog, mem, mem_len);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t
+ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len)
+{
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    struct ubpf_stats_shard *stats = &vm->stats[section.shard];
+    uint64_t ret = UINT64_MAX;
+
+    /* Code must be loaded before we can execute */
+    if (prog && vm->stats_enabled) {
+        uint64_t start = now_ns();
+        ret = exec_prog(prog, mem, mem_len);
+        ubpf_count(&stats->run_ns, now_ns() - start);
+        ubpf_count(&stats->runs, 1);
+    } else if (prog) {
+        ret = exec_prog(prog, mem, mem_len);
+        ubpf_count(&stats->runs, 1);
+    }
+
+    ubpf_read_unlock(vm, &section);
+    return ret;
+}
+
+/* Every buffer in the batch is run by the same program, even across a ubpf_replace */
+void
+ubpf_exec_batch(const struct ubpf_vm *vm, void **mems, size_t *lens, uint64_t *results, size_t n)
+{
+    struct ubpf_read_section section;
+    const struct ubpf_prog *prog = ubpf_read_lock(vm, &section);
+    struct ubpf_stats_shard *stats = &vm->stats[section.shard];
+    uint64_t start = vm->stats_enabled ? now_ns() : 0;
+    size_t i;
+
+    if (!prog) {
+        for (i = 0; i < n; i++) {
+            results[i] = UINT64_MAX;
+        }
+    } else if (vm->threaded_enabled && !prog->exec_jitted && !(vm->profiling_enabled && prog->counters)) {
+        for (i = 0; i < n; i++) {
+            results[i] = ubpf_threaded_exec(prog, mems[i], lens[i]);
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            results[i] = exec_prog(prog, mems[i], lens[i]);
+        }
     }
 
+    if (prog && vm->stats_enabled) {
+        ubpf_count(&stats->run_ns, now_ns() - start);
+    }
+    if (prog) {
+        ubpf_count(&stats->runs, n);
+    }
+    ubpf_read_unlock(vm, &section);
+}
+
+static bool
+validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg)
+{
     int i;
     for (i = 0; i < num_insts; i++) {
         struct ebpf_inst inst = insts[i];
@@ -657,6 +1303,16 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
                 *errmsg = ubpf_error("incomplete lddw at PC %d", i);
                 return false;
             }
+            if (inst.src == EBPF_PSEUDO_MAP_IDX) {
+                if (inst.imm < 0 || inst.imm >= MAX_MAPS || insts[i+1].imm != 0) {
+                    *errmsg = ubpf_error("invalid map index at PC %d", i);
+                    return false;
+                }
+                if (!vm->maps[inst.imm]) {
+                    *errmsg = ubpf_error("load of nonexistent map %u at PC %d", inst.imm, i);
+                    return false;
+                }
+            }
             i++; /* Skip next instruction */
             break;
 
@@ -698,11 +1354,22 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
             break;
 
         case EBPF_OP_CALL:
+            if (inst.src == EBPF_PSEUDO_CALL) {
+                int target = i + 1 + inst.imm;
+                if (target < 0 || target >= num_insts) {
+                    *errmsg = ubpf_error("call out of bounds at PC %d", i);
+                    return false;
+                } else if (insts[target].opcode == 0) {
+                    *errmsg = ubpf_error("call to middle of lddw at PC %d", i);
+                    return false;
+                }
+                break;
+            }
             if (inst.imm < 0 || inst.imm >= MAX_EXT_FUNCS) {
                 *errmsg = ubpf_error("invalid call immediate at PC %d", i);
                 return false;
             }
-            if (!vm->ext_funcs[inst.imm]) {
+            if (inst.imm >= vm->num_ext_funcs || !vm->ext_funcs[inst.imm]) {
                 *errmsg = ubpf_error("call to nonexistent function %u at PC %d", inst.imm, i);
                 return false;
             }
@@ -740,24 +1407,320 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
     return true;
 }
 
+/*
+ * Local calls split the program into functions, which must be entered
+ * only by calls: no jump leaves its function, and every function but the
+ * last ends with an exit or a jump, rather than falling into the next.
+ * The calls make a graph that a depth-first walk checks has no cycle, as
+ * the frames of recursion could not be bounded, and no chain longer than
+ * MAX_CALL_FRAMES.
+ */
+int
+ubpf_find_funcs(struct ubpf_prog *prog, char **errmsg)
+{
+    const struct ebpf_inst *insts = prog->insts;
+    int num_insts = prog->num_insts;
+    int i, f, num_funcs = 0;
+    int rv = -1;
+
+    bool *entry = calloc(num_insts, sizeof(bool));
+    if (!entry) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+    entry[0] = true;
+    for (i = 0; i < num_insts; i++) {
+        if (ubpf_is_local_call(insts[i])) {
+            entry[i + 1 + insts[i].imm] = true;
+        }
+    }
+    for (i = 0; i < num_insts; i++) {
+        num_funcs += entry[i];
+    }
+    if (num_funcs > MAX_FUNCS) {
+        *errmsg = ubpf_error("too many functions (max %u)", MAX_FUNCS);
+        free(entry);
+        return -1;
+    }
+
+    struct ubpf_func *funcs = calloc(num_funcs, sizeof(*funcs));
+    uint8_t *state = calloc(num_funcs, 1);
+    uint8_t *frames = calloc(num_funcs, 1);
+    int *stack = calloc(num_funcs, sizeof(*stack));
+    int *next_pc = calloc(num_funcs, sizeof(*next_pc));
+    if (!funcs || !state || !frames || !stack || !next_pc) {
+        *errmsg = ubpf_error("out of memory");
+        free(funcs);
+        goto out;
+    }
+
+    for (i = 0, f = -1; i < num_insts; i++) {
+        if (entry[i]) {
+            funcs[++f].start = i;
+        }
+        funcs[f].end = i + 1;
+    }
+    free(prog->funcs);
+    prog->funcs = funcs;
+    prog->num_funcs = num_funcs;
+
+    for (f = 0; f < num_funcs; f++) {
+        for (i = funcs[f].start; i < funcs[f].end; i++) {
+            struct ebpf_inst inst = insts[i];
+            if ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP &&
+                    inst.opcode != EBPF_OP_CALL && inst.opcode != EBPF_OP_EXIT) {
+                int target = i + 1 + inst.offset;
+                if (target < funcs[f].start || target >= funcs[f].end) {
+                    *errmsg = ubpf_error("jump out of function at PC %d", i);
+                    goto out;
+                }
+            }
+        }
+        struct ebpf_inst last = insts[funcs[f].end - 1];
+        if (f < num_funcs - 1 && last.opcode != EBPF_OP_EXIT && last.opcode != EBPF_OP_JA) {
+            *errmsg = ubpf_error("function falls through at PC %d", funcs[f].end - 1);
+            goto out;
+        }
+    }
+
+    /* state is 1 while a function is on the stack, 2 once the deepest chain from it is in 'frames' */
+    for (f = 0; f < num_funcs; f++) {
+        int sp = 0;
+        if (state[f]) {
+            continue;
+        }
+        stack[sp] = f;
+        next_pc[sp++] = funcs[f].start;
+        state[f] = 1;
+        frames[f] = 1;
+        while (sp > 0) {
+            int cur = stack[sp - 1];
+            int pc = next_pc[sp - 1];
+            while (pc < funcs[cur].end && !ubpf_is_local_call(insts[pc])) {
+                pc++;
+            }
+            if (pc == funcs[cur].end) {
+                state[cur] = 2;
+                sp--;
+                continue;
+            }
+
+            int callee = ubpf_find_func(prog, pc + 1 + insts[pc].imm);
+            if (state[callee] == 0) {
+                /* Come back to this call once the callee is done */
+                next_pc[sp - 1] = pc;
+                stack[sp] = callee;
+                next_pc[sp++] = funcs[callee].start;
+                state[callee] = 1;
+                frames[callee] = 1;
+                continue;
+            } else if (state[callee] == 1) {
+                *errmsg = ubpf_error("recursive call at PC %d", pc);
+                goto out;
+            }
+
+            if (frames[callee] + 1 > MAX_CALL_FRAMES) {
+                *errmsg = ubpf_error("too many nested calls at PC %d (max %u frames)", pc, MAX_CALL_FRAMES);
+                goto out;
+            }
+            if (frames[callee] + 1 > frames[cur]) {
+                frames[cur] = frames[callee] + 1;
+            }
+            next_pc[sp - 1] = pc + 1;
+        }
+    }
+    rv = 0;
+
+out:
+    free(entry);
+    free(state);
+    free(frames);
+    free(stack);
+    free(next_pc);
+    return rv;
+}
+
+int
+ubpf_find_budget_points(struct ubpf_prog *prog)
+{
+    int i;
+    uint32_t j;
+
+    free(prog->budget_points);
+    prog->budget_points = NULL;
+    if (!prog->budget) {
+        return 0;
+    }
+
+    prog->budget_points = calloc(prog->num_insts, sizeof(prog->budget_points[0]));
+    if (!prog->budget_points) {
+        return -1;
+    }
+
+    for (i = 0; i < prog->num_insts; i++) {
+        struct ebpf_inst inst = prog->insts[i];
+        if (inst.opcode == EBPF_OP_JSWITCH) {
+            const struct ubpf_switch *sw = &prog->switches[inst.imm];
+            for (j = 0; j < sw->num_entries && sw->targets[j] > i; j++);
+            prog->budget_points[i] = j < sw->num_entries || sw->default_pc <= i;
+        } else if ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_CALL &&
+                inst.opcode != EBPF_OP_EXIT) {
+            prog->budget_points[i] = inst.offset < 0;
+        } else {
+            prog->budget_points[i] = ubpf_is_local_call(inst);
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        }
+    }
+    return 0;
+}
+
+/* Whether the 'size' bytes at 'addr' lie within the 'len' bytes at 'base', without overflowing */
 static bool
-bounds_check(const struct ubpf_vm *vm, void *addr, int size, const char *type, uint16_t cur_pc, void *mem, size_t mem_len, void *stack)
+within(const void *addr, uint64_t size, const void *base, uint64_t len)
 {
-    if (!vm->bounds_check_enabled)
-        return true;
-    if (mem && (addr >= mem && (addr + size) <= (mem + mem_len))) {
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)base;
+    return base && (uintptr_t)addr >= (uintptr_t)base && off <= len && size <= len - off;
+}
+
+bool
+ubpf_bounds_check(const struct ubpf_prog *prog, void *addr, int size, bool store, uint16_t cur_pc, void *mem, size_t mem_len, void *stack)
+{
+    if (within(addr, size, mem, mem_len)) {
         /* Context access */
         return true;
-    } else if (addr >= stack && (addr + size) <= (stack + STACK_SIZE)) {
+    } else if (within(addr, size, stack, prog->stack_size)) {
         /* Stack access */
         return true;
     } else {
-        fprintf(stderr, "uBPF error: out of bounds memory %s at PC %u, addr %p, size %d\n", type, cur_pc, addr, size);
-        fprintf(stderr, "mem %p/%zd stack %p/%d\n", mem, mem_len, stack, STACK_SIZE);
+        int i;
+        for (i = 0; i < prog->num_maps; i++) {
+            if (ubpf_map_contains(prog->maps[i], addr, size)) {
+                /* Map value access */
+                return true;
+            }
+        }
+        struct ubpf_runtime_error error = {
+            .kind = UBPF_ERROR_OUT_OF_BOUNDS, .pc = ubpf_orig_pc(prog, cur_pc), .addr = addr, .size = size,
+            .store = store, .mem = mem, .mem_len = mem_len, .stack = stack, .stack_size = prog->stack_size,
+        };
+        ubpf_report_error(prog->vm, &error);
         return false;
     }
 }
 
+/*
+ * Checks the memory the helper called at 'cur_pc' reads through its
+ * pointer arguments as ubpf_bounds_check checks an access, with lengths
+ * taken from the arguments rather than the instruction.
+ */
+bool
+ubpf_check_mem_args(const struct ubpf_prog *prog, const uint64_t *reg, uint16_t cur_pc, void *mem, size_t mem_len, void *stack)
+{
+    const struct ubpf_ext_func_info *info = &prog->vm->ext_func_info[prog->insts[cur_pc].imm];
+    int i, j;
+
+    for (i = 0; i < UBPF_MAX_MEM_ARGS && info->mem_args[i][0]; i++) {
+        void *addr = (void *)(uintptr_t)reg[info->mem_args[i][0]];
+        uint64_t size = reg[info->mem_args[i][1]];
+        if (size == 0 || within(addr, size, mem, mem_len) || within(addr, size, stack, prog->stack_size)) {
+            continue;
+        }
+        for (j = 0; j < prog->num_maps && !ubpf_map_contains(prog->maps[j], addr, size); j++);
+        if (j == prog->num_maps) {
+            struct ubpf_runtime_error error = {
+                .kind = UBPF_ERROR_MEM_ARG, .pc = ubpf_orig_pc(prog, cur_pc), .addr = addr, .size = size,
+                .reg = info->mem_args[i][0], .mem = mem, .mem_len = mem_len, .stack = stack,
+                .stack_size = prog->stack_size,
+            };
+            ubpf_report_error(prog->vm, &error);
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+ubpf_report_error(const struct ubpf_vm *vm, const struct ubpf_runtime_error *error)
+{
+    ubpf_count(&vm->stats[ubpf_current_shard()].errors[error->kind], 1);
+    if (vm->error_fn) {
+        vm->error_fn(vm->error_ctx, error);
+        return;
+    }
+
+    switch (error->kind) {
+    case UBPF_ERROR_DIV_BY_ZERO:
+        fprintf(stderr, "uBPF error: division by zero at PC %u\n", error->pc);
+        return;
+    case UBPF_ERROR_BUDGET:
+        fprintf(stderr, "uBPF error: budget exhausted at PC %u\n", error->pc);
+        return;
+    case UBPF_ERROR_OUT_OF_BOUNDS:
+        fprintf(stderr, "uBPF error: out of bounds memory %s at PC %u, addr %p, size %d\n",
+                error->store ? "store" : "load", error->pc, error->addr, (int)error->size);
+        break;
+    case UBPF_ERROR_MEM_ARG:
+        fprintf(stderr, "uBPF error: out of bounds memory argument r%d to call at PC %u, addr %p, size %llu\n",
+                error->reg, error->pc, error->addr, (unsigned long long)error->size);
+        break;
+    }
+    fprintf(stderr, "mem %p/%zd stack %p/%u\n", error->mem, error->mem_len, error->stack, error->stack_size);
+}
+
+void
+ubpf_report_error_at(const struct ubpf_vm *vm, enum ubpf_error_kind kind, uint16_t pc)
+{
+    struct ubpf_runtime_error error = { .kind = kind, .pc = pc };
+    ubpf_report_error(vm, &error);
+}
+
+int
+ubpf_set_error_callback(struct ubpf_vm *vm, ubpf_error_fn fn, void *ctx)
+{
+    if (vm->sealed) {
+        return -1;
+    }
+
+    vm->error_fn = fn;
+    vm->error_ctx = ctx;
+    return 0;
+}
+
+void
+ubpf_get_stats(const struct ubpf_vm *vm, struct ubpf_stats *stats)
+{
+    int i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < UBPF_READER_SHARDS; i++) {
+        const struct ubpf_stats_shard *shard = &vm->stats[i];
+        stats->runs += __atomic_load_n(&shard->runs, __ATOMIC_RELAXED);
+        stats->run_ns += __atomic_load_n(&shard->run_ns, __ATOMIC_RELAXED);
+        stats->helper_calls += __atomic_load_n(&shard->helper_calls, __ATOMIC_RELAXED);
+        for (j = 0; j < UBPF_NUM_ERROR_KINDS; j++) {
+            stats->errors[j] += __atomic_load_n(&shard->errors[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void
+ubpf_reset_stats(struct ubpf_vm *vm)
+{
+    int i, j;
+
+    for (i = 0; i < UBPF_READER_SHARDS; i++) {
+        struct ubpf_stats_shard *shard = &vm->stats[i];
+        __atomic_store_n(&shard->runs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->run_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->helper_calls, 0, __ATOMIC_RELAXED);
+        for (j = 0; j < UBPF_NUM_ERROR_KINDS; j++) {
+            __atomic_store_n(&shard->errors[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
 char *
 ubpf_error(const char *fmt, ...)
 {